@@ -41,6 +41,7 @@
 #include <string.h>
 #include <stdbool.h>
 #include <stdint.h>
+#include <stddef.h>
 #include <stdarg.h>
 #include <errno.h>
 #include <time.h>
@@ -56,6 +57,8 @@
   #include <wincrypt.h>
   #include <io.h>
   #include <fcntl.h>   /* _O_BINARY */
+  #include <sys/stat.h>
+  #include <dirent.h>  /* MinGW が提供 */
   #ifndef SHUT_RDWR
     #define SHUT_RDWR SD_BOTH
   #endif
@@ -96,6 +99,9 @@
   #include <netdb.h>
   #include <arpa/inet.h>
   #include <fcntl.h>
+  #include <sys/mman.h>
+  #include <sys/stat.h>
+  #include <dirent.h>
   /* POSIX: struct timeval を使った setsockopt ラッパー */
   static inline void sock_set_timeout(int sock, int sec) {
     struct timeval tv = {.tv_sec = sec, .tv_usec = 0};
@@ -154,6 +160,19 @@ static int load_windows_ca_store(SSL_CTX *ctx) {
 #include <opus.h>
 #include <sodium.h>
 
+/* v2.6.0: MP3 のプロセス内デコード — libmpg123 があるとき (Makefile が HAVE_MPG123 を付ける) */
+#ifdef HAVE_MPG123
+  #include <mpg123.h>
+#endif
+
+/* SIMD (音声のゲイン処理) — AVX2 は実行時に判定する */
+#if defined(__SSE2__) || (defined(__x86_64__) && defined(__GNUC__))
+  #include <immintrin.h>
+#endif
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+  #include <arm_neon.h>
+#endif
+
 /* =========================================================================
  * Section 1: Constants & Macros
  * ========================================================================= */
@@ -204,7 +223,7 @@ static int load_windows_ca_store(SSL_CTX *ctx) {
 #define MAX_COLLECTED         100
 
 /* v2.0.0: Voice limits */
-#define MAX_VOICE_CONNS       8     /* Max simultaneous voice connections */
+#define MAX_VOICE_CONNS       256   /* Max simultaneous voice connections */
 #define VOICE_SAMPLE_RATE     48000
 #define VOICE_CHANNELS        2     /* Stereo */
 #define VOICE_FRAME_MS        20
@@ -212,7 +231,73 @@ static int load_windows_ca_store(SSL_CTX *ctx) {
 #define VOICE_FRAME_SIZE      (VOICE_FRAME_SAMPLES * VOICE_CHANNELS)       /* 1920 */
 #define VOICE_MAX_PACKET      4000
 #define MAX_AUDIO_QUEUE       64
-#define MAX_VOICE_STATE_CACHE 512
+#define VOICE_OPUS_MAX        1276  /* 20ms の Opus パケット上限 (1275) + 余裕 */
+#define VOICE_RING_SLOTS      256   /* 先読みリングの容量 (2 の累乗, 5.12 秒) */
+#define VOICE_RING_DEFAULT_MS 1000  /* 先読みの既定深さ */
+#define VOICE_RING_MAX_MS     3000
+#define VOICE_SENDERS_MAX     16    /* 送信スレッドの上限 */
+#define VOICE_WHEEL_SLOTS     VOICE_FRAME_MS  /* 1ms 刻みのタイマーホイール */
+#define VOICE_SEND_BATCH      10    /* 1 回にまとめて送るパケット (遅延の巻き戻し上限 200ms) */
+#define VOICE_SPEAK_BATCH     64    /* 1 刻みで送る SPEAKING の上限 (残りは次の刻み) */
+#define VOICE_DONE_SLOTS      16    /* 完了イベント待ちの曲 (2 の累乗) */
+#define VOICE_SEAL_OVERHEAD   (12 + crypto_aead_xchacha20poly1305_ietf_ABYTES + 4)
+#define VOICE_RECV_STREAMS    128   /* 1 接続で同時に受ける話者 */
+#define VOICE_JB_SLOTS        64    /* 話者ごとのジッタバッファ (2 の累乗, 1.28 秒) */
+#define VOICE_JB_DEFAULT_MS   60    /* 取り出し開始までに溜める量 */
+#define VOICE_RECV_BATCH      32    /* recvmmsg 1 回で読むデータグラム */
+
+/* v2.6.0: REST rate-limit buckets / purge */
+#define MAX_RL_BUCKETS        128
+#define RL_ROUTE_LEN          160
+#define RL_MAX_WAIT_SEC       60.0
+#define DISCORD_EPOCH_MS      1420070400000ULL
+#define PURGE_PAGE_SIZE       100
+#define PURGE_BULK_MAX        100
+#define PURGE_BULK_MAX_AGE_MS (14ULL * 24 * 3600 * 1000 - 60 * 1000) /* 14日 − 安全マージン */
+#define REST_POOL_SIZE        4     /* 並列 REST 用 curl ハンドル数 */
+#define MAX_MOD_JOBS          8
+#define MODJOB_MAX_WORKERS    8
+#define MODJOB_DEFAULT_WORKERS 4
+#define MODJOB_BAN_CHUNK      200   /* bulk-ban の1回あたり上限 */
+#define MODJOB_CHECKPOINT_EVERY 50
+#define COMMAND_CACHE_DEFAULT ".hajimu_discord_commands"
+#define MAX_WEBHOOK_QUEUES    16
+#define MAX_ATTACHMENTS       10
+#define WEBHOOK_MAX_EMBEDS    10
+#define WEBHOOK_MAX_PENDING   10000 /* キュー1本あたりの上限 */
+#define WEBHOOK_IDLE_SEC      30    /* 空のまま経過したら送信スレッド終了 */
+#define WEBHOOK_MAX_ATTEMPTS  3
+#define CACHE_MAP_MIN_CAP     64            /* エンティティキャッシュのハッシュ初期容量 */
+#define SNOWMAP_TOMB          UINT64_MAX    /* 削除済みスロット */
+#define MSG_CACHE_MAX_PER_CHANNEL 1000
+#define MSG_CACHE_DEFAULT_MB  32
+#define CACHE_SWEEP_DEFAULT_SEC 60          /* キャッシュ掃除の既定間隔 */
+#define MAX_NAME_KEY          160           /* 正規化済みメンバー名の最大バイト数 */
+#define NAME_DELTA_MAX        512           /* 名前索引の未ソート分がこれを超えたらマージ */
+#define NAME_SCAN_MAX         2048          /* 前方一致検索で照合する最大件数 */
+#define MSG_INDEX_DEFAULT_MB  16            /* メッセージ索引のサーバーあたり既定上限 */
+#define MSG_INDEX_MAX_GRAMS   128           /* 検索クエリから取る bigram の最大数 */
+#define SNAP_MAGIC            "HJDCSNAP"
+#define SNAP_VERSION          1
+#define SNAP_ENDIAN_MARK      0x01020304u
+#define SNAP_STR_NONE         0xFFFFFFFFu   /* 文字列プール内の null */
+#define ROLE_FLAG_HOIST       0x01
+#define ROLE_FLAG_MANAGED     0x02
+#define ROLE_FLAG_MENTIONABLE 0x04
+#define PERM_ADMINISTRATOR    (1ULL << 3)
+#define PERM_VIEW_CHANNEL     (1ULL << 10)
+#define PERM_SEND_MESSAGES    (1ULL << 11)
+#define PERM_READ_MESSAGE_HISTORY (1ULL << 16)
+/* 送信権限が無いと暗黙に失う権限: TTS・埋め込み・添付・全員メンション */
+#define PERM_SEND_IMPLIED     ((1ULL << 12) | (1ULL << 14) | (1ULL << 15) | (1ULL << 17))
+#define PERM_ALL              ((1ULL << 50) - 1)
+#define VS_FLAG_SELF_MUTE     0x01          /* ボイス状態フラグ */
+#define VS_FLAG_SELF_DEAF     0x02
+#define VS_FLAG_MUTE          0x04
+#define VS_FLAG_DEAF          0x08
+#define VS_FLAG_STREAM        0x10
+#define VS_FLAG_VIDEO         0x20
+#define VS_FLAG_BOT           0x40
 
 /* Discord component types */
 #define COMP_ACTION_ROW       1
@@ -448,6 +533,145 @@ typedef struct {
     char path[256];       /* File/URL path */
 } AudioQueueItem;
 
+/* v2.6.0: One encoded 20ms frame in the send-ahead ring.
+ * VFRAME_END は曲の区切りで、data にその曲のパスを入れる。 */
+enum { VFRAME_AUDIO = 0, VFRAME_END };
+
+typedef struct {
+    uint16_t len;
+    uint16_t samples;           /* 48kHz でのサンプル数 (パススルーは 20ms の倍数) */
+    uint8_t  kind;              /* VFRAME_* */
+    uint32_t track;             /* 曲番号 (スキップ・停止の判定に使う) */
+    uint8_t  rtp[12];           /* 送信時に RTP ヘッダーを書き、data をその場で暗号化する */
+    uint8_t  data[VOICE_OPUS_MAX + crypto_aead_xchacha20poly1305_ietf_ABYTES + 4];
+} VoiceFrame;
+_Static_assert(offsetof(VoiceFrame, data) == offsetof(VoiceFrame, rtp) + 12,
+               "VoiceFrame rtp must prefix data");
+
+/* Single-producer / single-consumer ring of encoded frames.
+ * tail は生成スレッドだけ、head は送信スレッドだけが進め、__atomic で公開する。 */
+typedef struct {
+    VoiceFrame *slots;          /* 初回の再生時に確保 */
+    uint32_t    head, tail;     /* 単調増加 (VOICE_RING_SLOTS - 1 でマスク) */
+    uint32_t    limit;          /* 先読みの深さ (フレーム数) */
+    uint32_t    low_water;      /* 再生中に観測した最小の残量 */
+    uint64_t    sent, underruns, overruns, late;
+} VoiceRing;
+
+/* v2.6.0: Next queued track opened ahead of time (voice_prefetch_*) */
+typedef struct VoicePrefetch VoicePrefetch;
+
+/* v2.6.0: Broadcast source — decoded and Opus-encoded once, then read by every
+ * subscribed connection's sender (RTP / nonce / 暗号化だけが接続ごと)。 */
+#define MAX_VOICE_CASTS 8
+
+typedef struct {
+    uint32_t id;                /* 0 = 空き */
+    AudioQueueItem queue[MAX_AUDIO_QUEUE];
+    int queue_head, queue_tail, queue_count;
+    bool loop_mode;
+    VoiceFrame *slots;          /* VOICE_RING_SLOTS — 書くのは配信スレッドだけ */
+    uint32_t tail;              /* 単調増加, __atomic で公開 */
+    uint32_t lead;              /* 実時間より先に作るフレーム数 */
+    struct timespec clock_start;
+    long long clock_units;      /* clock_start から作った 20ms 単位 */
+    int producing;              /* 曲の途中 (読み手はフレーム切れをアンダーランとして扱う) */
+    int subscribers;
+    uint64_t frames, encoded;   /* 作ったフレーム / そのうちエンコードしたもの */
+    volatile bool skip;
+    volatile bool stop;
+    OpusEncoder *enc;
+    VoicePrefetch *prefetch;    /* キューの先頭を準備中 (配信スレッドだけが触る) */
+    pthread_t thread;
+    pthread_mutex_t mutex;      /* queue */
+    pthread_cond_t cond;
+} VoiceCast;
+
+/* v2.6.0: Voice receive — per-SSRC jitter buffer, decoder and WAV sink */
+typedef struct {
+    uint16_t seq;
+    uint16_t len;
+    bool     used;
+    uint8_t  data[VOICE_OPUS_MAX];
+} VoiceJitterSlot;
+
+typedef struct {
+    uint32_t ssrc;
+    VoiceJitterSlot jb[VOICE_JB_SLOTS];
+    int      count;             /* jb に入っているパケット */
+    uint16_t next_seq;          /* 次に取り出す seq */
+    bool     playing;           /* 溜まって取り出し中 (発話の切れ目で止まる) */
+    OpusDecoder *dec;           /* 取り出しスレッドだけが使う */
+    FILE    *wav;
+    uint64_t wav_samples;       /* 書いたサンプル (録音開始からの無音の詰め物を含む) */
+    uint64_t packets, lost, late;
+} VoiceRecvStream;
+
+typedef struct {
+    VoiceRecvStream *streams[VOICE_RECV_STREAMS];  /* 最初のパケットで確保 */
+    int      stream_count;
+    char     dir[256];          /* WAV の保存先 (空 = 保存しない) */
+    Value    callback;          /* (サーバーID, ユーザーID, PCM配列) */
+    bool     has_callback;
+    int      depth;             /* 取り出し開始までに溜めるフレーム */
+    uint64_t tick;              /* 取り出しの刻み = 録音の時間軸 (20ms) */
+    uint64_t packets, decrypt_errors, no_slot;
+    volatile bool stop;
+    bool     detached;          /* コールバック内から停止された — 取り出しスレッドが後始末する */
+    pthread_t recv_thread, play_thread;
+    pthread_mutex_t mutex;      /* streams[] と jb */
+} VoiceRecv;
+
+typedef struct {
+    uint32_t ssrc;              /* 0 = 空き */
+    char     user_id[MAX_SNOWFLAKE];
+} VoiceSpeaker;
+
+/* v2.6.0: 48kHz/16bit/stereo PCM reader — in-process decoder or ffmpeg pipe */
+typedef struct PcmNative PcmNative;
+
+typedef struct {
+    FILE      *fp;              /* ffmpeg のパイプ (native のときは NULL) */
+    bool       is_pipe;
+    PcmNative *native;          /* WAV / FLAC のネイティブデコーダー */
+    int16_t   *ahead;           /* pcm_source_prefill で先に読んだ分 */
+    size_t     ahead_len, ahead_pos;
+} PcmSource;
+
+/* v2.6.0: Effect / TTS source mixed over the music queue */
+#define VOICE_MAX_MIX 8
+
+typedef struct {
+    char     path[256];
+    uint32_t id;                /* 0 = 空き */
+    int32_t  gain;              /* Q12 (4096 = 100%) */
+    bool     stop;              /* 音声効果停止 で立つ */
+    PcmSource src;              /* 生成スレッドが開いて閉じる */
+    bool     open;
+} VoiceMixSource;
+
+/* v2.6.0: Encoded frame sequence of one source, shared by all connections */
+typedef struct {
+    uint64_t key;               /* ソース + エンコード設定のハッシュ */
+    uint8_t *data;              /* [len u16][samples u16][Opus]… / NULL = ディスクのみ */
+    size_t   bytes;
+    uint32_t frames;
+    uint64_t tick;              /* LRU */
+    int      refs;              /* 再生中の接続数 (0 のものだけ追い出す) */
+    bool     on_disk;
+} VoiceClip;
+
+typedef struct {
+    size_t max_bytes;           /* メモリ上限 (0 = 無効) */
+    size_t mem_bytes;
+    size_t disk_max, disk_bytes;
+    char   dir[256];            /* ディスク退避先 (空 = 退避しない) */
+    uint64_t tick, hits, misses, evictions;
+    VoiceClip **clips;
+    int count, cap;
+    pthread_mutex_t mutex;
+} VoiceClipCache;
+
 typedef struct {
     /* Identity */
     char guild_id[MAX_SNOWFLAKE];
@@ -487,10 +711,49 @@ typedef struct {
     int queue_count;
     bool loop_mode;
 
+    /* Send-ahead pipeline (v2.6.0): audio_thread がデコード・エンコードして
+     * ring に積み、送信プールが 20ms ごとに RTP を付けて暗号化・送信する */
+    VoiceRing ring;
+    uint32_t track_seq;         /* 生成側が付けた最後の曲番号 (voice_mutex) */
+    uint32_t producing_track;   /* 生成中の曲 (0 = なし) */
+    uint32_t sending_track;     /* 送信中の曲 (0 = なし) */
+    uint32_t drop_upto;         /* この番号以下の曲のフレームは捨てる */
+    bool passthrough;           /* 生成中の曲を Opus のまま送っている */
+    int bitrate;                /* エンコーダーのビットレート (キャッシュのキーに含める) */
+    int32_t gain_target;        /* 音声音量 (Q12, 4096 = 100%) */
+    int32_t gain_cur;           /* 生成側が最後に掛けたゲイン */
+    bool limiter;               /* ソフトリミッター */
+    VoiceMixSource mix[VOICE_MAX_MIX];  /* 曲に重ねる効果音 (voice_mutex) */
+    uint32_t mix_seq;
+    int mix_active;             /* 使用中の mix の数 */
+    OpusDecoder *opus_dec;      /* 効果を重ねる間だけパススルーの曲をデコードする */
+    AudioQueueItem done[VOICE_DONE_SLOTS];  /* 送信し終えた曲 → 生成側が完了イベントを出す */
+    uint32_t done_head, done_tail;
+    VoicePrefetch *prefetch;    /* キューの先頭を準備中 (生成スレッドだけが触る) */
+
+    /* Pooled sender (v2.6.0): 送信スレッドのタイマーホイールに載り、
+     * 以下は登録先スレッドが wheel の mutex を持って触る */
+    int sender_id;              /* 送信スレッドの番号 (-1 = 未登録) */
+    int wheel_slot;             /* 20ms 内の送信位置 (ms) */
+    bool speaking;
+    bool speaking_changed;      /* op 5 をまだ送っていない — mutex を離してから送る */
+    int silence_left;
+    uint32_t hold;              /* 40/60ms のパケットを送った後に空ける刻み数 */
+    uint8_t silence_pkt[VOICE_SEND_BATCH][VOICE_SEAL_OVERHEAD + 3];
+    VoiceCast *cast;            /* 購読中の配信 (NULL = 自分のキューを送る) */
+    uint32_t cast_pos;          /* 次に読む配信フレーム */
+    uint8_t (*cast_pkt)[VOICE_OPUS_MAX + VOICE_SEAL_OVERHEAD];  /* 配信フレームの暗号化先 ×VOICE_SEND_BATCH */
+
+    /* Receive (v2.6.0): SPEAKING (op 5) の SSRC → ユーザー対応は常に記録し、
+     * 受信は 音声受信開始 で recv を確保してから */
+    VoiceSpeaker speakers[VOICE_RECV_STREAMS];  /* voice_mutex */
+    VoiceRecv *recv;
+
     /* Threads */
     pthread_t voice_ws_thread;
     pthread_t audio_thread;
     pthread_mutex_t voice_mutex;
+    pthread_cond_t voice_cond;  /* キュー追加・効果・完了・切断で生成側を起こす */
     int voice_heartbeat_interval; /* ms */
     volatile bool voice_heartbeat_acked;
 
@@ -501,6 +764,355 @@ typedef struct {
     bool server_received;
 } VoiceConn;
 
+/* v2.6.0: Voice sender pool. 各スレッドが 1ms 刻み × 20 のタイマーホイールを持ち、
+ * 刻みが来た位置の接続にだけ 1 フレームずつ送る。接続は負荷の低いスレッドの
+ * 空いた位置に割り当て、20ms の間に送信を散らす。 */
+typedef struct {
+    pthread_t thread;
+    pthread_mutex_t mutex;      /* wheel と、載っている接続の送信状態 */
+    pthread_mutex_t speak_mutex; /* mutex の外で op 5 を送っている間持つ (detach が待つ) */
+    VoiceConn **wheel[VOICE_WHEEL_SLOTS];
+    int count[VOICE_WHEEL_SLOTS], cap[VOICE_WHEEL_SLOTS];
+    int load;                   /* 載っている接続の数 */
+    int index;
+} VoiceSender;
+
+typedef struct {
+    VoiceSender threads[VOICE_SENDERS_MAX];
+    int count;                  /* 起動済みのスレッド数 (0 = 未起動) */
+    int want;                   /* 音声送信設定 (0 = コア数, 最大 8) */
+    bool high_priority;
+    bool pin_cpu;
+    pthread_mutex_t mutex;
+} VoiceSenderPool;
+
+/* --- REST rate-limit bucket (v2.6.0) --- */
+typedef struct {
+    char   route[RL_ROUTE_LEN];  /* "METHOD /channels/123/messages/:id" */
+    int    remaining;            /* -1 = 不明 */
+    double reset_at;             /* CLOCK_MONOTONIC 秒 */
+    double last_used;
+} RateBucket;
+
+/* --- Bulk moderation job (v2.6.0) --- */
+typedef enum {
+    MODJOB_ROLE_ADD = 0,
+    MODJOB_ROLE_REMOVE,
+    MODJOB_KICK,
+    MODJOB_TIMEOUT,
+    MODJOB_BAN,
+    MODJOB_TYPE_COUNT
+} ModJobType;
+
+typedef struct {
+    bool  active;
+    bool  finished;
+    volatile bool stop;
+    int   id;
+    ModJobType type;
+    char  guild_id[MAX_SNOWFLAKE];
+    char  role_id[MAX_SNOWFLAKE];
+    int   param;                      /* タイムアウト秒数 / BAN時の削除秒数 */
+    char  (*targets)[MAX_SNOWFLAKE];
+    uint8_t *done_flags;              /* 0 = 未完了, 1 = 成功, 2 = 失敗 */
+    int   total;
+    int   next;                       /* 次に割り当てる添字 */
+    int   watermark;                  /* [0, watermark) はすべて完了 */
+    int   done_count, ok_count, fail_count;
+    int   progress_step;
+    int   running_workers;
+    FILE *checkpoint;
+    long  checkpoint_wm_offset;
+    long *checkpoint_offsets;         /* 対象ごとの行の位置 (失敗の印を書く) */
+    char  checkpoint_path[512];
+    pthread_mutex_t mutex;
+    struct timespec start_time;
+} ModJob;
+
+/* --- Webhook send queue (v2.6.0) --- */
+typedef struct WebhookItem {
+    char *content;
+    char *username;
+    char *avatar_url;
+    char *embeds[WEBHOOK_MAX_EMBEDS];   /* serialized embed JSON */
+    int   embed_count;
+    bool  batchable;
+    struct WebhookItem *next;
+} WebhookItem;
+
+typedef struct {
+    bool  active;
+    bool  thread_running;
+    bool  cond_init;
+    char  url[MAX_URL_LEN];             /* クエリを除いた Webhook URL */
+    WebhookItem *head, *tail;
+    int   pending, inflight;
+    int   sent, failed, dropped, requests;
+    pthread_cond_t cond;
+} WebhookQueue;
+
+/* --- Entity cache (v2.6.0) --- */
+typedef struct {
+    uint64_t k1, k2;        /* k1 == 0: 空き, SNOWMAP_TOMB: 削除済み */
+    uint32_t idx;           /* 行番号 */
+} SnowSlot;
+
+/* Open-addressing map keyed by one or two snowflakes (k2 = 0 for single keys) */
+typedef struct {
+    SnowSlot *slots;
+    uint32_t  cap;          /* 2 の累乗 */
+    uint32_t  live, used;   /* used = live + 墓標 */
+} SnowMap;
+
+typedef struct {
+    uint64_t id;
+    uint64_t allow, deny;
+    uint8_t  type;          /* 0 = ロール, 1 = メンバー */
+} PermOverwrite;
+
+typedef struct {
+    char *name, *icon;
+    int   member_count;
+    bool  unavailable;
+} CachedGuild;
+
+typedef struct {
+    char *name, *topic;
+    bool  nsfw;
+    PermOverwrite *overwrites;
+    int   overwrite_count;
+} CachedChannel;
+
+typedef struct {
+    char    *name;
+    uint32_t color;
+    uint8_t  flags;         /* ROLE_FLAG_* */
+} CachedRole;
+
+typedef struct {
+    char     *nick, *username, *global_name, *avatar;
+    uint64_t *roles;
+    uint16_t  role_count;
+    bool      bot, pending;
+    int64_t   joined_at;    /* UNIX ms */
+} CachedMember;
+
+/* Member name index entry — key は name_fold() で正規化した名前 */
+typedef struct {
+    char    *key;
+    uint64_t user_id;
+    uint8_t  field;         /* NAME_FIELD_* */
+} NameEntry;
+
+typedef struct {
+    uint64_t   guild_id;
+    NameEntry *sorted;      /* key 順 */
+    uint32_t   sorted_count;
+    NameEntry *delta;       /* 追記分 (未ソート) */
+    uint32_t   delta_count, delta_cap;
+    uint32_t   stale;       /* 古くなった可能性のある項目数 (概算) */
+} NameIndex;
+
+/* 各エンティティは行番号で引く。ID・所属サーバー・権限など走査される項目は
+ * 並列配列に、名前などの冷たい項目は Cached* 構造体に置く。 */
+typedef struct {
+    SnowMap   guild_map, channel_map, role_map, member_map;
+
+    uint32_t  guild_count, guild_cap;
+    uint64_t *guild_id, *guild_owner;
+    CachedGuild *guilds;
+
+    uint32_t  channel_count, channel_cap;
+    uint64_t *channel_id, *channel_guild, *channel_parent;
+    int32_t  *channel_pos;
+    uint8_t  *channel_type;
+    CachedChannel *channels;
+
+    uint32_t  role_count, role_cap;
+    uint64_t *role_id, *role_guild, *role_perms;
+    int32_t  *role_pos;
+    CachedRole *roles;
+
+    uint32_t  member_count, member_cap;     /* key: (guild_id, user_id) */
+    uint64_t *member_guild, *member_user;
+    int64_t  *member_timeout;               /* communication_disabled_until (UNIX ms) */
+    uint32_t *member_seen;                  /* 最終観測 (CLOCK_MONOTONIC 秒) */
+    CachedMember *members;
+
+    /* Voice states — key (guild_id, user_id)。チャンネルごとの人数は
+     * vchan_* に増分で持ち、人数照会をハッシュ 1 回で済ませる。 */
+    uint32_t  voice_count, voice_cap;
+    uint64_t *voice_guild, *voice_user, *voice_channel;
+    uint8_t  *voice_flags;                  /* VS_FLAG_* */
+    SnowMap   voice_map, vchan_map;
+    uint32_t  vchan_count, vchan_cap;
+    uint64_t *vchan_id;
+    uint32_t *vchan_users, *vchan_humans;
+
+    /* Member name indexes — サーバーごとに初回検索時に作る */
+    SnowMap     nidx_map;
+    NameIndex **nidx;
+    uint32_t    nidx_count, nidx_cap;
+
+    pthread_mutex_t mutex;
+} EntityCache;
+
+/* --- Message cache (v2.6.0) --- */
+typedef struct {
+    uint64_t id, author_id;
+    char    *blob;              /* "著者名\0内容\0添付URL(改行区切り)\0" */
+    uint32_t blob_len;
+    uint16_t attachment_count;
+    bool     edited;
+} CachedMessage;
+
+/* チャンネルごとのリングバッファ。書き込み順の LRU リストで繋ぎ、
+ * 全体の上限を超えたら最も古く書かれたチャンネルから追い出す。 */
+typedef struct MsgRing {
+    uint64_t channel_id, guild_id;
+    CachedMessage *slots;
+    uint32_t cap, head, count;
+    uint32_t index;             /* rings[] 内の位置 */
+    struct MsgRing *lru_prev, *lru_next;
+} MsgRing;
+
+typedef struct {
+    uint32_t  per_channel;      /* 0 = 無効 */
+    size_t    max_bytes, bytes;
+    uint64_t  evictions;
+    SnowMap   ring_map;
+    MsgRing **rings;
+    uint32_t  ring_count, ring_cap;
+    MsgRing  *lru_head, *lru_tail;
+    pthread_mutex_t mutex;
+} MessageCache;
+
+/* --- Message full-text index (v2.6.0) --- */
+/* bigram ごとの転置リスト。文書番号の差分を LEB128 varint で詰める (昇順)。 */
+typedef struct {
+    uint8_t *buf;
+    uint32_t len, cap;
+    uint32_t last;              /* 最後に追加した文書番号 */
+    uint32_t count;
+} MsgPosting;
+
+/* サーバーごとの索引。文書番号は docs[] の位置で、追記のみ。
+ * 削除・編集前の文書は doc_msg を 0 にして残し、圧縮時にまとめて消す。 */
+typedef struct {
+    uint64_t    guild_id;
+    uint32_t    doc_count, doc_cap, dead;
+    uint64_t   *doc_msg, *doc_channel, *doc_author;
+    SnowMap     msg_map;        /* message_id → 文書番号 */
+    SnowMap     term_map;       /* bigram → terms[] */
+    uint64_t   *term_gram;
+    MsgPosting *terms;
+    uint32_t    term_count, term_cap;
+    size_t      post_bytes;     /* 転置リストの確保済みバイト数 */
+    size_t      post_len;       /* 転置リストの使用バイト数 */
+} MsgIndexGuild;
+
+typedef struct {
+    size_t          max_bytes;  /* サーバーあたり, 0 = 無効 */
+    uint64_t        evictions;
+    SnowMap         guild_map;
+    MsgIndexGuild **guilds;
+    uint32_t        guild_count, guild_cap;
+    pthread_mutex_t mutex;
+} MsgIndex;
+
+/* --- Reaction & poll tallies (v2.6.0) --- */
+/* 絵文字ごと・回答ごとの集計。投票者は昇順の ID 配列で持ち、重複を除く。 */
+typedef struct {
+    uint64_t  emoji_id;         /* カスタム絵文字 (0 = Unicode 絵文字・投票) */
+    char     *name;             /* 絵文字名 (投票は NULL) */
+    uint32_t  answer_id;        /* 投票の回答ID (リアクションは 0) */
+    uint32_t  count, burst;
+    uint64_t *voters;           /* 記録しない場合は NULL */
+    uint32_t  voter_count, voter_cap;
+} TallyEntry;
+
+typedef struct {
+    uint64_t    message_id, channel_id, guild_id;
+    uint64_t    tick;           /* 最終更新 (自動追跡の追い出し順) */
+    TallyEntry *entries;
+    uint16_t    entry_count, entry_cap;
+    bool        pinned;         /* 集計追跡で明示的に追加 — 追い出さない */
+    bool        voters;         /* 投票者を記録する */
+} TallyMessage;
+
+typedef struct {
+    uint32_t      max_auto;     /* 自動追跡の上限件数 (0 = 自動追跡しない) */
+    bool          auto_voters;
+    uint64_t      since_id;     /* これ以降に作られたメッセージは 0 から数えて正確 */
+    uint64_t      tick, evictions;
+    SnowMap       msg_map;      /* message_id → msgs[] */
+    SnowMap       gone_map;     /* 追い出した・解除した自動集計の対象 — 途中から数え直さない */
+    TallyMessage *msgs;
+    uint32_t      msg_count, msg_cap, auto_count;
+    pthread_mutex_t mutex;
+} TallyStore;
+
+/* --- Presence store (v2.6.0) --- */
+enum { PRES_OFFLINE = 0, PRES_ONLINE, PRES_IDLE, PRES_DND };
+enum { PRES_PLANE_STATUS = 0, PRES_PLANE_DESKTOP, PRES_PLANE_MOBILE, PRES_PLANE_WEB, PRES_PLANES };
+enum { PRES_KEEP_ALL = 0, PRES_KEEP_STATUS, PRES_KEEP_NONE };
+
+/* サーバーごとのメンバースロット。状態は 1 スロット 2bit で 64bit 語に
+ * 32 人ずつ詰め、全体・デスクトップ・モバイル・ウェブの 4 面を持つ。
+ * オフライン (0) になったスロットは空きリストへ戻す。 */
+typedef struct {
+    uint64_t  guild_id;
+    uint32_t  slot_count, slot_cap;     /* slot_count = 使用した最大スロット数 */
+    uint64_t *user;                     /* slot → user_id (0 = 空き) */
+    uint64_t *planes[PRES_PLANES];      /* 2 bit/slot, (slot_cap / 32) 語 */
+    uint32_t *activity;                 /* 文字列 ID (0 = なし) */
+    uint32_t *free_slots;
+    uint32_t  free_count, free_cap;
+    uint32_t  status_count[4];          /* PRES_* ごとの人数 (オフラインは数えない) */
+} PresenceGuild;
+
+typedef struct {
+    SnowMap   guild_map;                /* guild_id → guilds[] */
+    SnowMap   slot_map;                 /* (guild_id, user_id) → slot */
+    PresenceGuild *guilds;
+    uint32_t  guild_count, guild_cap;
+    /* アクティビティ名の intern 表 — ID 0 は「なし」 */
+    char    **strs;
+    uint32_t *str_refs;
+    uint32_t  str_count, str_cap;       /* str_count = 使用した最大 ID + 1 */
+    uint32_t *str_free;
+    uint32_t  str_free_count, str_free_cap;
+    uint32_t *str_table;                /* 開番地法: 文字列 ID (0 = 空き) */
+    uint32_t  str_table_cap, str_table_used;
+    int       retention;                /* PRES_KEEP_* */
+    pthread_mutex_t mutex;
+} PresenceStore;
+
+/* --- Cache memory budget (v2.6.0) --- */
+typedef enum {
+    CACHE_CAT_GUILD = 0,
+    CACHE_CAT_CHANNEL,
+    CACHE_CAT_ROLE,
+    CACHE_CAT_MEMBER,
+    CACHE_CAT_VOICE,
+    CACHE_CAT_MESSAGE,
+    CACHE_CAT_PRESENCE,
+    CACHE_CAT_MSG_INDEX,
+    CACHE_CAT_TALLY,
+    CACHE_CAT_COUNT
+} CacheCategory;
+
+enum { MEMBER_KEEP_ALL = 0, MEMBER_KEEP_VOICE, MEMBER_KEEP_NONE };
+
+typedef struct {
+    size_t   member_budget;             /* bytes, 0 = 無制限 (メッセージは MessageCache.max_bytes) */
+    size_t   global_budget;
+    uint64_t evictions[CACHE_CAT_COUNT];
+    int      member_retention;          /* MEMBER_KEEP_* */
+    int      sweep_interval;            /* 秒 */
+    bool     sweeper_running;
+} CacheBudget;
+
 /* --- Bot State --- */
 typedef struct {
     /* Authentication */
@@ -522,7 +1134,6 @@ typedef struct {
     pthread_t heartbeat_thread;
     pthread_mutex_t callback_mutex;
     pthread_mutex_t ws_write_mutex;
-    pthread_mutex_t rest_mutex;
 
     /* Intents */
     int intents;
@@ -566,9 +1177,30 @@ typedef struct {
 
     /* Application ID for slash commands */
     char application_id[MAX_SNOWFLAKE];
+    char command_guild_id[MAX_SNOWFLAKE]; /* 空ならグローバル登録 (v2.6.0) */
 
-    /* libcurl */
-    CURL *curl;
+    /* libcurl — REST handle pool (v2.6.0). 各スロットは専用 mutex を持ち、
+     * 別スロットのリクエストは並行して実行される。 */
+    struct {
+        CURL *curl;
+        pthread_mutex_t mutex;
+    } rest_pool[REST_POOL_SIZE];
+    unsigned int rest_rr;
+
+    /* Bulk moderation jobs (v2.6.0) */
+    ModJob mod_jobs[MAX_MOD_JOBS];
+    pthread_mutex_t mod_job_mutex;
+    int mod_job_seq;
+
+    /* Webhook send queues (v2.6.0) */
+    WebhookQueue webhook_queues[MAX_WEBHOOK_QUEUES];
+    pthread_mutex_t webhook_mutex;
+
+    /* REST rate-limit buckets (v2.6.0) */
+    RateBucket rl_buckets[MAX_RL_BUCKETS];
+    int rl_bucket_count;
+    double rl_global_until;
+    pthread_mutex_t rl_mutex;
 
     /* Log level */
     int log_level;
@@ -576,14 +1208,34 @@ typedef struct {
     /* Voice connections (v2.0.0) */
     VoiceConn voice_conns[MAX_VOICE_CONNS];
     int voice_conn_count;
+    VoiceSenderPool voice_senders;
+    VoiceCast voice_casts[MAX_VOICE_CASTS];
+    uint32_t voice_cast_seq;
+    pthread_mutex_t voice_cast_mutex;
 
-    /* Voice state cache — maps (guild_id, user_id) → channel_id */
-    struct {
-        char guild_id[MAX_SNOWFLAKE];
-        char user_id[MAX_SNOWFLAKE];
-        char channel_id[MAX_SNOWFLAKE];
-    } voice_states[MAX_VOICE_STATE_CACHE];
-    int voice_state_count;
+    /* Encoded-frame cache for loops and repeated clips (v2.6.0) */
+    VoiceClipCache voice_cache;
+
+    /* Entity cache — guilds / channels / roles / members / voice states (v2.6.0) */
+    EntityCache cache;
+
+    /* Message cache — opt-in per-channel rings (v2.6.0) */
+    MessageCache msg_cache;
+
+    /* Message full-text index — opt-in bigram index per guild (v2.6.0) */
+    MsgIndex msg_index;
+
+    /* Reaction & poll tallies — updated from gateway events (v2.6.0) */
+    TallyStore tally;
+
+    /* Presence store — packed per-guild statuses (v2.6.0) */
+    PresenceStore presence;
+
+    /* Cache budgets & background sweeper (v2.6.0) */
+    CacheBudget cache_budget;
+
+    /* Cache snapshot for warm restarts (v2.6.0) — 空なら無効 */
+    char cache_snapshot_path[512];
 
     /* Sharding (v2.2.0) */
     int shard_id;
@@ -614,6 +1266,14 @@ static int voice_ws_connect_raw(WsConn *ws, const char *host, int port, const ch
 static void voice_check_ready(VoiceConn *vc);
 static void *voice_ws_thread_func(void *arg);
 static void *voice_audio_thread_func(void *arg);
+static bool voice_sender_attach(VoiceConn *vc);
+static void voice_sender_detach(VoiceConn *vc);
+static void voice_send_speaking(VoiceConn *vc, bool speaking);
+static void voice_recv_stop(VoiceConn *vc);
+static void voice_recv_free(VoiceRecv *rv);
+static bool pcm_source_close(PcmSource *s);
+static void voice_prefetch_abandon(VoicePrefetch *pf);
+static void voice_prefetch_cancel(VoicePrefetch *pf);
 
 /* =========================================================================
  * Section 3: Logging
@@ -1023,6 +1683,35 @@ static char *base64_encode(const uint8_t *data, int len) {
     return out;
 }
 
+/* Decode standard Base64 (改行・空白は無視). Returns malloc'd buffer. */
+static uint8_t *base64_decode(const char *in, size_t *out_len) {
+    size_t n = strlen(in);
+    uint8_t *out = (uint8_t *)malloc(n / 4 * 3 + 3);
+    if (!out) return NULL;
+    uint32_t acc = 0;
+    int bits = 0;
+    size_t j = 0;
+    for (size_t i = 0; i < n; i++) {
+        char c = in[i];
+        int v;
+        if (c >= 'A' && c <= 'Z') v = c - 'A';
+        else if (c >= 'a' && c <= 'z') v = c - 'a' + 26;
+        else if (c >= '0' && c <= '9') v = c - '0' + 52;
+        else if (c == '+' || c == '-') v = 62;
+        else if (c == '/' || c == '_') v = 63;
+        else if (c == '=') break;
+        else continue;
+        acc = (acc << 6) | (uint32_t)v;
+        bits += 6;
+        if (bits >= 8) {
+            bits -= 8;
+            out[j++] = (uint8_t)((acc >> bits) & 0xFF);
+        }
+    }
+    *out_len = j;
+    return out;
+}
+
 /* =========================================================================
  * Section 8: HTTP Client (libcurl wrapper)
  * ========================================================================= */
@@ -1044,40 +1733,185 @@ static size_t curl_write_cb(void *ptr, size_t size, size_t nmemb, void *userdata
     return total;
 }
 
-/* Generic REST API call. Returns JSON response (caller must free). */
-static JsonNode *discord_rest(const char *method, const char *endpoint,
-                              const char *body, long *http_code) {
-    if (!g_bot.token_set) {
-        LOG_E("トークンが設定されていません");
-        return NULL;
-    }
+/* v2.6.0: Per-route rate-limit buckets
+ *
+ * Discord のレート制限はルート (メソッド + メジャーパラメータ) 単位。
+ * 応答ヘッダ X-RateLimit-Remaining / Reset-After を記録しておき、
+ * 残数 0 のバケットへの次のリクエストは送信前にリセットまで待機する。
+ * 待機は REST ハンドルを確保する前に行うため、他ルートのリクエストは塞がない。 */
+
+typedef struct {
+    int    remaining;
+    double reset_after;
+    bool   has_remaining;
+    bool   has_reset;
+    bool   global;
+} RlHeaders;
+
+static double mono_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
 
-    pthread_mutex_lock(&g_bot.rest_mutex);
+static bool rl_is_snowflake(const char *s, int len) {
+    if (len < 15 || len > 20) return false;
+    for (int i = 0; i < len; i++) if (s[i] < '0' || s[i] > '9') return false;
+    return true;
+}
 
-    if (!g_bot.curl) {
-        g_bot.curl = curl_easy_init();
-    }
-    CURL *curl = g_bot.curl;
-    if (!curl) {
-        pthread_mutex_unlock(&g_bot.rest_mutex);
-        return NULL;
+/* "/channels/123/messages/456?x=1" → "DELETE /channels/123/messages/:id"
+ * channels / guilds / webhooks(+token) 直後の ID はメジャーパラメータとして残す。 */
+static void rl_route_key(const char *method, const char *endpoint, char *out, size_t cap) {
+    StrBuf sb; sb_init(&sb);
+    sb_append(&sb, method);
+    sb_append_char(&sb, ' ');
+    const char *p = endpoint;
+    char prev[32] = "";
+    bool keep_next = false;
+    int keep_count = 0;
+    while (*p && *p != '?') {
+        if (*p == '/') { sb_append_char(&sb, '/'); p++; continue; }
+        const char *seg = p;
+        while (*p && *p != '/' && *p != '?') p++;
+        int len = (int)(p - seg);
+        if (keep_next && keep_count > 0) {
+            sb_appendn(&sb, seg, len);
+            keep_count--;
+            keep_next = keep_count > 0;
+        } else if (strcmp(prev, "reactions") == 0) {
+            sb_append(&sb, ":emoji");
+            keep_next = false;
+        } else if (rl_is_snowflake(seg, len)) {
+            sb_append(&sb, ":id");
+            keep_next = false;
+        } else {
+            sb_appendn(&sb, seg, len);
+            keep_next = false;
+        }
+        snprintf(prev, sizeof(prev), "%.*s", len < 31 ? len : 31, seg);
+        if (strcmp(prev, "channels") == 0 || strcmp(prev, "guilds") == 0) {
+            keep_next = true; keep_count = 1;
+        } else if (strcmp(prev, "webhooks") == 0) {
+            keep_next = true; keep_count = 2;
+        }
     }
+    snprintf(out, cap, "%s", sb.data);
+    sb_free(&sb);
+}
 
-    char url[MAX_URL_LEN];
-    snprintf(url, sizeof(url), "%s%s", DISCORD_API_BASE, endpoint);
+static size_t rl_header_cb(char *buf, size_t size, size_t nitems, void *userdata) {
+    size_t total = size * nitems;
+    RlHeaders *h = (RlHeaders *)userdata;
+    char line[256];
+    size_t n = total < sizeof(line) - 1 ? total : sizeof(line) - 1;
+    memcpy(line, buf, n);
+    line[n] = '\0';
+    char *colon = strchr(line, ':');
+    if (!colon) return total;
+    *colon = '\0';
+    const char *val = colon + 1;
+    while (*val == ' ') val++;
+    if (strcasecmp(line, "x-ratelimit-remaining") == 0) {
+        h->remaining = atoi(val);
+        h->has_remaining = true;
+    } else if (strcasecmp(line, "x-ratelimit-reset-after") == 0) {
+        h->reset_after = atof(val);
+        h->has_reset = true;
+    } else if (strcasecmp(line, "x-ratelimit-global") == 0) {
+        h->global = strncasecmp(val, "true", 4) == 0;
+    } else if (strcasecmp(line, "x-ratelimit-scope") == 0) {
+        if (strncasecmp(val, "global", 6) == 0) h->global = true;
+    }
+    return total;
+}
 
-    CurlBuf resp = {NULL, 0};
-    resp.data = (char *)calloc(1, REST_BUF_INIT);
-    if (!resp.data) {
-        pthread_mutex_unlock(&g_bot.rest_mutex);
-        return NULL;
+/* Caller must hold rl_mutex */
+static RateBucket *rl_bucket_find(const char *route, bool create) {
+    for (int i = 0; i < g_bot.rl_bucket_count; i++) {
+        if (strcmp(g_bot.rl_buckets[i].route, route) == 0) return &g_bot.rl_buckets[i];
+    }
+    if (!create) return NULL;
+    RateBucket *b;
+    if (g_bot.rl_bucket_count < MAX_RL_BUCKETS) {
+        b = &g_bot.rl_buckets[g_bot.rl_bucket_count++];
+    } else {
+        /* 満杯: 最も古く使われたバケットを再利用 */
+        b = &g_bot.rl_buckets[0];
+        for (int i = 1; i < MAX_RL_BUCKETS; i++) {
+            if (g_bot.rl_buckets[i].last_used < b->last_used) b = &g_bot.rl_buckets[i];
+        }
+    }
+    memset(b, 0, sizeof(*b));
+    snprintf(b->route, sizeof(b->route), "%s", route);
+    b->remaining = -1;
+    return b;
+}
+
+/* 送信前: バケットが枯渇していればリセットまで待機し、1枠予約する */
+static void rl_wait(const char *route) {
+    for (;;) {
+        pthread_mutex_lock(&g_bot.rl_mutex);
+        double now = mono_now();
+        double wait = g_bot.rl_global_until - now;
+        RateBucket *b = rl_bucket_find(route, false);
+        if (b) {
+            b->last_used = now;
+            if (now >= b->reset_at) {
+                b->remaining = -1;
+            } else if (b->remaining == 0) {
+                if (b->reset_at - now > wait) wait = b->reset_at - now;
+            }
+        }
+        if (wait <= 0) {
+            if (b && b->remaining > 0) b->remaining--;
+            pthread_mutex_unlock(&g_bot.rl_mutex);
+            return;
+        }
+        pthread_mutex_unlock(&g_bot.rl_mutex);
+        if (wait > RL_MAX_WAIT_SEC) wait = RL_MAX_WAIT_SEC;
+        LOG_D("レート制限バケット待機: %s (%.2f秒)", route, wait);
+        usleep((useconds_t)(wait * 1000000));
+    }
+}
+
+/* 応答後: ヘッダからバケット状態を更新 */
+static void rl_update(const char *route, const RlHeaders *h) {
+    if (!h->has_remaining && !h->has_reset) return;
+    pthread_mutex_lock(&g_bot.rl_mutex);
+    RateBucket *b = rl_bucket_find(route, true);
+    double now = mono_now();
+    b->last_used = now;
+    if (h->has_remaining) b->remaining = h->remaining;
+    if (h->has_reset) b->reset_at = now + h->reset_after;
+    pthread_mutex_unlock(&g_bot.rl_mutex);
+}
+
+/* 429 受信時: バケット (global なら全体) を retry_after の間ブロック */
+static void rl_block(const char *route, double retry_after, bool global) {
+    pthread_mutex_lock(&g_bot.rl_mutex);
+    double until = mono_now() + retry_after;
+    if (global) {
+        if (until > g_bot.rl_global_until) g_bot.rl_global_until = until;
+    } else {
+        RateBucket *b = rl_bucket_find(route, true);
+        b->remaining = 0;
+        if (until > b->reset_at) b->reset_at = until;
     }
+    pthread_mutex_unlock(&g_bot.rl_mutex);
+}
 
-    /* Headers */
+/* Configure a reset easy handle for one JSON REST request and perform it.
+ * bot_auth=false は Webhook 用 (URL 内のトークンで認証)。 */
+static CURLcode rest_perform(CURL *curl, const char *method, const char *url,
+                             const char *body, bool bot_auth, bool fresh,
+                             CurlBuf *resp, RlHeaders *rlh, long *code) {
     struct curl_slist *hdrs = NULL;
-    char auth[MAX_TOKEN_LEN + 32];
-    snprintf(auth, sizeof(auth), "Authorization: Bot %s", g_bot.token);
-    hdrs = curl_slist_append(hdrs, auth);
+    if (bot_auth) {
+        char auth[MAX_TOKEN_LEN + 32];
+        snprintf(auth, sizeof(auth), "Authorization: Bot %s", g_bot.token);
+        hdrs = curl_slist_append(hdrs, auth);
+    }
     hdrs = curl_slist_append(hdrs, "Content-Type: application/json");
     hdrs = curl_slist_append(hdrs, DISCORD_USER_AGENT);
 
@@ -1085,9 +1919,13 @@ static JsonNode *discord_rest(const char *method, const char *endpoint,
     curl_easy_setopt(curl, CURLOPT_URL, url);
     curl_easy_setopt(curl, CURLOPT_HTTPHEADER, hdrs);
     curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, curl_write_cb);
-    curl_easy_setopt(curl, CURLOPT_WRITEDATA, &resp);
+    curl_easy_setopt(curl, CURLOPT_WRITEDATA, resp);
+    curl_easy_setopt(curl, CURLOPT_HEADERFUNCTION, rl_header_cb);
+    curl_easy_setopt(curl, CURLOPT_HEADERDATA, rlh);
     curl_easy_setopt(curl, CURLOPT_TIMEOUT, 30L);
     curl_easy_setopt(curl, CURLOPT_NOSIGNAL, 1L);
+    /* スリープ後・切断後は接続が stale になるため FRESH_CONNECT で強制再接続 */
+    if (fresh) curl_easy_setopt(curl, CURLOPT_FRESH_CONNECT, 1L);
 #ifdef _WIN32
     /* Windows: クロスコンパイル済み libcurl は CA バンドルを持たないため
      * CURLSSLOPT_NATIVE_CA でシステム証明書ストアを使用する。*/
@@ -1110,128 +1948,138 @@ static JsonNode *discord_rest(const char *method, const char *endpoint,
     /* GET is default */
 
     CURLcode res = curl_easy_perform(curl);
-    long code = 0;
-    curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &code);
+    *code = 0;
+    curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, code);
     curl_slist_free_all(hdrs);
+    return res;
+}
 
-    if (http_code) *http_code = code;
+/* REST プール / レート制限 / Webhook キューの mutex を一度だけ初期化する。
+ * Webhook はボット作成前でも使えるため fn_bot_create とは独立させている。
+ * REST のエラーは Webhook の送信スレッドからも event_fire するので、
+ * callback_mutex もここで作る。 */
+static pthread_once_t g_rest_once = PTHREAD_ONCE_INIT;
+
+static void rest_init_mutexes(void) {
+    pthread_mutexattr_t attr;
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+    pthread_mutex_init(&g_bot.callback_mutex, &attr);
+    pthread_mutexattr_destroy(&attr);
+    for (int i = 0; i < REST_POOL_SIZE; i++)
+        pthread_mutex_init(&g_bot.rest_pool[i].mutex, NULL);
+    pthread_mutex_init(&g_bot.rl_mutex, NULL);
+    pthread_mutex_init(&g_bot.webhook_mutex, NULL);
+}
+
+static void rest_init(void) {
+    pthread_once(&g_rest_once, rest_init_mutexes);
+}
+
+/* Acquire a REST handle from the pool (空きスロット優先、なければ順番に待つ).
+ * Returns the slot index with its mutex held, or -1. */
+static int rest_acquire(void) {
+    rest_init();
+    for (int i = 0; i < REST_POOL_SIZE; i++) {
+        if (pthread_mutex_trylock(&g_bot.rest_pool[i].mutex) == 0) {
+            if (!g_bot.rest_pool[i].curl) g_bot.rest_pool[i].curl = curl_easy_init();
+            if (g_bot.rest_pool[i].curl) return i;
+            pthread_mutex_unlock(&g_bot.rest_pool[i].mutex);
+            return -1;
+        }
+    }
+    int slot = (int)(__atomic_fetch_add(&g_bot.rest_rr, 1, __ATOMIC_RELAXED) % REST_POOL_SIZE);
+    pthread_mutex_lock(&g_bot.rest_pool[slot].mutex);
+    if (!g_bot.rest_pool[slot].curl) g_bot.rest_pool[slot].curl = curl_easy_init();
+    if (g_bot.rest_pool[slot].curl) return slot;
+    pthread_mutex_unlock(&g_bot.rest_pool[slot].mutex);
+    return -1;
+}
+
+static void rest_release(int slot) {
+    pthread_mutex_unlock(&g_bot.rest_pool[slot].mutex);
+}
 
+/* Perform a JSON REST request on a pooled handle, honouring the route's
+ * rate-limit bucket. Retries once after 429 or a stale connection. */
+static JsonNode *rest_request(const char *method, const char *url, const char *route,
+                              const char *body, bool bot_auth, long *http_code,
+                              CURLcode *curl_res) {
+    rest_init();
     JsonNode *result = NULL;
-    if (res == CURLE_OK && resp.data && resp.len > 0) {
-        result = json_parse(resp.data);
+    bool fresh = false;
+    for (int attempt = 0; attempt < 2; attempt++) {
+        rl_wait(route);
 
-        /* Rate limit handling */
-        if (code == 429) {
-            JsonNode *retry = json_get(result, "retry_after");
-            double wait = retry ? retry->number : 1.0;
-            LOG_W("レート制限中… %.1f秒待機します", wait);
-            usleep((useconds_t)(wait * 1000000));
-            json_free(result); free(result);
-            free(resp.data);
-            /* Retry once — スリープ後は接続が stale になるため FRESH_CONNECT で強制再接続 */
-            resp.data = (char *)calloc(1, REST_BUF_INIT);
-            if (!resp.data) {
-                pthread_mutex_unlock(&g_bot.rest_mutex);
-                return NULL;
-            }
-            resp.len = 0;
-            hdrs = NULL;
-            hdrs = curl_slist_append(hdrs, auth);
-            hdrs = curl_slist_append(hdrs, "Content-Type: application/json");
-            hdrs = curl_slist_append(hdrs, DISCORD_USER_AGENT);
-            curl_easy_reset(curl);
-            curl_easy_setopt(curl, CURLOPT_URL, url);
-            curl_easy_setopt(curl, CURLOPT_HTTPHEADER, hdrs);
-            curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, curl_write_cb);
-            curl_easy_setopt(curl, CURLOPT_WRITEDATA, &resp);
-            curl_easy_setopt(curl, CURLOPT_TIMEOUT, 30L);
-            curl_easy_setopt(curl, CURLOPT_NOSIGNAL, 1L);
-            curl_easy_setopt(curl, CURLOPT_FRESH_CONNECT, 1L);
-#ifdef _WIN32
-            curl_easy_setopt(curl, CURLOPT_SSL_OPTIONS, (long)CURLSSLOPT_NATIVE_CA);
-#endif
-            if (strcmp(method, "POST") == 0) {
-                curl_easy_setopt(curl, CURLOPT_POST, 1L);
-                curl_easy_setopt(curl, CURLOPT_POSTFIELDS, body ? body : "");
-            } else if (strcmp(method, "PUT") == 0) {
-                curl_easy_setopt(curl, CURLOPT_CUSTOMREQUEST, "PUT");
-                curl_easy_setopt(curl, CURLOPT_POSTFIELDS, body ? body : "");
-            } else if (strcmp(method, "PATCH") == 0) {
-                curl_easy_setopt(curl, CURLOPT_CUSTOMREQUEST, "PATCH");
-                curl_easy_setopt(curl, CURLOPT_POSTFIELDS, body ? body : "");
-            } else if (strcmp(method, "DELETE") == 0) {
-                curl_easy_setopt(curl, CURLOPT_CUSTOMREQUEST, "DELETE");
-                if (body) curl_easy_setopt(curl, CURLOPT_POSTFIELDS, body);
-            }
-            res = curl_easy_perform(curl);
-            curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &code);
-            curl_slist_free_all(hdrs);
-            if (http_code) *http_code = code;
-            result = (res == CURLE_OK && resp.data) ? json_parse(resp.data) : NULL;
-        }
-    } else if (res == CURLE_SEND_ERROR || res == CURLE_RECV_ERROR) {
-        /* サーバー側が keep-alive 接続を閉じていた (stale connection)。
-         * FRESH_CONNECT で再接続して1回だけリトライする。*/
-        LOG_W("REST 接続エラー (%s)、再接続してリトライします", curl_easy_strerror(res));
-        free(resp.data);
+        int slot = rest_acquire();
+        if (slot < 0) return NULL;
+        CurlBuf resp = {NULL, 0};
         resp.data = (char *)calloc(1, REST_BUF_INIT);
         if (!resp.data) {
-            pthread_mutex_unlock(&g_bot.rest_mutex);
+            rest_release(slot);
             return NULL;
         }
-        resp.len = 0;
-        hdrs = NULL;
-        hdrs = curl_slist_append(hdrs, auth);
-        hdrs = curl_slist_append(hdrs, "Content-Type: application/json");
-        hdrs = curl_slist_append(hdrs, DISCORD_USER_AGENT);
-        curl_easy_reset(curl);
-        curl_easy_setopt(curl, CURLOPT_URL, url);
-        curl_easy_setopt(curl, CURLOPT_HTTPHEADER, hdrs);
-        curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, curl_write_cb);
-        curl_easy_setopt(curl, CURLOPT_WRITEDATA, &resp);
-        curl_easy_setopt(curl, CURLOPT_TIMEOUT, 30L);
-        curl_easy_setopt(curl, CURLOPT_NOSIGNAL, 1L);
-        curl_easy_setopt(curl, CURLOPT_FRESH_CONNECT, 1L);
-#ifdef _WIN32
-        curl_easy_setopt(curl, CURLOPT_SSL_OPTIONS, (long)CURLSSLOPT_NATIVE_CA);
-#endif
-        if (strcmp(method, "POST") == 0) {
-            curl_easy_setopt(curl, CURLOPT_POST, 1L);
-            curl_easy_setopt(curl, CURLOPT_POSTFIELDS, body ? body : "");
-        } else if (strcmp(method, "PUT") == 0) {
-            curl_easy_setopt(curl, CURLOPT_CUSTOMREQUEST, "PUT");
-            curl_easy_setopt(curl, CURLOPT_POSTFIELDS, body ? body : "");
-        } else if (strcmp(method, "PATCH") == 0) {
-            curl_easy_setopt(curl, CURLOPT_CUSTOMREQUEST, "PATCH");
-            curl_easy_setopt(curl, CURLOPT_POSTFIELDS, body ? body : "");
-        } else if (strcmp(method, "DELETE") == 0) {
-            curl_easy_setopt(curl, CURLOPT_CUSTOMREQUEST, "DELETE");
-            if (body) curl_easy_setopt(curl, CURLOPT_POSTFIELDS, body);
-        }
-        res = curl_easy_perform(curl);
-        curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &code);
-        curl_slist_free_all(hdrs);
+        RlHeaders rlh = {0};
+        long code = 0;
+        CURLcode res = rest_perform(g_bot.rest_pool[slot].curl, method, url, body,
+                                   bot_auth, fresh, &resp, &rlh, &code);
+        rest_release(slot);
+
         if (http_code) *http_code = code;
-        if (res == CURLE_OK && resp.data && resp.len > 0) {
+        if (curl_res) *curl_res = res;
+        if (res == CURLE_OK) rl_update(route, &rlh);
+
+        if (res == CURLE_OK && resp.len > 0) {
             result = json_parse(resp.data);
+            /* Rate limit handling — バケットを塞いでから1回だけリトライ */
+            if (code == 429 && attempt == 0) {
+                JsonNode *retry = json_get(result, "retry_after");
+                double wait = retry ? retry->number : 1.0;
+                JsonNode *glob = json_get(result, "global");
+                bool global = rlh.global || (glob && glob->type == JSON_BOOL && glob->boolean);
+                LOG_W("レート制限中… %.1f秒待機します%s", wait, global ? " (グローバル)" : "");
+                rl_block(route, wait, global);
+                json_free(result); free(result);
+                result = NULL;
+                free(resp.data);
+                fresh = true;
+                continue;
+            }
+        } else if ((res == CURLE_SEND_ERROR || res == CURLE_RECV_ERROR) && attempt == 0) {
+            /* サーバー側が keep-alive 接続を閉じていた (stale connection)。
+             * FRESH_CONNECT で再接続して1回だけリトライする。*/
+            LOG_W("REST 接続エラー (%s)、再接続してリトライします", curl_easy_strerror(res));
+            free(resp.data);
+            fresh = true;
+            continue;
         } else if (res != CURLE_OK) {
-            LOG_E("REST APIエラー (リトライ失敗): %s", curl_easy_strerror(res));
+            if (attempt) LOG_E("REST APIエラー (リトライ失敗): %s", curl_easy_strerror(res));
+            else         LOG_E("REST APIエラー: %s", curl_easy_strerror(res));
             Value err_msg = hajimu_string(curl_easy_strerror(res));
             event_fire("エラー", 1, &err_msg);
             event_fire("ERROR", 1, &err_msg);
         }
-    } else if (res != CURLE_OK) {
-        LOG_E("REST APIエラー: %s", curl_easy_strerror(res));
-        Value err_msg = hajimu_string(curl_easy_strerror(res));
-        event_fire("エラー", 1, &err_msg);
-        event_fire("ERROR", 1, &err_msg);
+        free(resp.data);
+        break;
     }
-
-    free(resp.data);
-    pthread_mutex_unlock(&g_bot.rest_mutex);
     return result;
 }
 
+/* Generic REST API call. Returns JSON response (caller must free). */
+static JsonNode *discord_rest(const char *method, const char *endpoint,
+                              const char *body, long *http_code) {
+    if (!g_bot.token_set) {
+        LOG_E("トークンが設定されていません");
+        return NULL;
+    }
+
+    char url[MAX_URL_LEN];
+    snprintf(url, sizeof(url), "%s%s", DISCORD_API_BASE, endpoint);
+    char route[RL_ROUTE_LEN];
+    rl_route_key(method, endpoint, route, sizeof(route));
+    return rest_request(method, url, route, body, true, http_code, NULL);
+}
+
 /* =========================================================================
  * Section 9: WebSocket Client
  * ========================================================================= */
@@ -1569,6 +2417,11 @@ static EventEntry *event_find(const char *name) {
     return NULL;
 }
 
+static bool event_has_handlers(const char *name) {
+    EventEntry *e = event_find(name);
+    return e && e->handler_count > 0;
+}
+
 static int event_register(const char *name, Value handler) {
     EventEntry *e = event_find(name);
     if (!e) {
@@ -1592,6 +2445,7 @@ static void event_fire(const char *name, int argc, Value *argv) {
     EventEntry *e = event_find(name);
     if (!e) return;
 
+    rest_init();    /* callback_mutex */
     pthread_mutex_lock(&g_bot.callback_mutex);
     for (int i = 0; i < e->handler_count; i++) {
         if (hajimu_runtime_available()) {
@@ -1810,36 +2664,12 @@ static Value json_to_value(JsonNode *node) {
     return hajimu_null();
 }
 
-/* Voice state cache helpers */
-static void voice_state_cache_update(const char *guild_id, const char *user_id, const char *channel_id) {
-    for (int i = 0; i < g_bot.voice_state_count; i++) {
-        if (strcmp(g_bot.voice_states[i].guild_id, guild_id) == 0 &&
-            strcmp(g_bot.voice_states[i].user_id, user_id) == 0) {
-            if (channel_id && *channel_id) {
-                snprintf(g_bot.voice_states[i].channel_id, MAX_SNOWFLAKE, "%s", channel_id);
-            } else {
-                g_bot.voice_states[i] = g_bot.voice_states[--g_bot.voice_state_count];
-            }
-            return;
-        }
-    }
-    if (channel_id && *channel_id && g_bot.voice_state_count < MAX_VOICE_STATE_CACHE) {
-        int idx = g_bot.voice_state_count++;
-        snprintf(g_bot.voice_states[idx].guild_id, MAX_SNOWFLAKE, "%s", guild_id);
-        snprintf(g_bot.voice_states[idx].user_id, MAX_SNOWFLAKE, "%s", user_id);
-        snprintf(g_bot.voice_states[idx].channel_id, MAX_SNOWFLAKE, "%s", channel_id);
-    }
-}
-
-static const char *voice_state_cache_get(const char *guild_id, const char *user_id) {
-    if (!guild_id || !user_id) return NULL;
-    for (int i = 0; i < g_bot.voice_state_count; i++) {
-        if (strcmp(g_bot.voice_states[i].guild_id, guild_id) == 0 &&
-            strcmp(g_bot.voice_states[i].user_id, user_id) == 0) {
-            return g_bot.voice_states[i].channel_id;
-        }
-    }
-    return NULL;
+/* Create an empty Value dict */
+static Value value_dict_new(void) {
+    Value dict;
+    memset(&dict, 0, sizeof(dict));
+    dict.type = VALUE_DICT;
+    return dict;
 }
 
 /* Helper to add a key-value pair to an existing Value dict */
@@ -1872,1602 +2702,7580 @@ static const char *value_get_str(Value *v, const char *key) {
 }
 
 /* =========================================================================
- * Section 12: Embed Builder → JSON
+ * Section 11.5: Entity Cache (v2.6.0)
+ *
+ * GUILD_CREATE / CHANNEL_* / GUILD_ROLE_* / GUILD_MEMBER_* などの
+ * ディスパッチからサーバー・チャンネル・ロール・メンバーを保持する。
+ * スノーフレークは 64bit 整数として開番地法ハッシュで引き、
+ * 走査や権限計算で使う項目は並列配列 (struct-of-arrays) に置く。
+ * 削除は末尾要素との入れ替えで行い、配列を常に詰めた状態に保つ。
  * ========================================================================= */
 
-static int embed_alloc(void) {
-    for (int i = 0; i < MAX_EMBEDS_STORE; i++) {
-        if (!g_bot.embeds[i].active) {
-            memset(&g_bot.embeds[i], 0, sizeof(Embed));
-            g_bot.embeds[i].active = true;
-            g_bot.embeds[i].color = -1;
-            return i;
+static void cache_init_mutex(void) {
+    pthread_mutex_init(&g_bot.cache.mutex, NULL);
+    pthread_mutex_init(&g_bot.msg_cache.mutex, NULL);
+    pthread_mutex_init(&g_bot.msg_index.mutex, NULL);
+    pthread_mutex_init(&g_bot.tally.mutex, NULL);
+    pthread_mutex_init(&g_bot.presence.mutex, NULL);
+}
+
+static pthread_once_t g_cache_once = PTHREAD_ONCE_INIT;
+
+static void cache_init(void) {
+    pthread_once(&g_cache_once, cache_init_mutex);
+}
+
+static uint64_t snow_parse(const char *s) {
+    return (s && *s) ? (uint64_t)strtoull(s, NULL, 10) : 0;
+}
+
+static uint64_t snow_hash(uint64_t k1, uint64_t k2) {
+    uint64_t h = k1 * 0x9E3779B97F4A7C15ULL ^ (k2 + 0x632BE59BD9B4E019ULL) * 0xC2B2AE3D27D4EB4FULL;
+    h ^= h >> 31;
+    h *= 0xBF58476D1CE4E5B9ULL;
+    h ^= h >> 29;
+    return h;
+}
+
+static int64_t snowmap_find(const SnowMap *m, uint64_t k1, uint64_t k2) {
+    if (!m->cap || !k1) return -1;
+    uint32_t mask = m->cap - 1;
+    for (uint32_t i = (uint32_t)snow_hash(k1, k2) & mask;; i = (i + 1) & mask) {
+        const SnowSlot *s = &m->slots[i];
+        if (s->k1 == 0) return -1;
+        if (s->k1 == k1 && s->k2 == k2) return s->idx;
+    }
+}
+
+static bool snowmap_rehash(SnowMap *m, uint32_t new_cap) {
+    SnowSlot *slots = (SnowSlot *)calloc(new_cap, sizeof(SnowSlot));
+    if (!slots) return false;
+    uint32_t mask = new_cap - 1;
+    for (uint32_t i = 0; i < m->cap; i++) {
+        SnowSlot *s = &m->slots[i];
+        if (s->k1 == 0 || s->k1 == SNOWMAP_TOMB) continue;
+        uint32_t j = (uint32_t)snow_hash(s->k1, s->k2) & mask;
+        while (slots[j].k1) j = (j + 1) & mask;
+        slots[j] = *s;
+    }
+    free(m->slots);
+    m->slots = slots;
+    m->cap = new_cap;
+    m->used = m->live;
+    return true;
+}
+
+/* Insert or overwrite (k1, k2) → idx */
+static bool snowmap_put(SnowMap *m, uint64_t k1, uint64_t k2, uint32_t idx) {
+    if (!k1 || k1 == SNOWMAP_TOMB) return false;
+    if ((m->used + 1) * 4 > m->cap * 3) {
+        /* 墓標が多いだけなら同じ容量で詰め直す */
+        uint32_t new_cap = m->cap ? m->cap : CACHE_MAP_MIN_CAP;
+        while ((m->live + 1) * 2 > new_cap) new_cap *= 2;
+        if (!snowmap_rehash(m, new_cap)) return false;
+    }
+    uint32_t mask = m->cap - 1;
+    int64_t tomb = -1;
+    for (uint32_t i = (uint32_t)snow_hash(k1, k2) & mask;; i = (i + 1) & mask) {
+        SnowSlot *s = &m->slots[i];
+        if (s->k1 == k1 && s->k2 == k2) { s->idx = idx; return true; }
+        if (s->k1 == SNOWMAP_TOMB) { if (tomb < 0) tomb = i; continue; }
+        if (s->k1 == 0) {
+            if (tomb >= 0) s = &m->slots[tomb];
+            else m->used++;
+            s->k1 = k1; s->k2 = k2; s->idx = idx;
+            m->live++;
+            return true;
         }
     }
-    LOG_E("埋め込みの上限に達しました");
-    return -1;
 }
 
-static Embed *embed_get(int idx) {
-    if (idx < 0 || idx >= MAX_EMBEDS_STORE || !g_bot.embeds[idx].active) return NULL;
-    return &g_bot.embeds[idx];
+static void snowmap_del(SnowMap *m, uint64_t k1, uint64_t k2) {
+    if (!m->cap || !k1) return;
+    uint32_t mask = m->cap - 1;
+    for (uint32_t i = (uint32_t)snow_hash(k1, k2) & mask;; i = (i + 1) & mask) {
+        SnowSlot *s = &m->slots[i];
+        if (s->k1 == 0) return;
+        if (s->k1 == k1 && s->k2 == k2) {
+            s->k1 = SNOWMAP_TOMB; s->k2 = 0;
+            m->live--;
+            return;
+        }
+    }
 }
 
-/* Serialize embed to JSON string */
-static char *embed_to_json(Embed *e) {
-    StrBuf sb; sb_init(&sb);
-    jb_obj_start(&sb);
-    if (e->title[0])       jb_str(&sb, "title", e->title);
-    if (e->description[0]) jb_str(&sb, "description", e->description);
-    if (e->color >= 0)     jb_int(&sb, "color", e->color);
-    if (e->timestamp[0])   jb_str(&sb, "timestamp", e->timestamp);
-    if (e->footer_text[0]) {
-        jb_key(&sb, "footer"); jb_obj_start(&sb);
-        jb_str(&sb, "text", e->footer_text);
-        if (e->footer_icon[0]) jb_str(&sb, "icon_url", e->footer_icon);
-        jb_obj_end(&sb); sb_append_char(&sb, ',');
-    }
-    if (e->thumbnail[0]) {
-        jb_key(&sb, "thumbnail"); jb_obj_start(&sb);
-        jb_str(&sb, "url", e->thumbnail);
-        jb_obj_end(&sb); sb_append_char(&sb, ',');
-    }
-    if (e->image[0]) {
-        jb_key(&sb, "image"); jb_obj_start(&sb);
-        jb_str(&sb, "url", e->image);
-        jb_obj_end(&sb); sb_append_char(&sb, ',');
+static void snowmap_free(SnowMap *m) {
+    free(m->slots);
+    memset(m, 0, sizeof(*m));
+}
+
+/* Grow a set of parallel arrays to hold at least `need` rows */
+static bool cache_reserve(void **arrays[], const size_t sizes[], int n,
+                          uint32_t *cap, uint32_t need) {
+    if (need <= *cap) return true;
+    uint32_t new_cap = *cap ? *cap * 2 : 16;
+    while (new_cap < need) new_cap *= 2;
+    for (int i = 0; i < n; i++) {
+        void *p = realloc(*arrays[i], (size_t)new_cap * sizes[i]);
+        if (!p) return false;   /* 拡張済みの配列はそのまま (cap は据え置き) */
+        *arrays[i] = p;
     }
-    if (e->author_name[0]) {
-        jb_key(&sb, "author"); jb_obj_start(&sb);
-        jb_str(&sb, "name", e->author_name);
-        if (e->author_icon[0]) jb_str(&sb, "icon_url", e->author_icon);
-        if (e->author_url[0])  jb_str(&sb, "url", e->author_url);
-        jb_obj_end(&sb); sb_append_char(&sb, ',');
+    *cap = new_cap;
+    return true;
+}
+
+/* ISO 8601 ("2024-01-02T03:04:05.678+00:00") → UNIX ms (0 = 無し) */
+static int64_t iso8601_to_ms(const char *s) {
+    if (!s || !*s) return 0;
+    int y, mo, d, h = 0, mi = 0, sec = 0;
+    if (sscanf(s, "%d-%d-%dT%d:%d:%d", &y, &mo, &d, &h, &mi, &sec) < 3) return 0;
+    int ms = 0;
+    const char *p = strchr(s, '.');
+    if (p) {
+        int digits = 0;
+        for (p++; *p >= '0' && *p <= '9'; p++) {
+            if (digits < 3) { ms = ms * 10 + (*p - '0'); digits++; }
+        }
+        while (digits++ < 3) ms *= 10;
+    }
+    /* days_from_civil (proleptic Gregorian) */
+    y -= mo <= 2;
+    int64_t era = (y >= 0 ? y : y - 399) / 400;
+    int64_t yoe = y - era * 400;
+    int64_t doy = (153 * (mo + (mo > 2 ? -3 : 9)) + 2) / 5 + d - 1;
+    int64_t doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;
+    int64_t days = era * 146097 + doe - 719468;
+    int64_t t = ((days * 24 + h) * 60 + mi) * 60 + sec;
+    const char *tz = s + strlen(s) - 6;   /* "+09:00" */
+    if (strlen(s) > 6 && (tz[0] == '+' || tz[0] == '-') && tz[3] == ':') {
+        int off = (atoi(tz + 1) * 60 + atoi(tz + 4)) * 60;
+        t -= tz[0] == '+' ? off : -off;
+    }
+    return t * 1000 + ms;
+}
+
+/* Replace *dst with obj[key] if the key is present (null clears it) */
+static void cache_set_str(char **dst, JsonNode *obj, const char *key) {
+    JsonNode *n = json_get(obj, key);
+    if (!n) return;
+    free(*dst);
+    *dst = (n->type == JSON_STRING && n->str.data[0]) ? strdup(n->str.data) : NULL;
+}
+
+/* --- Guilds --- */
+
+static void cache_guild_free_row(CachedGuild *g) {
+    free(g->name);
+    free(g->icon);
+}
+
+/* Find or append the row for a guild */
+static int64_t cache_guild_row(uint64_t id) {
+    EntityCache *c = &g_bot.cache;
+    if (!id) return -1;
+    int64_t i = snowmap_find(&c->guild_map, id, 0);
+    if (i >= 0) return i;
+    void **arrs[] = { (void **)&c->guild_id, (void **)&c->guild_owner, (void **)&c->guilds };
+    const size_t sizes[] = { sizeof(uint64_t), sizeof(uint64_t), sizeof(CachedGuild) };
+    if (!cache_reserve(arrs, sizes, 3, &c->guild_cap, c->guild_count + 1)) return -1;
+    i = c->guild_count;
+    if (!snowmap_put(&c->guild_map, id, 0, (uint32_t)i)) return -1;
+    c->guild_count++;
+    c->guild_id[i] = id;
+    c->guild_owner[i] = 0;
+    memset(&c->guilds[i], 0, sizeof(CachedGuild));
+    return i;
+}
+
+static int64_t cache_guild_upsert(JsonNode *obj) {
+    EntityCache *c = &g_bot.cache;
+    int64_t i = cache_guild_row(snow_parse(json_get_str(obj, "id")));
+    if (i < 0) return -1;
+    CachedGuild *g = &c->guilds[i];
+    const char *owner = json_get_str(obj, "owner_id");
+    if (owner) c->guild_owner[i] = snow_parse(owner);
+    cache_set_str(&g->name, obj, "name");
+    cache_set_str(&g->icon, obj, "icon");
+    JsonNode *mc = json_get(obj, "member_count");
+    if (mc && mc->type == JSON_NUMBER) g->member_count = (int)mc->number;
+    g->unavailable = json_get_bool(obj, "unavailable");
+    return i;
+}
+
+static void cache_guild_remove_row(uint32_t i) {
+    EntityCache *c = &g_bot.cache;
+    snowmap_del(&c->guild_map, c->guild_id[i], 0);
+    cache_guild_free_row(&c->guilds[i]);
+    uint32_t last = --c->guild_count;
+    if (i != last) {
+        c->guild_id[i] = c->guild_id[last];
+        c->guild_owner[i] = c->guild_owner[last];
+        c->guilds[i] = c->guilds[last];
+        snowmap_put(&c->guild_map, c->guild_id[i], 0, i);
+    }
+}
+
+/* --- Channels --- */
+
+static void cache_channel_free_row(CachedChannel *ch) {
+    free(ch->name);
+    free(ch->topic);
+    free(ch->overwrites);
+}
+
+static int64_t cache_channel_row(uint64_t id, uint64_t guild_id) {
+    EntityCache *c = &g_bot.cache;
+    if (!id) return -1;
+    int64_t i = snowmap_find(&c->channel_map, id, 0);
+    if (i >= 0) return i;
+    void **arrs[] = { (void **)&c->channel_id, (void **)&c->channel_guild,
+                      (void **)&c->channel_parent, (void **)&c->channel_pos,
+                      (void **)&c->channel_type, (void **)&c->channels };
+    const size_t sizes[] = { sizeof(uint64_t), sizeof(uint64_t), sizeof(uint64_t),
+                             sizeof(int32_t), sizeof(uint8_t), sizeof(CachedChannel) };
+    if (!cache_reserve(arrs, sizes, 6, &c->channel_cap, c->channel_count + 1)) return -1;
+    i = c->channel_count;
+    if (!snowmap_put(&c->channel_map, id, 0, (uint32_t)i)) return -1;
+    c->channel_count++;
+    c->channel_id[i] = id;
+    c->channel_guild[i] = guild_id;
+    c->channel_parent[i] = 0;
+    c->channel_pos[i] = 0;
+    c->channel_type[i] = 0;
+    memset(&c->channels[i], 0, sizeof(CachedChannel));
+    return i;
+}
+
+static int64_t cache_channel_upsert(JsonNode *obj, uint64_t guild_id) {
+    EntityCache *c = &g_bot.cache;
+    const char *gid = json_get_str(obj, "guild_id");
+    if (gid) guild_id = snow_parse(gid);
+    int64_t i = cache_channel_row(snow_parse(json_get_str(obj, "id")), guild_id);
+    if (i < 0) return -1;
+    CachedChannel *ch = &c->channels[i];
+    if (guild_id) c->channel_guild[i] = guild_id;
+    JsonNode *n;
+    if ((n = json_get(obj, "parent_id")))
+        c->channel_parent[i] = n->type == JSON_STRING ? snow_parse(n->str.data) : 0;
+    if ((n = json_get(obj, "position")) && n->type == JSON_NUMBER)
+        c->channel_pos[i] = (int32_t)n->number;
+    if ((n = json_get(obj, "type")) && n->type == JSON_NUMBER)
+        c->channel_type[i] = (uint8_t)n->number;
+    cache_set_str(&ch->name, obj, "name");
+    cache_set_str(&ch->topic, obj, "topic");
+    if ((n = json_get(obj, "nsfw"))) ch->nsfw = n->type == JSON_BOOL && n->boolean;
+
+    JsonNode *ow = json_get(obj, "permission_overwrites");
+    if (ow && ow->type == JSON_ARRAY) {
+        free(ch->overwrites);
+        ch->overwrites = NULL;
+        ch->overwrite_count = 0;
+        if (ow->arr.count > 0) {
+            ch->overwrites = (PermOverwrite *)calloc(ow->arr.count, sizeof(PermOverwrite));
+            if (ch->overwrites) {
+                for (int k = 0; k < ow->arr.count; k++) {
+                    JsonNode *o = &ow->arr.items[k];
+                    PermOverwrite *p = &ch->overwrites[ch->overwrite_count];
+                    p->id = snow_parse(json_get_str(o, "id"));
+                    if (!p->id) continue;
+                    p->type = (uint8_t)json_get_num(o, "type");
+                    p->allow = snow_parse(json_get_str(o, "allow"));
+                    p->deny = snow_parse(json_get_str(o, "deny"));
+                    ch->overwrite_count++;
+                }
+            }
+        }
     }
-    if (e->field_count > 0) {
-        jb_key(&sb, "fields"); jb_arr_start(&sb);
-        for (int i = 0; i < e->field_count; i++) {
-            jb_obj_start(&sb);
-            jb_str(&sb, "name",  e->fields[i].name);
-            jb_str(&sb, "value", e->fields[i].value);
-            jb_bool(&sb, "inline", e->fields[i].is_inline);
-            jb_obj_end(&sb); sb_append_char(&sb, ',');
+    return i;
+}
+
+static void cache_channel_remove_row(uint32_t i) {
+    EntityCache *c = &g_bot.cache;
+    snowmap_del(&c->channel_map, c->channel_id[i], 0);
+    cache_channel_free_row(&c->channels[i]);
+    uint32_t last = --c->channel_count;
+    if (i != last) {
+        c->channel_id[i] = c->channel_id[last];
+        c->channel_guild[i] = c->channel_guild[last];
+        c->channel_parent[i] = c->channel_parent[last];
+        c->channel_pos[i] = c->channel_pos[last];
+        c->channel_type[i] = c->channel_type[last];
+        c->channels[i] = c->channels[last];
+        snowmap_put(&c->channel_map, c->channel_id[i], 0, i);
+    }
+}
+
+/* --- Roles --- */
+
+static int64_t cache_role_row(uint64_t id, uint64_t guild_id) {
+    EntityCache *c = &g_bot.cache;
+    if (!id) return -1;
+    int64_t i = snowmap_find(&c->role_map, id, 0);
+    if (i < 0) {
+        void **arrs[] = { (void **)&c->role_id, (void **)&c->role_guild,
+                          (void **)&c->role_perms, (void **)&c->role_pos,
+                          (void **)&c->roles };
+        const size_t sizes[] = { sizeof(uint64_t), sizeof(uint64_t), sizeof(uint64_t),
+                                 sizeof(int32_t), sizeof(CachedRole) };
+        if (!cache_reserve(arrs, sizes, 5, &c->role_cap, c->role_count + 1)) return -1;
+        i = c->role_count;
+        if (!snowmap_put(&c->role_map, id, 0, (uint32_t)i)) return -1;
+        c->role_count++;
+        c->role_id[i] = id;
+        c->role_perms[i] = 0;
+        c->role_pos[i] = 0;
+        memset(&c->roles[i], 0, sizeof(CachedRole));
+    }
+    c->role_guild[i] = guild_id;
+    return i;
+}
+
+static int64_t cache_role_upsert(JsonNode *obj, uint64_t guild_id) {
+    EntityCache *c = &g_bot.cache;
+    int64_t i = cache_role_row(snow_parse(json_get_str(obj, "id")), guild_id);
+    if (i < 0) return -1;
+    CachedRole *r = &c->roles[i];
+    const char *perms = json_get_str(obj, "permissions");
+    if (perms) c->role_perms[i] = snow_parse(perms);
+    JsonNode *n;
+    if ((n = json_get(obj, "position")) && n->type == JSON_NUMBER)
+        c->role_pos[i] = (int32_t)n->number;
+    if ((n = json_get(obj, "color")) && n->type == JSON_NUMBER)
+        r->color = (uint32_t)n->number;
+    cache_set_str(&r->name, obj, "name");
+    r->flags = (json_get_bool(obj, "hoist") ? ROLE_FLAG_HOIST : 0) |
+               (json_get_bool(obj, "managed") ? ROLE_FLAG_MANAGED : 0) |
+               (json_get_bool(obj, "mentionable") ? ROLE_FLAG_MENTIONABLE : 0);
+    return i;
+}
+
+static void cache_role_remove_row(uint32_t i) {
+    EntityCache *c = &g_bot.cache;
+    snowmap_del(&c->role_map, c->role_id[i], 0);
+    free(c->roles[i].name);
+    uint32_t last = --c->role_count;
+    if (i != last) {
+        c->role_id[i] = c->role_id[last];
+        c->role_guild[i] = c->role_guild[last];
+        c->role_perms[i] = c->role_perms[last];
+        c->role_pos[i] = c->role_pos[last];
+        c->roles[i] = c->roles[last];
+        snowmap_put(&c->role_map, c->role_id[i], 0, i);
+    }
+}
+
+/* --- Member name index (prefix search) ---
+ *
+ * サーバーごとに正規化済みの名前 (ニックネーム・表示名・ユーザー名) を
+ * ソート済み配列に持ち、前方一致を二分探索で引く。追加は未ソートの
+ * delta に積み、検索時に一定量を超えていればマージする。名前の変更や
+ * メンバー削除で古くなった項目は検索時にメンバーキャッシュと照合して捨て、
+ * 古い項目が半分を超えたら作り直す。索引は初回検索時に作る。 */
+
+static const uint16_t name_halfwidth_kana[] = {
+    /* U+FF66 ～ U+FF9D → 全角カタカナ */
+    0x30F2, 0x30A1, 0x30A3, 0x30A5, 0x30A7, 0x30A9, 0x30E3, 0x30E5, 0x30E7, 0x30C3,
+    0x30FC, 0x30A2, 0x30A4, 0x30A6, 0x30A8, 0x30AA, 0x30AB, 0x30AD, 0x30AF, 0x30B1,
+    0x30B3, 0x30B5, 0x30B7, 0x30B9, 0x30BB, 0x30BD, 0x30BF, 0x30C1, 0x30C4, 0x30C6,
+    0x30C8, 0x30CA, 0x30CB, 0x30CC, 0x30CD, 0x30CE, 0x30CF, 0x30D2, 0x30D5, 0x30D8,
+    0x30DB, 0x30DE, 0x30DF, 0x30E0, 0x30E1, 0x30E2, 0x30E4, 0x30E6, 0x30E8, 0x30E9,
+    0x30EA, 0x30EB, 0x30EC, 0x30ED, 0x30EF, 0x30F3
+};
+
+/* Decode one UTF-8 sequence; invalid bytes are returned as-is (Latin-1 扱い) */
+static uint32_t utf8_next(const unsigned char **p) {
+    const unsigned char *s = *p;
+    uint32_t c = s[0];
+    int n = c >= 0xF0 ? 3 : c >= 0xE0 ? 2 : c >= 0xC0 ? 1 : 0;
+    if (n == 0 || c >= 0xF8) { *p = s + 1; return c; }
+    c &= 0x3F >> n;
+    for (int k = 1; k <= n; k++) {
+        if ((s[k] & 0xC0) != 0x80) { *p = s + 1; return s[0]; }
+        c = (c << 6) | (s[k] & 0x3F);
+    }
+    *p = s + n + 1;
+    return c;
+}
+
+static size_t utf8_put(uint32_t c, char *out) {
+    if (c < 0x80) { out[0] = (char)c; return 1; }
+    if (c < 0x800) {
+        out[0] = (char)(0xC0 | (c >> 6));
+        out[1] = (char)(0x80 | (c & 0x3F));
+        return 2;
+    }
+    if (c < 0x10000) {
+        out[0] = (char)(0xE0 | (c >> 12));
+        out[1] = (char)(0x80 | ((c >> 6) & 0x3F));
+        out[2] = (char)(0x80 | (c & 0x3F));
+        return 3;
+    }
+    out[0] = (char)(0xF0 | (c >> 18));
+    out[1] = (char)(0x80 | ((c >> 12) & 0x3F));
+    out[2] = (char)(0x80 | ((c >> 6) & 0x3F));
+    out[3] = (char)(0x80 | (c & 0x3F));
+    return 4;
+}
+
+/* Normalize a name for matching: 英字は小文字、全角英数・記号は半角、
+ * 半角カナは全角 (濁点・半濁点を結合)、カタカナはひらがなに寄せる。 */
+static size_t name_fold(const char *in, char *out, size_t cap) {
+    const unsigned char *p = (const unsigned char *)in;
+    size_t len = 0;
+    uint32_t prev = 0;
+    size_t prev_at = 0;
+    while (*p && len + 4 < cap) {
+        uint32_t c = utf8_next(&p);
+        if (c >= 0xFF01 && c <= 0xFF5E) c -= 0xFEE0;             /* 全角 ASCII */
+        else if (c == 0x3000) c = ' ';                            /* 全角スペース */
+        else if (c >= 0xFF66 && c <= 0xFF9D) c = name_halfwidth_kana[c - 0xFF66];
+        if ((c == 0xFF9E || c == 0x3099) && prev) {               /* 濁点 */
+            if ((prev >= 0x304B && prev <= 0x3062 && (prev & 1)) ||
+                (prev >= 0x3064 && prev <= 0x3069 && !(prev & 1)) ||
+                (prev >= 0x306F && prev <= 0x307D && prev % 3 == 0)) c = prev + 1;
+            else if (prev == 0x3046) c = 0x3094;
+            else continue;
+            len = prev_at;
+        } else if ((c == 0xFF9F || c == 0x309A) && prev) {        /* 半濁点 */
+            if (!(prev >= 0x306F && prev <= 0x307D && prev % 3 == 0)) continue;
+            c = prev + 2;
+            len = prev_at;
         }
-        jb_arr_end(&sb); sb_append_char(&sb, ',');
+        if (c >= 'A' && c <= 'Z') c += 'a' - 'A';
+        else if (c >= 0x30A1 && c <= 0x30F6) c -= 0x60;           /* カタカナ → ひらがな */
+        prev = c;
+        prev_at = len;
+        len += utf8_put(c, out + len);
+    }
+    out[len] = '\0';
+    return len;
+}
+
+enum { NAME_FIELD_NICK = 0, NAME_FIELD_GLOBAL, NAME_FIELD_USERNAME, NAME_FIELD_COUNT };
+
+static const char *member_name_field(const CachedMember *m, int field) {
+    switch (field) {
+    case NAME_FIELD_NICK:   return m->nick;
+    case NAME_FIELD_GLOBAL: return m->global_name;
+    default:                return m->username;
+    }
+}
+
+static uint32_t member_names_hash(const CachedMember *m) {
+    uint32_t h = 2166136261u;
+    for (int f = 0; f < NAME_FIELD_COUNT; f++) {
+        const char *s = member_name_field(m, f);
+        for (; s && *s; s++) h = (h ^ (uint8_t)*s) * 16777619u;
+        h = (h ^ 0xFF) * 16777619u;
+    }
+    return h;
+}
+
+static int name_entry_cmp(const void *a, const void *b) {
+    const NameEntry *x = (const NameEntry *)a, *y = (const NameEntry *)b;
+    int r = strcmp(x->key, y->key);
+    if (r) return r;
+    return x->user_id < y->user_id ? -1 : x->user_id > y->user_id;
+}
+
+static NameIndex *name_index_find(uint64_t guild_id) {
+    EntityCache *c = &g_bot.cache;
+    int64_t i = snowmap_find(&c->nidx_map, guild_id, 0);
+    return i >= 0 ? c->nidx[i] : NULL;
+}
+
+/* Queue every name of a member into the unsorted delta */
+static void name_index_append(NameIndex *ix, uint64_t user_id, const CachedMember *m) {
+    char key[MAX_NAME_KEY];
+    for (int f = 0; f < NAME_FIELD_COUNT; f++) {
+        const char *s = member_name_field(m, f);
+        if (!s || !s[0]) continue;
+        name_fold(s, key, sizeof(key));
+        void **arrs[] = { (void **)&ix->delta };
+        const size_t sizes[] = { sizeof(NameEntry) };
+        if (!cache_reserve(arrs, sizes, 1, &ix->delta_cap, ix->delta_count + 1)) return;
+        NameEntry *e = &ix->delta[ix->delta_count];
+        e->key = strdup(key);
+        if (!e->key) return;
+        e->user_id = user_id;
+        e->field = (uint8_t)f;
+        ix->delta_count++;
+    }
+}
+
+/* Sort the delta and merge it into the sorted array */
+static bool name_index_merge(NameIndex *ix) {
+    if (!ix->delta_count) return true;
+    qsort(ix->delta, ix->delta_count, sizeof(NameEntry), name_entry_cmp);
+    uint32_t total = ix->sorted_count + ix->delta_count;
+    NameEntry *merged = (NameEntry *)malloc((size_t)total * sizeof(NameEntry));
+    if (!merged) return false;
+    uint32_t a = 0, b = 0, k = 0;
+    while (a < ix->sorted_count && b < ix->delta_count)
+        merged[k++] = name_entry_cmp(&ix->sorted[a], &ix->delta[b]) <= 0
+                      ? ix->sorted[a++] : ix->delta[b++];
+    while (a < ix->sorted_count) merged[k++] = ix->sorted[a++];
+    while (b < ix->delta_count) merged[k++] = ix->delta[b++];
+    free(ix->sorted);
+    ix->sorted = merged;
+    ix->sorted_count = total;
+    ix->delta_count = 0;
+    return true;
+}
+
+static void name_index_free(NameIndex *ix) {
+    for (uint32_t k = 0; k < ix->sorted_count; k++) free(ix->sorted[k].key);
+    for (uint32_t k = 0; k < ix->delta_count; k++) free(ix->delta[k].key);
+    free(ix->sorted);
+    free(ix->delta);
+    free(ix);
+}
+
+static void name_index_drop(uint64_t guild_id) {
+    EntityCache *c = &g_bot.cache;
+    int64_t i = snowmap_find(&c->nidx_map, guild_id, 0);
+    if (i < 0) return;
+    name_index_free(c->nidx[i]);
+    snowmap_del(&c->nidx_map, guild_id, 0);
+    uint32_t last = --c->nidx_count;
+    if ((uint32_t)i != last) {
+        c->nidx[i] = c->nidx[last];
+        snowmap_put(&c->nidx_map, c->nidx[i]->guild_id, 0, (uint32_t)i);
     }
-    jb_obj_end(&sb);
-    return sb_detach(&sb);
 }
 
-/* =========================================================================
- * Section 13: Discord Gateway Protocol
- * ========================================================================= */
+/* Build the index for a guild from the member cache (caller holds cache mutex) */
+static NameIndex *name_index_build(uint64_t guild_id) {
+    EntityCache *c = &g_bot.cache;
+    name_index_drop(guild_id);
+    void **arrs[] = { (void **)&c->nidx };
+    const size_t sizes[] = { sizeof(NameIndex *) };
+    if (!cache_reserve(arrs, sizes, 1, &c->nidx_cap, c->nidx_count + 1)) return NULL;
+    NameIndex *ix = (NameIndex *)calloc(1, sizeof(NameIndex));
+    if (!ix) return NULL;
+    ix->guild_id = guild_id;
+    if (!snowmap_put(&c->nidx_map, guild_id, 0, c->nidx_count)) { free(ix); return NULL; }
+    c->nidx[c->nidx_count++] = ix;
+    for (uint32_t i = 0; i < c->member_count; i++)
+        if (c->member_guild[i] == guild_id) name_index_append(ix, c->member_user[i], &c->members[i]);
+    name_index_merge(ix);
+    return ix;
+}
 
-static void gw_send_json(const char *json) {
-    LOG_D("GW送信: %.200s", json);
-    ws_send_text(&g_bot.ws, json, (int)strlen(json));
+/* A member row was added or renamed — 索引があるサーバーだけ追記する */
+static void name_index_on_member(uint64_t guild_id, uint32_t row, bool renamed) {
+    NameIndex *ix = name_index_find(guild_id);
+    if (!ix) return;
+    const CachedMember *m = &g_bot.cache.members[row];
+    if (renamed) ix->stale += NAME_FIELD_COUNT;
+    name_index_append(ix, g_bot.cache.member_user[row], m);
 }
 
-static void gw_send_heartbeat(void) {
-    char buf[64];
-    if (g_bot.last_seq > 0) {
-        snprintf(buf, sizeof(buf), "{\"op\":1,\"d\":%d}", g_bot.last_seq);
-    } else {
-        snprintf(buf, sizeof(buf), "{\"op\":1,\"d\":null}");
-    }
-    gw_send_json(buf);
-    g_bot.heartbeat_acked = false;
-    LOG_D("Heartbeat送信 (seq=%d)", g_bot.last_seq);
+static void name_index_on_remove(uint64_t guild_id) {
+    NameIndex *ix = name_index_find(guild_id);
+    if (ix) ix->stale += NAME_FIELD_COUNT;
 }
 
-static void gw_send_identify(void) {
-    StrBuf sb; sb_init(&sb);
-    jb_obj_start(&sb);
-    jb_int(&sb, "op", GW_IDENTIFY);
-    jb_key(&sb, "d"); jb_obj_start(&sb);
-    jb_str(&sb, "token", g_bot.token);
-    jb_int(&sb, "intents", g_bot.intents);
-    jb_key(&sb, "properties"); jb_obj_start(&sb);
-    jb_str(&sb, "os", "hajimu");
-    jb_str(&sb, "browser", "hajimu_discord");
-    jb_str(&sb, "device", "hajimu_discord");
-    jb_obj_end(&sb); sb_append_char(&sb, ',');
-    /* Sharding (v2.2.0) */
-    if (g_bot.sharding_enabled) {
-        jb_key(&sb, "shard");
-        sb_appendf(&sb, "[%d,%d],", g_bot.shard_id, g_bot.shard_count);
+typedef struct {
+    uint32_t row;
+    uint8_t  field, exact;
+    uint16_t len;
+} NameHit;
+
+static int name_hit_cmp(const void *a, const void *b) {
+    const NameHit *x = (const NameHit *)a, *y = (const NameHit *)b;
+    if (x->exact != y->exact) return y->exact - x->exact;   /* 完全一致を先に */
+    if (x->len != y->len) return x->len - y->len;           /* 短い名前を先に */
+    if (x->field != y->field) return x->field - y->field;   /* ニックネーム → 表示名 → ユーザー名 */
+    return x->row < y->row ? -1 : x->row > y->row;
+}
+
+/* Check an index entry against the live member row; false when it went stale */
+static bool name_entry_live(uint64_t guild_id, const NameEntry *e, NameHit *hit) {
+    EntityCache *c = &g_bot.cache;
+    int64_t row = snowmap_find(&c->member_map, guild_id, e->user_id);
+    if (row < 0) return false;
+    const char *s = member_name_field(&c->members[row], e->field);
+    if (!s) return false;
+    char key[MAX_NAME_KEY];
+    size_t len = name_fold(s, key, sizeof(key));
+    if (strcmp(key, e->key) != 0) return false;
+    hit->row = (uint32_t)row;
+    hit->field = e->field;
+    hit->len = (uint16_t)(len < UINT16_MAX ? len : UINT16_MAX);
+    return true;
+}
+
+/* Top-N members whose names start with query (caller holds cache mutex).
+ * rows/fields には重複のないメンバー行とその一致項目を返す。 */
+static int name_index_search(uint64_t guild_id, const char *query, int limit,
+                             uint32_t *rows, uint8_t *fields) {
+    NameIndex *ix = name_index_find(guild_id);
+    uint32_t entries = ix ? ix->sorted_count + ix->delta_count : 0;
+    if (!ix || ix->stale * 2 > entries + 64) ix = name_index_build(guild_id);
+    if (!ix) return 0;
+    if (ix->delta_count > NAME_DELTA_MAX) name_index_merge(ix);
+
+    char q[MAX_NAME_KEY];
+    size_t qlen = name_fold(query, q, sizeof(q));
+    NameHit *hits = (NameHit *)malloc(NAME_SCAN_MAX * sizeof(NameHit));
+    if (!hits) return 0;
+    int nhits = 0;
+    uint32_t lo = 0, hi = ix->sorted_count;
+    while (lo < hi) {
+        uint32_t mid = lo + (hi - lo) / 2;
+        if (strcmp(ix->sorted[mid].key, q) < 0) lo = mid + 1;
+        else hi = mid;
+    }
+    for (uint32_t k = lo; k < ix->sorted_count && nhits < NAME_SCAN_MAX; k++) {
+        const NameEntry *e = &ix->sorted[k];
+        if (strncmp(e->key, q, qlen) != 0) break;
+        if (name_entry_live(guild_id, e, &hits[nhits])) {
+            hits[nhits].exact = e->key[qlen] == '\0';
+            nhits++;
+        }
     }
-    jb_obj_end(&sb); sb_append_char(&sb, ',');
-    jb_obj_end(&sb);
-    gw_send_json(sb.data);
-    sb_free(&sb);
-    LOG_I("IDENTIFY送信");
+    for (uint32_t k = 0; k < ix->delta_count && nhits < NAME_SCAN_MAX; k++) {
+        const NameEntry *e = &ix->delta[k];
+        if (strncmp(e->key, q, qlen) != 0) continue;
+        if (name_entry_live(guild_id, e, &hits[nhits])) {
+            hits[nhits].exact = e->key[qlen] == '\0';
+            nhits++;
+        }
+    }
+    qsort(hits, (size_t)nhits, sizeof(NameHit), name_hit_cmp);
+    int n = 0;
+    for (int k = 0; k < nhits && n < limit; k++) {
+        bool dup = false;
+        for (int j = 0; j < n && !dup; j++) dup = rows[j] == hits[k].row;
+        if (dup) continue;
+        rows[n] = hits[k].row;
+        fields[n] = hits[k].field;
+        n++;
+    }
+    free(hits);
+    return n;
 }
 
-static void gw_send_resume(void) {
-    StrBuf sb; sb_init(&sb);
-    jb_obj_start(&sb);
-    jb_int(&sb, "op", GW_RESUME);
-    jb_key(&sb, "d"); jb_obj_start(&sb);
-    jb_str(&sb, "token", g_bot.token);
-    jb_str(&sb, "session_id", g_bot.session_id);
-    jb_int(&sb, "seq", g_bot.last_seq);
-    jb_obj_end(&sb); sb_append_char(&sb, ',');
-    jb_obj_end(&sb);
-    gw_send_json(sb.data);
-    sb_free(&sb);
-    LOG_I("RESUME送信 (session=%s, seq=%d)", g_bot.session_id, g_bot.last_seq);
+/* --- Members (key: guild_id, user_id) --- */
+
+static void cache_member_free_row(CachedMember *m) {
+    free(m->nick);
+    free(m->username);
+    free(m->global_name);
+    free(m->avatar);
+    free(m->roles);
+}
+
+/* Find or append the row for (guild, user); -1 when retention forbids new rows */
+static int64_t cache_member_row(uint64_t guild_id, uint64_t user_id) {
+    EntityCache *c = &g_bot.cache;
+    if (!guild_id || !user_id) return -1;
+    int64_t i = snowmap_find(&c->member_map, guild_id, user_id);
+    if (i >= 0) return i;
+    /* 保持ポリシー「なし」では自分以外を新規に載せない */
+    if (g_bot.cache_budget.member_retention == MEMBER_KEEP_NONE &&
+        user_id != snow_parse(g_bot.bot_id)) return -1;
+    void **arrs[] = { (void **)&c->member_guild, (void **)&c->member_user,
+                      (void **)&c->member_timeout, (void **)&c->member_seen,
+                      (void **)&c->members };
+    const size_t sizes[] = { sizeof(uint64_t), sizeof(uint64_t), sizeof(int64_t),
+                             sizeof(uint32_t), sizeof(CachedMember) };
+    if (!cache_reserve(arrs, sizes, 5, &c->member_cap, c->member_count + 1)) return -1;
+    i = c->member_count;
+    if (!snowmap_put(&c->member_map, guild_id, user_id, (uint32_t)i)) return -1;
+    c->member_count++;
+    c->member_guild[i] = guild_id;
+    c->member_user[i] = user_id;
+    c->member_timeout[i] = 0;
+    c->member_seen[i] = (uint32_t)mono_now();
+    memset(&c->members[i], 0, sizeof(CachedMember));
+    return i;
+}
+
+/* obj: member オブジェクト, user: obj に user が無い場合の補完
+ * (MESSAGE_CREATE の member には user が含まれず author を使う) */
+static int64_t cache_member_upsert(uint64_t guild_id, JsonNode *obj, JsonNode *user) {
+    EntityCache *c = &g_bot.cache;
+    if (!guild_id || !obj || obj->type != JSON_OBJECT) return -1;
+    JsonNode *u = json_get(obj, "user");
+    if (!u) u = user;
+    uint64_t uid = snow_parse(u ? json_get_str(u, "id") : json_get_str(obj, "user_id"));
+    uint32_t before = c->member_count;
+    int64_t i = cache_member_row(guild_id, uid);
+    if (i < 0) return -1;
+    CachedMember *m = &c->members[i];
+    bool added = c->member_count > before;
+    uint32_t names = added ? 0 : member_names_hash(m);
+    c->member_seen[i] = (uint32_t)mono_now();
+    JsonNode *n;
+    if ((n = json_get(obj, "communication_disabled_until")))
+        c->member_timeout[i] = n->type == JSON_STRING ? iso8601_to_ms(n->str.data) : 0;
+    if ((n = json_get(obj, "joined_at")) && n->type == JSON_STRING)
+        m->joined_at = iso8601_to_ms(n->str.data);
+    cache_set_str(&m->nick, obj, "nick");
+    cache_set_str(&m->avatar, obj, "avatar");
+    if ((n = json_get(obj, "pending"))) m->pending = n->type == JSON_BOOL && n->boolean;
+    if (u) {
+        cache_set_str(&m->username, u, "username");
+        cache_set_str(&m->global_name, u, "global_name");
+        if ((n = json_get(u, "bot"))) m->bot = n->type == JSON_BOOL && n->boolean;
+    }
+    JsonNode *roles = json_get(obj, "roles");
+    if (roles && roles->type == JSON_ARRAY) {
+        free(m->roles);
+        m->roles = NULL;
+        m->role_count = 0;
+        if (roles->arr.count > 0) {
+            m->roles = (uint64_t *)malloc(roles->arr.count * sizeof(uint64_t));
+            if (m->roles) {
+                for (int k = 0; k < roles->arr.count && k < UINT16_MAX; k++) {
+                    JsonNode *r = &roles->arr.items[k];
+                    if (r->type == JSON_STRING) m->roles[m->role_count++] = snow_parse(r->str.data);
+                }
+            }
+        }
+    }
+    if (added || member_names_hash(m) != names) name_index_on_member(guild_id, (uint32_t)i, !added);
+    return i;
+}
+
+static void cache_member_remove_row(uint32_t i) {
+    EntityCache *c = &g_bot.cache;
+    name_index_on_remove(c->member_guild[i]);
+    snowmap_del(&c->member_map, c->member_guild[i], c->member_user[i]);
+    cache_member_free_row(&c->members[i]);
+    uint32_t last = --c->member_count;
+    if (i != last) {
+        c->member_guild[i] = c->member_guild[last];
+        c->member_user[i] = c->member_user[last];
+        c->member_timeout[i] = c->member_timeout[last];
+        c->member_seen[i] = c->member_seen[last];
+        c->members[i] = c->members[last];
+        snowmap_put(&c->member_map, c->member_guild[i], c->member_user[i], i);
+    }
+}
+
+/* --- Voice states --- */
+
+/* Adjust the occupancy row for a voice channel; rows are dropped at zero */
+static void vchan_adjust(uint64_t channel_id, int users, int humans) {
+    EntityCache *c = &g_bot.cache;
+    int64_t i = snowmap_find(&c->vchan_map, channel_id, 0);
+    if (i < 0) {
+        if (users <= 0) return;
+        void **arrs[] = { (void **)&c->vchan_id, (void **)&c->vchan_users,
+                          (void **)&c->vchan_humans };
+        const size_t sizes[] = { sizeof(uint64_t), sizeof(uint32_t), sizeof(uint32_t) };
+        if (!cache_reserve(arrs, sizes, 3, &c->vchan_cap, c->vchan_count + 1)) return;
+        i = c->vchan_count;
+        if (!snowmap_put(&c->vchan_map, channel_id, 0, (uint32_t)i)) return;
+        c->vchan_count++;
+        c->vchan_id[i] = channel_id;
+        c->vchan_users[i] = c->vchan_humans[i] = 0;
+    }
+    c->vchan_users[i] += users;
+    c->vchan_humans[i] += humans;
+    if (c->vchan_users[i] == 0) {
+        snowmap_del(&c->vchan_map, channel_id, 0);
+        uint32_t last = --c->vchan_count;
+        if ((uint32_t)i != last) {
+            c->vchan_id[i] = c->vchan_id[last];
+            c->vchan_users[i] = c->vchan_users[last];
+            c->vchan_humans[i] = c->vchan_humans[last];
+            snowmap_put(&c->vchan_map, c->vchan_id[i], 0, (uint32_t)i);
+        }
+    }
 }
 
-static void gw_send_presence(const char *status, const char *activity_name, int type) {
-    StrBuf sb; sb_init(&sb);
-    jb_obj_start(&sb);
-    jb_int(&sb, "op", GW_PRESENCE_UPDATE);
-    jb_key(&sb, "d"); jb_obj_start(&sb);
-    jb_null(&sb, "since");
-    jb_key(&sb, "activities"); jb_arr_start(&sb);
-    if (activity_name && activity_name[0]) {
-        jb_obj_start(&sb);
-        jb_str(&sb, "name", activity_name);
-        jb_int(&sb, "type", type);
-        jb_obj_end(&sb);
+static void voice_state_remove_row(uint32_t i) {
+    EntityCache *c = &g_bot.cache;
+    vchan_adjust(c->voice_channel[i], -1, (c->voice_flags[i] & VS_FLAG_BOT) ? 0 : -1);
+    snowmap_del(&c->voice_map, c->voice_guild[i], c->voice_user[i]);
+    uint32_t last = --c->voice_count;
+    if (i != last) {
+        c->voice_guild[i] = c->voice_guild[last];
+        c->voice_user[i] = c->voice_user[last];
+        c->voice_channel[i] = c->voice_channel[last];
+        c->voice_flags[i] = c->voice_flags[last];
+        snowmap_put(&c->voice_map, c->voice_guild[i], c->voice_user[i], i);
     }
-    jb_arr_end(&sb); sb_append_char(&sb, ',');
-    jb_str(&sb, "status", status);
-    jb_bool(&sb, "afk", false);
-    jb_obj_end(&sb); sb_append_char(&sb, ',');
-    jb_obj_end(&sb);
-    gw_send_json(sb.data);
-    sb_free(&sb);
 }
 
-/* Process READY event */
-static void gw_handle_ready(JsonNode *data) {
-    const char *session = json_get_str(data, "session_id");
-    if (session) snprintf(g_bot.session_id, sizeof(g_bot.session_id), "%s", session);
+static void voice_state_set(uint64_t guild_id, uint64_t uid, uint64_t cid, uint8_t flags);
 
-    const char *resume = json_get_str(data, "resume_gateway_url");
-    if (resume) snprintf(g_bot.resume_url, sizeof(g_bot.resume_url), "%s", resume);
+/* VOICE_STATE_UPDATE / GUILD_CREATE.voice_states の1件を反映 (caller holds cache mutex) */
+static void voice_state_cache_update(uint64_t guild_id, JsonNode *vs) {
+    EntityCache *c = &g_bot.cache;
+    uint64_t uid = snow_parse(json_get_str(vs, "user_id"));
+    uint64_t cid = snow_parse(json_get_str(vs, "channel_id"));
+    if (!guild_id || !uid) return;
 
-    /* Bot user info */
-    JsonNode *user = json_get(data, "user");
+    uint8_t flags = (json_get_bool(vs, "self_mute")   ? VS_FLAG_SELF_MUTE : 0) |
+                    (json_get_bool(vs, "self_deaf")   ? VS_FLAG_SELF_DEAF : 0) |
+                    (json_get_bool(vs, "mute")        ? VS_FLAG_MUTE : 0) |
+                    (json_get_bool(vs, "deaf")        ? VS_FLAG_DEAF : 0) |
+                    (json_get_bool(vs, "self_stream") ? VS_FLAG_STREAM : 0) |
+                    (json_get_bool(vs, "self_video")  ? VS_FLAG_VIDEO : 0);
+    /* Bot 判定: ペイロードの member.user.bot → メンバーキャッシュ → 自分自身 */
+    JsonNode *member = json_get(vs, "member");
+    JsonNode *user = member ? json_get(member, "user") : NULL;
     if (user) {
-        const char *id = json_get_str(user, "id");
-        if (id) snprintf(g_bot.bot_id, sizeof(g_bot.bot_id), "%s", id);
-        const char *name = json_get_str(user, "username");
-        if (name) snprintf(g_bot.bot_username, sizeof(g_bot.bot_username), "%s", name);
-        const char *disc = json_get_str(user, "discriminator");
-        if (disc) snprintf(g_bot.bot_discriminator, sizeof(g_bot.bot_discriminator), "%s", disc);
+        if (json_get_bool(user, "bot")) flags |= VS_FLAG_BOT;
+    } else {
+        int64_t mi = snowmap_find(&c->member_map, guild_id, uid);
+        if (mi >= 0 && c->members[mi].bot) flags |= VS_FLAG_BOT;
+    }
+    if (uid == snow_parse(g_bot.bot_id)) flags |= VS_FLAG_BOT;
+    if (member) cache_member_upsert(guild_id, member, NULL);
+    voice_state_set(guild_id, uid, cid, flags);
+}
+
+/* Set (guild, user) → channel with flags; cid = 0 removes the row */
+static void voice_state_set(uint64_t guild_id, uint64_t uid, uint64_t cid, uint8_t flags) {
+    EntityCache *c = &g_bot.cache;
+    int64_t i = snowmap_find(&c->voice_map, guild_id, uid);
+    if (i >= 0) {
+        if (!cid) { voice_state_remove_row((uint32_t)i); return; }
+        if (c->voice_channel[i] != cid ||
+            ((c->voice_flags[i] ^ flags) & VS_FLAG_BOT)) {
+            vchan_adjust(c->voice_channel[i], -1, (c->voice_flags[i] & VS_FLAG_BOT) ? 0 : -1);
+            vchan_adjust(cid, 1, (flags & VS_FLAG_BOT) ? 0 : 1);
+            c->voice_channel[i] = cid;
+        }
+        c->voice_flags[i] = flags;
+        return;
     }
+    if (!cid) return;
+    void **arrs[] = { (void **)&c->voice_guild, (void **)&c->voice_user,
+                      (void **)&c->voice_channel, (void **)&c->voice_flags };
+    const size_t sizes[] = { sizeof(uint64_t), sizeof(uint64_t), sizeof(uint64_t),
+                             sizeof(uint8_t) };
+    if (!cache_reserve(arrs, sizes, 4, &c->voice_cap, c->voice_count + 1)) return;
+    i = c->voice_count;
+    if (!snowmap_put(&c->voice_map, guild_id, uid, (uint32_t)i)) return;
+    c->voice_count++;
+    c->voice_guild[i] = guild_id;
+    c->voice_user[i] = uid;
+    c->voice_channel[i] = cid;
+    c->voice_flags[i] = flags;
+    vchan_adjust(cid, 1, (flags & VS_FLAG_BOT) ? 0 : 1);
+}
+
+/* Look up a user's current voice channel ID (false if not in voice) */
+static bool voice_state_cache_get(const char *guild_id, const char *user_id,
+                                  char *out, size_t cap) {
+    if (!guild_id || !user_id) return false;
+    cache_init();
+    bool found = false;
+    pthread_mutex_lock(&g_bot.cache.mutex);
+    int64_t i = snowmap_find(&g_bot.cache.voice_map, snow_parse(guild_id), snow_parse(user_id));
+    if (i >= 0) {
+        snprintf(out, cap, "%llu", (unsigned long long)g_bot.cache.voice_channel[i]);
+        found = true;
+    }
+    pthread_mutex_unlock(&g_bot.cache.mutex);
+    return found;
+}
+
+/* Drop a guild and every channel / role / member / voice state that belongs to it */
+static void cache_purge_guild(uint64_t guild_id) {
+    EntityCache *c = &g_bot.cache;
+    int64_t gi = snowmap_find(&c->guild_map, guild_id, 0);
+    if (gi >= 0) cache_guild_remove_row((uint32_t)gi);
+    for (uint32_t i = c->channel_count; i-- > 0;)
+        if (c->channel_guild[i] == guild_id) cache_channel_remove_row(i);
+    for (uint32_t i = c->role_count; i-- > 0;)
+        if (c->role_guild[i] == guild_id) cache_role_remove_row(i);
+    for (uint32_t i = c->member_count; i-- > 0;)
+        if (c->member_guild[i] == guild_id) cache_member_remove_row(i);
+    for (uint32_t i = c->voice_count; i-- > 0;)
+        if (c->voice_guild[i] == guild_id) voice_state_remove_row(i);
+    name_index_drop(guild_id);
+}
+
+/* Release every cached entity (caller holds cache mutex). ボイス状態は
+ * REST で取り直せず次の VOICE_STATE_UPDATE まで戻らないので残す
+ * (サーバー退出時は cache_purge_guild が消す)。 */
+static void entity_cache_clear(void) {
+    EntityCache *c = &g_bot.cache;
+    for (uint32_t i = 0; i < c->guild_count; i++) cache_guild_free_row(&c->guilds[i]);
+    for (uint32_t i = 0; i < c->channel_count; i++) cache_channel_free_row(&c->channels[i]);
+    for (uint32_t i = 0; i < c->role_count; i++) free(c->roles[i].name);
+    for (uint32_t i = 0; i < c->member_count; i++) cache_member_free_row(&c->members[i]);
+    while (c->nidx_count) name_index_drop(c->nidx[c->nidx_count - 1]->guild_id);
+    snowmap_free(&c->nidx_map);
+    snowmap_free(&c->guild_map);
+    snowmap_free(&c->channel_map);
+    snowmap_free(&c->role_map);
+    snowmap_free(&c->member_map);
+    /* 配列は再利用する — 行数だけ戻す */
+    c->guild_count = c->channel_count = c->role_count = c->member_count = 0;
+}
+
+/* Drop every voice state (caller holds cache mutex) — スナップショット復元用 */
+static void voice_state_clear(void) {
+    EntityCache *c = &g_bot.cache;
+    snowmap_free(&c->voice_map);
+    snowmap_free(&c->vchan_map);
+    c->voice_count = c->vchan_count = 0;
+}
+
+/* Feed a gateway dispatch into the cache (called before events fire) */
+static void entity_cache_on_dispatch(const char *event_name, JsonNode *data) {
+    if (!data || data->type != JSON_OBJECT) return;
+    EntityCache *c = &g_bot.cache;
+    uint64_t gid = snow_parse(json_get_str(data, "guild_id"));
+
+    pthread_mutex_lock(&c->mutex);
+    if (strcmp(event_name, "READY") == 0) {
+        /* スナップショットから復元したサーバーのうち、もう参加していないものを捨てる */
+        JsonNode *arr = json_get(data, "guilds");
+        SnowMap keep = {0};
+        if (arr && arr->type == JSON_ARRAY)
+            for (int k = 0; k < arr->arr.count; k++)
+                snowmap_put(&keep, snow_parse(json_get_str(&arr->arr.items[k], "id")), 0, 0);
+        for (uint32_t i = c->guild_count; i-- > 0;) {
+            if (i >= c->guild_count) continue;      /* purge で詰められた */
+            if (snowmap_find(&keep, c->guild_id[i], 0) < 0) cache_purge_guild(c->guild_id[i]);
+        }
+        snowmap_free(&keep);
+    } else if (strcmp(event_name, "GUILD_CREATE") == 0 || strcmp(event_name, "GUILD_UPDATE") == 0) {
+        gid = snow_parse(json_get_str(data, "id"));
+        if (strcmp(event_name, "GUILD_CREATE") == 0 && snowmap_find(&c->guild_map, gid, 0) >= 0) {
+            /* 既知のサーバー (スナップショット復元・障害復帰) — GUILD_CREATE が完全な
+             * 一覧を持つので、消えたチャンネル・ロール・ボイス状態を残さないよう作り直す。
+             * メンバーは一部しか届かないため保持する。 */
+            for (uint32_t i = c->channel_count; i-- > 0;)
+                if (c->channel_guild[i] == gid) cache_channel_remove_row(i);
+            for (uint32_t i = c->role_count; i-- > 0;)
+                if (c->role_guild[i] == gid) cache_role_remove_row(i);
+            for (uint32_t i = c->voice_count; i-- > 0;)
+                if (c->voice_guild[i] == gid) voice_state_remove_row(i);
+        }
+        cache_guild_upsert(data);
+        JsonNode *arr;
+        if ((arr = json_get(data, "roles")) && arr->type == JSON_ARRAY)
+            for (int k = 0; k < arr->arr.count; k++) cache_role_upsert(&arr->arr.items[k], gid);
+        if ((arr = json_get(data, "channels")) && arr->type == JSON_ARRAY)
+            for (int k = 0; k < arr->arr.count; k++) cache_channel_upsert(&arr->arr.items[k], gid);
+        if ((arr = json_get(data, "threads")) && arr->type == JSON_ARRAY)
+            for (int k = 0; k < arr->arr.count; k++) cache_channel_upsert(&arr->arr.items[k], gid);
+        if ((arr = json_get(data, "members")) && arr->type == JSON_ARRAY)
+            for (int k = 0; k < arr->arr.count; k++) cache_member_upsert(gid, &arr->arr.items[k], NULL);
+        if ((arr = json_get(data, "voice_states")) && arr->type == JSON_ARRAY)
+            for (int k = 0; k < arr->arr.count; k++) voice_state_cache_update(gid, &arr->arr.items[k]);
+    } else if (strcmp(event_name, "VOICE_STATE_UPDATE") == 0) {
+        voice_state_cache_update(gid, data);
+    } else if (strcmp(event_name, "GUILD_DELETE") == 0) {
+        gid = snow_parse(json_get_str(data, "id"));
+        if (json_get_bool(data, "unavailable")) {
+            /* 障害による一時的な切断 — データは保持して復帰を待つ */
+            int64_t gi = snowmap_find(&c->guild_map, gid, 0);
+            if (gi >= 0) c->guilds[gi].unavailable = true;
+        } else {
+            cache_purge_guild(gid);
+        }
+    } else if (strcmp(event_name, "CHANNEL_CREATE") == 0 ||
+               strcmp(event_name, "CHANNEL_UPDATE") == 0 ||
+               strcmp(event_name, "THREAD_CREATE") == 0 ||
+               strcmp(event_name, "THREAD_UPDATE") == 0) {
+        if (gid) cache_channel_upsert(data, gid);   /* DM チャンネルは保持しない */
+    } else if (strcmp(event_name, "CHANNEL_DELETE") == 0 ||
+               strcmp(event_name, "THREAD_DELETE") == 0) {
+        int64_t i = snowmap_find(&c->channel_map, snow_parse(json_get_str(data, "id")), 0);
+        if (i >= 0) cache_channel_remove_row((uint32_t)i);
+    } else if (strcmp(event_name, "GUILD_ROLE_CREATE") == 0 ||
+               strcmp(event_name, "GUILD_ROLE_UPDATE") == 0) {
+        JsonNode *role = json_get(data, "role");
+        if (gid && role) cache_role_upsert(role, gid);
+    } else if (strcmp(event_name, "GUILD_ROLE_DELETE") == 0) {
+        int64_t i = snowmap_find(&c->role_map, snow_parse(json_get_str(data, "role_id")), 0);
+        if (i >= 0) cache_role_remove_row((uint32_t)i);
+    } else if (strcmp(event_name, "GUILD_MEMBER_ADD") == 0 ||
+               strcmp(event_name, "GUILD_MEMBER_UPDATE") == 0) {
+        uint32_t before = c->member_count;
+        cache_member_upsert(gid, data, NULL);
+        if (c->member_count > before && strcmp(event_name, "GUILD_MEMBER_ADD") == 0) {
+            int64_t gi = snowmap_find(&c->guild_map, gid, 0);
+            if (gi >= 0) c->guilds[gi].member_count++;
+        }
+    } else if (strcmp(event_name, "GUILD_MEMBER_REMOVE") == 0) {
+        JsonNode *u = json_get(data, "user");
+        uint64_t uid = snow_parse(u ? json_get_str(u, "id") : NULL);
+        int64_t i = snowmap_find(&c->member_map, gid, uid);
+        if (i >= 0) cache_member_remove_row((uint32_t)i);
+        int64_t gi = snowmap_find(&c->guild_map, gid, 0);
+        if (gi >= 0 && c->guilds[gi].member_count > 0) c->guilds[gi].member_count--;
+    } else if (strcmp(event_name, "GUILD_MEMBERS_CHUNK") == 0) {
+        JsonNode *arr = json_get(data, "members");
+        if (arr && arr->type == JSON_ARRAY)
+            for (int k = 0; k < arr->arr.count; k++) cache_member_upsert(gid, &arr->arr.items[k], NULL);
+    } else if (strcmp(event_name, "MESSAGE_CREATE") == 0 ||
+               strcmp(event_name, "INTERACTION_CREATE") == 0) {
+        /* メッセージ・インタラクションに付く member で既存メンバーを最新化する。
+         * 発言者ごとに行を足すと部分的な行で表と名前索引が膨らみ続けるので、
+         * 既にキャッシュにいるメンバーだけを更新する (追加はしない)。 */
+        JsonNode *member = json_get(data, "member");
+        JsonNode *author = json_get(data, "author");
+        JsonNode *u = member ? json_get(member, "user") : NULL;
+        if (!u) u = author;
+        uint64_t uid = snow_parse(u ? json_get_str(u, "id") : NULL);
+        if (gid && member && uid && snowmap_find(&c->member_map, gid, uid) >= 0)
+            cache_member_upsert(gid, member, author);
+    }
+    pthread_mutex_unlock(&c->mutex);
+}
+
+/* --- Effective permissions --- */
+
+static bool member_has_role(const CachedMember *m, uint64_t role_id) {
+    for (int k = 0; k < m->role_count; k++)
+        if (m->roles[k] == role_id) return true;
+    return false;
+}
 
-    /* Application info */
-    JsonNode *app = json_get(data, "application");
-    if (app) {
-        const char *app_id = json_get_str(app, "id");
-        if (app_id) {
-            if (g_bot.application_id[0]) {
-                /* 環境変数で既に設定済み — 一致確認のみ */
-                if (strcmp(g_bot.application_id, app_id) != 0) {
-                    LOG_W("CLIENT_ID 不一致: env=%s, READY=%s (READYの値を使用)",
-                          g_bot.application_id, app_id);
-                    snprintf(g_bot.application_id, sizeof(g_bot.application_id), "%s", app_id);
-                }
-            } else {
-                snprintf(g_bot.application_id, sizeof(g_bot.application_id), "%s", app_id);
+/* Compute a member's effective permissions from cached data (caller holds
+ * cache mutex). channel_id = 0 ならサーバー全体の権限。
+ * サーバー・メンバー・チャンネルのいずれかが未キャッシュなら false。 */
+static bool perm_compute(uint64_t guild_id, uint64_t channel_id, uint64_t user_id,
+                         uint64_t *out) {
+    EntityCache *c = &g_bot.cache;
+    int64_t gi = snowmap_find(&c->guild_map, guild_id, 0);
+    int64_t mi = snowmap_find(&c->member_map, guild_id, user_id);
+    if (gi < 0 || mi < 0) return false;
+    int64_t ci = -1;
+    if (channel_id) {
+        ci = snowmap_find(&c->channel_map, channel_id, 0);
+        if (ci < 0) return false;
+        /* スレッドは親チャンネルの上書きに従う */
+        uint8_t type = c->channel_type[ci];
+        if ((type == 10 || type == 11 || type == 12) && c->channel_parent[ci]) {
+            ci = snowmap_find(&c->channel_map, c->channel_parent[ci], 0);
+            if (ci < 0) return false;
+        }
+    }
+    if (c->guild_owner[gi] == user_id) { *out = PERM_ALL; return true; }
+
+    /* Base: @everyone (ロールID = サーバーID) | メンバーの全ロール */
+    const CachedMember *m = &c->members[mi];
+    uint64_t perms = 0;
+    int64_t ri = snowmap_find(&c->role_map, guild_id, 0);
+    if (ri >= 0) perms = c->role_perms[ri];
+    for (int k = 0; k < m->role_count; k++) {
+        ri = snowmap_find(&c->role_map, m->roles[k], 0);
+        if (ri >= 0) perms |= c->role_perms[ri];
+    }
+    if (perms & PERM_ADMINISTRATOR) { *out = PERM_ALL; return true; }
+
+    if (ci >= 0) {
+        const CachedChannel *ch = &c->channels[ci];
+        uint64_t role_allow = 0, role_deny = 0, member_allow = 0, member_deny = 0;
+        for (int k = 0; k < ch->overwrite_count; k++) {
+            const PermOverwrite *o = &ch->overwrites[k];
+            if (o->type == 0 && o->id == guild_id) {
+                perms = (perms & ~o->deny) | o->allow;
+            } else if (o->type == 0 && member_has_role(m, o->id)) {
+                role_allow |= o->allow;
+                role_deny |= o->deny;
+            } else if (o->type == 1 && o->id == user_id) {
+                member_allow = o->allow;
+                member_deny = o->deny;
             }
         }
+        perms = (perms & ~role_deny) | role_allow;
+        perms = (perms & ~member_deny) | member_allow;
     }
 
-    g_bot.gateway_ready = true;
-    LOG_I("準備完了！ ボット: %s (ID: %s)", g_bot.bot_username, g_bot.bot_id);
+    /* タイムアウト中は閲覧と履歴読取のみ */
+    if (c->member_timeout[mi] > 0) {
+        struct timespec now;
+        clock_gettime(CLOCK_REALTIME, &now);
+        if (c->member_timeout[mi] > (int64_t)now.tv_sec * 1000 + now.tv_nsec / 1000000)
+            perms &= PERM_VIEW_CHANNEL | PERM_READ_MESSAGE_HISTORY;
+    }
+    if (ci >= 0) {
+        /* 暗黙の拒否: 閲覧できなければ全拒否、送信できなければ送信系も不可 */
+        if (!(perms & PERM_VIEW_CHANNEL)) perms = 0;
+        else if (!(perms & PERM_SEND_MESSAGES)) perms &= ~PERM_SEND_IMPLIED;
+    }
+    *out = perms;
+    return true;
+}
 
-    /* Fire READY event */
-    Value bot_info = hajimu_string(g_bot.bot_username);
-    event_fire("READY", 1, &bot_info);
-    event_fire("準備完了", 1, &bot_info);
+/* --- Cached entity → Value (caller holds cache mutex) --- */
+
+static Value snow_value(uint64_t id) {
+    char buf[MAX_SNOWFLAKE];
+    snprintf(buf, sizeof(buf), "%llu", (unsigned long long)id);
+    return hajimu_string(buf);
 }
 
-/* Process INTERACTION_CREATE — slash commands */
-/* --- Async callback execution (v2.5.0) --- */
-/* Run command/component callbacks in a detached thread so the gateway
-   thread can keep receiving events (crucial for voice connect flow). */
-typedef struct {
-    Value    callback;
-    Value    arg;
-    char     label[64];   /* for debug logging */
-} AsyncCallbackArg;
+static Value opt_str_value(const char *s) {
+    return s ? hajimu_string(s) : hajimu_null();
+}
+
+static Value cache_guild_value(uint32_t i) {
+    EntityCache *c = &g_bot.cache;
+    CachedGuild *g = &c->guilds[i];
+    Value d = value_dict_new();
+    value_dict_add(&d, "ID", snow_value(c->guild_id[i]));
+    value_dict_add(&d, "名前", opt_str_value(g->name));
+    value_dict_add(&d, "アイコン", opt_str_value(g->icon));
+    value_dict_add(&d, "オーナーID", c->guild_owner[i] ? snow_value(c->guild_owner[i]) : hajimu_null());
+    value_dict_add(&d, "メンバー数", hajimu_number(g->member_count));
+    value_dict_add(&d, "利用不可", hajimu_bool(g->unavailable));
+    return d;
+}
+
+static Value cache_channel_value(uint32_t i) {
+    EntityCache *c = &g_bot.cache;
+    CachedChannel *ch = &c->channels[i];
+    Value d = value_dict_new();
+    value_dict_add(&d, "ID", snow_value(c->channel_id[i]));
+    value_dict_add(&d, "サーバーID", snow_value(c->channel_guild[i]));
+    value_dict_add(&d, "名前", opt_str_value(ch->name));
+    value_dict_add(&d, "種類", hajimu_number(c->channel_type[i]));
+    value_dict_add(&d, "位置", hajimu_number(c->channel_pos[i]));
+    value_dict_add(&d, "親ID", c->channel_parent[i] ? snow_value(c->channel_parent[i]) : hajimu_null());
+    value_dict_add(&d, "トピック", opt_str_value(ch->topic));
+    value_dict_add(&d, "NSFW", hajimu_bool(ch->nsfw));
+    Value ows = hajimu_array();
+    for (int k = 0; k < ch->overwrite_count; k++) {
+        PermOverwrite *p = &ch->overwrites[k];
+        Value o = value_dict_new();
+        value_dict_add(&o, "ID", snow_value(p->id));
+        value_dict_add(&o, "種類", hajimu_number(p->type));
+        value_dict_add(&o, "許可", snow_value(p->allow));
+        value_dict_add(&o, "拒否", snow_value(p->deny));
+        hajimu_array_push(&ows, o);
+    }
+    value_dict_add(&d, "権限上書き", ows);
+    return d;
+}
+
+static Value cache_role_value(uint32_t i) {
+    EntityCache *c = &g_bot.cache;
+    CachedRole *r = &c->roles[i];
+    Value d = value_dict_new();
+    value_dict_add(&d, "ID", snow_value(c->role_id[i]));
+    value_dict_add(&d, "サーバーID", snow_value(c->role_guild[i]));
+    value_dict_add(&d, "名前", opt_str_value(r->name));
+    value_dict_add(&d, "権限", snow_value(c->role_perms[i]));
+    value_dict_add(&d, "位置", hajimu_number(c->role_pos[i]));
+    value_dict_add(&d, "色", hajimu_number(r->color));
+    value_dict_add(&d, "表示分離", hajimu_bool(r->flags & ROLE_FLAG_HOIST));
+    value_dict_add(&d, "管理済み", hajimu_bool(r->flags & ROLE_FLAG_MANAGED));
+    value_dict_add(&d, "メンション可能", hajimu_bool(r->flags & ROLE_FLAG_MENTIONABLE));
+    return d;
+}
+
+static Value cache_member_value(uint32_t i) {
+    EntityCache *c = &g_bot.cache;
+    CachedMember *m = &c->members[i];
+    Value d = value_dict_new();
+    value_dict_add(&d, "ID", snow_value(c->member_user[i]));
+    value_dict_add(&d, "サーバーID", snow_value(c->member_guild[i]));
+    value_dict_add(&d, "ユーザー名", opt_str_value(m->username));
+    value_dict_add(&d, "表示名", opt_str_value(m->global_name));
+    value_dict_add(&d, "ニックネーム", opt_str_value(m->nick));
+    value_dict_add(&d, "アバター", opt_str_value(m->avatar));
+    value_dict_add(&d, "ボット", hajimu_bool(m->bot));
+    value_dict_add(&d, "保留中", hajimu_bool(m->pending));
+    Value roles = hajimu_array();
+    for (int k = 0; k < m->role_count; k++) hajimu_array_push(&roles, snow_value(m->roles[k]));
+    value_dict_add(&d, "ロール", roles);
+    value_dict_add(&d, "参加日時", hajimu_number((double)m->joined_at));
+    value_dict_add(&d, "タイムアウト期限", hajimu_number((double)c->member_timeout[i]));
+    return d;
+}
+
+/* --- Message cache --- */
+
+/* Record layout: blob = "author\0content\0url1\nurl2\0" (1回の確保にまとめる) */
+static size_t msg_record_bytes(const CachedMessage *m) {
+    return sizeof(CachedMessage) + m->blob_len;
+}
+
+static void msg_record_free(CachedMessage *m) {
+    free(m->blob);
+    memset(m, 0, sizeof(*m));
+}
+
+static bool msg_record_fill(CachedMessage *m, JsonNode *data, const CachedMessage *prev) {
+    JsonNode *author = json_get(data, "author");
+    const char *name = author ? json_get_str(author, "username") : NULL;
+    const char *content = json_get_str(data, "content");
+    JsonNode *atts = json_get(data, "attachments");
+    /* MESSAGE_UPDATE は変更された項目だけを含むことがある — 無い項目は前の値を使う */
+    const char *prev_name = prev ? prev->blob : "";
+    const char *prev_content = prev ? prev_name + strlen(prev_name) + 1 : "";
+    const char *prev_urls = prev ? prev_content + strlen(prev_content) + 1 : "";
+    if (!name) name = prev_name;
+    if (!content) content = prev_content;
 
-static void *async_callback_thread(void *ptr) {
-    AsyncCallbackArg *a = (AsyncCallbackArg *)ptr;
-    pthread_mutex_lock(&g_bot.callback_mutex);
-    if (hajimu_runtime_available()) {
-        LOG_I("CMD: '%s' コールバック開始", a->label);
-        hajimu_call(&a->callback, 1, &a->arg);
-        LOG_I("CMD: '%s' コールバック完了", a->label);
+    StrBuf sb; sb_init(&sb);
+    sb_append(&sb, name); sb_append_char(&sb, '\0');
+    sb_append(&sb, content); sb_append_char(&sb, '\0');
+    uint16_t att_count = 0;
+    if (atts && atts->type == JSON_ARRAY) {
+        for (int k = 0; k < atts->arr.count; k++) {
+            const char *url = json_get_str(&atts->arr.items[k], "url");
+            if (!url) continue;
+            if (att_count++) sb_append_char(&sb, '\n');
+            sb_append(&sb, url);
+        }
+    } else if (prev) {
+        sb_append(&sb, prev_urls);
+        att_count = prev->attachment_count;
+    }
+    sb_append_char(&sb, '\0');
+    if (!sb.data) return false;
+
+    m->id = snow_parse(json_get_str(data, "id"));
+    m->author_id = author ? snow_parse(json_get_str(author, "id")) : (prev ? prev->author_id : 0);
+    JsonNode *edited = json_get(data, "edited_timestamp");
+    m->edited = (edited && edited->type == JSON_STRING) || (prev && prev->edited);
+    m->attachment_count = att_count;
+    m->blob_len = (uint32_t)sb.len;
+    /* StrBuf は余裕を持って確保するので詰め直す */
+    char *shrunk = (char *)realloc(sb.data, sb.len);
+    m->blob = shrunk ? shrunk : sb.data;
+    return true;
+}
+
+static MsgRing *msg_ring_find(uint64_t channel_id) {
+    int64_t i = snowmap_find(&g_bot.msg_cache.ring_map, channel_id, 0);
+    return i >= 0 ? g_bot.msg_cache.rings[i] : NULL;
+}
+
+/* Move a ring to the head of the LRU list */
+static void msg_ring_touch(MsgRing *r) {
+    MessageCache *mc = &g_bot.msg_cache;
+    if (mc->lru_head == r) return;
+    if (r->lru_prev) r->lru_prev->lru_next = r->lru_next;
+    if (r->lru_next) r->lru_next->lru_prev = r->lru_prev;
+    if (mc->lru_tail == r) mc->lru_tail = r->lru_prev;
+    r->lru_prev = NULL;
+    r->lru_next = mc->lru_head;
+    if (mc->lru_head) mc->lru_head->lru_prev = r;
+    mc->lru_head = r;
+    if (!mc->lru_tail) mc->lru_tail = r;
+}
+
+static void msg_ring_drop(MsgRing *r) {
+    MessageCache *mc = &g_bot.msg_cache;
+    for (uint32_t k = 0; k < r->count; k++) {
+        CachedMessage *m = &r->slots[(r->head + k) % r->cap];
+        mc->bytes -= msg_record_bytes(m);
+        msg_record_free(m);
+    }
+    if (r->lru_prev) r->lru_prev->lru_next = r->lru_next;
+    else mc->lru_head = r->lru_next;
+    if (r->lru_next) r->lru_next->lru_prev = r->lru_prev;
+    else mc->lru_tail = r->lru_prev;
+    snowmap_del(&mc->ring_map, r->channel_id, 0);
+    uint32_t i = r->index, last = --mc->ring_count;
+    if (i != last) {
+        mc->rings[i] = mc->rings[last];
+        mc->rings[i]->index = i;
+        snowmap_put(&mc->ring_map, mc->rings[i]->channel_id, 0, i);
+    }
+    mc->bytes -= sizeof(MsgRing) + (size_t)r->cap * sizeof(CachedMessage);
+    free(r->slots);
+    free(r);
+}
+
+static MsgRing *msg_ring_get(uint64_t channel_id, uint64_t guild_id) {
+    MessageCache *mc = &g_bot.msg_cache;
+    MsgRing *r = msg_ring_find(channel_id);
+    if (r) return r;
+    void **arrs[] = { (void **)&mc->rings };
+    const size_t sizes[] = { sizeof(MsgRing *) };
+    if (!cache_reserve(arrs, sizes, 1, &mc->ring_cap, mc->ring_count + 1)) return NULL;
+    r = (MsgRing *)calloc(1, sizeof(MsgRing));
+    if (!r) return NULL;
+    r->slots = (CachedMessage *)calloc(mc->per_channel, sizeof(CachedMessage));
+    if (!r->slots || !snowmap_put(&mc->ring_map, channel_id, 0, mc->ring_count)) {
+        free(r->slots);
+        free(r);
+        return NULL;
     }
-    pthread_mutex_unlock(&g_bot.callback_mutex);
-    free(a);
-    return NULL;
+    r->channel_id = channel_id;
+    r->guild_id = guild_id;
+    r->cap = mc->per_channel;
+    r->index = mc->ring_count;
+    mc->rings[mc->ring_count++] = r;
+    mc->bytes += sizeof(MsgRing) + (size_t)r->cap * sizeof(CachedMessage);
+    msg_ring_touch(r);
+    return r;
 }
 
-static void run_callback_async(Value *callback, Value *arg, const char *label) {
-    AsyncCallbackArg *a = (AsyncCallbackArg *)calloc(1, sizeof(AsyncCallbackArg));
-    if (!a) return;
-    a->callback = *callback;
-    a->arg = *arg;
-    snprintf(a->label, sizeof(a->label), "%s", label ? label : "?");
-    pthread_t t;
-    if (pthread_create(&t, NULL, async_callback_thread, a) == 0) {
-        pthread_detach(t);
-    } else {
-        LOG_E("コールバックスレッド作成失敗: %s", label);
-        free(a);
+static int msg_ring_index_of(MsgRing *r, uint64_t message_id) {
+    for (uint32_t k = r->count; k-- > 0;)   /* 新しい方から */
+        if (r->slots[(r->head + k) % r->cap].id == message_id) return (int)k;
+    return -1;
+}
+
+/* Remove the k-th oldest record (最古なら head を進め、途中なら新しい側を詰める) */
+static void msg_ring_remove_at(MsgRing *r, uint32_t k) {
+    MessageCache *mc = &g_bot.msg_cache;
+    CachedMessage *m = &r->slots[(r->head + k) % r->cap];
+    mc->bytes -= msg_record_bytes(m);
+    msg_record_free(m);
+    if (k == 0) {
+        r->head = (r->head + 1) % r->cap;
+        r->count--;
+        return;
+    }
+    for (uint32_t j = k; j + 1 < r->count; j++)
+        r->slots[(r->head + j) % r->cap] = r->slots[(r->head + j + 1) % r->cap];
+    memset(&r->slots[(r->head + r->count - 1) % r->cap], 0, sizeof(CachedMessage));
+    r->count--;
+}
+
+/* Append a filled record as the newest entry (ring full → oldest is evicted) */
+static void msg_ring_push(MsgRing *r, const CachedMessage *rec) {
+    MessageCache *mc = &g_bot.msg_cache;
+    if (r->count == r->cap) {
+        msg_ring_remove_at(r, 0);
+        mc->evictions++;
+    }
+    r->slots[(r->head + r->count) % r->cap] = *rec;
+    r->count++;
+    mc->bytes += msg_record_bytes(rec);
+    msg_ring_touch(r);
+}
+
+/* Evict the oldest messages of the least recently written channels */
+static void msg_cache_enforce(void) {
+    MessageCache *mc = &g_bot.msg_cache;
+    while (mc->bytes > mc->max_bytes && mc->lru_tail) {
+        MsgRing *r = mc->lru_tail;
+        if (r->count == 0) { msg_ring_drop(r); continue; }
+        msg_ring_remove_at(r, 0);
+        mc->evictions++;
+        if (r->count == 0) msg_ring_drop(r);
+    }
+}
+
+static void msg_cache_clear(void) {
+    MessageCache *mc = &g_bot.msg_cache;
+    while (mc->ring_count > 0) msg_ring_drop(mc->rings[mc->ring_count - 1]);
+    snowmap_free(&mc->ring_map);
+}
+
+static Value msg_record_value(const MsgRing *r, const CachedMessage *m) {
+    const char *name = m->blob;
+    const char *content = name + strlen(name) + 1;
+    const char *urls = content + strlen(content) + 1;
+    Value d = value_dict_new();
+    value_dict_add(&d, "ID", snow_value(m->id));
+    value_dict_add(&d, "チャンネルID", snow_value(r->channel_id));
+    value_dict_add(&d, "サーバーID", r->guild_id ? snow_value(r->guild_id) : hajimu_null());
+    value_dict_add(&d, "著者ID", snow_value(m->author_id));
+    value_dict_add(&d, "ユーザー名", hajimu_string(name));
+    value_dict_add(&d, "内容", hajimu_string(content));
+    Value atts = hajimu_array();
+    char *list = strdup(urls);
+    for (char *p = list; p && *p;) {
+        char *nl = strchr(p, '\n');
+        if (nl) *nl = '\0';
+        hajimu_array_push(&atts, hajimu_string(p));
+        p = nl ? nl + 1 : p + strlen(p);
+    }
+    free(list);
+    value_dict_add(&d, "添付ファイル", atts);
+    value_dict_add(&d, "編集済み", hajimu_bool(m->edited));
+    value_dict_add(&d, "タイムスタンプ", hajimu_number((double)((m->id >> 22) + DISCORD_EPOCH_MS)));
+    return d;
+}
+
+/* Feed MESSAGE_* dispatches into the message cache.
+ * 更新・削除の場合は反映前のレコードを Value で返す (無ければ null)。 */
+static Value message_cache_on_dispatch(const char *event_name, JsonNode *data) {
+    MessageCache *mc = &g_bot.msg_cache;
+    Value prev = hajimu_null();
+    if (!mc->per_channel || !data || data->type != JSON_OBJECT) return prev;
+    bool channel_gone = strcmp(event_name, "CHANNEL_DELETE") == 0 ||
+                        strcmp(event_name, "THREAD_DELETE") == 0;
+    uint64_t cid = snow_parse(json_get_str(data, channel_gone ? "id" : "channel_id"));
+    if (!cid) return prev;
+
+    pthread_mutex_lock(&mc->mutex);
+    if (channel_gone) {
+        MsgRing *r = msg_ring_find(cid);
+        if (r) msg_ring_drop(r);
+    } else if (strcmp(event_name, "MESSAGE_CREATE") == 0) {
+        MsgRing *r = msg_ring_get(cid, snow_parse(json_get_str(data, "guild_id")));
+        CachedMessage rec = {0};
+        if (r && msg_record_fill(&rec, data, NULL)) {
+            msg_ring_push(r, &rec);
+            msg_cache_enforce();
+        } else {
+            msg_record_free(&rec);
+        }
+    } else if (strcmp(event_name, "MESSAGE_UPDATE") == 0) {
+        MsgRing *r = msg_ring_find(cid);
+        int k = r ? msg_ring_index_of(r, snow_parse(json_get_str(data, "id"))) : -1;
+        if (k >= 0) {
+            CachedMessage *m = &r->slots[(r->head + k) % r->cap];
+            prev = msg_record_value(r, m);
+            CachedMessage rec = {0};
+            if (msg_record_fill(&rec, data, m)) {
+                mc->bytes += msg_record_bytes(&rec);
+                mc->bytes -= msg_record_bytes(m);
+                msg_record_free(m);
+                *m = rec;
+                msg_cache_enforce();
+            }
+        }
+    } else if (strcmp(event_name, "MESSAGE_DELETE") == 0) {
+        MsgRing *r = msg_ring_find(cid);
+        int k = r ? msg_ring_index_of(r, snow_parse(json_get_str(data, "id"))) : -1;
+        if (k >= 0) {
+            prev = msg_record_value(r, &r->slots[(r->head + k) % r->cap]);
+            msg_ring_remove_at(r, (uint32_t)k);
+        }
+    } else if (strcmp(event_name, "MESSAGE_DELETE_BULK") == 0) {
+        MsgRing *r = msg_ring_find(cid);
+        JsonNode *ids = json_get(data, "ids");
+        if (r && ids && ids->type == JSON_ARRAY) {
+            prev = hajimu_array();
+            for (int j = 0; j < ids->arr.count; j++) {
+                JsonNode *id = &ids->arr.items[j];
+                int k = id->type == JSON_STRING ? msg_ring_index_of(r, snow_parse(id->str.data)) : -1;
+                if (k < 0) continue;
+                hajimu_array_push(&prev, msg_record_value(r, &r->slots[(r->head + k) % r->cap]));
+                msg_ring_remove_at(r, (uint32_t)k);
+            }
+        }
     }
+    pthread_mutex_unlock(&mc->mutex);
+    return prev;
 }
 
-static void gw_handle_interaction(JsonNode *data) {
-    int type = (int)json_get_num(data, "type");
+/* --- Message full-text index --- */
 
-    /* Type 2 = APPLICATION_COMMAND */
-    if (type == 2) {
-        JsonNode *cmd_data = json_get(data, "data");
-        if (!cmd_data) return;
-        const char *cmd_name = json_get_str(cmd_data, "name");
-        if (!cmd_name) return;
-
-        /* Find registered command */
-        for (int i = 0; i < g_bot.command_count; i++) {
-            if (strcmp(g_bot.commands[i].name, cmd_name) == 0) {
-                LOG_I("CMD: '%s' コマンド一致 (idx=%d)", cmd_name, i);
-                /* Build interaction value for the callback */
-                Value interaction = json_to_value(data);
+static size_t snowmap_bytes(const SnowMap *m);
 
-                /* Inject ボイスチャンネルID from voice state cache */
-                {
-                    const char *gid = json_get_str(data, "guild_id");
-                    JsonNode *member = json_get(data, "member");
-                    JsonNode *user = member ? json_get(member, "user") : NULL;
-                    const char *uid = user ? json_get_str(user, "id") : NULL;
-                    if (gid && uid) {
-                        const char *vc_id = voice_state_cache_get(gid, uid);
-                        if (vc_id) {
-                            value_dict_add(&interaction, "ボイスチャンネルID", hajimu_string(vc_id));
-                        }
-                    }
-                }
+static int cmp_u64(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+    return x < y ? -1 : x > y;
+}
 
-                event_fire("INTERACTION_CREATE", 1, &interaction);
+/* 区切り文字: 空白・ASCII 記号・一般句読点・CJK 記号。bigram は区切りをまたがない */
+static bool msg_index_is_sep(uint32_t c) {
+    if (c < 0x80)
+        return !((c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9'));
+    return (c >= 0x2000 && c <= 0x206F) || (c >= 0x3000 && c <= 0x303F) || c == 0x30FB;
+}
 
-                /* Call specific command handler (async to not block gateway) */
-                run_callback_async(&g_bot.commands[i].callback, &interaction, cmd_name);
-                return;
-            }
+/* Fold `text` with name_fold() and rewrite it as NUL-separated words.
+ * 戻り値は malloc した "語\0語\0...\0" (末尾は空語)。 */
+static char *msg_index_words(const char *text) {
+    size_t n = strlen(text), cap = n * 2 + 8;   /* 不正バイトは 2 バイトに広がる */
+    char *folded = (char *)malloc(cap);
+    char *words = (char *)malloc(cap + 2);
+    if (!folded || !words) { free(folded); free(words); return NULL; }
+    name_fold(text, folded, cap);
+    size_t len = 0;
+    for (const unsigned char *p = (const unsigned char *)folded; *p;) {
+        uint32_t c = utf8_next(&p);
+        if (msg_index_is_sep(c)) {
+            if (len && words[len - 1]) words[len++] = '\0';
+        } else {
+            len += utf8_put(c, words + len);
+        }
+    }
+    if (len && words[len - 1]) words[len++] = '\0';
+    words[len] = '\0';
+    free(folded);
+    return words;
+}
+
+/* Collect the sorted, unique bigrams of NUL-separated words (最大 max 件) */
+static uint32_t msg_index_grams(const char *words, uint64_t *grams, uint32_t max) {
+    uint32_t count = 0;
+    for (const char *w = words; *w && count < max; w += strlen(w) + 1) {
+        const unsigned char *p = (const unsigned char *)w;
+        uint32_t prev = utf8_next(&p);
+        while (*p && count < max) {
+            uint32_t c = utf8_next(&p);
+            grams[count++] = ((uint64_t)prev << 21) | c;
+            prev = c;
         }
-
-        /* Fire generic command event */
-        Value interaction = json_to_value(data);
-        event_fire("コマンド受信", 1, &interaction);
     }
+    if (count == 0) return 0;
+    qsort(grams, count, sizeof(uint64_t), cmp_u64);
+    uint32_t n = 1;
+    for (uint32_t k = 1; k < count; k++)
+        if (grams[k] != grams[n - 1]) grams[n++] = grams[k];
+    return n;
+}
 
-    /* Type 3 = MESSAGE_COMPONENT (button click, select menu) */
-    if (type == 3) {
-        JsonNode *comp_data = json_get(data, "data");
-        if (!comp_data) return;
-        const char *custom_id = json_get_str(comp_data, "custom_id");
-        int comp_type = (int)json_get_num(comp_data, "component_type");
-        if (!custom_id) return;
+static uint32_t posting_next(const uint8_t **p) {
+    uint32_t v = 0;
+    int shift = 0;
+    uint8_t b;
+    do {
+        b = *(*p)++;
+        v |= (uint32_t)(b & 0x7F) << shift;
+        shift += 7;
+    } while (b & 0x80);
+    return v;
+}
 
-        Value interaction = json_to_value(data);
-        event_fire("INTERACTION_CREATE", 1, &interaction);
+static uint32_t posting_put(uint8_t *out, uint32_t v) {
+    uint32_t n = 0;
+    while (v >= 0x80) { out[n++] = (uint8_t)(v | 0x80); v >>= 7; }
+    out[n++] = (uint8_t)v;
+    return n;
+}
 
-        /* v1.6.0: Feed interaction collectors */
-        JsonNode *msg = json_get(data, "message");
-        const char *msg_id = msg ? json_get_str(msg, "id") : NULL;
-        JsonNode *ch = json_get(data, "channel_id");
-        const char *ch_id = (ch && ch->type == JSON_STRING) ? ch->str.data : "";
-        collector_feed(2, ch_id, msg_id ? msg_id : "", &interaction);
+/* Append a document number (呼び出し側が昇順を保証する) */
+static bool posting_add(MsgIndexGuild *g, MsgPosting *p, uint32_t doc) {
+    if (p->len + 5 > p->cap) {
+        uint32_t cap = p->cap ? p->cap * 2 : 8;
+        while (cap < p->len + 5) cap *= 2;
+        uint8_t *buf = (uint8_t *)realloc(p->buf, cap);
+        if (!buf) return false;
+        g->post_bytes += cap - p->cap;
+        p->buf = buf;
+        p->cap = cap;
+    }
+    uint32_t n = posting_put(p->buf + p->len, p->count ? doc - p->last : doc);
+    p->len += n;
+    g->post_len += n;
+    p->last = doc;
+    p->count++;
+    return true;
+}
 
-        /* Find registered component handler */
-        for (int i = 0; i < g_bot.comp_handler_count; i++) {
-            if (strcmp(g_bot.comp_handlers[i].custom_id, custom_id) == 0 &&
-                (g_bot.comp_handlers[i].type == comp_type || g_bot.comp_handlers[i].type == 0)) {
-                run_callback_async(&g_bot.comp_handlers[i].callback, &interaction, custom_id);
-                return;
+static MsgIndexGuild *msg_index_guild(uint64_t guild_id, bool create) {
+    MsgIndex *mi = &g_bot.msg_index;
+    int64_t i = snowmap_find(&mi->guild_map, guild_id, 0);
+    if (i >= 0) return mi->guilds[i];
+    if (!create || !guild_id) return NULL;
+    void **arrs[] = { (void **)&mi->guilds };
+    const size_t sizes[] = { sizeof(MsgIndexGuild *) };
+    if (!cache_reserve(arrs, sizes, 1, &mi->guild_cap, mi->guild_count + 1)) return NULL;
+    MsgIndexGuild *g = (MsgIndexGuild *)calloc(1, sizeof(MsgIndexGuild));
+    if (!g) return NULL;
+    if (!snowmap_put(&mi->guild_map, guild_id, 0, mi->guild_count)) {
+        free(g);
+        return NULL;
+    }
+    g->guild_id = guild_id;
+    mi->guilds[mi->guild_count++] = g;
+    return g;
+}
+
+static void msg_index_guild_free(MsgIndexGuild *g) {
+    for (uint32_t t = 0; t < g->term_count; t++) free(g->terms[t].buf);
+    free(g->terms);
+    free(g->term_gram);
+    free(g->doc_msg);
+    free(g->doc_channel);
+    free(g->doc_author);
+    snowmap_free(&g->msg_map);
+    snowmap_free(&g->term_map);
+    free(g);
+}
+
+static void msg_index_drop_guild(uint64_t guild_id) {
+    MsgIndex *mi = &g_bot.msg_index;
+    int64_t i = snowmap_find(&mi->guild_map, guild_id, 0);
+    if (i < 0) return;
+    msg_index_guild_free(mi->guilds[i]);
+    snowmap_del(&mi->guild_map, guild_id, 0);
+    uint32_t last = --mi->guild_count;
+    if ((uint32_t)i != last) {
+        mi->guilds[i] = mi->guilds[last];
+        snowmap_put(&mi->guild_map, mi->guilds[i]->guild_id, 0, (uint32_t)i);
+    }
+}
+
+static void msg_index_clear(void) {
+    MsgIndex *mi = &g_bot.msg_index;
+    for (uint32_t i = 0; i < mi->guild_count; i++) msg_index_guild_free(mi->guilds[i]);
+    free(mi->guilds);
+    mi->guilds = NULL;
+    mi->guild_count = mi->guild_cap = 0;
+    snowmap_free(&mi->guild_map);
+}
+
+/* Allocated bytes of one guild index (統計用, 確保済み容量で数える) */
+static size_t msg_index_guild_bytes(const MsgIndexGuild *g) {
+    return sizeof(MsgIndexGuild) + snowmap_bytes(&g->msg_map) + snowmap_bytes(&g->term_map) +
+           (size_t)g->doc_cap * 3 * sizeof(uint64_t) +
+           (size_t)g->term_cap * (sizeof(uint64_t) + sizeof(MsgPosting)) + g->post_bytes;
+}
+
+/* Bytes in use, measured for the per-guild bound. 容量で測ると配列の倍々拡張の
+ * たびに上限を超えて圧縮が続くため、件数と実長から見積もる。 */
+static size_t msg_index_guild_used(const MsgIndexGuild *g) {
+    return (size_t)g->doc_count * (3 * sizeof(uint64_t) + 2 * sizeof(SnowSlot)) +
+           (size_t)g->term_count * (sizeof(uint64_t) + sizeof(MsgPosting) + 2 * sizeof(SnowSlot)) +
+           g->post_len;
+}
+
+static void msg_index_kill(MsgIndexGuild *g, uint64_t message_id) {
+    int64_t d = snowmap_find(&g->msg_map, message_id, 0);
+    if (d < 0) return;
+    snowmap_del(&g->msg_map, message_id, 0);
+    g->doc_msg[d] = 0;
+    g->dead++;
+}
+
+/* Index one message as a new document (編集時は呼び出し側で古い文書を消す) */
+static void msg_index_add(MsgIndexGuild *g, uint64_t message_id, uint64_t channel_id,
+                          uint64_t author_id, const char *content) {
+    char *words = msg_index_words(content);
+    size_t n = words ? strlen(content) + 1 : 0;
+    uint64_t *grams = n ? (uint64_t *)malloc(n * sizeof(uint64_t)) : NULL;
+    uint32_t count = grams ? msg_index_grams(words, grams, (uint32_t)n) : 0;
+    free(words);
+    void **arrs[] = { (void **)&g->doc_msg, (void **)&g->doc_channel, (void **)&g->doc_author };
+    const size_t sizes[] = { sizeof(uint64_t), sizeof(uint64_t), sizeof(uint64_t) };
+    if (count == 0 || !cache_reserve(arrs, sizes, 3, &g->doc_cap, g->doc_count + 1) ||
+        !snowmap_put(&g->msg_map, message_id, 0, g->doc_count)) {
+        free(grams);
+        return;
+    }
+    uint32_t doc = g->doc_count++;
+    g->doc_msg[doc] = message_id;
+    g->doc_channel[doc] = channel_id;
+    g->doc_author[doc] = author_id;
+    for (uint32_t k = 0; k < count; k++) {
+        int64_t t = snowmap_find(&g->term_map, grams[k], 0);
+        if (t < 0) {
+            void **tarrs[] = { (void **)&g->term_gram, (void **)&g->terms };
+            const size_t tsizes[] = { sizeof(uint64_t), sizeof(MsgPosting) };
+            if (!cache_reserve(tarrs, tsizes, 2, &g->term_cap, g->term_count + 1) ||
+                !snowmap_put(&g->term_map, grams[k], 0, g->term_count)) continue;
+            t = g->term_count++;
+            g->term_gram[t] = grams[k];
+            memset(&g->terms[t], 0, sizeof(MsgPosting));
+        }
+        posting_add(g, &g->terms[t], doc);
+    }
+    free(grams);
+}
+
+/* Drop the oldest `drop` documents and every deleted one, renumbering the rest.
+ * 番号の写像は単調で詰まる一方なので、各差分は元の差分の和以下になり、
+ * 転置リストはその場で書き直せる。空になった bigram は消す。 */
+static void msg_index_compact(MsgIndexGuild *g, uint32_t drop) {
+    uint32_t *remap = (uint32_t *)malloc((size_t)(g->doc_count ? g->doc_count : 1) * sizeof(uint32_t));
+    if (!remap) return;
+    uint32_t n = 0;
+    for (uint32_t d = 0; d < g->doc_count; d++) {
+        if (d < drop || !g->doc_msg[d]) {
+            if (g->doc_msg[d]) g_bot.msg_index.evictions++;
+            remap[d] = UINT32_MAX;
+            continue;
+        }
+        remap[d] = n;
+        g->doc_msg[n] = g->doc_msg[d];
+        g->doc_channel[n] = g->doc_channel[d];
+        g->doc_author[n] = g->doc_author[d];
+        n++;
+    }
+    g->doc_count = n;
+    g->dead = 0;
+    snowmap_free(&g->msg_map);
+    for (uint32_t d = 0; d < n; d++) snowmap_put(&g->msg_map, g->doc_msg[d], 0, d);
+
+    snowmap_free(&g->term_map);
+    g->post_bytes = g->post_len = 0;
+    uint32_t kept = 0;
+    for (uint32_t t = 0; t < g->term_count; t++) {
+        MsgPosting p = g->terms[t];
+        const uint8_t *q = p.buf, *end = p.buf + p.len;
+        uint8_t *w = p.buf;
+        uint32_t cur = 0, prev = 0, count = 0;
+        while (q < end) {
+            cur += posting_next(&q);
+            uint32_t nd = remap[cur];
+            if (nd == UINT32_MAX) continue;
+            w += posting_put(w, count ? nd - prev : nd);
+            prev = nd;
+            count++;
+        }
+        if (count == 0) { free(p.buf); continue; }
+        p.len = (uint32_t)(w - p.buf);
+        p.last = prev;
+        p.count = count;
+        uint8_t *shrunk = (uint8_t *)realloc(p.buf, p.len);
+        if (shrunk) { p.buf = shrunk; p.cap = p.len; }
+        g->post_bytes += p.cap;
+        g->post_len += p.len;
+        g->term_gram[kept] = g->term_gram[t];
+        g->terms[kept] = p;
+        snowmap_put(&g->term_map, g->term_gram[kept], 0, kept);
+        kept++;
+    }
+    g->term_count = kept;
+    free(remap);
+}
+
+/* Keep a guild index under the per-guild bound — 超えたら上限の 3/4 まで
+ * 古い文書を捨て、削除済みが半分を超えた場合も詰め直す。 */
+static void msg_index_enforce(MsgIndexGuild *g) {
+    size_t max = g_bot.msg_index.max_bytes;
+    size_t used = msg_index_guild_used(g);
+    if (max && used > max && g->doc_count > 0) {
+        size_t target = max / 4 * 3;
+        uint32_t drop = (uint32_t)((double)g->doc_count * (double)(used - target) / (double)used) + 1;
+        msg_index_compact(g, drop);
+    } else if (g->dead > 1024 && g->dead * 2 > g->doc_count) {
+        msg_index_compact(g, 0);
+    }
+}
+
+/* Feed MESSAGE_* dispatches and deletions into the full-text index */
+static void msg_index_on_dispatch(const char *event_name, JsonNode *data) {
+    MsgIndex *mi = &g_bot.msg_index;
+    if (!mi->max_bytes || !data || data->type != JSON_OBJECT) return;
+    bool upsert = strcmp(event_name, "MESSAGE_CREATE") == 0 || strcmp(event_name, "MESSAGE_UPDATE") == 0;
+    bool del = !upsert && strcmp(event_name, "MESSAGE_DELETE") == 0;
+    bool bulk = !upsert && !del && strcmp(event_name, "MESSAGE_DELETE_BULK") == 0;
+    bool channel_gone = !upsert && !del && !bulk &&
+                        (strcmp(event_name, "CHANNEL_DELETE") == 0 ||
+                         strcmp(event_name, "THREAD_DELETE") == 0);
+    bool guild_gone = !upsert && !del && !bulk && !channel_gone &&
+                      strcmp(event_name, "GUILD_DELETE") == 0;
+    if (!upsert && !del && !bulk && !channel_gone && !guild_gone) return;
+    uint64_t gid = snow_parse(json_get_str(data, guild_gone ? "id" : "guild_id"));
+    if (!gid) return;   /* DM は索引しない */
+
+    pthread_mutex_lock(&mi->mutex);
+    if (upsert) {
+        /* 内容を含まない更新 (埋め込みの展開など) は無視する */
+        const char *content = json_get_str(data, "content");
+        uint64_t mid = snow_parse(json_get_str(data, "id"));
+        MsgIndexGuild *g = content && mid ? msg_index_guild(gid, true) : NULL;
+        if (g) {
+            JsonNode *author = json_get(data, "author");
+            uint64_t cid = snow_parse(json_get_str(data, "channel_id"));
+            uint64_t aid = snow_parse(author ? json_get_str(author, "id") : NULL);
+            int64_t d = snowmap_find(&g->msg_map, mid, 0);
+            if (d >= 0) {
+                if (!aid) aid = g->doc_author[d];
+                msg_index_kill(g, mid);
+            }
+            msg_index_add(g, mid, cid, aid, content);
+            msg_index_enforce(g);
+        }
+    } else if (del) {
+        MsgIndexGuild *g = msg_index_guild(gid, false);
+        if (g) msg_index_kill(g, snow_parse(json_get_str(data, "id")));
+    } else if (bulk) {
+        MsgIndexGuild *g = msg_index_guild(gid, false);
+        JsonNode *ids = json_get(data, "ids");
+        if (g && ids && ids->type == JSON_ARRAY) {
+            for (int j = 0; j < ids->arr.count; j++)
+                if (ids->arr.items[j].type == JSON_STRING)
+                    msg_index_kill(g, snow_parse(ids->arr.items[j].str.data));
+            msg_index_enforce(g);
+        }
+    } else if (channel_gone) {
+        MsgIndexGuild *g = msg_index_guild(gid, false);
+        uint64_t cid = snow_parse(json_get_str(data, "id"));
+        if (g && cid) {
+            for (uint32_t d = 0; d < g->doc_count; d++)
+                if (g->doc_msg[d] && g->doc_channel[d] == cid) msg_index_kill(g, g->doc_msg[d]);
+            msg_index_enforce(g);
+        }
+    } else if (!json_get_bool(data, "unavailable")) {
+        msg_index_drop_guild(gid);
+    }
+    pthread_mutex_unlock(&mi->mutex);
+}
+
+static int posting_count_cmp(const void *a, const void *b) {
+    uint32_t x = (*(MsgPosting *const *)a)->count, y = (*(MsgPosting *const *)b)->count;
+    return x < y ? -1 : x > y;
+}
+
+/* Documents containing every bigram of `words`, oldest first (caller holds the
+ * index mutex)。最も短い転置リストを展開し、残りを短い順に突き合わせる。
+ * 戻り値は malloc した文書番号配列 (件数 0 なら NULL)。 */
+static uint32_t *msg_index_match(MsgIndexGuild *g, const char *words, uint32_t *out_count) {
+    *out_count = 0;
+    uint64_t grams[MSG_INDEX_MAX_GRAMS];
+    uint32_t n = msg_index_grams(words, grams, MSG_INDEX_MAX_GRAMS);
+    MsgPosting *lists[MSG_INDEX_MAX_GRAMS];
+    for (uint32_t k = 0; k < n; k++) {
+        int64_t t = snowmap_find(&g->term_map, grams[k], 0);
+        if (t < 0) return NULL;
+        lists[k] = &g->terms[t];
+    }
+    if (n == 0) return NULL;
+    qsort(lists, n, sizeof(MsgPosting *), posting_count_cmp);
+
+    uint32_t *cand = (uint32_t *)malloc((size_t)lists[0]->count * sizeof(uint32_t));
+    if (!cand) return NULL;
+    uint32_t count = 0, cur = 0;
+    for (const uint8_t *q = lists[0]->buf, *end = q + lists[0]->len; q < end;) {
+        cur += posting_next(&q);
+        cand[count++] = cur;
+    }
+    for (uint32_t k = 1; k < n && count > 0; k++) {
+        const uint8_t *q = lists[k]->buf, *end = q + lists[k]->len;
+        uint32_t kept = 0;
+        cur = posting_next(&q);
+        bool more = true;
+        for (uint32_t c = 0; c < count && more; c++) {
+            while (cur < cand[c]) {
+                if (q >= end) { more = false; break; }
+                cur += posting_next(&q);
             }
+            if (more && cur == cand[c]) cand[kept++] = cand[c];
         }
+        count = kept;
+    }
+    if (count == 0) { free(cand); return NULL; }
+    *out_count = count;
+    return cand;
+}
+
+/* Does every word occur in the folded text? (キャッシュ済みの本文で偽陽性を除く) */
+static bool msg_index_verify(const char *content, const char *words) {
+    size_t cap = strlen(content) * 2 + 8;
+    char *folded = (char *)malloc(cap);
+    if (!folded) return true;
+    name_fold(content, folded, cap);
+    bool ok = true;
+    for (const char *w = words; *w && ok; w += strlen(w) + 1)
+        ok = strstr(folded, w) != NULL;
+    free(folded);
+    return ok;
+}
+
+/* --- Reaction & poll tallies --- */
+
+static void tally_message_free(TallyMessage *m) {
+    for (uint16_t k = 0; k < m->entry_count; k++) {
+        free(m->entries[k].name);
+        free(m->entries[k].voters);
+    }
+    free(m->entries);
+}
+
+static TallyMessage *tally_find(uint64_t message_id) {
+    int64_t i = snowmap_find(&g_bot.tally.msg_map, message_id, 0);
+    return i >= 0 ? &g_bot.tally.msgs[i] : NULL;
+}
+
+static TallyMessage *tally_add(uint64_t message_id, uint64_t channel_id, uint64_t guild_id,
+                               bool pinned, bool voters) {
+    TallyStore *ts = &g_bot.tally;
+    void **arrs[] = { (void **)&ts->msgs };
+    const size_t sizes[] = { sizeof(TallyMessage) };
+    if (!cache_reserve(arrs, sizes, 1, &ts->msg_cap, ts->msg_count + 1) ||
+        !snowmap_put(&ts->msg_map, message_id, 0, ts->msg_count)) return NULL;
+    snowmap_del(&ts->gone_map, message_id, 0);
+    TallyMessage *m = &ts->msgs[ts->msg_count++];
+    memset(m, 0, sizeof(*m));
+    m->message_id = message_id;
+    m->channel_id = channel_id;
+    m->guild_id = guild_id;
+    m->tick = ++ts->tick;
+    m->pinned = pinned;
+    m->voters = voters;
+    if (!pinned) ts->auto_count++;
+    return m;
+}
+
+/* First snowflake that can be created from now on */
+static uint64_t tally_since_now(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    uint64_t ms = (uint64_t)now.tv_sec * 1000 + (uint64_t)(now.tv_nsec / 1000000);
+    return ms > DISCORD_EPOCH_MS ? (ms - DISCORD_EPOCH_MS) << 22 : 0;
+}
+
+/* Remember a dropped auto-tally target so later reactions do not recreate it
+ * from zero. 墓標が上限件数の 4 倍を超えたら捨てて since_id を今に進める
+ * (それ以前のメッセージはどれも自動集計されなくなるので同じ効果になる)。 */
+static void tally_forget(uint64_t message_id) {
+    TallyStore *ts = &g_bot.tally;
+    if (!ts->max_auto || message_id < ts->since_id) return;
+    if (ts->gone_map.live >= ts->max_auto * 4) {
+        snowmap_free(&ts->gone_map);
+        ts->since_id = tally_since_now();
+        return;
+    }
+    snowmap_put(&ts->gone_map, message_id, 0, 0);
+}
+
+/* Can a reaction on this untracked message start an exact tally from zero? */
+static bool tally_auto_eligible(uint64_t message_id) {
+    TallyStore *ts = &g_bot.tally;
+    return ts->max_auto && message_id >= ts->since_id &&
+           snowmap_find(&ts->gone_map, message_id, 0) < 0;
+}
+
+static void tally_remove_at(uint32_t i) {
+    TallyStore *ts = &g_bot.tally;
+    TallyMessage *m = &ts->msgs[i];
+    if (!m->pinned) ts->auto_count--;
+    snowmap_del(&ts->msg_map, m->message_id, 0);
+    tally_message_free(m);
+    uint32_t last = --ts->msg_count;
+    if (i != last) {
+        ts->msgs[i] = ts->msgs[last];
+        snowmap_put(&ts->msg_map, ts->msgs[i].message_id, 0, i);
+    }
+}
+
+/* Evict the least recently updated auto-tracked messages over the limit.
+ * 1 件ずつだと毎回の全走査になるため、上限の 1/8 を余分にまとめて外す。 */
+static void tally_enforce(void) {
+    TallyStore *ts = &g_bot.tally;
+    if (ts->auto_count <= ts->max_auto) return;
+    uint32_t need = ts->auto_count - ts->max_auto + ts->max_auto / 8;
+    if (need > ts->auto_count) need = ts->auto_count;
+    uint64_t *ticks = (uint64_t *)malloc((size_t)ts->auto_count * sizeof(uint64_t));
+    if (!ticks) return;
+    uint32_t n = 0;
+    for (uint32_t i = 0; i < ts->msg_count; i++)
+        if (!ts->msgs[i].pinned) ticks[n++] = ts->msgs[i].tick;
+    qsort(ticks, n, sizeof(uint64_t), cmp_u64);
+    uint64_t cutoff = ticks[need - 1];
+    free(ticks);
+    for (uint32_t i = ts->msg_count; i-- > 0;) {
+        if (ts->msgs[i].pinned || ts->msgs[i].tick > cutoff) continue;
+        tally_forget(ts->msgs[i].message_id);
+        tally_remove_at(i);
+        ts->evictions++;
+    }
+}
+
+/* Find (or add) the entry for a custom emoji, a Unicode emoji or a poll answer */
+static TallyEntry *tally_entry(TallyMessage *m, uint64_t emoji_id, const char *name,
+                               uint32_t answer_id, bool create) {
+    for (uint16_t k = 0; k < m->entry_count; k++) {
+        TallyEntry *e = &m->entries[k];
+        if (answer_id ? e->answer_id == answer_id
+            : !e->answer_id && (emoji_id ? e->emoji_id == emoji_id
+                                         : !e->emoji_id && name && e->name && strcmp(e->name, name) == 0))
+            return e;
+    }
+    if (!create || (!answer_id && !emoji_id && !name)) return NULL;
+    if (m->entry_count == m->entry_cap) {
+        if (m->entry_cap == UINT16_MAX) return NULL;
+        uint16_t cap = m->entry_cap ? (uint16_t)(m->entry_cap * 2) : 4;
+        TallyEntry *p = (TallyEntry *)realloc(m->entries, cap * sizeof(TallyEntry));
+        if (!p) return NULL;
+        m->entries = p;
+        m->entry_cap = cap;
+    }
+    TallyEntry *e = &m->entries[m->entry_count++];
+    memset(e, 0, sizeof(*e));
+    e->emoji_id = answer_id ? 0 : emoji_id;
+    e->name = (!answer_id && name) ? strdup(name) : NULL;
+    e->answer_id = answer_id;
+    return e;
+}
+
+static void tally_entry_remove(TallyMessage *m, TallyEntry *e) {
+    free(e->name);
+    free(e->voters);
+    *e = m->entries[--m->entry_count];
+}
+
+/* Position of `user` in the sorted voter array (無ければ挿入位置) */
+static uint32_t tally_voter_pos(const TallyEntry *e, uint64_t user, bool *found) {
+    uint32_t lo = 0, hi = e->voter_count;
+    while (lo < hi) {
+        uint32_t mid = (lo + hi) / 2;
+        if (e->voters[mid] < user) lo = mid + 1;
+        else hi = mid;
+    }
+    *found = lo < e->voter_count && e->voters[lo] == user;
+    return lo;
+}
+
+static void tally_voter_set(TallyEntry *e, uint64_t user, bool add) {
+    bool found;
+    uint32_t k = tally_voter_pos(e, user, &found);
+    if (add && !found) {
+        void **arrs[] = { (void **)&e->voters };
+        const size_t sizes[] = { sizeof(uint64_t) };
+        if (!cache_reserve(arrs, sizes, 1, &e->voter_cap, e->voter_count + 1)) return;
+        memmove(&e->voters[k + 1], &e->voters[k], (e->voter_count - k) * sizeof(uint64_t));
+        e->voters[k] = user;
+        e->voter_count++;
+    } else if (!add && found) {
+        memmove(&e->voters[k], &e->voters[k + 1], (e->voter_count - k - 1) * sizeof(uint64_t));
+        e->voter_count--;
+    }
+}
+
+/* Seed counts from a fetched message (投票者は REST で取らない) */
+static void tally_seed(TallyMessage *m, JsonNode *msg) {
+    JsonNode *reactions = json_get(msg, "reactions");
+    for (int k = 0; reactions && reactions->type == JSON_ARRAY && k < reactions->arr.count; k++) {
+        JsonNode *r = &reactions->arr.items[k];
+        JsonNode *emoji = json_get(r, "emoji");
+        if (!emoji) continue;
+        TallyEntry *e = tally_entry(m, snow_parse(json_get_str(emoji, "id")),
+                                    json_get_str(emoji, "name"), 0, true);
+        if (!e) continue;
+        JsonNode *details = json_get(r, "count_details");
+        e->count = (uint32_t)json_get_num(r, "count");
+        e->burst = details ? (uint32_t)json_get_num(details, "burst") : 0;
+    }
+    JsonNode *poll = json_get(msg, "poll");
+    JsonNode *results = poll ? json_get(poll, "results") : NULL;
+    JsonNode *counts = results ? json_get(results, "answer_counts") : NULL;
+    for (int k = 0; counts && counts->type == JSON_ARRAY && k < counts->arr.count; k++) {
+        JsonNode *a = &counts->arr.items[k];
+        TallyEntry *e = tally_entry(m, 0, NULL, (uint32_t)json_get_num(a, "id"), true);
+        if (e) e->count = (uint32_t)json_get_num(a, "count");
+    }
+}
+
+/* Feed MESSAGE_REACTION_* / MESSAGE_POLL_VOTE_* and deletions into the tallies.
+ * 追跡中のメッセージか、自動追跡が有効で since_id 以降に作られ、まだ追い出して
+ * いないメッセージだけ数える (途中から数えても正しい値にならないため)。 */
+static void tally_on_dispatch(const char *event_name, JsonNode *data) {
+    TallyStore *ts = &g_bot.tally;
+    if ((!ts->max_auto && !ts->msg_count) || !data || data->type != JSON_OBJECT) return;
+    bool is_msg = strncmp(event_name, "MESSAGE_", 8) == 0;
+    const char *ev = is_msg ? event_name + 8 : event_name;
+    bool react = is_msg && (strcmp(ev, "REACTION_ADD") == 0 || strcmp(ev, "REACTION_REMOVE") == 0);
+    bool vote = is_msg && !react &&
+                (strcmp(ev, "POLL_VOTE_ADD") == 0 || strcmp(ev, "POLL_VOTE_REMOVE") == 0);
+    bool clear_all = is_msg && strcmp(ev, "REACTION_REMOVE_ALL") == 0;
+    bool clear_emoji = is_msg && strcmp(ev, "REACTION_REMOVE_EMOJI") == 0;
+    bool del = is_msg && strcmp(ev, "DELETE") == 0;
+    bool bulk = is_msg && strcmp(ev, "DELETE_BULK") == 0;
+    bool channel_gone = !is_msg && (strcmp(ev, "CHANNEL_DELETE") == 0 || strcmp(ev, "THREAD_DELETE") == 0);
+    bool guild_gone = !is_msg && strcmp(ev, "GUILD_DELETE") == 0;
+    if (!react && !vote && !clear_all && !clear_emoji && !del && !bulk && !channel_gone && !guild_gone)
+        return;
 
-        /* Fire generic component events */
-        if (comp_type == COMP_BUTTON) {
-            event_fire("ボタンクリック", 1, &interaction);
-            event_fire("BUTTON_CLICK", 1, &interaction);
-        } else if (comp_type == COMP_STRING_SELECT) {
-            event_fire("セレクト選択", 1, &interaction);
-            event_fire("SELECT_MENU", 1, &interaction);
+    pthread_mutex_lock(&ts->mutex);
+    if (react || vote) {
+        uint64_t mid = snow_parse(json_get_str(data, "message_id"));
+        uint64_t uid = snow_parse(json_get_str(data, "user_id"));
+        bool add = strstr(ev, "_ADD") != NULL;
+        TallyMessage *m = tally_find(mid);
+        bool created = false;
+        if (!m && add && tally_auto_eligible(mid)) {
+            m = tally_add(mid, snow_parse(json_get_str(data, "channel_id")),
+                          snow_parse(json_get_str(data, "guild_id")), false, ts->auto_voters);
+            created = m != NULL;
+        }
+        JsonNode *emoji = react ? json_get(data, "emoji") : NULL;
+        TallyEntry *e = !m ? NULL
+            : react ? (emoji ? tally_entry(m, snow_parse(json_get_str(emoji, "id")),
+                                           json_get_str(emoji, "name"), 0, add) : NULL)
+                    : tally_entry(m, 0, NULL, (uint32_t)json_get_num(data, "answer_id"), add);
+        if (e) {
+            bool burst = react && json_get_bool(data, "burst");
+            if (add) {
+                e->count++;
+                if (burst) e->burst++;
+            } else {
+                if (e->count) e->count--;
+                if (burst && e->burst) e->burst--;
+            }
+            if (m->voters && uid) tally_voter_set(e, uid, add);
+            if (!m->guild_id) m->guild_id = snow_parse(json_get_str(data, "guild_id"));
+            m->tick = ++ts->tick;
+        }
+        if (created) tally_enforce();
+    } else if (clear_all || clear_emoji) {
+        TallyMessage *m = tally_find(snow_parse(json_get_str(data, "message_id")));
+        JsonNode *emoji = json_get(data, "emoji");
+        for (uint16_t k = m ? m->entry_count : 0; k-- > 0;) {
+            TallyEntry *e = &m->entries[k];
+            if (e->answer_id) continue;
+            if (clear_emoji) {
+                uint64_t id = emoji ? snow_parse(json_get_str(emoji, "id")) : 0;
+                const char *name = emoji ? json_get_str(emoji, "name") : NULL;
+                if (id ? e->emoji_id != id : (e->emoji_id || !name || !e->name || strcmp(e->name, name) != 0))
+                    continue;
+            }
+            tally_entry_remove(m, e);
+        }
+    } else if (del || bulk) {
+        JsonNode *ids = bulk ? json_get(data, "ids") : NULL;
+        int n = bulk ? (ids && ids->type == JSON_ARRAY ? ids->arr.count : 0) : 1;
+        for (int j = 0; j < n; j++) {
+            const char *id = bulk ? (ids->arr.items[j].type == JSON_STRING ? ids->arr.items[j].str.data : NULL)
+                                  : json_get_str(data, "id");
+            int64_t i = snowmap_find(&ts->msg_map, snow_parse(id), 0);
+            if (i >= 0) tally_remove_at((uint32_t)i);
         }
+    } else {
+        uint64_t id = snow_parse(json_get_str(data, "id"));
+        if (guild_gone && json_get_bool(data, "unavailable")) id = 0;
+        for (uint32_t i = ts->msg_count; id && i-- > 0;)
+            if ((guild_gone ? ts->msgs[i].guild_id : ts->msgs[i].channel_id) == id) tally_remove_at(i);
     }
+    pthread_mutex_unlock(&ts->mutex);
+}
 
-    /* Type 4 = APPLICATION_COMMAND_AUTOCOMPLETE */
-    if (type == 4) {
-        JsonNode *ac_data = json_get(data, "data");
-        if (!ac_data) return;
-        const char *cmd_name = json_get_str(ac_data, "name");
-        if (!cmd_name) return;
+/* --- Presence store --- */
 
-        Value interaction = json_to_value(data);
+static const char *const pres_status_names[4] = { "offline", "online", "idle", "dnd" };
 
-        /* Find registered autocomplete handler */
-        for (int i = 0; i < g_bot.autocomplete_count; i++) {
-            if (strcmp(g_bot.autocomplete_handlers[i].command_name, cmd_name) == 0) {
-                run_callback_async(&g_bot.autocomplete_handlers[i].callback, &interaction, cmd_name);
-                return;
+static int pres_status_parse(const char *s) {
+    if (!s) return PRES_OFFLINE;
+    if (strcmp(s, "online") == 0 || strcmp(s, "オンライン") == 0) return PRES_ONLINE;
+    if (strcmp(s, "idle") == 0 || strcmp(s, "退席中") == 0) return PRES_IDLE;
+    if (strcmp(s, "dnd") == 0 || strcmp(s, "取り込み中") == 0) return PRES_DND;
+    return PRES_OFFLINE;
+}
+
+static unsigned pres_get(const uint64_t *plane, uint32_t slot) {
+    return (unsigned)(plane[slot >> 5] >> ((slot & 31) * 2)) & 3;
+}
+
+static void pres_put(uint64_t *plane, uint32_t slot, unsigned v) {
+    unsigned sh = (slot & 31) * 2;
+    plane[slot >> 5] = (plane[slot >> 5] & ~(3ULL << sh)) | ((uint64_t)v << sh);
+}
+
+/* Count slots that are not offline on a plane — 1 語で 32 人を数える */
+static uint32_t pres_plane_active(const uint64_t *plane, uint32_t slots) {
+    const uint64_t lo = 0x5555555555555555ULL;
+    uint32_t n = 0;
+    for (uint32_t w = 0; w < (slots + 31) / 32; w++)
+        n += (uint32_t)__builtin_popcountll((plane[w] | (plane[w] >> 1)) & lo);
+    return n;
+}
+
+static uint32_t pres_str_hash(const char *s) {
+    uint32_t h = 2166136261u;                   /* FNV-1a */
+    for (; *s; s++) h = (h ^ (uint8_t)*s) * 16777619u;
+    return h;
+}
+
+/* Rebuild the intern table from live strings (tombstones are dropped) */
+static bool pres_str_rehash(uint32_t live) {
+    PresenceStore *ps = &g_bot.presence;
+    uint32_t cap = CACHE_MAP_MIN_CAP;
+    while (cap < live * 2 + 2) cap *= 2;
+    uint32_t *t = (uint32_t *)calloc(cap, sizeof(uint32_t));
+    if (!t) return false;
+    for (uint32_t id = 1; id < ps->str_count; id++) {
+        if (!ps->strs[id]) continue;
+        uint32_t j = pres_str_hash(ps->strs[id]) & (cap - 1);
+        while (t[j]) j = (j + 1) & (cap - 1);
+        t[j] = id;
+    }
+    free(ps->str_table);
+    ps->str_table = t;
+    ps->str_table_cap = cap;
+    ps->str_table_used = live;
+    return true;
+}
+
+/* Intern an activity name and take a reference; 0 for none (caller holds presence mutex) */
+static uint32_t pres_intern(const char *s) {
+    PresenceStore *ps = &g_bot.presence;
+    if (!s || !s[0] || ps->retention != PRES_KEEP_ALL) return 0;
+    uint32_t h = pres_str_hash(s);
+    if (ps->str_table_cap) {
+        for (uint32_t j = h & (ps->str_table_cap - 1); ps->str_table[j];
+             j = (j + 1) & (ps->str_table_cap - 1)) {
+            uint32_t id = ps->str_table[j];
+            if (ps->strs[id] && strcmp(ps->strs[id], s) == 0) {
+                ps->str_refs[id]++;
+                return id;
             }
         }
+    }
+    uint32_t live = ps->str_count - ps->str_free_count - (ps->str_count ? 1 : 0);
+    if ((ps->str_table_used + 1) * 4 > ps->str_table_cap * 3 && !pres_str_rehash(live + 1))
+        return 0;
+    uint32_t id;
+    if (ps->str_free_count) {
+        id = ps->str_free[--ps->str_free_count];
+    } else {
+        if (ps->str_count == 0) ps->str_count = 1;      /* ID 0 は予約 */
+        void **arrs[] = { (void **)&ps->strs, (void **)&ps->str_refs };
+        const size_t sizes[] = { sizeof(char *), sizeof(uint32_t) };
+        if (!cache_reserve(arrs, sizes, 2, &ps->str_cap, ps->str_count + 1)) return 0;
+        id = ps->str_count++;
+    }
+    ps->strs[id] = strdup(s);
+    if (!ps->strs[id]) {
+        ps->str_refs[id] = 0;
+        void **arrs[] = { (void **)&ps->str_free };
+        const size_t sizes[] = { sizeof(uint32_t) };
+        if (cache_reserve(arrs, sizes, 1, &ps->str_free_cap, ps->str_free_count + 1))
+            ps->str_free[ps->str_free_count++] = id;
+        return 0;
+    }
+    ps->str_refs[id] = 1;
+    uint32_t j = h & (ps->str_table_cap - 1);
+    while (ps->str_table[j]) j = (j + 1) & (ps->str_table_cap - 1);
+    ps->str_table[j] = id;
+    ps->str_table_used++;
+    return id;
+}
+
+/* Drop a reference; the string is freed at zero and its table entry becomes a tombstone */
+static void pres_release(uint32_t id) {
+    PresenceStore *ps = &g_bot.presence;
+    if (!id || id >= ps->str_count || !ps->strs[id]) return;
+    if (--ps->str_refs[id] > 0) return;
+    free(ps->strs[id]);
+    ps->strs[id] = NULL;
+    void **arrs[] = { (void **)&ps->str_free };
+    const size_t sizes[] = { sizeof(uint32_t) };
+    if (cache_reserve(arrs, sizes, 1, &ps->str_free_cap, ps->str_free_count + 1))
+        ps->str_free[ps->str_free_count++] = id;
+}
+
+static PresenceGuild *pres_guild(uint64_t guild_id, bool create) {
+    PresenceStore *ps = &g_bot.presence;
+    int64_t i = snowmap_find(&ps->guild_map, guild_id, 0);
+    if (i >= 0) return &ps->guilds[i];
+    if (!create || !guild_id) return NULL;
+    void **arrs[] = { (void **)&ps->guilds };
+    const size_t sizes[] = { sizeof(PresenceGuild) };
+    if (!cache_reserve(arrs, sizes, 1, &ps->guild_cap, ps->guild_count + 1)) return NULL;
+    i = ps->guild_count;
+    if (!snowmap_put(&ps->guild_map, guild_id, 0, (uint32_t)i)) return NULL;
+    ps->guild_count++;
+    memset(&ps->guilds[i], 0, sizeof(PresenceGuild));
+    ps->guilds[i].guild_id = guild_id;
+    return &ps->guilds[i];
+}
+
+/* Grow the slot arrays; planes are zero-filled so new slots read as offline */
+static bool pres_grow(PresenceGuild *g) {
+    uint32_t new_cap = g->slot_cap ? g->slot_cap * 2 : 64;
+    uint64_t *user = (uint64_t *)realloc(g->user, new_cap * sizeof(uint64_t));
+    if (!user) return false;
+    g->user = user;
+    uint32_t *act = (uint32_t *)realloc(g->activity, new_cap * sizeof(uint32_t));
+    if (!act) return false;
+    g->activity = act;
+    for (int p = 0; p < PRES_PLANES; p++) {
+        uint64_t *pl = (uint64_t *)realloc(g->planes[p], new_cap / 32 * sizeof(uint64_t));
+        if (!pl) return false;
+        memset(pl + g->slot_cap / 32, 0, (new_cap - g->slot_cap) / 32 * sizeof(uint64_t));
+        g->planes[p] = pl;
+    }
+    g->slot_cap = new_cap;
+    return true;
+}
 
-        event_fire("オートコンプリート", 1, &interaction);
-        event_fire("AUTOCOMPLETE", 1, &interaction);
+static void pres_clear_slot(PresenceGuild *g, uint32_t slot) {
+    PresenceStore *ps = &g_bot.presence;
+    g->status_count[pres_get(g->planes[PRES_PLANE_STATUS], slot)]--;
+    for (int p = 0; p < PRES_PLANES; p++) pres_put(g->planes[p], slot, PRES_OFFLINE);
+    pres_release(g->activity[slot]);
+    g->activity[slot] = 0;
+    snowmap_del(&ps->slot_map, g->guild_id, g->user[slot]);
+    g->user[slot] = 0;
+    void **arrs[] = { (void **)&g->free_slots };
+    const size_t sizes[] = { sizeof(uint32_t) };
+    if (cache_reserve(arrs, sizes, 1, &g->free_cap, g->free_count + 1))
+        g->free_slots[g->free_count++] = slot;
+}
+
+/* Record one presence; offline frees the member's slot (caller holds presence mutex) */
+static void pres_set(uint64_t guild_id, uint64_t user_id, const unsigned st[PRES_PLANES],
+                     const char *activity) {
+    PresenceStore *ps = &g_bot.presence;
+    if (!guild_id || !user_id || ps->retention == PRES_KEEP_NONE) return;
+    int64_t found = snowmap_find(&ps->slot_map, guild_id, user_id);
+    PresenceGuild *g = pres_guild(guild_id, st[PRES_PLANE_STATUS] != PRES_OFFLINE);
+    if (!g) return;
+    uint32_t slot;
+    if (found >= 0) {
+        slot = (uint32_t)found;
+        if (st[PRES_PLANE_STATUS] == PRES_OFFLINE) { pres_clear_slot(g, slot); return; }
+        g->status_count[pres_get(g->planes[PRES_PLANE_STATUS], slot)]--;
+    } else {
+        if (st[PRES_PLANE_STATUS] == PRES_OFFLINE) return;
+        if (!g->free_count && g->slot_count == g->slot_cap && !pres_grow(g)) return;
+        slot = g->free_count ? g->free_slots[g->free_count - 1] : g->slot_count;
+        if (!snowmap_put(&ps->slot_map, guild_id, user_id, slot)) return;
+        if (g->free_count) g->free_count--;
+        else g->slot_count++;
+        g->user[slot] = user_id;
+        g->activity[slot] = 0;
+    }
+    for (int p = 0; p < PRES_PLANES; p++) pres_put(g->planes[p], slot, st[p]);
+    g->status_count[st[PRES_PLANE_STATUS]]++;
+    uint32_t id = pres_intern(activity);
+    pres_release(g->activity[slot]);
+    g->activity[slot] = id;
+}
+
+static void pres_guild_free(PresenceGuild *g) {
+    PresenceStore *ps = &g_bot.presence;
+    for (uint32_t s = 0; s < g->slot_count; s++) {
+        if (!g->user[s]) continue;
+        pres_release(g->activity[s]);
+        snowmap_del(&ps->slot_map, g->guild_id, g->user[s]);
+    }
+    free(g->user);
+    free(g->activity);
+    for (int p = 0; p < PRES_PLANES; p++) free(g->planes[p]);
+    free(g->free_slots);
+}
+
+static void pres_drop_guild(uint64_t guild_id) {
+    PresenceStore *ps = &g_bot.presence;
+    int64_t i = snowmap_find(&ps->guild_map, guild_id, 0);
+    if (i < 0) return;
+    pres_guild_free(&ps->guilds[i]);
+    snowmap_del(&ps->guild_map, guild_id, 0);
+    uint32_t last = --ps->guild_count;
+    if ((uint32_t)i != last) {
+        ps->guilds[i] = ps->guilds[last];
+        snowmap_put(&ps->guild_map, ps->guilds[i].guild_id, 0, (uint32_t)i);
+    }
+}
+
+/* Release every presence and interned string (caller holds presence mutex) */
+static void presence_clear(void) {
+    PresenceStore *ps = &g_bot.presence;
+    while (ps->guild_count) pres_drop_guild(ps->guilds[ps->guild_count - 1].guild_id);
+    snowmap_free(&ps->guild_map);
+    snowmap_free(&ps->slot_map);
+    for (uint32_t id = 1; id < ps->str_count; id++) free(ps->strs[id]);
+    ps->str_count = ps->str_free_count = 0;
+    free(ps->str_table);
+    ps->str_table = NULL;
+    ps->str_table_cap = ps->str_table_used = 0;
+}
+
+/* Drop every interned activity but keep statuses (保持ポリシー「ステータスのみ」) */
+static void presence_drop_activities(void) {
+    PresenceStore *ps = &g_bot.presence;
+    for (uint32_t i = 0; i < ps->guild_count; i++) {
+        PresenceGuild *g = &ps->guilds[i];
+        for (uint32_t s = 0; s < g->slot_count; s++) {
+            pres_release(g->activity[s]);
+            g->activity[s] = 0;
+        }
     }
+}
 
-    /* Type 5 = MODAL_SUBMIT */
-    if (type == 5) {
-        JsonNode *modal_data = json_get(data, "data");
-        if (!modal_data) return;
-        const char *custom_id = json_get_str(modal_data, "custom_id");
-        if (!custom_id) return;
+/* One PRESENCE_UPDATE-shaped object (also GUILD_CREATE.presences[]) */
+static void presence_apply(uint64_t guild_id, JsonNode *p) {
+    JsonNode *user = json_get(p, "user");
+    uint64_t uid = snow_parse(user ? json_get_str(user, "id") : NULL);
+    unsigned st[PRES_PLANES] = { (unsigned)pres_status_parse(json_get_str(p, "status")), 0, 0, 0 };
+    JsonNode *cs = json_get(p, "client_status");
+    if (cs && cs->type == JSON_OBJECT) {
+        st[PRES_PLANE_DESKTOP] = (unsigned)pres_status_parse(json_get_str(cs, "desktop"));
+        st[PRES_PLANE_MOBILE] = (unsigned)pres_status_parse(json_get_str(cs, "mobile"));
+        st[PRES_PLANE_WEB] = (unsigned)pres_status_parse(json_get_str(cs, "web"));
+    }
+    /* 先頭のアクティビティ名 — カスタムステータス (type 4) は state を使う */
+    const char *activity = NULL;
+    JsonNode *acts = json_get(p, "activities");
+    if (acts && acts->type == JSON_ARRAY && acts->arr.count > 0) {
+        JsonNode *a = &acts->arr.items[0];
+        if ((int)json_get_num(a, "type") == 4) activity = json_get_str(a, "state");
+        if (!activity) activity = json_get_str(a, "name");
+    }
+    pres_set(guild_id, uid, st, activity);
+}
+
+/* Feed presence-related dispatches into the store */
+static void presence_on_dispatch(const char *event_name, JsonNode *data) {
+    if (!data || data->type != JSON_OBJECT) return;
+    PresenceStore *ps = &g_bot.presence;
+    bool update = strcmp(event_name, "PRESENCE_UPDATE") == 0;
+    bool create = !update && strcmp(event_name, "GUILD_CREATE") == 0;
+    bool gone = !update && !create && strcmp(event_name, "GUILD_DELETE") == 0;
+    bool left = !update && !create && !gone && strcmp(event_name, "GUILD_MEMBER_REMOVE") == 0;
+    if (!update && !create && !gone && !left) return;
+
+    pthread_mutex_lock(&ps->mutex);
+    if (update) {
+        presence_apply(snow_parse(json_get_str(data, "guild_id")), data);
+    } else if (create) {
+        /* GUILD_CREATE はオンラインのメンバー全員を含む — 作り直す */
+        uint64_t gid = snow_parse(json_get_str(data, "id"));
+        JsonNode *arr = json_get(data, "presences");
+        if (arr && arr->type == JSON_ARRAY) {
+            pres_drop_guild(gid);
+            for (int k = 0; k < arr->arr.count; k++) presence_apply(gid, &arr->arr.items[k]);
+        }
+    } else if (gone) {
+        if (!json_get_bool(data, "unavailable")) pres_drop_guild(snow_parse(json_get_str(data, "id")));
+    } else {
+        JsonNode *u = json_get(data, "user");
+        uint64_t gid = snow_parse(json_get_str(data, "guild_id"));
+        int64_t slot = snowmap_find(&ps->slot_map, gid, snow_parse(u ? json_get_str(u, "id") : NULL));
+        PresenceGuild *g = pres_guild(gid, false);
+        if (slot >= 0 && g) pres_clear_slot(g, (uint32_t)slot);
+    }
+    pthread_mutex_unlock(&ps->mutex);
+}
 
-        Value interaction = json_to_value(data);
-        event_fire("INTERACTION_CREATE", 1, &interaction);
+/* --- Memory accounting & sweeping --- */
 
-        /* Find registered modal handler */
-        for (int i = 0; i < g_bot.comp_handler_count; i++) {
-            if (strcmp(g_bot.comp_handlers[i].custom_id, custom_id) == 0 &&
-                g_bot.comp_handlers[i].type == -1) { /* -1 = modal */
-                run_callback_async(&g_bot.comp_handlers[i].callback, &interaction, custom_id);
-                return;
+static const char *const cache_cat_names[CACHE_CAT_COUNT] = {
+    "サーバー", "チャンネル", "ロール", "メンバー", "ボイス状態", "メッセージ", "プレゼンス",
+    "メッセージ索引", "集計"
+};
+
+static size_t str_bytes(const char *s) {
+    return s ? strlen(s) + 1 : 0;
+}
+
+static size_t snowmap_bytes(const SnowMap *m) {
+    return (size_t)m->cap * sizeof(SnowSlot);
+}
+
+/* Bytes held by one entity category (caller holds cache mutex).
+ * 配列は確保済み容量で数え、文字列は実長で数える。 */
+static size_t cache_cat_bytes(CacheCategory cat, uint32_t *entries) {
+    EntityCache *c = &g_bot.cache;
+    size_t b = 0;
+    switch (cat) {
+    case CACHE_CAT_GUILD:
+        *entries = c->guild_count;
+        b = snowmap_bytes(&c->guild_map) +
+            (size_t)c->guild_cap * (2 * sizeof(uint64_t) + sizeof(CachedGuild));
+        for (uint32_t i = 0; i < c->guild_count; i++)
+            b += str_bytes(c->guilds[i].name) + str_bytes(c->guilds[i].icon);
+        break;
+    case CACHE_CAT_CHANNEL:
+        *entries = c->channel_count;
+        b = snowmap_bytes(&c->channel_map) +
+            (size_t)c->channel_cap * (3 * sizeof(uint64_t) + sizeof(int32_t) +
+                                      sizeof(uint8_t) + sizeof(CachedChannel));
+        for (uint32_t i = 0; i < c->channel_count; i++) {
+            CachedChannel *ch = &c->channels[i];
+            b += str_bytes(ch->name) + str_bytes(ch->topic) +
+                 (size_t)ch->overwrite_count * sizeof(PermOverwrite);
+        }
+        break;
+    case CACHE_CAT_ROLE:
+        *entries = c->role_count;
+        b = snowmap_bytes(&c->role_map) +
+            (size_t)c->role_cap * (3 * sizeof(uint64_t) + sizeof(int32_t) + sizeof(CachedRole));
+        for (uint32_t i = 0; i < c->role_count; i++) b += str_bytes(c->roles[i].name);
+        break;
+    case CACHE_CAT_MEMBER:
+        *entries = c->member_count;
+        b = snowmap_bytes(&c->member_map) +
+            (size_t)c->member_cap * (2 * sizeof(uint64_t) + sizeof(int64_t) +
+                                     sizeof(uint32_t) + sizeof(CachedMember));
+        for (uint32_t i = 0; i < c->member_count; i++) {
+            CachedMember *m = &c->members[i];
+            b += str_bytes(m->nick) + str_bytes(m->username) + str_bytes(m->global_name) +
+                 str_bytes(m->avatar) + (size_t)m->role_count * sizeof(uint64_t);
+        }
+        /* 名前索引もメンバーとして数える */
+        b += snowmap_bytes(&c->nidx_map) + (size_t)c->nidx_cap * sizeof(NameIndex *);
+        for (uint32_t k = 0; k < c->nidx_count; k++) {
+            const NameIndex *ix = c->nidx[k];
+            b += sizeof(NameIndex) +
+                 ((size_t)ix->sorted_count + ix->delta_cap) * sizeof(NameEntry);
+            for (uint32_t e = 0; e < ix->sorted_count; e++) b += str_bytes(ix->sorted[e].key);
+            for (uint32_t e = 0; e < ix->delta_count; e++) b += str_bytes(ix->delta[e].key);
+        }
+        break;
+    case CACHE_CAT_VOICE:
+        *entries = c->voice_count;
+        b = snowmap_bytes(&c->voice_map) + snowmap_bytes(&c->vchan_map) +
+            (size_t)c->voice_cap * (3 * sizeof(uint64_t) + sizeof(uint8_t)) +
+            (size_t)c->vchan_cap * (sizeof(uint64_t) + 2 * sizeof(uint32_t));
+        break;
+    case CACHE_CAT_MESSAGE: {
+        /* メッセージキャッシュは自前で増分集計している */
+        MessageCache *mc = &g_bot.msg_cache;
+        pthread_mutex_lock(&mc->mutex);
+        uint32_t n = 0;
+        for (uint32_t i = 0; i < mc->ring_count; i++) n += mc->rings[i]->count;
+        *entries = n;
+        b = mc->bytes + snowmap_bytes(&mc->ring_map) + (size_t)mc->ring_cap * sizeof(MsgRing *);
+        pthread_mutex_unlock(&mc->mutex);
+        break;
+    }
+    case CACHE_CAT_PRESENCE: {
+        PresenceStore *ps = &g_bot.presence;
+        pthread_mutex_lock(&ps->mutex);
+        *entries = ps->slot_map.live;
+        b = snowmap_bytes(&ps->guild_map) + snowmap_bytes(&ps->slot_map) +
+            (size_t)ps->guild_cap * sizeof(PresenceGuild) +
+            (size_t)ps->str_cap * (sizeof(char *) + sizeof(uint32_t)) +
+            (size_t)ps->str_free_cap * sizeof(uint32_t) +
+            (size_t)ps->str_table_cap * sizeof(uint32_t);
+        for (uint32_t i = 0; i < ps->guild_count; i++) {
+            const PresenceGuild *g = &ps->guilds[i];
+            b += (size_t)g->slot_cap * (sizeof(uint64_t) + sizeof(uint32_t)) +
+                 (size_t)g->slot_cap / 32 * PRES_PLANES * sizeof(uint64_t) +
+                 (size_t)g->free_cap * sizeof(uint32_t);
+        }
+        for (uint32_t id = 1; id < ps->str_count; id++) b += str_bytes(ps->strs[id]);
+        pthread_mutex_unlock(&ps->mutex);
+        break;
+    }
+    case CACHE_CAT_MSG_INDEX: {
+        MsgIndex *mi = &g_bot.msg_index;
+        pthread_mutex_lock(&mi->mutex);
+        *entries = 0;
+        b = snowmap_bytes(&mi->guild_map) + (size_t)mi->guild_cap * sizeof(MsgIndexGuild *);
+        for (uint32_t i = 0; i < mi->guild_count; i++) {
+            *entries += mi->guilds[i]->doc_count - mi->guilds[i]->dead;
+            b += msg_index_guild_bytes(mi->guilds[i]);
+        }
+        pthread_mutex_unlock(&mi->mutex);
+        break;
+    }
+    case CACHE_CAT_TALLY: {
+        TallyStore *ts = &g_bot.tally;
+        pthread_mutex_lock(&ts->mutex);
+        *entries = ts->msg_count;
+        b = snowmap_bytes(&ts->msg_map) + snowmap_bytes(&ts->gone_map) +
+            (size_t)ts->msg_cap * sizeof(TallyMessage);
+        for (uint32_t i = 0; i < ts->msg_count; i++) {
+            const TallyMessage *m = &ts->msgs[i];
+            b += (size_t)m->entry_cap * sizeof(TallyEntry);
+            for (uint16_t k = 0; k < m->entry_count; k++)
+                b += str_bytes(m->entries[k].name) + (size_t)m->entries[k].voter_cap * sizeof(uint64_t);
+        }
+        pthread_mutex_unlock(&ts->mutex);
+        break;
+    }
+    default:
+        *entries = 0;
+        break;
+    }
+    return b;
+}
+
+static int cmp_u32(const void *a, const void *b) {
+    uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+/* Evict the least recently seen members until about `excess` bytes are freed */
+static void cache_evict_members(size_t excess) {
+    EntityCache *c = &g_bot.cache;
+    if (!excess || c->member_count == 0) return;
+    uint32_t entries;
+    size_t per_row = cache_cat_bytes(CACHE_CAT_MEMBER, &entries) / c->member_count;
+    if (per_row == 0) per_row = 1;
+    uint32_t need = (uint32_t)((excess + per_row - 1) / per_row);
+    if (need > c->member_count) need = c->member_count;
+
+    /* need 番目に古い最終観測時刻を閾値にして、それ以前を末尾から削除 */
+    uint32_t *seen = (uint32_t *)malloc(c->member_count * sizeof(uint32_t));
+    if (!seen) return;
+    memcpy(seen, c->member_seen, c->member_count * sizeof(uint32_t));
+    qsort(seen, c->member_count, sizeof(uint32_t), cmp_u32);
+    uint32_t cutoff = seen[need - 1];
+    free(seen);
+
+    uint64_t self = snow_parse(g_bot.bot_id);
+    for (uint32_t i = c->member_count; i-- > 0 && need > 0;) {
+        if (c->member_seen[i] > cutoff || c->member_user[i] == self) continue;
+        cache_member_remove_row(i);
+        g_bot.cache_budget.evictions[CACHE_CAT_MEMBER]++;
+        need--;
+    }
+}
+
+/* Apply the member retention policy (caller holds cache mutex) */
+static void cache_apply_member_retention(void) {
+    EntityCache *c = &g_bot.cache;
+    int policy = g_bot.cache_budget.member_retention;
+    if (policy == MEMBER_KEEP_ALL) return;
+    uint64_t self = snow_parse(g_bot.bot_id);
+
+    SnowMap active = {0};   /* ボイスに誰かがいるサーバー */
+    if (policy == MEMBER_KEEP_VOICE)
+        for (uint32_t i = 0; i < c->voice_count; i++) snowmap_put(&active, c->voice_guild[i], 0, 0);
+    for (uint32_t i = c->member_count; i-- > 0;) {
+        if (c->member_user[i] == self) continue;
+        if (policy == MEMBER_KEEP_VOICE && snowmap_find(&active, c->member_guild[i], 0) >= 0) continue;
+        cache_member_remove_row(i);
+        g_bot.cache_budget.evictions[CACHE_CAT_MEMBER]++;
+    }
+    snowmap_free(&active);
+}
+
+/* Give back table capacity after large evictions */
+static void cache_shrink_members(void) {
+    EntityCache *c = &g_bot.cache;
+    if (c->member_cap > 64 && c->member_count < c->member_cap / 4) {
+        uint32_t new_cap = c->member_cap;
+        while (new_cap > 64 && c->member_count < new_cap / 4) new_cap /= 2;
+        void **arrs[] = { (void **)&c->member_guild, (void **)&c->member_user,
+                          (void **)&c->member_timeout, (void **)&c->member_seen,
+                          (void **)&c->members };
+        const size_t sizes[] = { sizeof(uint64_t), sizeof(uint64_t), sizeof(int64_t),
+                                 sizeof(uint32_t), sizeof(CachedMember) };
+        /* 縮めた配列と縮めていない配列が混ざると cap と合わなくなるので、
+         * 5 本とも新しく確保できたときだけ移し替える (失敗したら元のまま) */
+        void *fresh[5];
+        int got = 0;
+        while (got < 5 && (fresh[got] = malloc((size_t)new_cap * sizes[got])) != NULL) got++;
+        if (got == 5) {
+            for (int k = 0; k < 5; k++) {
+                memcpy(fresh[k], *arrs[k], (size_t)c->member_count * sizes[k]);
+                free(*arrs[k]);
+                *arrs[k] = fresh[k];
             }
+            c->member_cap = new_cap;
+        } else {
+            while (got-- > 0) free(fresh[got]);
+        }
+    }
+    SnowMap *m = &c->member_map;
+    if (m->cap > CACHE_MAP_MIN_CAP && m->live * 8 < m->cap) {
+        uint32_t new_cap = m->cap;
+        while (new_cap > CACHE_MAP_MIN_CAP && m->live * 8 < new_cap) new_cap /= 2;
+        snowmap_rehash(m, new_cap);
+    }
+}
+
+/* One sweep: retention policy, per-cache budgets, then the global budget.
+ * 追い出し対象はメンバーとメッセージのみ (サーバー・チャンネル・ロール・
+ * ボイス状態は権限計算や人数照会に必要なため、プレゼンスはオフラインで
+ * 自動的に外れるため、メッセージ索引はサーバーごとの上限で自ら削るため
+ * 集計だけ行う)。 */
+static void cache_sweep(void) {
+    CacheBudget *cb = &g_bot.cache_budget;
+    pthread_mutex_lock(&g_bot.cache.mutex);
+    cache_apply_member_retention();
+    uint32_t entries;
+    size_t member_bytes = cache_cat_bytes(CACHE_CAT_MEMBER, &entries);
+    if (cb->member_budget && member_bytes > cb->member_budget) {
+        cache_evict_members(member_bytes - cb->member_budget);
+        cache_shrink_members();
+    }
+    size_t total = 0;
+    for (int cat = 0; cat < CACHE_CAT_COUNT; cat++)
+        total += cache_cat_bytes((CacheCategory)cat, &entries);
+    size_t excess = (cb->global_budget && total > cb->global_budget) ? total - cb->global_budget : 0;
+    if (excess) {
+        /* まずメッセージを削り、足りなければメンバーを削る */
+        MessageCache *mc = &g_bot.msg_cache;
+        pthread_mutex_lock(&mc->mutex);
+        size_t before = mc->bytes;
+        size_t saved_max = mc->max_bytes;
+        mc->max_bytes = before > excess ? before - excess : 0;
+        msg_cache_enforce();
+        mc->max_bytes = saved_max;
+        size_t freed = before - mc->bytes;
+        pthread_mutex_unlock(&mc->mutex);
+        if (freed < excess) {
+            cache_evict_members(excess - freed);
+            cache_shrink_members();
         }
+    }
+    pthread_mutex_unlock(&g_bot.cache.mutex);
+    if (excess) LOG_D("キャッシュ掃除: 全体 %zu bytes (超過 %zu)", total, excess);
+}
 
-        event_fire("モーダル送信", 1, &interaction);
-        event_fire("MODAL_SUBMIT", 1, &interaction);
+static void *cache_sweeper_thread(void *arg) {
+    (void)arg;
+    while (!__atomic_load_n(&g_shutdown, __ATOMIC_ACQUIRE)) {
+        for (int s = 0; s < __atomic_load_n(&g_bot.cache_budget.sweep_interval, __ATOMIC_RELAXED) &&
+                        !__atomic_load_n(&g_shutdown, __ATOMIC_ACQUIRE); s++)
+            usleep(1000000);
+        if (!__atomic_load_n(&g_shutdown, __ATOMIC_ACQUIRE)) cache_sweep();
     }
+    __atomic_store_n(&g_bot.cache_budget.sweeper_running, false, __ATOMIC_RELEASE);
+    return NULL;
 }
 
-/* Process a DISPATCH event (opcode 0) */
-static void gw_handle_dispatch(const char *event_name, JsonNode *data) {
-    if (!event_name || !data) return;
+/* --- Cache snapshot (warm restart) ---
+ *
+ * エンティティキャッシュ・メッセージキャッシュ・ゲートウェイのセッション情報を
+ * 固定レイアウトのバイナリに書き出し、起動時に読み戻して RESUME で再開する。
+ *
+ *   SnapHeader
+ *   SnapSection × section_count
+ *   各セクション (8 バイト境界, count 件の固定長レコード)
+ *
+ * 数値はリトルエンディアン固定 — ビッグエンディアン環境では読み書きしない。
+ * 文字列は STRS プールへのオフセット (SNAP_STR_NONE = null) で参照する。 */
+
+enum {
+    SNAP_SEC_STRS = 1,      /* バイト列 (NUL 終端文字列とメッセージ本体) */
+    SNAP_SEC_GUILDS,
+    SNAP_SEC_CHANNELS,
+    SNAP_SEC_OVERWRITES,
+    SNAP_SEC_ROLES,
+    SNAP_SEC_MEMBERS,
+    SNAP_SEC_ROLE_IDS,      /* uint64_t — メンバーのロール ID */
+    SNAP_SEC_VOICE,
+    SNAP_SEC_MESSAGES,
+    SNAP_SEC_END
+};
+#define SNAP_SEC_COUNT (SNAP_SEC_END - 1)
 
-    LOG_D("イベント: %s", event_name);
+typedef struct {
+    char     magic[8];
+    uint32_t version;
+    uint32_t endian;            /* SNAP_ENDIAN_MARK */
+    uint8_t  token_hash[16];    /* SHA-256(トークン) の先頭 16 バイト */
+    int64_t  saved_at_ms;
+    int64_t  last_seq;
+    uint32_t section_count;
+    uint32_t reserved;
+    char     session_id[128];
+    char     resume_url[256];
+    char     bot_id[24];
+    char     bot_username[128];
+    char     application_id[24];
+} SnapHeader;
 
-    if (strcmp(event_name, "READY") == 0) {
-        gw_handle_ready(data);
-        return;
-    }
+typedef struct {
+    uint32_t kind, count;
+    uint64_t offset, bytes;
+} SnapSection;
 
-    if (strcmp(event_name, "INTERACTION_CREATE") == 0) {
-        gw_handle_interaction(data);
-        return;
-    }
+typedef struct {
+    uint64_t id, owner;
+    uint32_t name, icon;
+    int32_t  member_count;
+    uint8_t  unavailable, pad[3];
+} SnapGuild;
 
-    /* Convert data to はじむ Value and fire events */
-    Value val = json_to_value(data);
+typedef struct {
+    uint64_t id, guild, parent;
+    int32_t  pos;
+    uint32_t name, topic;
+    uint32_t ow_first;
+    uint16_t ow_count;
+    uint8_t  type, nsfw;
+    uint32_t pad;
+} SnapChannel;
 
-    /* Fire English event name */
-    event_fire(event_name, 1, &val);
+typedef struct {
+    uint64_t id, allow, deny;
+    uint8_t  type, pad[7];
+} SnapOverwrite;
 
-    /* Fire Japanese event aliases */
-    if (strcmp(event_name, "MESSAGE_CREATE") == 0) {
-        /* Inject ボイスチャンネルID from voice state cache */
-        {
-            const char *gid = json_get_str(data, "guild_id");
-            JsonNode *author = json_get(data, "author");
-            const char *uid = author ? json_get_str(author, "id") : NULL;
-            if (gid && uid) {
-                const char *vc_id = voice_state_cache_get(gid, uid);
-                if (vc_id) {
-                    value_dict_add(&val, "ボイスチャンネルID", hajimu_string(vc_id));
-                }
-            }
+typedef struct {
+    uint64_t id, guild, perms;
+    int32_t  pos;
+    uint32_t color, name;
+    uint8_t  flags, pad[3];
+} SnapRole;
+
+typedef struct {
+    uint64_t guild, user;
+    int64_t  timeout, joined_at;
+    uint32_t nick, username, global_name, avatar;
+    uint32_t role_first;
+    uint16_t role_count;
+    uint8_t  bot, pending;
+} SnapMember;
+
+typedef struct {
+    uint64_t guild, user, channel;
+    uint8_t  flags, pad[7];
+} SnapVoice;
+
+typedef struct {
+    uint64_t channel, guild, id, author;
+    uint32_t blob, blob_len;
+    uint16_t attachment_count;
+    uint8_t  edited, pad[5];
+} SnapMessage;
+
+_Static_assert(sizeof(SnapHeader) == 616, "SnapHeader layout");
+_Static_assert(sizeof(SnapSection) == 24, "SnapSection layout");
+_Static_assert(sizeof(SnapGuild) == 32, "SnapGuild layout");
+_Static_assert(sizeof(SnapChannel) == 48, "SnapChannel layout");
+_Static_assert(sizeof(SnapOverwrite) == 32, "SnapOverwrite layout");
+_Static_assert(sizeof(SnapRole) == 40, "SnapRole layout");
+_Static_assert(sizeof(SnapMember) == 56, "SnapMember layout");
+_Static_assert(sizeof(SnapVoice) == 32, "SnapVoice layout");
+_Static_assert(sizeof(SnapMessage) == 48, "SnapMessage layout");
+
+static const size_t snap_record_size[SNAP_SEC_END] = {
+    [SNAP_SEC_STRS]       = 1,
+    [SNAP_SEC_GUILDS]     = sizeof(SnapGuild),
+    [SNAP_SEC_CHANNELS]   = sizeof(SnapChannel),
+    [SNAP_SEC_OVERWRITES] = sizeof(SnapOverwrite),
+    [SNAP_SEC_ROLES]      = sizeof(SnapRole),
+    [SNAP_SEC_MEMBERS]    = sizeof(SnapMember),
+    [SNAP_SEC_ROLE_IDS]   = sizeof(uint64_t),
+    [SNAP_SEC_VOICE]      = sizeof(SnapVoice),
+    [SNAP_SEC_MESSAGES]   = sizeof(SnapMessage),
+};
+
+static bool snap_host_little_endian(void) {
+    const uint32_t one = 1;
+    return *(const uint8_t *)&one == 1;
+}
+
+static void snap_token_hash(uint8_t out[16]) {
+    unsigned char digest[SHA256_DIGEST_LENGTH];
+    SHA256((const unsigned char *)g_bot.token, strlen(g_bot.token), digest);
+    memcpy(out, digest, 16);
+}
+
+static uint32_t snap_str(StrBuf *pool, const char *s) {
+    if (!s) return SNAP_STR_NONE;
+    uint32_t off = (uint32_t)pool->len;
+    sb_appendn(pool, s, (int)strlen(s) + 1);
+    return off;
+}
+
+/* Resolve a pool offset; NULL when out of range or not NUL-terminated */
+static const char *snap_str_at(const uint8_t *pool, size_t pool_len, uint32_t off) {
+    if (off == SNAP_STR_NONE || off >= pool_len) return NULL;
+    if (!memchr(pool + off, '\0', pool_len - off)) return NULL;
+    return (const char *)pool + off;
+}
+
+static char *snap_strdup(const uint8_t *pool, size_t pool_len, uint32_t off) {
+    const char *s = snap_str_at(pool, pool_len, off);
+    return s ? strdup(s) : NULL;
+}
+
+/* Serialize both caches and the gateway session into sec[] (caller holds both mutexes) */
+static void cache_snapshot_build(StrBuf sec[SNAP_SEC_END], uint32_t count[SNAP_SEC_END]) {
+    EntityCache *c = &g_bot.cache;
+    StrBuf *pool = &sec[SNAP_SEC_STRS];
+
+    for (uint32_t i = 0; i < c->guild_count; i++) {
+        const CachedGuild *g = &c->guilds[i];
+        SnapGuild r = {0};
+        r.id = c->guild_id[i];
+        r.owner = c->guild_owner[i];
+        r.name = snap_str(pool, g->name);
+        r.icon = snap_str(pool, g->icon);
+        r.member_count = g->member_count;
+        r.unavailable = g->unavailable;
+        sb_appendn(&sec[SNAP_SEC_GUILDS], (const char *)&r, sizeof(r));
+        count[SNAP_SEC_GUILDS]++;
+    }
+    for (uint32_t i = 0; i < c->channel_count; i++) {
+        const CachedChannel *ch = &c->channels[i];
+        SnapChannel r = {0};
+        r.id = c->channel_id[i];
+        r.guild = c->channel_guild[i];
+        r.parent = c->channel_parent[i];
+        r.pos = c->channel_pos[i];
+        r.type = c->channel_type[i];
+        r.name = snap_str(pool, ch->name);
+        r.topic = snap_str(pool, ch->topic);
+        r.nsfw = ch->nsfw;
+        r.ow_first = count[SNAP_SEC_OVERWRITES];
+        r.ow_count = (uint16_t)ch->overwrite_count;
+        for (int k = 0; k < r.ow_count; k++) {
+            SnapOverwrite o = {0};
+            o.id = ch->overwrites[k].id;
+            o.allow = ch->overwrites[k].allow;
+            o.deny = ch->overwrites[k].deny;
+            o.type = ch->overwrites[k].type;
+            sb_appendn(&sec[SNAP_SEC_OVERWRITES], (const char *)&o, sizeof(o));
+            count[SNAP_SEC_OVERWRITES]++;
         }
-        event_fire("メッセージ受信", 1, &val);
-        /* v1.6.0: Feed message collectors */
-        JsonNode *ch = json_get(data, "channel_id");
-        const char *ch_id = (ch && ch->type == JSON_STRING) ? ch->str.data : "";
-        collector_feed(0, ch_id, NULL, &val);
-    } else if (strcmp(event_name, "GUILD_MEMBER_ADD") == 0) {
-        event_fire("メンバー参加", 1, &val);
-    } else if (strcmp(event_name, "GUILD_MEMBER_REMOVE") == 0) {
-        event_fire("メンバー退出", 1, &val);
-    } else if (strcmp(event_name, "MESSAGE_REACTION_ADD") == 0) {
-        event_fire("リアクション追加", 1, &val);
-        /* v1.6.0: Feed reaction collectors */
-        JsonNode *ch = json_get(data, "channel_id");
-        JsonNode *msg = json_get(data, "message_id");
-        const char *ch_id = (ch && ch->type == JSON_STRING) ? ch->str.data : "";
-        const char *msg_id = (msg && msg->type == JSON_STRING) ? msg->str.data : "";
-        collector_feed(1, ch_id, msg_id, &val);
-    } else if (strcmp(event_name, "MESSAGE_REACTION_REMOVE") == 0) {
-        event_fire("リアクション削除", 1, &val);
-    } else if (strcmp(event_name, "GUILD_CREATE") == 0) {
-        event_fire("サーバー参加", 1, &val);
-        /* Populate voice state cache from guild data */
-        {
-            const char *gid = json_get_str(data, "id");
-            JsonNode *vs = json_get(data, "voice_states");
-            if (gid && vs && vs->type == JSON_ARRAY) {
-                for (int vi = 0; vi < vs->arr.count; vi++) {
-                    const char *uid = json_get_str(&vs->arr.items[vi], "user_id");
-                    const char *cid = json_get_str(&vs->arr.items[vi], "channel_id");
-                    if (uid) {
-                        voice_state_cache_update(gid, uid, cid);
-                    }
-                }
-            }
+        sb_appendn(&sec[SNAP_SEC_CHANNELS], (const char *)&r, sizeof(r));
+        count[SNAP_SEC_CHANNELS]++;
+    }
+    for (uint32_t i = 0; i < c->role_count; i++) {
+        SnapRole r = {0};
+        r.id = c->role_id[i];
+        r.guild = c->role_guild[i];
+        r.perms = c->role_perms[i];
+        r.pos = c->role_pos[i];
+        r.color = c->roles[i].color;
+        r.name = snap_str(pool, c->roles[i].name);
+        r.flags = c->roles[i].flags;
+        sb_appendn(&sec[SNAP_SEC_ROLES], (const char *)&r, sizeof(r));
+        count[SNAP_SEC_ROLES]++;
+    }
+    for (uint32_t i = 0; i < c->member_count; i++) {
+        const CachedMember *m = &c->members[i];
+        SnapMember r = {0};
+        r.guild = c->member_guild[i];
+        r.user = c->member_user[i];
+        r.timeout = c->member_timeout[i];
+        r.joined_at = m->joined_at;
+        r.nick = snap_str(pool, m->nick);
+        r.username = snap_str(pool, m->username);
+        r.global_name = snap_str(pool, m->global_name);
+        r.avatar = snap_str(pool, m->avatar);
+        r.role_first = count[SNAP_SEC_ROLE_IDS];
+        r.role_count = m->role_count;
+        r.bot = m->bot;
+        r.pending = m->pending;
+        if (m->role_count) {
+            sb_appendn(&sec[SNAP_SEC_ROLE_IDS], (const char *)m->roles,
+                       (int)(m->role_count * sizeof(uint64_t)));
+            count[SNAP_SEC_ROLE_IDS] += m->role_count;
         }
-    } else if (strcmp(event_name, "GUILD_DELETE") == 0) {
-        event_fire("サーバー退出", 1, &val);
-    } else if (strcmp(event_name, "CHANNEL_CREATE") == 0) {
-        event_fire("チャンネル作成", 1, &val);
-    } else if (strcmp(event_name, "CHANNEL_DELETE") == 0) {
-        event_fire("チャンネル削除", 1, &val);
-    } else if (strcmp(event_name, "MESSAGE_UPDATE") == 0) {
-        event_fire("メッセージ編集", 1, &val);
-    } else if (strcmp(event_name, "MESSAGE_DELETE") == 0) {
-        event_fire("メッセージ削除イベント", 1, &val);
-    } else if (strcmp(event_name, "TYPING_START") == 0) {
-        event_fire("入力中", 1, &val);
-    } else if (strcmp(event_name, "PRESENCE_UPDATE") == 0) {
-        event_fire("プレゼンス更新", 1, &val);
-    } else if (strcmp(event_name, "VOICE_STATE_UPDATE") == 0) {
-        event_fire("ボイス状態更新", 1, &val);
-        /* Cache voice states for all users */
-        {
-            const char *uid = json_get_str(data, "user_id");
-            const char *gid = json_get_str(data, "guild_id");
-            const char *cid = json_get_str(data, "channel_id");
-            if (uid && gid) {
-                voice_state_cache_update(gid, uid, cid);
+        sb_appendn(&sec[SNAP_SEC_MEMBERS], (const char *)&r, sizeof(r));
+        count[SNAP_SEC_MEMBERS]++;
+    }
+    for (uint32_t i = 0; i < c->voice_count; i++) {
+        SnapVoice r = {0};
+        r.guild = c->voice_guild[i];
+        r.user = c->voice_user[i];
+        r.channel = c->voice_channel[i];
+        r.flags = c->voice_flags[i];
+        sb_appendn(&sec[SNAP_SEC_VOICE], (const char *)&r, sizeof(r));
+        count[SNAP_SEC_VOICE]++;
+    }
+    /* 古く書かれたチャンネルから、各チャンネル内は古い順に — 読込時に LRU 順が再現される */
+    for (MsgRing *ring = g_bot.msg_cache.lru_tail; ring; ring = ring->lru_prev) {
+        for (uint32_t k = 0; k < ring->count; k++) {
+            const CachedMessage *m = &ring->slots[(ring->head + k) % ring->cap];
+            SnapMessage r = {0};
+            r.channel = ring->channel_id;
+            r.guild = ring->guild_id;
+            r.id = m->id;
+            r.author = m->author_id;
+            r.blob = (uint32_t)pool->len;
+            r.blob_len = m->blob_len;
+            r.attachment_count = m->attachment_count;
+            r.edited = m->edited;
+            sb_appendn(pool, m->blob, (int)m->blob_len);
+            sb_appendn(&sec[SNAP_SEC_MESSAGES], (const char *)&r, sizeof(r));
+            count[SNAP_SEC_MESSAGES]++;
+        }
+    }
+}
+
+/* Write the snapshot atomically (path.tmp → rename) */
+static bool cache_snapshot_save(const char *path) {
+    if (!path || !path[0]) return false;
+    if (!snap_host_little_endian()) {
+        LOG_W("キャッシュ保存: ビッグエンディアン環境には対応していません");
+        return false;
+    }
+    cache_init();
+    StrBuf sec[SNAP_SEC_END];
+    uint32_t count[SNAP_SEC_END] = {0};
+    for (int k = 1; k < SNAP_SEC_END; k++) sb_init(&sec[k]);
+
+    pthread_mutex_lock(&g_bot.cache.mutex);
+    pthread_mutex_lock(&g_bot.msg_cache.mutex);
+    cache_snapshot_build(sec, count);
+    pthread_mutex_unlock(&g_bot.msg_cache.mutex);
+    pthread_mutex_unlock(&g_bot.cache.mutex);
+    count[SNAP_SEC_STRS] = (uint32_t)sec[SNAP_SEC_STRS].len;
+
+    SnapHeader h;
+    memset(&h, 0, sizeof(h));
+    memcpy(h.magic, SNAP_MAGIC, sizeof(h.magic));
+    h.version = SNAP_VERSION;
+    h.endian = SNAP_ENDIAN_MARK;
+    snap_token_hash(h.token_hash);
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    h.saved_at_ms = (int64_t)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+    h.last_seq = g_bot.last_seq;
+    h.section_count = SNAP_SEC_COUNT;
+    snprintf(h.session_id, sizeof(h.session_id), "%s", g_bot.session_id);
+    if (strlen(g_bot.resume_url) < sizeof(h.resume_url))
+        snprintf(h.resume_url, sizeof(h.resume_url), "%s", g_bot.resume_url);
+    snprintf(h.bot_id, sizeof(h.bot_id), "%s", g_bot.bot_id);
+    snprintf(h.bot_username, sizeof(h.bot_username), "%s", g_bot.bot_username);
+    snprintf(h.application_id, sizeof(h.application_id), "%s", g_bot.application_id);
+
+    SnapSection table[SNAP_SEC_COUNT];
+    uint64_t off = sizeof(h) + sizeof(table);
+    for (int k = 1; k < SNAP_SEC_END; k++) {
+        off = (off + 7) & ~(uint64_t)7;
+        table[k - 1].kind = (uint32_t)k;
+        table[k - 1].count = count[k];
+        table[k - 1].offset = off;
+        table[k - 1].bytes = (uint64_t)sec[k].len;
+        off += (uint64_t)sec[k].len;
+    }
+
+    char tmp[sizeof(g_bot.cache_snapshot_path) + 8];
+    snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+    FILE *fp = fopen(tmp, "wb");
+    bool ok = fp != NULL;
+    if (ok) {
+        static const char zeros[8] = {0};
+        ok = fwrite(&h, sizeof(h), 1, fp) == 1 &&
+             fwrite(table, sizeof(table), 1, fp) == 1;
+        uint64_t pos = sizeof(h) + sizeof(table);
+        for (int k = 1; ok && k < SNAP_SEC_END; k++) {
+            size_t pad = (size_t)(table[k - 1].offset - pos);
+            if (pad) ok = fwrite(zeros, 1, pad, fp) == pad;
+            if (ok && sec[k].len) ok = fwrite(sec[k].data, (size_t)sec[k].len, 1, fp) == 1;
+            pos = table[k - 1].offset + table[k - 1].bytes;
+        }
+        if (fclose(fp) != 0) ok = false;
+    }
+    if (ok) {
+#ifdef _WIN32
+        remove(path);   /* Windows の rename は既存ファイルを上書きしない */
+#endif
+        ok = rename(tmp, path) == 0;
+    }
+    if (!ok) {
+        LOG_W("キャッシュ保存に失敗しました: %s", path);
+        remove(tmp);
+    } else {
+        LOG_I("キャッシュ保存: %s (サーバー%u, チャンネル%u, メンバー%u, メッセージ%u)", path,
+              count[SNAP_SEC_GUILDS], count[SNAP_SEC_CHANNELS],
+              count[SNAP_SEC_MEMBERS], count[SNAP_SEC_MESSAGES]);
+    }
+    for (int k = 1; k < SNAP_SEC_END; k++) sb_free(&sec[k]);
+    return ok;
+}
+
+/* Rebuild the caches from validated sections (caller holds both mutexes) */
+static void cache_snapshot_restore(const uint8_t *base, const SnapSection *sec[SNAP_SEC_END]) {
+    EntityCache *c = &g_bot.cache;
+    const uint8_t *pool = base + sec[SNAP_SEC_STRS]->offset;
+    size_t pool_len = (size_t)sec[SNAP_SEC_STRS]->bytes;
+    const SnapOverwrite *ows = (const SnapOverwrite *)(base + sec[SNAP_SEC_OVERWRITES]->offset);
+    uint32_t ow_total = sec[SNAP_SEC_OVERWRITES]->count;
+    const uint64_t *role_ids = (const uint64_t *)(base + sec[SNAP_SEC_ROLE_IDS]->offset);
+    uint32_t role_total = sec[SNAP_SEC_ROLE_IDS]->count;
+
+    entity_cache_clear();
+    voice_state_clear();
+    msg_cache_clear();
+
+    const SnapGuild *gs = (const SnapGuild *)(base + sec[SNAP_SEC_GUILDS]->offset);
+    for (uint32_t k = 0; k < sec[SNAP_SEC_GUILDS]->count; k++) {
+        int64_t i = cache_guild_row(gs[k].id);
+        if (i < 0) continue;
+        c->guild_owner[i] = gs[k].owner;
+        c->guilds[i].name = snap_strdup(pool, pool_len, gs[k].name);
+        c->guilds[i].icon = snap_strdup(pool, pool_len, gs[k].icon);
+        c->guilds[i].member_count = gs[k].member_count;
+        c->guilds[i].unavailable = gs[k].unavailable != 0;
+    }
+    const SnapChannel *cs = (const SnapChannel *)(base + sec[SNAP_SEC_CHANNELS]->offset);
+    for (uint32_t k = 0; k < sec[SNAP_SEC_CHANNELS]->count; k++) {
+        int64_t i = cache_channel_row(cs[k].id, cs[k].guild);
+        if (i < 0) continue;
+        CachedChannel *ch = &c->channels[i];
+        c->channel_parent[i] = cs[k].parent;
+        c->channel_pos[i] = cs[k].pos;
+        c->channel_type[i] = cs[k].type;
+        ch->name = snap_strdup(pool, pool_len, cs[k].name);
+        ch->topic = snap_strdup(pool, pool_len, cs[k].topic);
+        ch->nsfw = cs[k].nsfw != 0;
+        if (cs[k].ow_count && cs[k].ow_first <= ow_total &&
+            cs[k].ow_count <= ow_total - cs[k].ow_first) {
+            ch->overwrites = (PermOverwrite *)calloc(cs[k].ow_count, sizeof(PermOverwrite));
+            if (!ch->overwrites) continue;
+            for (uint32_t j = 0; j < cs[k].ow_count; j++) {
+                const SnapOverwrite *o = &ows[cs[k].ow_first + j];
+                ch->overwrites[j].id = o->id;
+                ch->overwrites[j].allow = o->allow;
+                ch->overwrites[j].deny = o->deny;
+                ch->overwrites[j].type = o->type;
             }
+            ch->overwrite_count = cs[k].ow_count;
         }
-        /* v2.0.0: Capture session_id for our voice connections */
-        {
-            const char *uid = json_get_str(data, "user_id");
-            const char *gid = json_get_str(data, "guild_id");
-            const char *sid = json_get_str(data, "session_id");
-            if (uid && gid && sid && strcmp(uid, g_bot.bot_id) == 0) {
-                VoiceConn *vc = voice_find(gid);
-                if (vc && vc->waiting_for_state) {
-                    snprintf(vc->session_id, sizeof(vc->session_id), "%s", sid);
-                    vc->state_received = true;
-                    vc->waiting_for_state = false;
-                    LOG_I("Voice session_id取得: %.32s", sid);
-                    voice_check_ready(vc);
+    }
+    const SnapRole *rs = (const SnapRole *)(base + sec[SNAP_SEC_ROLES]->offset);
+    for (uint32_t k = 0; k < sec[SNAP_SEC_ROLES]->count; k++) {
+        int64_t i = cache_role_row(rs[k].id, rs[k].guild);
+        if (i < 0) continue;
+        c->role_perms[i] = rs[k].perms;
+        c->role_pos[i] = rs[k].pos;
+        c->roles[i].color = rs[k].color;
+        c->roles[i].name = snap_strdup(pool, pool_len, rs[k].name);
+        c->roles[i].flags = rs[k].flags;
+    }
+    const SnapMember *ms = (const SnapMember *)(base + sec[SNAP_SEC_MEMBERS]->offset);
+    for (uint32_t k = 0; k < sec[SNAP_SEC_MEMBERS]->count; k++) {
+        int64_t i = cache_member_row(ms[k].guild, ms[k].user);
+        if (i < 0) continue;
+        CachedMember *m = &c->members[i];
+        c->member_timeout[i] = ms[k].timeout;
+        m->joined_at = ms[k].joined_at;
+        m->nick = snap_strdup(pool, pool_len, ms[k].nick);
+        m->username = snap_strdup(pool, pool_len, ms[k].username);
+        m->global_name = snap_strdup(pool, pool_len, ms[k].global_name);
+        m->avatar = snap_strdup(pool, pool_len, ms[k].avatar);
+        m->bot = ms[k].bot != 0;
+        m->pending = ms[k].pending != 0;
+        if (ms[k].role_count && ms[k].role_first <= role_total &&
+            ms[k].role_count <= role_total - ms[k].role_first) {
+            m->roles = (uint64_t *)malloc(ms[k].role_count * sizeof(uint64_t));
+            if (m->roles) {
+                memcpy(m->roles, role_ids + ms[k].role_first, ms[k].role_count * sizeof(uint64_t));
+                m->role_count = ms[k].role_count;
+            }
+        }
+    }
+    const SnapVoice *vs = (const SnapVoice *)(base + sec[SNAP_SEC_VOICE]->offset);
+    for (uint32_t k = 0; k < sec[SNAP_SEC_VOICE]->count; k++)
+        if (vs[k].guild && vs[k].user) voice_state_set(vs[k].guild, vs[k].user, vs[k].channel, vs[k].flags);
+
+    /* メッセージキャッシュが無効ならメッセージは読み捨てる */
+    if (!g_bot.msg_cache.per_channel) return;
+    const SnapMessage *msgs = (const SnapMessage *)(base + sec[SNAP_SEC_MESSAGES]->offset);
+    for (uint32_t k = 0; k < sec[SNAP_SEC_MESSAGES]->count; k++) {
+        const SnapMessage *sm = &msgs[k];
+        /* 本体は "著者名\0内容\0URL\0" — NUL が 3 つ揃っていなければ捨てる */
+        if (!sm->channel || sm->blob >= pool_len || sm->blob_len > pool_len - sm->blob) continue;
+        const uint8_t *blob = pool + sm->blob;
+        int nuls = 0;
+        for (uint32_t j = 0; j < sm->blob_len; j++) nuls += blob[j] == '\0';
+        if (nuls < 3 || blob[sm->blob_len - 1] != '\0') continue;
+        MsgRing *r = msg_ring_get(sm->channel, sm->guild);
+        if (!r) continue;
+        CachedMessage rec = {0};
+        rec.blob = (char *)malloc(sm->blob_len);
+        if (!rec.blob) continue;
+        memcpy(rec.blob, blob, sm->blob_len);
+        rec.id = sm->id;
+        rec.author_id = sm->author;
+        rec.blob_len = sm->blob_len;
+        rec.attachment_count = sm->attachment_count;
+        rec.edited = sm->edited != 0;
+        msg_ring_push(r, &rec);
+    }
+    msg_cache_enforce();
+}
+
+/* Load a snapshot written by cache_snapshot_save. 現在のキャッシュを置き換え、
+ * 保存時のセッションがあれば次の接続で RESUME する。 */
+static bool cache_snapshot_load(const char *path) {
+    if (!path || !path[0]) return false;
+    if (!snap_host_little_endian()) {
+        LOG_W("キャッシュ読込: ビッグエンディアン環境には対応していません");
+        return false;
+    }
+    cache_init();
+    FILE *fp = fopen(path, "rb");
+    if (!fp) {
+        LOG_D("キャッシュ読込: スナップショットがありません: %s", path);
+        return false;
+    }
+    fseek(fp, 0, SEEK_END);
+    long flen = ftell(fp);
+    fseek(fp, 0, SEEK_SET);
+    if (flen < (long)sizeof(SnapHeader)) {
+        fclose(fp);
+        LOG_W("キャッシュ読込: ファイルが壊れています: %s", path);
+        return false;
+    }
+    size_t size = (size_t)flen;
+    const uint8_t *base = NULL;
+#ifndef _WIN32
+    void *map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fileno(fp), 0);
+    if (map != MAP_FAILED) base = (const uint8_t *)map;
+#endif
+    uint8_t *buf = NULL;
+    if (!base) {
+        buf = (uint8_t *)malloc(size);
+        if (buf && fread(buf, 1, size, fp) == size) base = buf;
+    }
+    fclose(fp);
+    if (!base) {
+        free(buf);
+        LOG_W("キャッシュ読込: 読み込めません: %s", path);
+        return false;
+    }
+
+    const char *why = NULL;
+    const SnapHeader *h = (const SnapHeader *)base;
+    const SnapSection *sec[SNAP_SEC_END] = {0};
+    uint8_t hash[16];
+    snap_token_hash(hash);
+    if (memcmp(h->magic, SNAP_MAGIC, sizeof(h->magic)) != 0) why = "形式が違います";
+    else if (h->version != SNAP_VERSION) why = "バージョンが違います";
+    else if (h->endian != SNAP_ENDIAN_MARK) why = "バイト順が違います";
+    else if (memcmp(h->token_hash, hash, sizeof(hash)) != 0) why = "別のボットのスナップショットです";
+    else if (h->section_count > 64 ||
+             size < sizeof(SnapHeader) + (size_t)h->section_count * sizeof(SnapSection))
+        why = "セクション表が壊れています";
+    if (!why) {
+        const SnapSection *table = (const SnapSection *)(base + sizeof(SnapHeader));
+        for (uint32_t k = 0; k < h->section_count && !why; k++) {
+            const SnapSection *s = &table[k];
+            if (s->kind == 0 || s->kind >= SNAP_SEC_END) continue;   /* 未知のセクションは無視 */
+            if ((s->offset & 7) || s->offset > size || s->bytes > size - s->offset ||
+                s->bytes != (uint64_t)s->count * snap_record_size[s->kind])
+                why = "セクションが壊れています";
+            sec[s->kind] = s;
+        }
+        for (int k = 1; k < SNAP_SEC_END && !why; k++)
+            if (!sec[k]) why = "セクションが足りません";
+    }
+
+    if (!why) {
+        pthread_mutex_lock(&g_bot.cache.mutex);
+        pthread_mutex_lock(&g_bot.msg_cache.mutex);
+        cache_snapshot_restore(base, sec);
+        pthread_mutex_unlock(&g_bot.msg_cache.mutex);
+        pthread_mutex_unlock(&g_bot.cache.mutex);
+
+        /* セッション未確立のときだけ保存時のセッションを引き継ぐ (無効なら
+         * INVALID_SESSION → IDENTIFY に戻り、READY で消えたサーバーを捨てる) */
+        if (!g_bot.session_id[0] && h->session_id[0] &&
+            memchr(h->session_id, '\0', sizeof(h->session_id))) {
+            snprintf(g_bot.session_id, sizeof(g_bot.session_id), "%s", h->session_id);
+            g_bot.last_seq = (int)h->last_seq;
+            if (memchr(h->resume_url, '\0', sizeof(h->resume_url)))
+                snprintf(g_bot.resume_url, sizeof(g_bot.resume_url), "%s", h->resume_url);
+            if (memchr(h->bot_id, '\0', sizeof(h->bot_id)))
+                snprintf(g_bot.bot_id, sizeof(g_bot.bot_id), "%s", h->bot_id);
+            if (memchr(h->bot_username, '\0', sizeof(h->bot_username)))
+                snprintf(g_bot.bot_username, sizeof(g_bot.bot_username), "%s", h->bot_username);
+            if (!g_bot.application_id[0] && memchr(h->application_id, '\0', sizeof(h->application_id)))
+                snprintf(g_bot.application_id, sizeof(g_bot.application_id), "%s", h->application_id);
+        }
+        LOG_I("キャッシュ読込: %s (サーバー%u, チャンネル%u, メンバー%u, メッセージ%u)", path,
+              sec[SNAP_SEC_GUILDS]->count, sec[SNAP_SEC_CHANNELS]->count,
+              sec[SNAP_SEC_MEMBERS]->count, sec[SNAP_SEC_MESSAGES]->count);
+    } else {
+        LOG_W("キャッシュ読込: %s: %s", why, path);
+    }
+
+#ifndef _WIN32
+    if (!buf) munmap((void *)base, size);
+#endif
+    free(buf);
+    return why == NULL;
+}
+
+/* =========================================================================
+ * Section 12: Embed Builder → JSON
+ * ========================================================================= */
+
+static int embed_alloc(void) {
+    for (int i = 0; i < MAX_EMBEDS_STORE; i++) {
+        if (!g_bot.embeds[i].active) {
+            memset(&g_bot.embeds[i], 0, sizeof(Embed));
+            g_bot.embeds[i].active = true;
+            g_bot.embeds[i].color = -1;
+            return i;
+        }
+    }
+    LOG_E("埋め込みの上限に達しました");
+    return -1;
+}
+
+static Embed *embed_get(int idx) {
+    if (idx < 0 || idx >= MAX_EMBEDS_STORE || !g_bot.embeds[idx].active) return NULL;
+    return &g_bot.embeds[idx];
+}
+
+/* Serialize embed to JSON string */
+static char *embed_to_json(Embed *e) {
+    StrBuf sb; sb_init(&sb);
+    jb_obj_start(&sb);
+    if (e->title[0])       jb_str(&sb, "title", e->title);
+    if (e->description[0]) jb_str(&sb, "description", e->description);
+    if (e->color >= 0)     jb_int(&sb, "color", e->color);
+    if (e->timestamp[0])   jb_str(&sb, "timestamp", e->timestamp);
+    if (e->footer_text[0]) {
+        jb_key(&sb, "footer"); jb_obj_start(&sb);
+        jb_str(&sb, "text", e->footer_text);
+        if (e->footer_icon[0]) jb_str(&sb, "icon_url", e->footer_icon);
+        jb_obj_end(&sb); sb_append_char(&sb, ',');
+    }
+    if (e->thumbnail[0]) {
+        jb_key(&sb, "thumbnail"); jb_obj_start(&sb);
+        jb_str(&sb, "url", e->thumbnail);
+        jb_obj_end(&sb); sb_append_char(&sb, ',');
+    }
+    if (e->image[0]) {
+        jb_key(&sb, "image"); jb_obj_start(&sb);
+        jb_str(&sb, "url", e->image);
+        jb_obj_end(&sb); sb_append_char(&sb, ',');
+    }
+    if (e->author_name[0]) {
+        jb_key(&sb, "author"); jb_obj_start(&sb);
+        jb_str(&sb, "name", e->author_name);
+        if (e->author_icon[0]) jb_str(&sb, "icon_url", e->author_icon);
+        if (e->author_url[0])  jb_str(&sb, "url", e->author_url);
+        jb_obj_end(&sb); sb_append_char(&sb, ',');
+    }
+    if (e->field_count > 0) {
+        jb_key(&sb, "fields"); jb_arr_start(&sb);
+        for (int i = 0; i < e->field_count; i++) {
+            jb_obj_start(&sb);
+            jb_str(&sb, "name",  e->fields[i].name);
+            jb_str(&sb, "value", e->fields[i].value);
+            jb_bool(&sb, "inline", e->fields[i].is_inline);
+            jb_obj_end(&sb); sb_append_char(&sb, ',');
+        }
+        jb_arr_end(&sb); sb_append_char(&sb, ',');
+    }
+    jb_obj_end(&sb);
+    return sb_detach(&sb);
+}
+
+/* =========================================================================
+ * Section 13: Discord Gateway Protocol
+ * ========================================================================= */
+
+static void gw_send_json(const char *json) {
+    LOG_D("GW送信: %.200s", json);
+    ws_send_text(&g_bot.ws, json, (int)strlen(json));
+}
+
+static void gw_send_heartbeat(void) {
+    char buf[64];
+    if (g_bot.last_seq > 0) {
+        snprintf(buf, sizeof(buf), "{\"op\":1,\"d\":%d}", g_bot.last_seq);
+    } else {
+        snprintf(buf, sizeof(buf), "{\"op\":1,\"d\":null}");
+    }
+    gw_send_json(buf);
+    g_bot.heartbeat_acked = false;
+    LOG_D("Heartbeat送信 (seq=%d)", g_bot.last_seq);
+}
+
+static void gw_send_identify(void) {
+    StrBuf sb; sb_init(&sb);
+    jb_obj_start(&sb);
+    jb_int(&sb, "op", GW_IDENTIFY);
+    jb_key(&sb, "d"); jb_obj_start(&sb);
+    jb_str(&sb, "token", g_bot.token);
+    jb_int(&sb, "intents", g_bot.intents);
+    jb_key(&sb, "properties"); jb_obj_start(&sb);
+    jb_str(&sb, "os", "hajimu");
+    jb_str(&sb, "browser", "hajimu_discord");
+    jb_str(&sb, "device", "hajimu_discord");
+    jb_obj_end(&sb); sb_append_char(&sb, ',');
+    /* Sharding (v2.2.0) */
+    if (g_bot.sharding_enabled) {
+        jb_key(&sb, "shard");
+        sb_appendf(&sb, "[%d,%d],", g_bot.shard_id, g_bot.shard_count);
+    }
+    jb_obj_end(&sb); sb_append_char(&sb, ',');
+    jb_obj_end(&sb);
+    gw_send_json(sb.data);
+    sb_free(&sb);
+    LOG_I("IDENTIFY送信");
+}
+
+static void gw_send_resume(void) {
+    StrBuf sb; sb_init(&sb);
+    jb_obj_start(&sb);
+    jb_int(&sb, "op", GW_RESUME);
+    jb_key(&sb, "d"); jb_obj_start(&sb);
+    jb_str(&sb, "token", g_bot.token);
+    jb_str(&sb, "session_id", g_bot.session_id);
+    jb_int(&sb, "seq", g_bot.last_seq);
+    jb_obj_end(&sb); sb_append_char(&sb, ',');
+    jb_obj_end(&sb);
+    gw_send_json(sb.data);
+    sb_free(&sb);
+    LOG_I("RESUME送信 (session=%s, seq=%d)", g_bot.session_id, g_bot.last_seq);
+}
+
+static void gw_send_presence(const char *status, const char *activity_name, int type) {
+    StrBuf sb; sb_init(&sb);
+    jb_obj_start(&sb);
+    jb_int(&sb, "op", GW_PRESENCE_UPDATE);
+    jb_key(&sb, "d"); jb_obj_start(&sb);
+    jb_null(&sb, "since");
+    jb_key(&sb, "activities"); jb_arr_start(&sb);
+    if (activity_name && activity_name[0]) {
+        jb_obj_start(&sb);
+        jb_str(&sb, "name", activity_name);
+        jb_int(&sb, "type", type);
+        jb_obj_end(&sb);
+    }
+    jb_arr_end(&sb); sb_append_char(&sb, ',');
+    jb_str(&sb, "status", status);
+    jb_bool(&sb, "afk", false);
+    jb_obj_end(&sb); sb_append_char(&sb, ',');
+    jb_obj_end(&sb);
+    gw_send_json(sb.data);
+    sb_free(&sb);
+}
+
+/* Process READY event */
+static void gw_handle_ready(JsonNode *data) {
+    const char *session = json_get_str(data, "session_id");
+    if (session) snprintf(g_bot.session_id, sizeof(g_bot.session_id), "%s", session);
+
+    const char *resume = json_get_str(data, "resume_gateway_url");
+    if (resume) snprintf(g_bot.resume_url, sizeof(g_bot.resume_url), "%s", resume);
+
+    /* Bot user info */
+    JsonNode *user = json_get(data, "user");
+    if (user) {
+        const char *id = json_get_str(user, "id");
+        if (id) snprintf(g_bot.bot_id, sizeof(g_bot.bot_id), "%s", id);
+        const char *name = json_get_str(user, "username");
+        if (name) snprintf(g_bot.bot_username, sizeof(g_bot.bot_username), "%s", name);
+        const char *disc = json_get_str(user, "discriminator");
+        if (disc) snprintf(g_bot.bot_discriminator, sizeof(g_bot.bot_discriminator), "%s", disc);
+    }
+
+    /* Application info */
+    JsonNode *app = json_get(data, "application");
+    if (app) {
+        const char *app_id = json_get_str(app, "id");
+        if (app_id) {
+            if (g_bot.application_id[0]) {
+                /* 環境変数で既に設定済み — 一致確認のみ */
+                if (strcmp(g_bot.application_id, app_id) != 0) {
+                    LOG_W("CLIENT_ID 不一致: env=%s, READY=%s (READYの値を使用)",
+                          g_bot.application_id, app_id);
+                    snprintf(g_bot.application_id, sizeof(g_bot.application_id), "%s", app_id);
                 }
+            } else {
+                snprintf(g_bot.application_id, sizeof(g_bot.application_id), "%s", app_id);
             }
         }
-    } else if (strcmp(event_name, "VOICE_SERVER_UPDATE") == 0) {
-        event_fire("ボイスサーバー更新", 1, &val);
-        /* v2.0.0: Capture voice server info */
-        {
-            const char *gid = json_get_str(data, "guild_id");
-            const char *token = json_get_str(data, "token");
-            const char *endpoint = json_get_str(data, "endpoint");
-            if (gid && token && endpoint) {
-                VoiceConn *vc = voice_find(gid);
-                if (vc && vc->waiting_for_server) {
-                    snprintf(vc->voice_token, sizeof(vc->voice_token), "%s", token);
-                    snprintf(vc->endpoint, sizeof(vc->endpoint), "%s", endpoint);
-                    vc->server_received = true;
-                    vc->waiting_for_server = false;
-                    LOG_I("Voiceサーバー情報取得: %s", endpoint);
-                    voice_check_ready(vc);
-                }
-            }
+    }
+
+    g_bot.gateway_ready = true;
+    LOG_I("準備完了！ ボット: %s (ID: %s)", g_bot.bot_username, g_bot.bot_id);
+
+    /* Fire READY event */
+    Value bot_info = hajimu_string(g_bot.bot_username);
+    event_fire("READY", 1, &bot_info);
+    event_fire("準備完了", 1, &bot_info);
+}
+
+/* Process INTERACTION_CREATE — slash commands */
+/* --- Async callback execution (v2.5.0) --- */
+/* Run command/component callbacks in a detached thread so the gateway
+   thread can keep receiving events (crucial for voice connect flow). */
+typedef struct {
+    Value    callback;
+    Value    arg;
+    char     label[64];   /* for debug logging */
+} AsyncCallbackArg;
+
+static void *async_callback_thread(void *ptr) {
+    AsyncCallbackArg *a = (AsyncCallbackArg *)ptr;
+    pthread_mutex_lock(&g_bot.callback_mutex);
+    if (hajimu_runtime_available()) {
+        LOG_I("CMD: '%s' コールバック開始", a->label);
+        hajimu_call(&a->callback, 1, &a->arg);
+        LOG_I("CMD: '%s' コールバック完了", a->label);
+    }
+    pthread_mutex_unlock(&g_bot.callback_mutex);
+    free(a);
+    return NULL;
+}
+
+static void run_callback_async(Value *callback, Value *arg, const char *label) {
+    AsyncCallbackArg *a = (AsyncCallbackArg *)calloc(1, sizeof(AsyncCallbackArg));
+    if (!a) return;
+    a->callback = *callback;
+    a->arg = *arg;
+    snprintf(a->label, sizeof(a->label), "%s", label ? label : "?");
+    pthread_t t;
+    if (pthread_create(&t, NULL, async_callback_thread, a) == 0) {
+        pthread_detach(t);
+    } else {
+        LOG_E("コールバックスレッド作成失敗: %s", label);
+        free(a);
+    }
+}
+
+static void gw_handle_interaction(JsonNode *data) {
+    int type = (int)json_get_num(data, "type");
+
+    /* Type 2 = APPLICATION_COMMAND */
+    if (type == 2) {
+        JsonNode *cmd_data = json_get(data, "data");
+        if (!cmd_data) return;
+        const char *cmd_name = json_get_str(cmd_data, "name");
+        if (!cmd_name) return;
+
+        /* Find registered command */
+        for (int i = 0; i < g_bot.command_count; i++) {
+            if (strcmp(g_bot.commands[i].name, cmd_name) == 0) {
+                LOG_I("CMD: '%s' コマンド一致 (idx=%d)", cmd_name, i);
+                /* Build interaction value for the callback */
+                Value interaction = json_to_value(data);
+
+                /* Inject ボイスチャンネルID from voice state cache */
+                {
+                    const char *gid = json_get_str(data, "guild_id");
+                    JsonNode *member = json_get(data, "member");
+                    JsonNode *user = member ? json_get(member, "user") : NULL;
+                    const char *uid = user ? json_get_str(user, "id") : NULL;
+                    char vc_id[MAX_SNOWFLAKE];
+                    if (gid && uid && voice_state_cache_get(gid, uid, vc_id, sizeof(vc_id))) {
+                        value_dict_add(&interaction, "ボイスチャンネルID", hajimu_string(vc_id));
+                    }
+                }
+
+                event_fire("INTERACTION_CREATE", 1, &interaction);
+
+                /* Call specific command handler (async to not block gateway) */
+                run_callback_async(&g_bot.commands[i].callback, &interaction, cmd_name);
+                return;
+            }
+        }
+
+        /* Fire generic command event */
+        Value interaction = json_to_value(data);
+        event_fire("コマンド受信", 1, &interaction);
+    }
+
+    /* Type 3 = MESSAGE_COMPONENT (button click, select menu) */
+    if (type == 3) {
+        JsonNode *comp_data = json_get(data, "data");
+        if (!comp_data) return;
+        const char *custom_id = json_get_str(comp_data, "custom_id");
+        int comp_type = (int)json_get_num(comp_data, "component_type");
+        if (!custom_id) return;
+
+        Value interaction = json_to_value(data);
+        event_fire("INTERACTION_CREATE", 1, &interaction);
+
+        /* v1.6.0: Feed interaction collectors */
+        JsonNode *msg = json_get(data, "message");
+        const char *msg_id = msg ? json_get_str(msg, "id") : NULL;
+        JsonNode *ch = json_get(data, "channel_id");
+        const char *ch_id = (ch && ch->type == JSON_STRING) ? ch->str.data : "";
+        collector_feed(2, ch_id, msg_id ? msg_id : "", &interaction);
+
+        /* Find registered component handler */
+        for (int i = 0; i < g_bot.comp_handler_count; i++) {
+            if (strcmp(g_bot.comp_handlers[i].custom_id, custom_id) == 0 &&
+                (g_bot.comp_handlers[i].type == comp_type || g_bot.comp_handlers[i].type == 0)) {
+                run_callback_async(&g_bot.comp_handlers[i].callback, &interaction, custom_id);
+                return;
+            }
+        }
+
+        /* Fire generic component events */
+        if (comp_type == COMP_BUTTON) {
+            event_fire("ボタンクリック", 1, &interaction);
+            event_fire("BUTTON_CLICK", 1, &interaction);
+        } else if (comp_type == COMP_STRING_SELECT) {
+            event_fire("セレクト選択", 1, &interaction);
+            event_fire("SELECT_MENU", 1, &interaction);
+        }
+    }
+
+    /* Type 4 = APPLICATION_COMMAND_AUTOCOMPLETE */
+    if (type == 4) {
+        JsonNode *ac_data = json_get(data, "data");
+        if (!ac_data) return;
+        const char *cmd_name = json_get_str(ac_data, "name");
+        if (!cmd_name) return;
+
+        Value interaction = json_to_value(data);
+
+        /* Find registered autocomplete handler */
+        for (int i = 0; i < g_bot.autocomplete_count; i++) {
+            if (strcmp(g_bot.autocomplete_handlers[i].command_name, cmd_name) == 0) {
+                run_callback_async(&g_bot.autocomplete_handlers[i].callback, &interaction, cmd_name);
+                return;
+            }
+        }
+
+        event_fire("オートコンプリート", 1, &interaction);
+        event_fire("AUTOCOMPLETE", 1, &interaction);
+    }
+
+    /* Type 5 = MODAL_SUBMIT */
+    if (type == 5) {
+        JsonNode *modal_data = json_get(data, "data");
+        if (!modal_data) return;
+        const char *custom_id = json_get_str(modal_data, "custom_id");
+        if (!custom_id) return;
+
+        Value interaction = json_to_value(data);
+        event_fire("INTERACTION_CREATE", 1, &interaction);
+
+        /* Find registered modal handler */
+        for (int i = 0; i < g_bot.comp_handler_count; i++) {
+            if (strcmp(g_bot.comp_handlers[i].custom_id, custom_id) == 0 &&
+                g_bot.comp_handlers[i].type == -1) { /* -1 = modal */
+                run_callback_async(&g_bot.comp_handlers[i].callback, &interaction, custom_id);
+                return;
+            }
+        }
+
+        event_fire("モーダル送信", 1, &interaction);
+        event_fire("MODAL_SUBMIT", 1, &interaction);
+    }
+}
+
+/* Process a DISPATCH event (opcode 0) */
+static void gw_handle_dispatch(const char *event_name, JsonNode *data) {
+    if (!event_name || !data) return;
+
+    LOG_D("イベント: %s", event_name);
+
+    /* v2.6.0: Keep the entity cache current before any handler runs */
+    entity_cache_on_dispatch(event_name, data);
+    /* 更新・削除イベントには反映前のキャッシュ済みメッセージを付ける */
+    Value prev_msg = message_cache_on_dispatch(event_name, data);
+    msg_index_on_dispatch(event_name, data);
+    tally_on_dispatch(event_name, data);
+    presence_on_dispatch(event_name, data);
+
+    if (strcmp(event_name, "READY") == 0) {
+        gw_handle_ready(data);
+        return;
+    }
+
+    if (strcmp(event_name, "INTERACTION_CREATE") == 0) {
+        gw_handle_interaction(data);
+        return;
+    }
+
+    /* 最も多い PRESENCE_UPDATE はハンドラが無ければ Value に変換しない */
+    if (strcmp(event_name, "PRESENCE_UPDATE") == 0 &&
+        !event_has_handlers("PRESENCE_UPDATE") && !event_has_handlers("プレゼンス更新"))
+        return;
+
+    /* Convert data to はじむ Value and fire events */
+    Value val = json_to_value(data);
+    if (prev_msg.type != VALUE_NULL) value_dict_add(&val, "以前のメッセージ", prev_msg);
+
+    /* Fire English event name */
+    event_fire(event_name, 1, &val);
+
+    /* Fire Japanese event aliases */
+    if (strcmp(event_name, "MESSAGE_CREATE") == 0) {
+        /* Inject ボイスチャンネルID from voice state cache */
+        {
+            const char *gid = json_get_str(data, "guild_id");
+            JsonNode *author = json_get(data, "author");
+            const char *uid = author ? json_get_str(author, "id") : NULL;
+            char vc_id[MAX_SNOWFLAKE];
+            if (gid && uid && voice_state_cache_get(gid, uid, vc_id, sizeof(vc_id))) {
+                value_dict_add(&val, "ボイスチャンネルID", hajimu_string(vc_id));
+            }
+        }
+        event_fire("メッセージ受信", 1, &val);
+        /* v1.6.0: Feed message collectors */
+        JsonNode *ch = json_get(data, "channel_id");
+        const char *ch_id = (ch && ch->type == JSON_STRING) ? ch->str.data : "";
+        collector_feed(0, ch_id, NULL, &val);
+    } else if (strcmp(event_name, "GUILD_MEMBER_ADD") == 0) {
+        event_fire("メンバー参加", 1, &val);
+    } else if (strcmp(event_name, "GUILD_MEMBER_REMOVE") == 0) {
+        event_fire("メンバー退出", 1, &val);
+    } else if (strcmp(event_name, "MESSAGE_REACTION_ADD") == 0) {
+        event_fire("リアクション追加", 1, &val);
+        /* v1.6.0: Feed reaction collectors */
+        JsonNode *ch = json_get(data, "channel_id");
+        JsonNode *msg = json_get(data, "message_id");
+        const char *ch_id = (ch && ch->type == JSON_STRING) ? ch->str.data : "";
+        const char *msg_id = (msg && msg->type == JSON_STRING) ? msg->str.data : "";
+        collector_feed(1, ch_id, msg_id, &val);
+    } else if (strcmp(event_name, "MESSAGE_REACTION_REMOVE") == 0) {
+        event_fire("リアクション削除", 1, &val);
+    } else if (strcmp(event_name, "GUILD_CREATE") == 0) {
+        event_fire("サーバー参加", 1, &val);
+    } else if (strcmp(event_name, "GUILD_DELETE") == 0) {
+        event_fire("サーバー退出", 1, &val);
+    } else if (strcmp(event_name, "CHANNEL_CREATE") == 0) {
+        event_fire("チャンネル作成", 1, &val);
+    } else if (strcmp(event_name, "CHANNEL_DELETE") == 0) {
+        event_fire("チャンネル削除", 1, &val);
+    } else if (strcmp(event_name, "MESSAGE_UPDATE") == 0) {
+        event_fire("メッセージ編集", 1, &val);
+    } else if (strcmp(event_name, "MESSAGE_DELETE") == 0) {
+        event_fire("メッセージ削除イベント", 1, &val);
+    } else if (strcmp(event_name, "TYPING_START") == 0) {
+        event_fire("入力中", 1, &val);
+    } else if (strcmp(event_name, "PRESENCE_UPDATE") == 0) {
+        event_fire("プレゼンス更新", 1, &val);
+    } else if (strcmp(event_name, "VOICE_STATE_UPDATE") == 0) {
+        event_fire("ボイス状態更新", 1, &val);
+        /* v2.0.0: Capture session_id for our voice connections */
+        {
+            const char *uid = json_get_str(data, "user_id");
+            const char *gid = json_get_str(data, "guild_id");
+            const char *sid = json_get_str(data, "session_id");
+            if (uid && gid && sid && strcmp(uid, g_bot.bot_id) == 0) {
+                VoiceConn *vc = voice_find(gid);
+                if (vc && vc->waiting_for_state) {
+                    snprintf(vc->session_id, sizeof(vc->session_id), "%s", sid);
+                    vc->state_received = true;
+                    vc->waiting_for_state = false;
+                    LOG_I("Voice session_id取得: %.32s", sid);
+                    voice_check_ready(vc);
+                }
+            }
+        }
+    } else if (strcmp(event_name, "VOICE_SERVER_UPDATE") == 0) {
+        event_fire("ボイスサーバー更新", 1, &val);
+        /* v2.0.0: Capture voice server info */
+        {
+            const char *gid = json_get_str(data, "guild_id");
+            const char *token = json_get_str(data, "token");
+            const char *endpoint = json_get_str(data, "endpoint");
+            if (gid && token && endpoint) {
+                VoiceConn *vc = voice_find(gid);
+                if (vc && vc->waiting_for_server) {
+                    snprintf(vc->voice_token, sizeof(vc->voice_token), "%s", token);
+                    snprintf(vc->endpoint, sizeof(vc->endpoint), "%s", endpoint);
+                    vc->server_received = true;
+                    vc->waiting_for_server = false;
+                    LOG_I("Voiceサーバー情報取得: %s", endpoint);
+                    voice_check_ready(vc);
+                }
+            }
+        }
+    } else if (strcmp(event_name, "AUTO_MODERATION_ACTION_EXECUTION") == 0) {
+        event_fire("自動モデレーション実行", 1, &val);
+    } else if (strcmp(event_name, "GUILD_SCHEDULED_EVENT_CREATE") == 0) {
+        event_fire("イベント作成", 1, &val);
+    } else if (strcmp(event_name, "GUILD_SCHEDULED_EVENT_UPDATE") == 0) {
+        event_fire("イベント更新", 1, &val);
+    } else if (strcmp(event_name, "GUILD_SCHEDULED_EVENT_DELETE") == 0) {
+        event_fire("イベント削除", 1, &val);
+    } else if (strcmp(event_name, "RESUMED") == 0) {
+        event_fire("再接続完了", 1, &val);
+        LOG_I("セッション再開完了");
+        if (!g_bot.gateway_ready && g_bot.bot_id[0]) {
+            /* スナップショットのセッションで起動直後に再開した — READY は届かない */
+            g_bot.gateway_ready = true;
+            LOG_I("準備完了！ (セッション再開) ボット: %s (ID: %s)", g_bot.bot_username, g_bot.bot_id);
+            Value bot_info = hajimu_string(g_bot.bot_username);
+            event_fire("READY", 1, &bot_info);
+            event_fire("準備完了", 1, &bot_info);
+        }
+    }
+    /* v2.3.0: 追加イベント — discord.js/discord.py 互換 */
+    else if (strcmp(event_name, "CHANNEL_UPDATE") == 0) {
+        event_fire("チャンネル更新", 1, &val);
+    } else if (strcmp(event_name, "CHANNEL_PINS_UPDATE") == 0) {
+        event_fire("ピン更新", 1, &val);
+    } else if (strcmp(event_name, "GUILD_UPDATE") == 0) {
+        event_fire("サーバー更新", 1, &val);
+    } else if (strcmp(event_name, "GUILD_BAN_ADD") == 0) {
+        event_fire("BAN追加", 1, &val);
+    } else if (strcmp(event_name, "GUILD_BAN_REMOVE") == 0) {
+        event_fire("BAN削除", 1, &val);
+    } else if (strcmp(event_name, "GUILD_EMOJIS_UPDATE") == 0) {
+        event_fire("絵文字更新", 1, &val);
+    } else if (strcmp(event_name, "GUILD_STICKERS_UPDATE") == 0) {
+        event_fire("スタンプ更新", 1, &val);
+    } else if (strcmp(event_name, "GUILD_MEMBER_UPDATE") == 0) {
+        event_fire("メンバー更新", 1, &val);
+    } else if (strcmp(event_name, "GUILD_ROLE_CREATE") == 0) {
+        event_fire("ロール作成", 1, &val);
+    } else if (strcmp(event_name, "GUILD_ROLE_UPDATE") == 0) {
+        event_fire("ロール更新", 1, &val);
+    } else if (strcmp(event_name, "GUILD_ROLE_DELETE") == 0) {
+        event_fire("ロール削除", 1, &val);
+    } else if (strcmp(event_name, "GUILD_INTEGRATIONS_UPDATE") == 0) {
+        event_fire("インテグレーション更新", 1, &val);
+    } else if (strcmp(event_name, "INVITE_CREATE") == 0) {
+        event_fire("招待作成", 1, &val);
+    } else if (strcmp(event_name, "INVITE_DELETE") == 0) {
+        event_fire("招待削除", 1, &val);
+    } else if (strcmp(event_name, "MESSAGE_DELETE_BULK") == 0) {
+        event_fire("メッセージ一括削除", 1, &val);
+    } else if (strcmp(event_name, "THREAD_CREATE") == 0) {
+        event_fire("スレッド作成", 1, &val);
+    } else if (strcmp(event_name, "THREAD_UPDATE") == 0) {
+        event_fire("スレッド更新", 1, &val);
+    } else if (strcmp(event_name, "THREAD_DELETE") == 0) {
+        event_fire("スレッド削除", 1, &val);
+    } else if (strcmp(event_name, "THREAD_LIST_SYNC") == 0) {
+        event_fire("スレッド同期", 1, &val);
+    } else if (strcmp(event_name, "THREAD_MEMBER_UPDATE") == 0) {
+        event_fire("スレッドメンバー更新", 1, &val);
+    } else if (strcmp(event_name, "THREAD_MEMBERS_UPDATE") == 0) {
+        event_fire("スレッドメンバーズ更新", 1, &val);
+    } else if (strcmp(event_name, "WEBHOOKS_UPDATE") == 0) {
+        event_fire("Webhook更新", 1, &val);
+    } else if (strcmp(event_name, "STAGE_INSTANCE_CREATE") == 0) {
+        event_fire("ステージ開始", 1, &val);
+    } else if (strcmp(event_name, "STAGE_INSTANCE_UPDATE") == 0) {
+        event_fire("ステージ更新", 1, &val);
+    } else if (strcmp(event_name, "STAGE_INSTANCE_DELETE") == 0) {
+        event_fire("ステージ終了", 1, &val);
+    } else if (strcmp(event_name, "GUILD_SCHEDULED_EVENT_USER_ADD") == 0) {
+        event_fire("イベント参加", 1, &val);
+    } else if (strcmp(event_name, "GUILD_SCHEDULED_EVENT_USER_REMOVE") == 0) {
+        event_fire("イベント退出", 1, &val);
+    } else if (strcmp(event_name, "MESSAGE_POLL_VOTE_ADD") == 0) {
+        event_fire("投票追加", 1, &val);
+    } else if (strcmp(event_name, "MESSAGE_POLL_VOTE_REMOVE") == 0) {
+        event_fire("投票削除", 1, &val);
+    } else if (strcmp(event_name, "ENTITLEMENT_CREATE") == 0) {
+        event_fire("エンタイトルメント作成", 1, &val);
+    } else if (strcmp(event_name, "ENTITLEMENT_UPDATE") == 0) {
+        event_fire("エンタイトルメント更新", 1, &val);
+    } else if (strcmp(event_name, "ENTITLEMENT_DELETE") == 0) {
+        event_fire("エンタイトルメント削除", 1, &val);
+    } else if (strcmp(event_name, "AUTO_MODERATION_RULE_CREATE") == 0) {
+        event_fire("自動モデレーションルール作成", 1, &val);
+    } else if (strcmp(event_name, "AUTO_MODERATION_RULE_UPDATE") == 0) {
+        event_fire("自動モデレーションルール更新", 1, &val);
+    } else if (strcmp(event_name, "AUTO_MODERATION_RULE_DELETE") == 0) {
+        event_fire("自動モデレーションルール削除", 1, &val);
+    }
+}
+
+/* Process one gateway message */
+static void gw_process_message(const char *json_text) {
+    if (!json_text) return;
+    LOG_D("GW受信: %.200s", json_text);
+
+    JsonNode *root = json_parse(json_text);
+    if (!root) return;
+
+    int op = (int)json_get_num(root, "op");
+    JsonNode *d = json_get(root, "d");
+
+    /* Update sequence number */
+    JsonNode *s_node = json_get(root, "s");
+    if (s_node && s_node->type == JSON_NUMBER) {
+        g_bot.last_seq = (int)s_node->number;
+    }
+
+    switch (op) {
+        case GW_DISPATCH: {
+            const char *event_name = json_get_str(root, "t");
+            gw_handle_dispatch(event_name, d);
+            break;
+        }
+
+        case GW_HEARTBEAT:
+            gw_send_heartbeat();
+            break;
+
+        case GW_RECONNECT:
+            LOG_I("サーバーから再接続要求を受信");
+            ws_close(&g_bot.ws);
+            break;
+
+        case GW_INVALID_SESSION: {
+            bool resumable = (d && d->type == JSON_BOOL) ? d->boolean : false;
+            LOG_W("セッション無効 (再開可能=%s)", resumable ? "はい" : "いいえ");
+            if (!resumable) {
+                g_bot.session_id[0] = '\0';
+                g_bot.last_seq = 0;
+            }
+            usleep(3000000); /* Wait 3 seconds as Discord recommends */
+            ws_close(&g_bot.ws);
+            break;
+        }
+
+        case GW_HELLO: {
+            g_bot.heartbeat_interval = (int)json_get_num(d, "heartbeat_interval");
+            LOG_I("HELLO受信 (heartbeat: %dms)", g_bot.heartbeat_interval);
+            g_bot.heartbeat_acked = true;
+
+            /* Send RESUME if we have a session, otherwise IDENTIFY */
+            if (g_bot.session_id[0]) {
+                gw_send_resume();
+            } else {
+                gw_send_identify();
+            }
+            break;
+        }
+
+        case GW_HEARTBEAT_ACK:
+            g_bot.heartbeat_acked = true;
+            LOG_D("Heartbeat ACK受信");
+            break;
+
+        default:
+            LOG_D("不明なopcode: %d", op);
+            break;
+    }
+
+    json_free(root);
+    free(root);
+}
+
+/* Heartbeat thread */
+static void *heartbeat_thread_func(void *arg) {
+    (void)arg;
+    while (g_bot.running && !g_shutdown) {
+        if (g_bot.heartbeat_interval <= 0) {
+            usleep(100000);
+            continue;
+        }
+
+        /* Jitter: first heartbeat at random fraction of interval */
+        int wait_ms = g_bot.heartbeat_interval;
+        struct timespec ts;
+        ts.tv_sec = wait_ms / 1000;
+        ts.tv_nsec = (wait_ms % 1000) * 1000000L;
+        nanosleep(&ts, NULL);
+
+        if (!g_bot.running || g_shutdown) break;
+
+        if (!g_bot.heartbeat_acked && g_bot.ws.connected) {
+            LOG_W("Heartbeat ACK未受信。接続が切断された可能性があります");
+            Value err_msg = hajimu_string("Heartbeat ACK未受信");
+            event_fire("エラー", 1, &err_msg);
+            event_fire("ERROR", 1, &err_msg);
+            ws_close(&g_bot.ws);
+            continue;
+        }
+
+        if (g_bot.ws.connected) {
+            gw_send_heartbeat();
+        }
+    }
+    return NULL;
+}
+
+/* v2.6.0: Slash command registration — bulk overwrite + hash cache
+ *
+ * 全コマンドを1つの配列にシリアライズして PUT で一括上書きする。
+ * 配列の SHA-256 をローカルキャッシュに保存し、次回起動時に一致すれば
+ * GET 1回で Discord 側の定義を確認して PUT を省略する。 */
+
+static int command_type_of(const SlashCommand *cmd) {
+    if (cmd->option_count == -2) return 2; /* USER context menu */
+    if (cmd->option_count == -3) return 3; /* MESSAGE context menu */
+    return 1;                              /* CHAT_INPUT */
+}
+
+/* Serialize every top-level command into a JSON array (caller frees) */
+static char *command_definitions_json(void) {
+    StrBuf sb; sb_init(&sb);
+    jb_arr_start(&sb);
+    for (int i = 0; i < g_bot.command_count; i++) {
+        SlashCommand *cmd = &g_bot.commands[i];
+        /* Skip subcommand entries (name contains '/') */
+        if (strchr(cmd->name, '/')) continue;
+
+        int cmd_type = command_type_of(cmd);
+        jb_obj_start(&sb);
+        jb_str(&sb, "name", cmd->name);
+        jb_int(&sb, "type", cmd_type);
+        /* Context menus don't need description */
+        if (cmd_type == 1) {
+            jb_str(&sb, "description", cmd->description);
+        }
+        if (cmd_type == 1 && cmd->option_count > 0) {
+            jb_key(&sb, "options"); jb_arr_start(&sb);
+            for (int j = 0; j < cmd->option_count; j++) {
+                jb_obj_start(&sb);
+                jb_str(&sb, "name", cmd->options[j].name);
+                jb_str(&sb, "description", cmd->options[j].description);
+                jb_int(&sb, "type", cmd->options[j].type);
+                jb_bool(&sb, "required", cmd->options[j].required);
+                jb_obj_end(&sb); sb_append_char(&sb, ',');
+            }
+            jb_arr_end(&sb); sb_append_char(&sb, ',');
+        }
+        jb_obj_end(&sb); sb_append_char(&sb, ',');
+    }
+    jb_arr_end(&sb);
+    return sb_detach(&sb);
+}
+
+static const char *command_cache_path(void) {
+    const char *p = getenv("DISCORD_COMMAND_CACHE");
+    return (p && p[0]) ? p : COMMAND_CACHE_DEFAULT;
+}
+
+/* Cache line: "<application_id> <scope> <sha256>" (scope = "global" or guild ID) */
+static bool command_cache_lookup(const char *scope, char *hash_out, size_t cap) {
+    FILE *fp = fopen(command_cache_path(), "r");
+    if (!fp) return false;
+    char app[MAX_SNOWFLAKE], sc[MAX_SNOWFLAKE], hash[80];
+    bool found = false;
+    while (fscanf(fp, "%23s %23s %79s", app, sc, hash) == 3) {
+        if (strcmp(app, g_bot.application_id) == 0 && strcmp(sc, scope) == 0) {
+            snprintf(hash_out, cap, "%s", hash);
+            found = true;
+        }
+    }
+    fclose(fp);
+    return found;
+}
+
+static void command_cache_store(const char *scope, const char *hash) {
+    const char *path = command_cache_path();
+    StrBuf sb; sb_init(&sb);
+    FILE *fp = fopen(path, "r");
+    if (fp) {
+        char app[MAX_SNOWFLAKE], sc[MAX_SNOWFLAKE], h[80];
+        while (fscanf(fp, "%23s %23s %79s", app, sc, h) == 3) {
+            if (strcmp(app, g_bot.application_id) == 0 && strcmp(sc, scope) == 0) continue;
+            sb_appendf(&sb, "%s %s %s\n", app, sc, h);
+        }
+        fclose(fp);
+    }
+    sb_appendf(&sb, "%s %s %s\n", g_bot.application_id, scope, hash);
+    fp = fopen(path, "w");
+    if (fp) {
+        fputs(sb.data, fp);
+        fclose(fp);
+    } else {
+        LOG_W("コマンドキャッシュを書き込めません: %s", path);
+    }
+    sb_free(&sb);
+}
+
+/* Match the remote command list against local definitions and copy IDs.
+ * strict: 名前・種類・説明・オプション数がすべて一致しなければ false */
+static bool command_apply_remote(JsonNode *arr, bool strict) {
+    if (!arr || arr->type != JSON_ARRAY) return false;
+    int local = 0;
+    for (int i = 0; i < g_bot.command_count; i++) {
+        SlashCommand *cmd = &g_bot.commands[i];
+        if (strchr(cmd->name, '/')) continue;
+        local++;
+        int cmd_type = command_type_of(cmd);
+        JsonNode *match = NULL;
+        for (int k = 0; k < arr->arr.count; k++) {
+            JsonNode *rc = &arr->arr.items[k];
+            const char *name = json_get_str(rc, "name");
+            if (name && strcmp(name, cmd->name) == 0 &&
+                (int)json_get_num(rc, "type") == cmd_type) { match = rc; break; }
+        }
+        if (!match) {
+            if (strict) return false;
+            continue;
+        }
+        if (strict && cmd_type == 1) {
+            const char *desc = json_get_str(match, "description");
+            JsonNode *opts = json_get(match, "options");
+            int remote_opts = (opts && opts->type == JSON_ARRAY) ? opts->arr.count : 0;
+            if (!desc || strcmp(desc, cmd->description) != 0 ||
+                remote_opts != (cmd->option_count > 0 ? cmd->option_count : 0)) return false;
+        }
+        const char *cmd_id = json_get_str(match, "id");
+        if (cmd_id) snprintf(cmd->registered_id, MAX_SNOWFLAKE, "%s", cmd_id);
+    }
+    if (strict && arr->arr.count != local) return false;
+    for (int i = 0; i < g_bot.command_count; i++) g_bot.commands[i].registered = true;
+    return true;
+}
+
+/* Register slash commands with Discord API */
+static void register_slash_commands(void) {
+    if (!g_bot.application_id[0]) {
+        LOG_E("Application IDが不明です。スラッシュコマンドを登録できません");
+        return;
+    }
+
+    char *defs = command_definitions_json();
+    unsigned char digest[SHA256_DIGEST_LENGTH];
+    SHA256((const unsigned char *)defs, strlen(defs), digest);
+    char hash[SHA256_DIGEST_LENGTH * 2 + 1];
+    for (int i = 0; i < SHA256_DIGEST_LENGTH; i++) sprintf(hash + i * 2, "%02x", digest[i]);
+
+    const char *scope = g_bot.command_guild_id[0] ? g_bot.command_guild_id : "global";
+    char endpoint[256];
+    if (g_bot.command_guild_id[0])
+        snprintf(endpoint, sizeof(endpoint), "/applications/%s/guilds/%s/commands",
+                 g_bot.application_id, g_bot.command_guild_id);
+    else
+        snprintf(endpoint, sizeof(endpoint), "/applications/%s/commands", g_bot.application_id);
+
+    /* Step 1: ハッシュが一致すれば GET 1回で確認して終了 */
+    char cached[80];
+    if (command_cache_lookup(scope, cached, sizeof(cached)) && strcmp(cached, hash) == 0) {
+        long code = 0;
+        JsonNode *remote = discord_rest("GET", endpoint, NULL, &code);
+        bool same = remote && code == 200 && command_apply_remote(remote, true);
+        if (remote) { json_free(remote); free(remote); }
+        if (same) {
+            LOG_I("コマンド定義に変更なし — 登録をスキップ (%s)", scope);
+            free(defs);
+            return;
+        }
+        LOG_I("Discord 側のコマンド定義が異なるため再登録します");
+    }
+
+    /* Step 2: 一括上書き */
+    long code = 0;
+    JsonNode *resp = discord_rest("PUT", endpoint, defs, &code);
+    if (resp && code == 200) {
+        command_apply_remote(resp, false);
+        command_cache_store(scope, hash);
+        LOG_I("コマンド一括登録: %d件 (%s)",
+              resp->type == JSON_ARRAY ? resp->arr.count : 0, scope);
+    } else {
+        LOG_E("コマンド一括登録失敗 (HTTP %ld)", code);
+    }
+    if (resp) { json_free(resp); free(resp); }
+    free(defs);
+}
+
+/* Main gateway loop */
+static void *gateway_thread_func(void *arg) {
+    (void)arg;
+
+    while (g_bot.running && !g_shutdown) {
+        /* Determine gateway host */
+        const char *host = DISCORD_GATEWAY_HOST;
+        const char *path = DISCORD_GATEWAY_PATH;
+        int port = DISCORD_GATEWAY_PORT;
+
+        /* Use resume URL if available */
+        char resume_host[256] = {0};
+        char resume_path[512] = {0};
+        if (g_bot.resume_url[0]) {
+            /* Parse wss://host/?... */
+            const char *h = strstr(g_bot.resume_url, "wss://");
+            if (h) {
+                h += 6;
+                const char *p = strchr(h, '/');
+                if (p) {
+                    int hlen = (int)(p - h);
+                    snprintf(resume_host, sizeof(resume_host), "%.*s", hlen, h);
+                    snprintf(resume_path, sizeof(resume_path), "%s", p);
+                    host = resume_host;
+                    path = resume_path;
+                }
+            }
+        }
+
+        LOG_I("Gatewayに接続中... (%s)", host);
+        if (ws_connect(&g_bot.ws, host, port, path) < 0) {
+            LOG_E("Gateway接続失敗。5秒後に再試行...");
+            Value err_msg = hajimu_string("Gateway接続失敗");
+            event_fire("エラー", 1, &err_msg);
+            event_fire("ERROR", 1, &err_msg);
+            sleep(5);
+            continue;
+        }
+
+        /* Read messages until disconnected */
+        while (g_bot.running && !g_shutdown && g_bot.ws.connected) {
+            char *msg = ws_read_message(&g_bot.ws);
+            if (!msg) {
+                if (g_bot.running && !g_shutdown) {
+                    LOG_W("Gateway接続が切断されました。再接続します...");
+                    Value disc_msg = hajimu_string("Gateway切断");
+                    event_fire("切断", 1, &disc_msg);
+                    event_fire("DISCONNECT", 1, &disc_msg);
+                    ws_close(&g_bot.ws);
+                }
+                break;
+            }
+            gw_process_message(msg);
+            free(msg);
+
+            /* After READY, register slash commands */
+            if (g_bot.gateway_ready && g_bot.command_count > 0) {
+                static bool commands_registered = false;
+                if (!commands_registered) {
+                    register_slash_commands();
+                    commands_registered = true;
+                }
+            }
+        }
+
+        if (g_bot.running && !g_shutdown) {
+            LOG_I("2秒後にGateway再接続...");
+            Value reconn_msg = hajimu_string("再接続中");
+            event_fire("再接続", 1, &reconn_msg);
+            event_fire("RECONNECT", 1, &reconn_msg);
+            sleep(2);
+        }
+    }
+
+    ws_close(&g_bot.ws);
+    LOG_I("Gatewayスレッド終了");
+    return NULL;
+}
+
+/* =========================================================================
+ * Section 13.5: Voice Channel System (v2.0.0)
+ * ========================================================================= */
+
+/* --- Voice Connection Management --- */
+
+static VoiceConn *voice_find(const char *guild_id) {
+    if (!guild_id || g_bot.voice_conn_count == 0) return NULL;
+    for (int i = 0; i < MAX_VOICE_CONNS; i++) {
+        if (g_bot.voice_conns[i].active &&
+            strcmp(g_bot.voice_conns[i].guild_id, guild_id) == 0)
+            return &g_bot.voice_conns[i];
+    }
+    return NULL;
+}
+
+static VoiceConn *voice_alloc(const char *guild_id) {
+    if (!guild_id) return NULL;
+    /* Check existing */
+    VoiceConn *vc = voice_find(guild_id);
+    if (vc) return vc;
+    /* Find free slot — 接続は動かさない (スレッドが VoiceConn * を持ち続けるため) */
+    for (int i = 0; i < MAX_VOICE_CONNS && !vc; i++) {
+        if (!g_bot.voice_conns[i].active) vc = &g_bot.voice_conns[i];
+    }
+    if (!vc) {
+        LOG_E("ボイス接続上限(%d)に達しました", MAX_VOICE_CONNS);
+        return NULL;
+    }
+    g_bot.voice_conn_count++;
+    memset(vc, 0, sizeof(*vc));
+    snprintf(vc->guild_id, sizeof(vc->guild_id), "%s", guild_id);
+    vc->active = true;
+    vc->vws.fd = -1;
+    vc->udp_fd = -1;
+    vc->sender_id = -1;
+    vc->ring.limit = VOICE_RING_DEFAULT_MS / VOICE_FRAME_MS;
+    vc->ring.low_water = UINT32_MAX;
+    vc->gain_target = vc->gain_cur = 4096;   /* VOICE_GAIN_ONE */
+    vc->limiter = true;
+    pthread_mutex_init(&vc->voice_mutex, NULL);
+    pthread_cond_init(&vc->voice_cond, NULL);
+    return vc;
+}
+
+/* Wake the producer out of its idle wait (queue / effects / done / close). */
+static void voice_wake(VoiceConn *vc) {
+    pthread_mutex_lock(&vc->voice_mutex);
+    pthread_cond_signal(&vc->voice_cond);
+    pthread_mutex_unlock(&vc->voice_mutex);
+}
+
+static void voice_free(VoiceConn *vc) {
+    if (!vc || !vc->active) return;
+
+    vc->stop_requested = true;
+    vc->playing = false;
+    voice_wake(vc);
+
+    /* Take it off the sender wheel — waits for a tick in progress */
+    voice_sender_detach(vc);
+    voice_recv_stop(vc);
+    if (vc->cast) {
+        __atomic_fetch_sub(&vc->cast->subscribers, 1, __ATOMIC_RELAXED);
+        vc->cast = NULL;
+    }
+    free(vc->cast_pkt);
+    vc->cast_pkt = NULL;
+
+    /* Signal voice_ws_thread to exit (it checks stop_requested with 1s timeout) */
+    /* Do NOT call ws_close here — the voice_ws_thread is still using the SSL
+       connection. It will exit within 1 second via the stop_requested flag. */
+
+    /* Wait for threads to exit first (they'll see stop_requested) */
+    if (vc->voice_ws_thread) {
+        pthread_join(vc->voice_ws_thread, NULL);
+        vc->voice_ws_thread = 0;
+    }
+    if (vc->audio_thread) {
+        pthread_join(vc->audio_thread, NULL);
+        vc->audio_thread = 0;
+    }
+    voice_prefetch_cancel(vc->prefetch);
+    vc->prefetch = NULL;
+
+    /* Now safe to clean up resources — no threads are using them */
+    if (vc->vws.connected) {
+        if (vc->speaking) voice_send_speaking(vc, false);
+        ws_close(&vc->vws);
+    }
+
+    /* Close UDP socket */
+    if (vc->udp_fd >= 0) {
+        close(vc->udp_fd);
+        vc->udp_fd = -1;
+    }
+
+    /* Destroy Opus encoder */
+    if (vc->opus_enc) {
+        opus_encoder_destroy(vc->opus_enc);
+        vc->opus_enc = NULL;
+    }
+    if (vc->opus_dec) {
+        opus_decoder_destroy(vc->opus_dec);
+        vc->opus_dec = NULL;
+    }
+    for (int i = 0; i < VOICE_MAX_MIX; i++) {
+        VoiceMixSource *m = &vc->mix[i];
+        if (!m->open) continue;
+        pcm_source_close(&m->src);
+        m->open = false;
+    }
+    free(vc->ring.slots);
+    vc->ring.slots = NULL;
+
+    pthread_cond_destroy(&vc->voice_cond);
+    pthread_mutex_destroy(&vc->voice_mutex);
+    vc->active = false;
+    g_bot.voice_conn_count--;
+}
+
+/* --- Voice WebSocket (separate from main Gateway) --- */
+
+/* Connect to voice WebSocket (no zlib decompression needed) */
+static int voice_ws_connect_raw(WsConn *ws, const char *host, int port, const char *path) {
+    struct addrinfo hints = {0}, *res = NULL;
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+    char port_str[8];
+    snprintf(port_str, sizeof(port_str), "%d", port);
+
+    if (getaddrinfo(host, port_str, &hints, &res) != 0) {
+        LOG_E("Voice DNS解決失敗: %s", host);
+        return -1;
+    }
+
+    ws->fd = socket(res->ai_family, res->ai_socktype, res->ai_protocol);
+    if (ws->fd < 0) {
+        freeaddrinfo(res);
+        return -1;
+    }
+
+    sock_set_timeout(ws->fd, 10);
+
+    if (connect(ws->fd, res->ai_addr, res->ai_addrlen) < 0) {
+        freeaddrinfo(res);
+        close(ws->fd); ws->fd = -1;
+        return -1;
+    }
+    freeaddrinfo(res);
+
+    ws->ssl_ctx = SSL_CTX_new(TLS_client_method());
+    if (!ws->ssl_ctx) { close(ws->fd); ws->fd = -1; return -1; }
+    SSL_CTX_set_verify(ws->ssl_ctx, SSL_VERIFY_PEER, NULL);
+    SSL_CTX_set_default_verify_paths(ws->ssl_ctx);
+#ifdef _WIN32
+    load_windows_ca_store(ws->ssl_ctx);
+#endif
+
+    ws->ssl = SSL_new(ws->ssl_ctx);
+    SSL_set_fd(ws->ssl, ws->fd);
+    SSL_set_tlsext_host_name(ws->ssl, host);
+
+    if (SSL_connect(ws->ssl) <= 0) {
+        SSL_free(ws->ssl); ws->ssl = NULL;
+        SSL_CTX_free(ws->ssl_ctx); ws->ssl_ctx = NULL;
+        close(ws->fd); ws->fd = -1;
+        return -1;
+    }
+
+    /* WebSocket upgrade handshake */
+    uint8_t nonce[16];
+    RAND_bytes(nonce, 16);
+    char *ws_key = base64_encode(nonce, 16);
+
+    char req[2048];
+    int req_len = snprintf(req, sizeof(req),
+        "GET %s HTTP/1.1\r\n"
+        "Host: %s\r\n"
+        "Upgrade: websocket\r\n"
+        "Connection: Upgrade\r\n"
+        "Sec-WebSocket-Key: %s\r\n"
+        "Sec-WebSocket-Version: 13\r\n"
+        "\r\n",
+        path, host, ws_key);
+    free(ws_key);
+
+    if (SSL_write(ws->ssl, req, req_len) <= 0) goto vws_fail;
+
+    char resp[4096];
+    int rlen = SSL_read(ws->ssl, resp, sizeof(resp) - 1);
+    if (rlen <= 0) goto vws_fail;
+    resp[rlen] = '\0';
+    if (!strstr(resp, "101")) goto vws_fail;
+
+    /* Voice WS does NOT use zlib */
+    ws->zlib_init = false;
+    ws->connected = true;
+    LOG_I("Voice WebSocket接続成功: %s", host);
+    return 0;
+
+vws_fail:
+    if (ws->ssl) { SSL_free(ws->ssl); ws->ssl = NULL; }
+    if (ws->ssl_ctx) { SSL_CTX_free(ws->ssl_ctx); ws->ssl_ctx = NULL; }
+    close(ws->fd); ws->fd = -1;
+    return -1;
+}
+
+/* Read voice WS message (no zlib, plain text frames only) */
+static char *voice_ws_read(WsConn *ws) {
+    if (!ws->connected || !ws->ssl) return NULL;
+
+    StrBuf raw; sb_init(&raw);
+    bool final = false;
+    int msg_opcode = 0;
+
+    while (!final) {
+        uint8_t hdr[2];
+        int r = SSL_read(ws->ssl, hdr, 2);
+        if (r <= 0) { sb_free(&raw); return NULL; }
+
+        final = (hdr[0] & 0x80) != 0;
+        int opcode = hdr[0] & 0x0F;
+        if (opcode != 0) msg_opcode = opcode;
+        bool masked = (hdr[1] & 0x80) != 0;
+        uint64_t payload_len = hdr[1] & 0x7F;
+
+        if (payload_len == 126) {
+            uint8_t ext[2];
+            if (SSL_read(ws->ssl, ext, 2) < 2) { sb_free(&raw); return NULL; }
+            payload_len = ((uint64_t)ext[0] << 8) | ext[1];
+        } else if (payload_len == 127) {
+            uint8_t ext[8];
+            if (SSL_read(ws->ssl, ext, 8) < 8) { sb_free(&raw); return NULL; }
+            payload_len = 0;
+            for (int i = 0; i < 8; i++) payload_len = (payload_len << 8) | ext[i];
+        }
+
+        uint8_t mask_key[4] = {0};
+        if (masked) {
+            if (SSL_read(ws->ssl, mask_key, 4) < 4) { sb_free(&raw); return NULL; }
+        }
+
+        if (payload_len > 0) {
+            if (payload_len > 16 * 1024 * 1024) { sb_free(&raw); return NULL; }
+            uint8_t *buf = (uint8_t *)malloc((size_t)payload_len);
+            if (!buf) { sb_free(&raw); return NULL; }
+            uint64_t total = 0;
+            while (total < payload_len) {
+                int chunk = (int)(payload_len - total);
+                if (chunk > 4096) chunk = 4096;
+                r = SSL_read(ws->ssl, buf + total, chunk);
+                if (r <= 0) { free(buf); sb_free(&raw); return NULL; }
+                total += r;
+            }
+            if (masked) {
+                for (uint64_t i = 0; i < payload_len; i++)
+                    buf[i] ^= mask_key[i & 3];
+            }
+            sb_appendn(&raw, (char *)buf, (int)payload_len);
+            free(buf);
+        }
+
+        if (msg_opcode == WS_OP_PING) {
+            ws_send_pong(ws, (uint8_t *)raw.data, raw.len);
+            sb_free(&raw); sb_init(&raw);
+            final = false;
+            continue;
+        }
+        if (msg_opcode == WS_OP_CLOSE) {
+            sb_free(&raw);
+            return NULL;
+        }
+    }
+
+    sb_append_char(&raw, '\0');
+    return sb_detach(&raw);
+}
+
+/* Send voice identify (op 0) */
+static void voice_send_identify(VoiceConn *vc) {
+    StrBuf sb; sb_init(&sb);
+    jb_obj_start(&sb);
+    jb_int(&sb, "op", 0);
+    jb_key(&sb, "d"); jb_obj_start(&sb);
+    jb_str(&sb, "server_id", vc->guild_id);
+    jb_str(&sb, "user_id", g_bot.bot_id);
+    jb_str(&sb, "session_id", vc->session_id);
+    jb_str(&sb, "token", vc->voice_token);
+    jb_obj_end(&sb); sb_append_char(&sb, ',');
+    jb_obj_end(&sb);
+    ws_send_text(&vc->vws, sb.data, sb.len);
+    sb_free(&sb);
+    LOG_I("Voice IDENTIFY送信 (guild=%s)", vc->guild_id);
+}
+
+/* Send voice select protocol (op 1) */
+static void voice_send_select_protocol(VoiceConn *vc) {
+    StrBuf sb; sb_init(&sb);
+    jb_obj_start(&sb);
+    jb_int(&sb, "op", 1);
+    jb_key(&sb, "d"); jb_obj_start(&sb);
+    jb_str(&sb, "protocol", "udp");
+    jb_key(&sb, "data"); jb_obj_start(&sb);
+    jb_str(&sb, "address", vc->external_ip);
+    jb_int(&sb, "port", vc->external_port);
+    jb_str(&sb, "mode", "aead_xchacha20_poly1305_rtpsize");
+    jb_obj_end(&sb); sb_append_char(&sb, ',');
+    jb_obj_end(&sb); sb_append_char(&sb, ',');
+    jb_obj_end(&sb);
+    ws_send_text(&vc->vws, sb.data, sb.len);
+    sb_free(&sb);
+    LOG_I("Voice SELECT_PROTOCOL送信 (ip=%s, port=%d)", vc->external_ip, vc->external_port);
+}
+
+/* Send voice heartbeat (op 3) */
+static void voice_send_heartbeat(VoiceConn *vc) {
+    /* Voice heartbeat uses a nonce (timestamp) */
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    uint64_t nonce = (uint64_t)ts.tv_sec * 1000 + (uint64_t)ts.tv_nsec / 1000000;
+
+    char buf[64];
+    snprintf(buf, sizeof(buf), "{\"op\":3,\"d\":%llu}", (unsigned long long)nonce);
+    ws_send_text(&vc->vws, buf, (int)strlen(buf));
+    vc->voice_heartbeat_acked = false;
+}
+
+/* Send voice speaking (op 5) */
+static void voice_send_speaking(VoiceConn *vc, bool speaking) {
+    StrBuf sb; sb_init(&sb);
+    jb_obj_start(&sb);
+    jb_int(&sb, "op", 5);
+    jb_key(&sb, "d"); jb_obj_start(&sb);
+    jb_int(&sb, "speaking", speaking ? 1 : 0);
+    jb_int(&sb, "delay", 0);
+    jb_int(&sb, "ssrc", (int64_t)vc->ssrc);
+    jb_obj_end(&sb); sb_append_char(&sb, ',');
+    jb_obj_end(&sb);
+    ws_send_text(&vc->vws, sb.data, sb.len);
+    sb_free(&sb);
+}
+
+/* SSRC ↔ user map fed by the voice WS (op 5 SPEAKING / op 13 CLIENT_DISCONNECT).
+ * 受信した RTP の話者をユーザーIDに変換するのに使う。 */
+static void voice_speaker_set(VoiceConn *vc, uint32_t ssrc, const char *user_id) {
+    if (!ssrc || !user_id) return;
+    pthread_mutex_lock(&vc->voice_mutex);
+    VoiceSpeaker *slot = NULL;
+    for (int i = 0; i < VOICE_RECV_STREAMS; i++) {
+        VoiceSpeaker *sp = &vc->speakers[i];
+        if (sp->ssrc == ssrc || (sp->ssrc && strcmp(sp->user_id, user_id) == 0)) {
+            slot = sp;
+            break;
+        }
+        if (!sp->ssrc && !slot) slot = sp;
+    }
+    if (slot) {
+        slot->ssrc = ssrc;
+        snprintf(slot->user_id, sizeof(slot->user_id), "%s", user_id);
+    }
+    pthread_mutex_unlock(&vc->voice_mutex);
+}
+
+static void voice_speaker_remove(VoiceConn *vc, const char *user_id) {
+    if (!user_id) return;
+    pthread_mutex_lock(&vc->voice_mutex);
+    for (int i = 0; i < VOICE_RECV_STREAMS; i++) {
+        if (vc->speakers[i].ssrc && strcmp(vc->speakers[i].user_id, user_id) == 0)
+            vc->speakers[i].ssrc = 0;
+    }
+    pthread_mutex_unlock(&vc->voice_mutex);
+}
+
+/* User ID for an SSRC, or "" while no SPEAKING has named it yet. */
+static void voice_speaker_user(VoiceConn *vc, uint32_t ssrc, char *out, size_t cap) {
+    out[0] = '\0';
+    pthread_mutex_lock(&vc->voice_mutex);
+    for (int i = 0; i < VOICE_RECV_STREAMS; i++) {
+        if (vc->speakers[i].ssrc == ssrc) {
+            snprintf(out, cap, "%s", vc->speakers[i].user_id);
+            break;
+        }
+    }
+    pthread_mutex_unlock(&vc->voice_mutex);
+}
+
+/* --- UDP IP Discovery --- */
+
+static int voice_ip_discovery(VoiceConn *vc) {
+    /* Create UDP socket */
+    vc->udp_fd = socket(AF_INET, SOCK_DGRAM, 0);
+    if (vc->udp_fd < 0) {
+        LOG_E("Voice UDPソケット作成失敗");
+        return -1;
+    }
+
+    memset(&vc->udp_addr, 0, sizeof(vc->udp_addr));
+    vc->udp_addr.sin_family = AF_INET;
+    vc->udp_addr.sin_port = htons((uint16_t)vc->voice_port);
+    inet_pton(AF_INET, vc->voice_ip, &vc->udp_addr.sin_addr);
+
+    /* Set timeout */
+    sock_set_rcvtimeo(vc->udp_fd, 5);
+
+    /* Send 74-byte IP Discovery packet:
+     * Type (2) = 0x0001, Length (2) = 70, SSRC (4), Address (64), Port (2) */
+    uint8_t disc_pkt[74];
+    memset(disc_pkt, 0, sizeof(disc_pkt));
+    disc_pkt[0] = 0x00; disc_pkt[1] = 0x01; /* Type: Request */
+    disc_pkt[2] = 0x00; disc_pkt[3] = 70;   /* Length: 70 */
+    disc_pkt[4] = (vc->ssrc >> 24) & 0xFF;
+    disc_pkt[5] = (vc->ssrc >> 16) & 0xFF;
+    disc_pkt[6] = (vc->ssrc >> 8) & 0xFF;
+    disc_pkt[7] = vc->ssrc & 0xFF;
+
+    ssize_t sent = sendto(vc->udp_fd, disc_pkt, sizeof(disc_pkt), 0,
+                          (struct sockaddr *)&vc->udp_addr, sizeof(vc->udp_addr));
+    if (sent != sizeof(disc_pkt)) {
+        LOG_E("Voice IP Discovery送信失敗");
+        return -1;
+    }
+
+    /* Receive response: same 74-byte format with our external IP+port filled in */
+    uint8_t resp[256];
+    socklen_t addr_len = sizeof(vc->udp_addr);
+    ssize_t rcvd = -1;
+    /* Retry up to 3 times (Discord may drop first packet) */
+    for (int attempt = 0; attempt < 3 && rcvd < 8; attempt++) {
+        if (attempt > 0) {
+            LOG_I("Voice IP Discovery リトライ (%d/3)", attempt + 1);
+            /* Resend discovery packet */
+            sendto(vc->udp_fd, disc_pkt, sizeof(disc_pkt), 0,
+                   (struct sockaddr *)&vc->udp_addr, sizeof(vc->udp_addr));
         }
-    } else if (strcmp(event_name, "AUTO_MODERATION_ACTION_EXECUTION") == 0) {
-        event_fire("自動モデレーション実行", 1, &val);
-    } else if (strcmp(event_name, "GUILD_SCHEDULED_EVENT_CREATE") == 0) {
-        event_fire("イベント作成", 1, &val);
-    } else if (strcmp(event_name, "GUILD_SCHEDULED_EVENT_UPDATE") == 0) {
-        event_fire("イベント更新", 1, &val);
-    } else if (strcmp(event_name, "GUILD_SCHEDULED_EVENT_DELETE") == 0) {
-        event_fire("イベント削除", 1, &val);
-    } else if (strcmp(event_name, "RESUMED") == 0) {
-        event_fire("再接続完了", 1, &val);
-        LOG_I("セッション再開完了");
+        rcvd = recvfrom(vc->udp_fd, resp, sizeof(resp), 0,
+                        (struct sockaddr *)&vc->udp_addr, &addr_len);
+        if (rcvd >= 8) break;
+        LOG_I("Voice IP Discovery recvfrom: %zd (errno=%d: %s)", rcvd, errno, strerror(errno));
     }
-    /* v2.3.0: 追加イベント — discord.js/discord.py 互換 */
-    else if (strcmp(event_name, "CHANNEL_UPDATE") == 0) {
-        event_fire("チャンネル更新", 1, &val);
-    } else if (strcmp(event_name, "CHANNEL_PINS_UPDATE") == 0) {
-        event_fire("ピン更新", 1, &val);
-    } else if (strcmp(event_name, "GUILD_UPDATE") == 0) {
-        event_fire("サーバー更新", 1, &val);
-    } else if (strcmp(event_name, "GUILD_BAN_ADD") == 0) {
-        event_fire("BAN追加", 1, &val);
-    } else if (strcmp(event_name, "GUILD_BAN_REMOVE") == 0) {
-        event_fire("BAN削除", 1, &val);
-    } else if (strcmp(event_name, "GUILD_EMOJIS_UPDATE") == 0) {
-        event_fire("絵文字更新", 1, &val);
-    } else if (strcmp(event_name, "GUILD_STICKERS_UPDATE") == 0) {
-        event_fire("スタンプ更新", 1, &val);
-    } else if (strcmp(event_name, "GUILD_MEMBER_UPDATE") == 0) {
-        event_fire("メンバー更新", 1, &val);
-    } else if (strcmp(event_name, "GUILD_ROLE_CREATE") == 0) {
-        event_fire("ロール作成", 1, &val);
-    } else if (strcmp(event_name, "GUILD_ROLE_UPDATE") == 0) {
-        event_fire("ロール更新", 1, &val);
-    } else if (strcmp(event_name, "GUILD_ROLE_DELETE") == 0) {
-        event_fire("ロール削除", 1, &val);
-    } else if (strcmp(event_name, "GUILD_INTEGRATIONS_UPDATE") == 0) {
-        event_fire("インテグレーション更新", 1, &val);
-    } else if (strcmp(event_name, "INVITE_CREATE") == 0) {
-        event_fire("招待作成", 1, &val);
-    } else if (strcmp(event_name, "INVITE_DELETE") == 0) {
-        event_fire("招待削除", 1, &val);
-    } else if (strcmp(event_name, "MESSAGE_DELETE_BULK") == 0) {
-        event_fire("メッセージ一括削除", 1, &val);
-    } else if (strcmp(event_name, "THREAD_CREATE") == 0) {
-        event_fire("スレッド作成", 1, &val);
-    } else if (strcmp(event_name, "THREAD_UPDATE") == 0) {
-        event_fire("スレッド更新", 1, &val);
-    } else if (strcmp(event_name, "THREAD_DELETE") == 0) {
-        event_fire("スレッド削除", 1, &val);
-    } else if (strcmp(event_name, "THREAD_LIST_SYNC") == 0) {
-        event_fire("スレッド同期", 1, &val);
-    } else if (strcmp(event_name, "THREAD_MEMBER_UPDATE") == 0) {
-        event_fire("スレッドメンバー更新", 1, &val);
-    } else if (strcmp(event_name, "THREAD_MEMBERS_UPDATE") == 0) {
-        event_fire("スレッドメンバーズ更新", 1, &val);
-    } else if (strcmp(event_name, "WEBHOOKS_UPDATE") == 0) {
-        event_fire("Webhook更新", 1, &val);
-    } else if (strcmp(event_name, "STAGE_INSTANCE_CREATE") == 0) {
-        event_fire("ステージ開始", 1, &val);
-    } else if (strcmp(event_name, "STAGE_INSTANCE_UPDATE") == 0) {
-        event_fire("ステージ更新", 1, &val);
-    } else if (strcmp(event_name, "STAGE_INSTANCE_DELETE") == 0) {
-        event_fire("ステージ終了", 1, &val);
-    } else if (strcmp(event_name, "GUILD_SCHEDULED_EVENT_USER_ADD") == 0) {
-        event_fire("イベント参加", 1, &val);
-    } else if (strcmp(event_name, "GUILD_SCHEDULED_EVENT_USER_REMOVE") == 0) {
-        event_fire("イベント退出", 1, &val);
-    } else if (strcmp(event_name, "MESSAGE_POLL_VOTE_ADD") == 0) {
-        event_fire("投票追加", 1, &val);
-    } else if (strcmp(event_name, "MESSAGE_POLL_VOTE_REMOVE") == 0) {
-        event_fire("投票削除", 1, &val);
-    } else if (strcmp(event_name, "ENTITLEMENT_CREATE") == 0) {
-        event_fire("エンタイトルメント作成", 1, &val);
-    } else if (strcmp(event_name, "ENTITLEMENT_UPDATE") == 0) {
-        event_fire("エンタイトルメント更新", 1, &val);
-    } else if (strcmp(event_name, "ENTITLEMENT_DELETE") == 0) {
-        event_fire("エンタイトルメント削除", 1, &val);
-    } else if (strcmp(event_name, "AUTO_MODERATION_RULE_CREATE") == 0) {
-        event_fire("自動モデレーションルール作成", 1, &val);
-    } else if (strcmp(event_name, "AUTO_MODERATION_RULE_UPDATE") == 0) {
-        event_fire("自動モデレーションルール更新", 1, &val);
-    } else if (strcmp(event_name, "AUTO_MODERATION_RULE_DELETE") == 0) {
-        event_fire("自動モデレーションルール削除", 1, &val);
+    if (rcvd < 8) {
+        LOG_E("Voice IP Discovery応答不正 (%zd bytes, errno=%d: %s)", rcvd, errno, strerror(errno));
+        return -1;
     }
+
+    /* Extract IP (bytes 8..71) and port (last 2 bytes, big-endian) */
+    snprintf(vc->external_ip, sizeof(vc->external_ip), "%s", (char *)&resp[8]);
+    vc->external_port = ((uint16_t)resp[rcvd - 2] << 8) | resp[rcvd - 1];
+
+    LOG_I("Voice IP Discovery完了: %s:%d", vc->external_ip, vc->external_port);
+    return 0;
 }
 
-/* Process one gateway message */
-static void gw_process_message(const char *json_text) {
-    if (!json_text) return;
-    LOG_D("GW受信: %.200s", json_text);
+/* --- Voice WebSocket Thread --- */
 
-    JsonNode *root = json_parse(json_text);
-    if (!root) return;
+static void *voice_ws_thread_func(void *arg) {
+    VoiceConn *vc = (VoiceConn *)arg;
 
-    int op = (int)json_get_num(root, "op");
-    JsonNode *d = json_get(root, "d");
+    /* Parse endpoint: remove port suffix, strip wss:// if present */
+    char host[256] = {0};
+    snprintf(host, sizeof(host), "%s", vc->endpoint);
 
-    /* Update sequence number */
-    JsonNode *s_node = json_get(root, "s");
-    if (s_node && s_node->type == JSON_NUMBER) {
-        g_bot.last_seq = (int)s_node->number;
+    /* Extract port if present, otherwise default to 443 */
+    int ws_port = 443;
+    char *colon = strrchr(host, ':');
+    if (colon) {
+        ws_port = atoi(colon + 1);
+        if (ws_port <= 0 || ws_port > 65535) ws_port = 443;
+        *colon = '\0';
     }
 
-    switch (op) {
-        case GW_DISPATCH: {
-            const char *event_name = json_get_str(root, "t");
-            gw_handle_dispatch(event_name, d);
+    /* Build path */
+    char path[512];
+    snprintf(path, sizeof(path), "/?v=4");
+
+    LOG_I("Voice WebSocketに接続中... (%s:%d)", host, ws_port);
+    if (voice_ws_connect_raw(&vc->vws, host, ws_port, path) < 0) {
+        LOG_E("Voice WebSocket接続失敗");
+        return NULL;
+    }
+
+    /* Send IDENTIFY */
+    voice_send_identify(vc);
+
+    /* Read messages */
+    time_t last_heartbeat = time(NULL);
+
+    while (vc->active && vc->vws.connected && !g_shutdown && !vc->stop_requested) {
+        /* Set short read timeout for heartbeating */
+        sock_set_rcvtimeo(vc->vws.fd, 1);
+
+        char *msg = voice_ws_read(&vc->vws);
+        if (!msg) {
+            /* Check if it's just a timeout (not a disconnect request) */
+            if (vc->active && vc->vws.connected && !g_shutdown && !vc->stop_requested) {
+                /* Send heartbeat if interval elapsed */
+                if (vc->voice_heartbeat_interval > 0) {
+                    time_t now = time(NULL);
+                    if ((now - last_heartbeat) * 1000 >= vc->voice_heartbeat_interval) {
+                        voice_send_heartbeat(vc);
+                        last_heartbeat = now;
+                    }
+                }
+                continue;
+            }
             break;
         }
 
-        case GW_HEARTBEAT:
-            gw_send_heartbeat();
+        JsonNode *root = json_parse(msg);
+        if (!root) { free(msg); continue; }
+
+        int op = (int)json_get_num(root, "op");
+        JsonNode *d = json_get(root, "d");
+        LOG_I("Voice WS受信: op=%d, raw=%.200s", op, msg);
+
+        switch (op) {
+        case 8: { /* HELLO — get heartbeat_interval */
+            if (d) {
+                double hb = json_get_num(d, "heartbeat_interval");
+                vc->voice_heartbeat_interval = (int)hb;
+                LOG_I("Voice Heartbeat間隔: %dms", vc->voice_heartbeat_interval);
+                /* Send first heartbeat immediately */
+                voice_send_heartbeat(vc);
+                last_heartbeat = time(NULL);
+            }
             break;
+        }
+        case 2: { /* READY — get SSRC, IP, port */
+            if (d) {
+                vc->ssrc = (uint32_t)json_get_num(d, "ssrc");
+                const char *ip = json_get_str(d, "ip");
+                int port = (int)json_get_num(d, "port");
+                if (ip) snprintf(vc->voice_ip, sizeof(vc->voice_ip), "%s", ip);
+                vc->voice_port = port;
+                LOG_I("Voice READY: ssrc=%u, ip=%s, port=%d", vc->ssrc, vc->voice_ip, vc->voice_port);
 
-        case GW_RECONNECT:
-            LOG_I("サーバーから再接続要求を受信");
-            ws_close(&g_bot.ws);
-            break;
+                /* Log available modes */
+                JsonNode *modes = json_get(d, "modes");
+                if (modes && modes->type == JSON_ARRAY) {
+                    for (int mi = 0; mi < modes->arr.count && mi < 10; mi++) {
+                        if (modes->arr.items[mi].type == JSON_STRING)
+                            LOG_I("Voice mode[%d]: %s", mi, modes->arr.items[mi].str);
+                    }
+                }
 
-        case GW_INVALID_SESSION: {
-            bool resumable = (d && d->type == JSON_BOOL) ? d->boolean : false;
-            LOG_W("セッション無効 (再開可能=%s)", resumable ? "はい" : "いいえ");
-            if (!resumable) {
-                g_bot.session_id[0] = '\0';
-                g_bot.last_seq = 0;
+                /* Perform IP Discovery */
+                if (voice_ip_discovery(vc) == 0) {
+                    /* Send SELECT_PROTOCOL */
+                    voice_send_select_protocol(vc);
+                } else {
+                    LOG_E("Voice IP Discovery失敗");
+                }
             }
-            usleep(3000000); /* Wait 3 seconds as Discord recommends */
-            ws_close(&g_bot.ws);
             break;
         }
+        case 4: { /* SESSION_DESCRIPTION — get secret_key */
+            if (d) {
+                JsonNode *key_arr = json_get(d, "secret_key");
+                if (key_arr && key_arr->type == JSON_ARRAY) {
+                    int ki = 0;
+                    int kcount = key_arr->arr.count;
+                    if (kcount > 32) kcount = 32;
+                    for (ki = 0; ki < kcount; ki++) {
+                        vc->secret_key[ki] = (unsigned char)(int)key_arr->arr.items[ki].number;
+                    }
+                    vc->ready = true;
+                    LOG_I("Voice準備完了! (guild=%s)", vc->guild_id);
 
-        case GW_HELLO: {
-            g_bot.heartbeat_interval = (int)json_get_num(d, "heartbeat_interval");
-            LOG_I("HELLO受信 (heartbeat: %dms)", g_bot.heartbeat_interval);
-            g_bot.heartbeat_acked = true;
+                    /* Initialize Opus encoder */
+                    int err;
+                    vc->opus_enc = opus_encoder_create(VOICE_SAMPLE_RATE, VOICE_CHANNELS,
+                                                       OPUS_APPLICATION_AUDIO, &err);
+                    if (err != OPUS_OK || !vc->opus_enc) {
+                        LOG_E("Opusエンコーダー作成失敗: %s", opus_strerror(err));
+                        vc->ready = false;
+                    } else {
+                        opus_encoder_ctl(vc->opus_enc, OPUS_SET_BITRATE(128000));
+                        vc->bitrate = 128000;
+                        LOG_I("Opusエンコーダー初期化完了");
+                        voice_wake(vc);
+                    }
 
-            /* Send RESUME if we have a session, otherwise IDENTIFY */
-            if (g_bot.session_id[0]) {
-                gw_send_resume();
-            } else {
-                gw_send_identify();
+                    /* Fire voice ready event */
+                    Value guild_val = hajimu_string(vc->guild_id);
+                    event_fire("ボイス接続完了", 1, &guild_val);
+                    event_fire("VOICE_CONNECTED", 1, &guild_val);
+                }
             }
             break;
         }
-
-        case GW_HEARTBEAT_ACK:
-            g_bot.heartbeat_acked = true;
-            LOG_D("Heartbeat ACK受信");
+        case 5: { /* SPEAKING — another user's SSRC */
+            if (d) voice_speaker_set(vc, (uint32_t)json_get_num(d, "ssrc"),
+                                     json_get_str(d, "user_id"));
             break;
-
+        }
+        case 6: { /* HEARTBEAT_ACK */
+            vc->voice_heartbeat_acked = true;
+            break;
+        }
+        case 13: { /* CLIENT_DISCONNECT */
+            if (d) voice_speaker_remove(vc, json_get_str(d, "user_id"));
+            break;
+        }
         default:
-            LOG_D("不明なopcode: %d", op);
+            LOG_D("Voice WS未処理op: %d", op);
             break;
-    }
+        }
 
-    json_free(root);
-    free(root);
-}
+        json_free(root);
+        free(msg);
 
-/* Heartbeat thread */
-static void *heartbeat_thread_func(void *arg) {
-    (void)arg;
-    while (g_bot.running && !g_shutdown) {
-        if (g_bot.heartbeat_interval <= 0) {
-            usleep(100000);
-            continue;
+        /* Send heartbeat if needed */
+        if (vc->voice_heartbeat_interval > 0) {
+            time_t now = time(NULL);
+            if ((now - last_heartbeat) * 1000 >= vc->voice_heartbeat_interval) {
+                voice_send_heartbeat(vc);
+                last_heartbeat = now;
+            }
         }
+    }
 
-        /* Jitter: first heartbeat at random fraction of interval */
-        int wait_ms = g_bot.heartbeat_interval;
-        struct timespec ts;
-        ts.tv_sec = wait_ms / 1000;
-        ts.tv_nsec = (wait_ms % 1000) * 1000000L;
-        nanosleep(&ts, NULL);
+    LOG_I("Voice WebSocketスレッド終了 (guild=%s)", vc->guild_id);
+    return NULL;
+}
 
-        if (!g_bot.running || g_shutdown) break;
+/* --- Kick off voice WS after both gateway events received --- */
 
-        if (!g_bot.heartbeat_acked && g_bot.ws.connected) {
-            LOG_W("Heartbeat ACK未受信。接続が切断された可能性があります");
-            Value err_msg = hajimu_string("Heartbeat ACK未受信");
-            event_fire("エラー", 1, &err_msg);
-            event_fire("ERROR", 1, &err_msg);
-            ws_close(&g_bot.ws);
-            continue;
-        }
+static void voice_check_ready(VoiceConn *vc) {
+    if (!vc->state_received || !vc->server_received) return;
 
-        if (g_bot.ws.connected) {
-            gw_send_heartbeat();
-        }
-    }
-    return NULL;
+    LOG_I("Voice両イベント受信完了。Voice WSに接続開始...");
+    /* Start voice WebSocket thread */
+    pthread_create(&vc->voice_ws_thread, NULL, voice_ws_thread_func, vc);
 }
 
-/* Register slash commands with Discord API */
-static void register_slash_commands(void) {
-    if (!g_bot.application_id[0]) {
-        LOG_E("Application IDが不明です。スラッシュコマンドを登録できません");
-        return;
-    }
+/* --- Audio Playback Thread --- */
 
-    for (int i = 0; i < g_bot.command_count; i++) {
-        if (g_bot.commands[i].registered) continue;
+/* Validate filepath for safe shell use (reject shell metacharacters) */
+static bool voice_filepath_safe(const char *path) {
+    /* Reject empty paths */
+    if (!path || !*path) return false;
 
-        /* Skip subcommand entries (name contains '/') */
-        if (strchr(g_bot.commands[i].name, '/')) {
-            g_bot.commands[i].registered = true;
-            continue;
+    /* For URLs, only reject the most dangerous shell metacharacters.
+     * URLs legitimately contain &, =, ?, etc. but since we use "%s"
+     * (double-quoted) in popen, only backtick, $, \, ", newline are dangerous. */
+    bool is_url = (strncmp(path, "http://", 7) == 0 || strncmp(path, "https://", 8) == 0);
+
+    for (const char *p = path; *p; p++) {
+        switch (*p) {
+            case '`': case '$': case '\\': case '"':
+            case '\n': case '\r':
+                return false;
+            case ';': case '|': case '<': case '>':
+            case '(': case ')': case '{': case '}': case '\'':
+                if (!is_url) return false;
+                break;
+            case '&':
+                if (!is_url) return false;
+                break;
         }
+    }
+    return true;
+}
 
-        StrBuf sb; sb_init(&sb);
-        jb_obj_start(&sb);
-        jb_str(&sb, "name", g_bot.commands[i].name);
+/* Check if source is a YouTube/supported streaming URL */
+static bool is_youtube_url(const char *url) {
+    return (strstr(url, "youtube.com/watch") != NULL ||
+            strstr(url, "youtu.be/") != NULL ||
+            strstr(url, "youtube.com/shorts/") != NULL ||
+            strstr(url, "youtube.com/playlist") != NULL ||
+            strstr(url, "music.youtube.com/") != NULL ||
+            strstr(url, "soundcloud.com/") != NULL ||
+            strstr(url, "nicovideo.jp/") != NULL ||
+            strstr(url, "twitter.com/") != NULL ||
+            strstr(url, "x.com/") != NULL);
+}
 
-        /* Determine command type */
-        int cmd_type = 1; /* CHAT_INPUT */
-        if (g_bot.commands[i].option_count == -2) cmd_type = 2; /* USER context menu */
-        else if (g_bot.commands[i].option_count == -3) cmd_type = 3; /* MESSAGE context menu */
-        jb_int(&sb, "type", cmd_type);
+/* Run yt-dlp and read output (helper) */
+static char *ytdlp_exec(const char *args, const char *url) {
+    if (!voice_filepath_safe(url)) return NULL;
+    char cmd[2048];
+    snprintf(cmd, sizeof(cmd), "yt-dlp %s %s \"%s\" 2>/dev/null",
+             g_bot.ytdlp_cookie_opt[0] ? g_bot.ytdlp_cookie_opt : "",
+             args, url);
+    FILE *pp = popen(cmd, "r");
+    if (!pp) return NULL;
 
-        /* Context menus don't need description */
-        if (cmd_type == 1) {
-            jb_str(&sb, "description", g_bot.commands[i].description);
-        }
+    char *buf = (char *)calloc(1, 4096);
+    if (!buf) { pclose(pp); return NULL; }
+    size_t total = 0;
+    char line[1024];
+    while (fgets(line, sizeof(line), pp)) {
+        size_t len = strlen(line);
+        if (total + len >= 4095) break;
+        memcpy(buf + total, line, len);
+        total += len;
+    }
+    buf[total] = '\0';
+    pclose(pp);
+    /* Trim trailing newlines */
+    while (total > 0 && (buf[total-1] == '\n' || buf[total-1] == '\r'))
+        buf[--total] = '\0';
+    return buf;
+}
 
-        if (cmd_type == 1 && g_bot.commands[i].option_count > 0) {
-            jb_key(&sb, "options"); jb_arr_start(&sb);
-            for (int j = 0; j < g_bot.commands[i].option_count; j++) {
-                jb_obj_start(&sb);
-                jb_str(&sb, "name", g_bot.commands[i].options[j].name);
-                jb_str(&sb, "description", g_bot.commands[i].options[j].description);
-                jb_int(&sb, "type", g_bot.commands[i].options[j].type);
-                jb_bool(&sb, "required", g_bot.commands[i].options[j].required);
-                jb_obj_end(&sb); sb_append_char(&sb, ',');
-            }
-            jb_arr_end(&sb); sb_append_char(&sb, ',');
-        }
+/* --- Opus passthrough demuxer (v2.6.0) ---
+ * .opus/.ogg/.webm や yt-dlp の bestaudio (多くは WebM/Opus) はすでに 48kHz の Opus を
+ * 含んでいるので、ffmpeg で PCM に戻して再エンコードせず、パケットをそのまま送る。
+ * 入力はパイプのこともあるため、シークせずに前から順に読むストリーミング方式。 */
 
-        jb_obj_end(&sb);
+#define OPUS_DEMUX_MAX_PACKET (1 << 20)  /* これを超えるパケット・ブロックは不正とみなす */
 
-        char endpoint[256];
-        snprintf(endpoint, sizeof(endpoint), "/applications/%s/commands", g_bot.application_id);
+enum { DEMUX_OGG = 1, DEMUX_WEBM };
 
-        long code = 0;
-        JsonNode *resp = discord_rest("POST", endpoint, sb.data, &code);
-        if (resp && (code == 200 || code == 201)) {
-            const char *cmd_id = json_get_str(resp, "id");
-            if (cmd_id) {
-                snprintf(g_bot.commands[i].registered_id, MAX_SNOWFLAKE, "%s", cmd_id);
-            }
-            g_bot.commands[i].registered = true;
-            const char *type_name = cmd_type == 1 ? "コマンド" :
-                                    cmd_type == 2 ? "ユーザーメニュー" : "メッセージメニュー";
-            LOG_I("%s登録: %s", type_name, g_bot.commands[i].name);
-        } else {
-            LOG_E("コマンド登録失敗: %s (HTTP %ld)", g_bot.commands[i].name, code);
-        }
-        if (resp) { json_free(resp); free(resp); }
-        sb_free(&sb);
+typedef struct {
+    FILE    *fp;
+    int      kind;              /* DEMUX_* */
+    int      channels;
+    uint8_t *buf;               /* Ogg: 組み立て中のパケット / WebM: ブロック本体 */
+    size_t   len, cap;
+    /* Ogg */
+    uint32_t serial;
+    bool     eos;               /* 論理ストリームが終わった (連結 Ogg の次を待つ) */
+    uint8_t  lacing[255];
+    int      seg_count, seg_i;
+    /* WebM */
+    uint64_t opus_track;        /* 0 = 未確定 */
+    uint64_t cur_track;
+    bool     cur_opus;
+    uint8_t  cur_head[64];
+    int      cur_head_len;
+    uint32_t lace_size[256];
+    int      lace_count, lace_i;
+    size_t   lace_off;
+    /* 先頭パケット (open で判定のために読んだもの) */
+    bool     pending;
+    size_t   pending_off, pending_len;
+} OpusDemux;
+
+static bool demux_read(OpusDemux *dm, void *dst, size_t n) {
+    return n == 0 || fread(dst, 1, n, dm->fp) == n;
+}
+
+static bool demux_skip(OpusDemux *dm, uint64_t n) {
+    uint8_t tmp[4096];
+    while (n > 0) {
+        size_t k = n > sizeof(tmp) ? sizeof(tmp) : (size_t)n;
+        if (fread(tmp, 1, k, dm->fp) != k) return false;
+        n -= k;
     }
+    return true;
 }
 
-/* Main gateway loop */
-static void *gateway_thread_func(void *arg) {
-    (void)arg;
+static bool demux_reserve(OpusDemux *dm, size_t need) {
+    if (need > OPUS_DEMUX_MAX_PACKET) return false;
+    if (need <= dm->cap) return true;
+    size_t cap = dm->cap ? dm->cap : 4096;
+    while (cap < need) cap *= 2;
+    uint8_t *nb = (uint8_t *)realloc(dm->buf, cap);
+    if (!nb) return false;
+    dm->buf = nb;
+    dm->cap = cap;
+    return true;
+}
 
-    while (g_bot.running && !g_shutdown) {
-        /* Determine gateway host */
-        const char *host = DISCORD_GATEWAY_HOST;
-        const char *path = DISCORD_GATEWAY_PATH;
-        int port = DISCORD_GATEWAY_PORT;
+/* OpusHead: channel mapping family 0 (mono/stereo) only — それ以外は
+ * Discord にそのまま送れないので ffmpeg 経由に戻す。 */
+static bool opus_head_ok(const uint8_t *p, size_t n, int *channels) {
+    if (n < 19 || memcmp(p, "OpusHead", 8) != 0) return false;
+    if (p[18] != 0 || p[9] < 1 || p[9] > 2) return false;
+    *channels = p[9];
+    return true;
+}
 
-        /* Use resume URL if available */
-        char resume_host[256] = {0};
-        char resume_path[512] = {0};
-        if (g_bot.resume_url[0]) {
-            /* Parse wss://host/?... */
-            const char *h = strstr(g_bot.resume_url, "wss://");
-            if (h) {
-                h += 6;
-                const char *p = strchr(h, '/');
-                if (p) {
-                    int hlen = (int)(p - h);
-                    snprintf(resume_host, sizeof(resume_host), "%.*s", hlen, h);
-                    snprintf(resume_path, sizeof(resume_path), "%s", p);
-                    host = resume_host;
-                    path = resume_path;
-                }
+/* --- Ogg --- */
+
+/* Next packet of the Opus logical stream into dm->buf. false on EOF/error. */
+static bool ogg_next_packet(OpusDemux *dm) {
+    dm->len = 0;
+    for (;;) {
+        if (dm->seg_i >= dm->seg_count) {
+            uint8_t hdr[27];
+            if (!demux_read(dm, hdr, sizeof(hdr)) || memcmp(hdr, "OggS", 4) != 0)
+                return false;
+            uint32_t serial = (uint32_t)hdr[14] | (uint32_t)hdr[15] << 8 |
+                              (uint32_t)hdr[16] << 16 | (uint32_t)hdr[17] << 24;
+            dm->seg_count = hdr[26];
+            dm->seg_i = 0;
+            if (!demux_read(dm, dm->lacing, (size_t)dm->seg_count)) return false;
+            /* Chained Ogg: 前のストリームが終わった後の BOS から次を読む */
+            if ((hdr[5] & 0x02) && (dm->eos || !dm->serial)) {
+                dm->serial = serial;
+                dm->eos = false;
+                dm->len = 0;
+            }
+            if (serial != dm->serial) {
+                uint64_t skip = 0;
+                for (int i = 0; i < dm->seg_count; i++) skip += dm->lacing[i];
+                if (!demux_skip(dm, skip)) return false;
+                dm->seg_count = 0;
+                continue;
             }
+            if (hdr[5] & 0x04) dm->eos = true;
+            /* 継続フラグなしのページは前のパケットの途中を捨てる */
+            if (!(hdr[5] & 0x01)) dm->len = 0;
         }
-
-        LOG_I("Gatewayに接続中... (%s)", host);
-        if (ws_connect(&g_bot.ws, host, port, path) < 0) {
-            LOG_E("Gateway接続失敗。5秒後に再試行...");
-            Value err_msg = hajimu_string("Gateway接続失敗");
-            event_fire("エラー", 1, &err_msg);
-            event_fire("ERROR", 1, &err_msg);
-            sleep(5);
-            continue;
+        while (dm->seg_i < dm->seg_count) {
+            uint8_t lace = dm->lacing[dm->seg_i++];
+            if (!demux_reserve(dm, dm->len + lace)) return false;
+            if (!demux_read(dm, dm->buf + dm->len, lace)) return false;
+            dm->len += lace;
+            if (lace < 255) return true;
         }
+    }
+}
 
-        /* Read messages until disconnected */
-        while (g_bot.running && !g_shutdown && g_bot.ws.connected) {
-            char *msg = ws_read_message(&g_bot.ws);
-            if (!msg) {
-                if (g_bot.running && !g_shutdown) {
-                    LOG_W("Gateway接続が切断されました。再接続します...");
-                    Value disc_msg = hajimu_string("Gateway切断");
-                    event_fire("切断", 1, &disc_msg);
-                    event_fire("DISCONNECT", 1, &disc_msg);
-                    ws_close(&g_bot.ws);
-                }
-                break;
-            }
-            gw_process_message(msg);
-            free(msg);
+/* --- WebM / Matroska --- */
+
+#define EBML_ID_SEGMENT        0x18538067u
+#define EBML_ID_TRACKS         0x1654AE6Bu
+#define EBML_ID_TRACK_ENTRY    0xAEu
+#define EBML_ID_TRACK_NUMBER   0xD7u
+#define EBML_ID_CODEC_ID       0x86u
+#define EBML_ID_CODEC_PRIVATE  0x63A2u
+#define EBML_ID_AUDIO          0xE1u
+#define EBML_ID_CLUSTER        0x1F43B675u
+#define EBML_ID_BLOCK_GROUP    0xA0u
+#define EBML_ID_BLOCK          0xA1u
+#define EBML_ID_SIMPLE_BLOCK   0xA3u
+#define EBML_SIZE_UNKNOWN      UINT64_MAX
+
+/* Read an EBML variable-length integer. keep_marker=true for element IDs. */
+static bool ebml_read_vint(OpusDemux *dm, uint64_t *out, bool keep_marker) {
+    int c = fgetc(dm->fp);
+    if (c == EOF || c == 0) return false;
+    int len = 1;
+    while (!(c & (0x80 >> (len - 1)))) len++;
+    uint64_t v = keep_marker ? (uint64_t)c : (uint64_t)(c & (0xFF >> len));
+    bool all_ones = (v == (uint64_t)(0xFF >> len));
+    for (int i = 1; i < len; i++) {
+        int b = fgetc(dm->fp);
+        if (b == EOF) return false;
+        if (b != 0xFF) all_ones = false;
+        v = v << 8 | (uint64_t)b;
+    }
+    *out = (!keep_marker && all_ones) ? EBML_SIZE_UNKNOWN : v;
+    return true;
+}
 
-            /* After READY, register slash commands */
-            if (g_bot.gateway_ready && g_bot.command_count > 0) {
-                static bool commands_registered = false;
-                if (!commands_registered) {
-                    register_slash_commands();
-                    commands_registered = true;
+static bool ebml_read_uint(OpusDemux *dm, uint64_t size, uint64_t *out) {
+    if (size > 8) return false;
+    uint8_t b[8];
+    if (!demux_read(dm, b, (size_t)size)) return false;
+    uint64_t v = 0;
+    for (uint64_t i = 0; i < size; i++) v = v << 8 | b[i];
+    *out = v;
+    return true;
+}
+
+/* Block/SimpleBlock payload in dm->buf → lace table. */
+static bool webm_parse_block(OpusDemux *dm) {
+    const uint8_t *p = dm->buf, *end = dm->buf + dm->len;
+    if (p >= end) return false;
+    /* Track number vint */
+    int vlen = 1;
+    while (vlen <= 8 && !(p[0] & (0x80 >> (vlen - 1)))) vlen++;
+    if (vlen > 8 || p + vlen + 3 > end) return false;
+    uint64_t track = p[0] & (0xFF >> vlen);
+    for (int i = 1; i < vlen; i++) track = track << 8 | p[i];
+    p += vlen;
+    if (track != dm->opus_track) return true;   /* 別トラック: 何も出さない */
+    uint8_t flags = p[2];
+    p += 3;                                     /* timecode (2) + flags (1) */
+
+    int lacing = (flags >> 1) & 3;
+    if (lacing == 0) {
+        dm->lace_count = 1;
+        dm->lace_size[0] = (uint32_t)(end - p);
+    } else {
+        if (p >= end) return false;
+        int n = *p++ + 1;
+        size_t total = 0;
+        if (lacing == 1) {                      /* Xiph */
+            for (int i = 0; i < n - 1; i++) {
+                uint32_t sz = 0;
+                for (;;) {
+                    if (p >= end) return false;
+                    uint8_t b = *p++;
+                    sz += b;
+                    if (b < 255) break;
                 }
+                dm->lace_size[i] = sz;
+                total += sz;
+            }
+        } else if (lacing == 3) {               /* EBML: 先頭サイズ + 符号付き差分 */
+            int64_t prev = 0;
+            for (int i = 0; i < n - 1; i++) {
+                if (p >= end) return false;
+                int l = 1;
+                while (l <= 8 && !(p[0] & (0x80 >> (l - 1)))) l++;
+                if (l > 8 || p + l > end) return false;
+                int64_t v = p[0] & (0xFF >> l);
+                for (int k = 1; k < l; k++) v = v << 8 | p[k];
+                p += l;
+                if (i > 0) v -= ((int64_t)1 << (7 * l - 1)) - 1;
+                int64_t sz = i == 0 ? v : prev + v;
+                if (sz < 0) return false;
+                dm->lace_size[i] = (uint32_t)sz;
+                prev = sz;
+                total += (size_t)sz;
             }
         }
-
-        if (g_bot.running && !g_shutdown) {
-            LOG_I("2秒後にGateway再接続...");
-            Value reconn_msg = hajimu_string("再接続中");
-            event_fire("再接続", 1, &reconn_msg);
-            event_fire("RECONNECT", 1, &reconn_msg);
-            sleep(2);
+        size_t remain = (size_t)(end - p);
+        if (lacing == 2) {                      /* Fixed */
+            if (remain % (size_t)n) return false;
+            for (int i = 0; i < n; i++) dm->lace_size[i] = (uint32_t)(remain / (size_t)n);
+        } else {
+            if (total > remain) return false;
+            dm->lace_size[n - 1] = (uint32_t)(remain - total);
         }
+        dm->lace_count = n;
     }
-
-    ws_close(&g_bot.ws);
-    LOG_I("Gatewayスレッド終了");
-    return NULL;
+    dm->lace_i = 0;
+    dm->lace_off = (size_t)(p - dm->buf);
+    return true;
 }
 
-/* =========================================================================
- * Section 13.5: Voice Channel System (v2.0.0)
- * ========================================================================= */
-
-/* --- Voice Connection Management --- */
+static void webm_check_track(OpusDemux *dm) {
+    if (dm->opus_track || !dm->cur_track || !dm->cur_opus || !dm->cur_head_len) return;
+    if (opus_head_ok(dm->cur_head, (size_t)dm->cur_head_len, &dm->channels))
+        dm->opus_track = dm->cur_track;
+}
 
-static VoiceConn *voice_find(const char *guild_id) {
-    if (!guild_id) return NULL;
-    for (int i = 0; i < g_bot.voice_conn_count; i++) {
-        if (g_bot.voice_conns[i].active &&
-            strcmp(g_bot.voice_conns[i].guild_id, guild_id) == 0)
-            return &g_bot.voice_conns[i];
+/* Next Opus frame of the WebM stream: dm->buf[*off .. *off+*len). */
+static bool webm_next_packet(OpusDemux *dm, size_t *off, size_t *len) {
+    for (;;) {
+        if (dm->lace_i < dm->lace_count) {
+            *off = dm->lace_off;
+            *len = dm->lace_size[dm->lace_i];
+            dm->lace_off += *len;
+            dm->lace_i++;
+            return true;
+        }
+        uint64_t id, size;
+        if (!ebml_read_vint(dm, &id, true) || !ebml_read_vint(dm, &size, false))
+            return false;
+        switch (id) {
+        case EBML_ID_TRACK_ENTRY:
+            dm->cur_track = 0;
+            dm->cur_opus = false;
+            dm->cur_head_len = 0;
+            continue;
+        case EBML_ID_SEGMENT: case EBML_ID_TRACKS: case EBML_ID_AUDIO:
+        case EBML_ID_CLUSTER: case EBML_ID_BLOCK_GROUP:
+            continue;   /* マスター要素は中に入るだけ (サイズ不明でもよい) */
+        case EBML_ID_TRACK_NUMBER:
+            if (!ebml_read_uint(dm, size, &dm->cur_track)) return false;
+            webm_check_track(dm);
+            continue;
+        case EBML_ID_CODEC_ID: {
+            char codec[32] = {0};
+            if (size >= sizeof(codec)) {
+                if (!demux_skip(dm, size)) return false;
+                continue;
+            }
+            if (!demux_read(dm, codec, (size_t)size)) return false;
+            dm->cur_opus = strcmp(codec, "A_OPUS") == 0;
+            webm_check_track(dm);
+            continue;
+        }
+        case EBML_ID_CODEC_PRIVATE:
+            if (size > sizeof(dm->cur_head)) {
+                if (!demux_skip(dm, size)) return false;
+                continue;
+            }
+            if (!demux_read(dm, dm->cur_head, (size_t)size)) return false;
+            dm->cur_head_len = (int)size;
+            webm_check_track(dm);
+            continue;
+        case EBML_ID_SIMPLE_BLOCK: case EBML_ID_BLOCK:
+            if (!dm->opus_track) return false;   /* トラック情報より先にブロック */
+            if (size == EBML_SIZE_UNKNOWN || !demux_reserve(dm, (size_t)size)) return false;
+            if (!demux_read(dm, dm->buf, (size_t)size)) return false;
+            dm->len = (size_t)size;
+            dm->lace_count = 0;
+            if (!webm_parse_block(dm)) return false;
+            continue;
+        default:
+            if (size == EBML_SIZE_UNKNOWN || !demux_skip(dm, size)) return false;
+            continue;
+        }
     }
-    return NULL;
 }
 
-static VoiceConn *voice_alloc(const char *guild_id) {
-    if (!guild_id) return NULL;
-    /* Check existing */
-    VoiceConn *vc = voice_find(guild_id);
-    if (vc) return vc;
-    /* Find free slot */
-    if (g_bot.voice_conn_count >= MAX_VOICE_CONNS) {
-        LOG_E("ボイス接続上限(%d)に達しました", MAX_VOICE_CONNS);
-        return NULL;
+/* Next Opus packet, as an (off, len) slice of dm->buf. */
+static bool opus_demux_packet(OpusDemux *dm, size_t *off, size_t *len) {
+    if (dm->pending) {
+        dm->pending = false;
+        *off = dm->pending_off;
+        *len = dm->pending_len;
+        return true;
+    }
+    if (dm->kind == DEMUX_WEBM) return webm_next_packet(dm, off, len);
+    for (;;) {
+        if (!ogg_next_packet(dm)) return false;
+        /* 連結 Ogg の 2 本目以降のヘッダーは送らない */
+        if (dm->len >= 8 && (memcmp(dm->buf, "OpusHead", 8) == 0 ||
+                             memcmp(dm->buf, "OpusTags", 8) == 0)) continue;
+        *off = 0;
+        *len = dm->len;
+        return true;
     }
-    vc = &g_bot.voice_conns[g_bot.voice_conn_count++];
-    memset(vc, 0, sizeof(*vc));
-    snprintf(vc->guild_id, sizeof(vc->guild_id), "%s", guild_id);
-    vc->active = true;
-    vc->vws.fd = -1;
-    vc->udp_fd = -1;
-    pthread_mutex_init(&vc->voice_mutex, NULL);
-    return vc;
 }
 
-static void voice_free(VoiceConn *vc) {
-    if (!vc || !vc->active) return;
+/* Samples per channel at 48kHz, or -1 when the sender cannot pace it
+ * (パケット長が 20ms の倍数でないもの)。 */
+static int opus_demux_samples(const uint8_t *pkt, size_t len) {
+    if (len == 0) return -1;
+    int n = opus_packet_get_nb_samples(pkt, (opus_int32)len, VOICE_SAMPLE_RATE);
+    if (n <= 0 || n % VOICE_FRAME_SAMPLES) return -1;
+    return n;
+}
 
-    vc->stop_requested = true;
-    vc->playing = false;
+/* Probe the container and read up to the first audio packet. false when
+ * the stream is not mono/stereo Opus in Ogg or WebM. */
+static bool opus_demux_open(OpusDemux *dm, FILE *fp) {
+    memset(dm, 0, sizeof(*dm));
+    dm->fp = fp;
+    uint8_t magic[4];
+    if (!demux_read(dm, magic, sizeof(magic))) return false;
+    if (memcmp(magic, "OggS", 4) == 0) {
+        dm->kind = DEMUX_OGG;
+        /* 先頭ページのヘッダーの残り (magic は読み済み) */
+        uint8_t hdr[23];
+        if (!demux_read(dm, hdr, sizeof(hdr))) return false;
+        dm->serial = (uint32_t)hdr[10] | (uint32_t)hdr[11] << 8 |
+                     (uint32_t)hdr[12] << 16 | (uint32_t)hdr[13] << 24;
+        dm->seg_count = hdr[22];
+        if (!demux_read(dm, dm->lacing, (size_t)dm->seg_count)) return false;
+        if (!ogg_next_packet(dm) || !opus_head_ok(dm->buf, dm->len, &dm->channels))
+            return false;
+    } else if (magic[0] == 0x1A && magic[1] == 0x45 && magic[2] == 0xDF && magic[3] == 0xA3) {
+        dm->kind = DEMUX_WEBM;
+        uint64_t size;
+        if (!ebml_read_vint(dm, &size, false) || size == EBML_SIZE_UNKNOWN ||
+            !demux_skip(dm, size)) return false;
+    } else {
+        return false;
+    }
+    size_t off, len;
+    if (!opus_demux_packet(dm, &off, &len)) return false;
+    if (opus_demux_samples(dm->buf + off, len) < 0) return false;
+    dm->pending = true;
+    dm->pending_off = off;
+    dm->pending_len = len;
+    return true;
+}
 
-    /* Signal voice_ws_thread to exit (it checks stop_requested with 1s timeout) */
-    /* Do NOT call ws_close here — the voice_ws_thread is still using the SSL
-       connection. It will exit within 1 second via the stop_requested flag. */
+static void opus_demux_free(OpusDemux *dm) {
+    free(dm->buf);
+    dm->buf = NULL;
+    dm->cap = dm->len = 0;
+}
 
-    /* Wait for threads to exit first (they'll see stop_requested) */
-    if (vc->voice_ws_thread) {
-        pthread_join(vc->voice_ws_thread, NULL);
-        vc->voice_ws_thread = 0;
+/* Open `filepath` for passthrough when it is (likely) Opus in Ogg/WebM:
+ * ローカルの .opus/.ogg/.oga/.webm/.weba/.mka と YouTube (bestaudio[acodec=opus])。
+ * NULL なら従来どおり PCM にデコードして再エンコードする。 */
+static FILE *voice_open_passthrough(const char *filepath, bool *is_pipe, OpusDemux *dm) {
+    FILE *fp = NULL;
+    *is_pipe = false;
+    if (is_youtube_url(filepath)) {
+        if (!voice_filepath_safe(filepath)) return NULL;
+        char cmd[2048];
+#ifdef _WIN32
+        snprintf(cmd, sizeof(cmd),
+            "yt-dlp -o - -f \"bestaudio[acodec=opus]\" --no-playlist --no-warnings %s \"%s\" 2>NUL",
+            g_bot.ytdlp_cookie_opt[0] ? g_bot.ytdlp_cookie_opt : "", filepath);
+#else
+        snprintf(cmd, sizeof(cmd),
+            "yt-dlp -o - -f \"bestaudio[acodec=opus]\" --no-playlist --no-warnings %s \"%s\" 2>/tmp/hajimu_ytdlp_err.log",
+            g_bot.ytdlp_cookie_opt[0] ? g_bot.ytdlp_cookie_opt : "", filepath);
+#endif
+        fp = popen(cmd, "r");
+        if (!fp) return NULL;
+#ifdef _WIN32
+        _setmode(_fileno(fp), _O_BINARY);
+#endif
+        *is_pipe = true;
+    } else {
+        const char *ext = strrchr(filepath, '.');
+        if (!ext || strstr(filepath, "://")) return NULL;
+        if (strcasecmp(ext, ".opus") != 0 && strcasecmp(ext, ".ogg") != 0 &&
+            strcasecmp(ext, ".oga") != 0 && strcasecmp(ext, ".webm") != 0 &&
+            strcasecmp(ext, ".weba") != 0 && strcasecmp(ext, ".mka") != 0) return NULL;
+        fp = fopen(filepath, "rb");
+        if (!fp) return NULL;
+    }
+    if (!opus_demux_open(dm, fp)) {
+        LOG_D("Opusパススルー不可、PCM経由で再生: %s", filepath);
+        opus_demux_free(dm);
+        if (*is_pipe) pclose(fp);
+        else fclose(fp);
+        return NULL;
     }
-    if (vc->audio_thread) {
-        pthread_join(vc->audio_thread, NULL);
-        vc->audio_thread = 0;
+    LOG_I("Opusパススルー再生 (%s, %dch): %s",
+          dm->kind == DEMUX_OGG ? "Ogg" : "WebM", dm->channels, filepath);
+    return fp;
+}
+
+/* --- Encoded-frame cache (v2.6.0) ---
+ * 一度送った曲・効果音のフレーム列を (ソース + エンコード設定) のハッシュで保存し、
+ * ループや同じクリップの再生では ffmpeg / yt-dlp を起動せずにそのまま流す。
+ * メモリは LRU のバイト上限で管理し、ディスク退避先があれば追い出した分を
+ * <ディレクトリ>/<キー>.hjop に書く (ファイル名がキーなので再起動後も使える)。
+ * フレームは [長さ u16][サンプル数 u16][Opus] の連続。 */
+
+#define VOICE_CACHE_DEFAULT_MB       32
+#define VOICE_CACHE_DEFAULT_DISK_MB  256
+#define VOICE_CLIP_MAGIC             "HJOP"
+
+static pthread_once_t g_voice_cache_once = PTHREAD_ONCE_INIT;
+
+static void voice_cache_init_once(void) {
+    pthread_mutex_init(&g_bot.voice_cache.mutex, NULL);
+    g_bot.voice_cache.max_bytes = (size_t)VOICE_CACHE_DEFAULT_MB << 20;
+    g_bot.voice_cache.disk_max = (size_t)VOICE_CACHE_DEFAULT_DISK_MB << 20;
+}
+
+static void voice_cache_init(void) {
+    pthread_once(&g_voice_cache_once, voice_cache_init_once);
+}
+
+/* Content key: source identity (path, plus size/mtime for local files so an
+ * edited file misses) and the encoder settings the frames were made with. */
+static uint64_t voice_clip_key_for(const char *path, int bitrate, int32_t gain, bool limiter) {
+    uint64_t h = 1469598103934665603ULL;
+#define CLIP_MIX(p, n) do { const uint8_t *b_ = (const uint8_t *)(p); \
+        for (size_t i_ = 0; i_ < (size_t)(n); i_++) { h ^= b_[i_]; h *= 1099511628211ULL; } } while (0)
+    CLIP_MIX(path, strlen(path));
+    struct stat st;
+    if (!strstr(path, "://") && stat(path, &st) == 0) {
+        int64_t size = (int64_t)st.st_size, mtime = (int64_t)st.st_mtime;
+        CLIP_MIX(&size, sizeof(size));
+        CLIP_MIX(&mtime, sizeof(mtime));
+    }
+    int32_t settings[3] = { bitrate, gain, limiter };
+    CLIP_MIX(settings, sizeof(settings));
+#undef CLIP_MIX
+    return h;
+}
+
+static uint64_t voice_clip_key(VoiceConn *vc, const char *path) {
+    return voice_clip_key_for(path, vc->bitrate,
+                              __atomic_load_n(&vc->gain_target, __ATOMIC_RELAXED), vc->limiter);
+}
+
+static void voice_clip_path(char *out, size_t cap, uint64_t key) {
+    snprintf(out, cap, "%s/%016llx.hjop", g_bot.voice_cache.dir, (unsigned long long)key);
+}
+
+/* Write a clip to `path` (voice_clip_path). Called without the cache mutex;
+ * the caller pins the clip (refs) so c->data stays put. */
+static bool voice_clip_write(const char *path, const VoiceClip *c) {
+    char tmp[308];
+    snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+    FILE *fp = fopen(tmp, "wb");
+    if (!fp) return false;
+    uint32_t frames = c->frames;
+    uint64_t bytes = c->bytes;
+    bool ok = fwrite(VOICE_CLIP_MAGIC, 4, 1, fp) == 1 &&
+              fwrite(&frames, sizeof(frames), 1, fp) == 1 &&
+              fwrite(&bytes, sizeof(bytes), 1, fp) == 1 &&
+              fwrite(c->data, c->bytes, 1, fp) == 1;
+    if (fclose(fp) != 0) ok = false;
+    if (ok) {
+#ifdef _WIN32
+        remove(path);   /* Windows の rename は既存ファイルを上書きしない */
+#endif
+        ok = rename(tmp, path) == 0;
+    }
+    if (!ok) remove(tmp);
+    return ok;
+}
+
+static uint8_t *voice_clip_read(uint64_t key, size_t *bytes, uint32_t *frames) {
+    char path[300];
+    voice_clip_path(path, sizeof(path), key);
+    FILE *fp = fopen(path, "rb");
+    if (!fp) return NULL;
+    char magic[4];
+    uint64_t n = 0;
+    uint8_t *data = NULL;
+    if (fread(magic, 4, 1, fp) == 1 && memcmp(magic, VOICE_CLIP_MAGIC, 4) == 0 &&
+        fread(frames, sizeof(*frames), 1, fp) == 1 &&
+        fread(&n, sizeof(n), 1, fp) == 1 && n > 0 && n <= (64u << 20)) {
+        data = (uint8_t *)malloc((size_t)n);
+        if (data && fread(data, (size_t)n, 1, fp) != 1) {
+            free(data);
+            data = NULL;
+        }
+    }
+    fclose(fp);
+    *bytes = (size_t)n;
+    return data;
+}
+
+static void voice_clip_remove_at(VoiceClipCache *vcc, int i) {
+    VoiceClip *c = vcc->clips[i];
+    if (c->data) vcc->mem_bytes -= c->bytes;
+    if (c->on_disk) vcc->disk_bytes -= c->bytes;
+    free(c->data);
+    free(c);
+    vcc->clips[i] = vcc->clips[--vcc->count];
+}
+
+/* Evict least-recently-used clips over the memory / disk budgets. Clips that
+ * are being streamed (refs > 0) stay. Caller holds the mutex; it is dropped
+ * while a victim is written to disk, so other connections keep finding clips. */
+static void voice_cache_enforce(VoiceClipCache *vcc) {
+    while (vcc->mem_bytes > vcc->max_bytes) {
+        int victim = -1;
+        for (int i = 0; i < vcc->count; i++) {
+            VoiceClip *c = vcc->clips[i];
+            if (!c->data || c->refs > 0) continue;
+            if (victim < 0 || c->tick < vcc->clips[victim]->tick) victim = i;
+        }
+        if (victim < 0) break;
+        VoiceClip *c = vcc->clips[victim];
+        bool spill = vcc->dir[0] && vcc->disk_max >= c->bytes;
+        if (spill && !c->on_disk) {
+            /* 書き込みはロックの外で。refs で固定して他から追い出されないようにする */
+            char path[300];
+            voice_clip_path(path, sizeof(path), c->key);
+            c->refs++;
+            pthread_mutex_unlock(&vcc->mutex);
+            bool ok = voice_clip_write(path, c);
+            pthread_mutex_lock(&vcc->mutex);
+            c->refs--;
+            if (ok && !c->on_disk) {
+                c->on_disk = true;
+                vcc->disk_bytes += c->bytes;
+            }
+            if (!ok) spill = false;
+            /* 書いている間に再生が始まったら、次の候補からやり直す */
+            if (c->refs > 0 || !c->data) continue;
+            for (victim = 0; vcc->clips[victim] != c; victim++) {}
+        }
+        vcc->evictions++;
+        if (spill) {
+            free(c->data);
+            c->data = NULL;
+            vcc->mem_bytes -= c->bytes;
+        } else {
+            voice_clip_remove_at(vcc, victim);
+        }
+    }
+    while (vcc->disk_bytes > vcc->disk_max) {
+        int victim = -1;
+        for (int i = 0; i < vcc->count; i++) {
+            VoiceClip *c = vcc->clips[i];
+            if (!c->on_disk || c->refs > 0) continue;
+            if (victim < 0 || c->tick < vcc->clips[victim]->tick) victim = i;
+        }
+        if (victim < 0) break;
+        VoiceClip *c = vcc->clips[victim];
+        char path[300];
+        voice_clip_path(path, sizeof(path), c->key);
+        remove(path);
+        if (c->data) {
+            c->on_disk = false;
+            vcc->disk_bytes -= c->bytes;
+        } else {
+            voice_clip_remove_at(vcc, victim);
+        }
     }
+}
 
-    /* Now safe to clean up resources — no threads are using them */
-    if (vc->vws.connected) {
-        ws_close(&vc->vws);
+static VoiceClip *voice_clip_find(VoiceClipCache *vcc, uint64_t key) {
+    for (int i = 0; i < vcc->count; i++)
+        if (vcc->clips[i]->key == key) return vcc->clips[i];
+    return NULL;
+}
+
+typedef struct {
+    uint64_t key;
+    size_t   bytes;
+    int64_t  mtime;
+} VoiceClipFile;
+
+static int voice_clip_file_cmp(const void *a, const void *b) {
+    int64_t x = ((const VoiceClipFile *)a)->mtime, y = ((const VoiceClipFile *)b)->mtime;
+    return (x > y) - (x < y);
+}
+
+/* Register the .hjop files already in the spill directory (前回までの起動で
+ * 書いたもの) so the disk budget counts them. 更新日時の古い順に、今ある曲より
+ * 古い LRU 順位を付けるので、上限を超えていれば古いファイルから消える。
+ * ディレクトリはロックの外で読み、登録だけロックして行う。 */
+static void voice_cache_scan(VoiceClipCache *vcc, const char *dir) {
+    DIR *d = opendir(dir);
+    if (!d) return;
+    VoiceClipFile *files = NULL;
+    int n = 0, cap = 0;
+    struct dirent *de;
+    while ((de = readdir(d)) != NULL) {
+        char *end = NULL;
+        unsigned long long key = strtoull(de->d_name, &end, 16);
+        if (!end || end - de->d_name != 16 || strcmp(end, ".hjop") != 0) continue;
+        char path[512];
+        struct stat st;
+        snprintf(path, sizeof(path), "%s/%s", dir, de->d_name);
+        if (stat(path, &st) != 0 || st.st_size <= 16) continue;   /* マジック + フレーム数 + バイト数 */
+        if (n == cap) {
+            int nc = cap ? cap * 2 : 64;
+            VoiceClipFile *nf = (VoiceClipFile *)realloc(files, (size_t)nc * sizeof(*nf));
+            if (!nf) break;
+            files = nf;
+            cap = nc;
+        }
+        files[n].key = key;
+        files[n].bytes = (size_t)st.st_size - 16;
+        files[n].mtime = (int64_t)st.st_mtime;
+        n++;
+    }
+    closedir(d);
+    qsort(files, (size_t)n, sizeof(*files), voice_clip_file_cmp);
+
+    pthread_mutex_lock(&vcc->mutex);
+    if (strcmp(vcc->dir, dir) == 0) {
+        int added = 0;
+        for (int i = 0; i < vcc->count; i++) vcc->clips[i]->tick += (uint64_t)n;
+        vcc->tick += (uint64_t)n;
+        for (int i = 0; i < n; i++) {
+            if (voice_clip_find(vcc, files[i].key)) continue;
+            if (vcc->count >= vcc->cap) {
+                int nc = vcc->cap ? vcc->cap * 2 : 16;
+                VoiceClip **grown = (VoiceClip **)realloc(vcc->clips, (size_t)nc * sizeof(*grown));
+                if (!grown) break;
+                vcc->clips = grown;
+                vcc->cap = nc;
+            }
+            VoiceClip *c = (VoiceClip *)calloc(1, sizeof(*c));
+            if (!c) break;
+            c->key = files[i].key;
+            c->bytes = files[i].bytes;
+            c->on_disk = true;
+            c->tick = (uint64_t)i + 1;
+            vcc->clips[vcc->count++] = c;
+            vcc->disk_bytes += c->bytes;
+            added++;
+        }
+        if (added) LOG_I("音声キャッシュ: 退避先の既存ファイル %d 件を登録しました", added);
+        voice_cache_enforce(vcc);
     }
+    pthread_mutex_unlock(&vcc->mutex);
+    free(files);
+}
 
-    /* Close UDP socket */
-    if (vc->udp_fd >= 0) {
-        close(vc->udp_fd);
-        vc->udp_fd = -1;
+/* Pin a cached clip for streaming (loading it back from disk if needed).
+ * NULL on miss; release with voice_clip_release. */
+static VoiceClip *voice_clip_acquire(uint64_t key) {
+    voice_cache_init();
+    VoiceClipCache *vcc = &g_bot.voice_cache;
+    pthread_mutex_lock(&vcc->mutex);
+    if (vcc->max_bytes == 0) {
+        pthread_mutex_unlock(&vcc->mutex);
+        return NULL;
     }
+    VoiceClip *c = voice_clip_find(vcc, key);
+    if (c) {
+        c->refs++;
+        c->tick = ++vcc->tick;
+        if (c->data) {
+            vcc->hits++;
+            pthread_mutex_unlock(&vcc->mutex);
+            return c;
+        }
+    } else if (!vcc->dir[0]) {
+        vcc->misses++;
+        pthread_mutex_unlock(&vcc->mutex);
+        return NULL;
+    }
+    pthread_mutex_unlock(&vcc->mutex);
 
-    /* Destroy Opus encoder */
-    if (vc->opus_enc) {
-        opus_encoder_destroy(vc->opus_enc);
-        vc->opus_enc = NULL;
+    /* ディスクからの読み込みはロックの外で (他の接続の検索を止めない) */
+    size_t bytes = 0;
+    uint32_t frames = 0;
+    uint8_t *data = voice_clip_read(key, &bytes, &frames);
+
+    pthread_mutex_lock(&vcc->mutex);
+    if (!c) c = voice_clip_find(vcc, key);   /* 読み込み中に他の接続が登録した */
+    if (!c && data) {
+        if (vcc->count >= vcc->cap) {
+            int cap = vcc->cap ? vcc->cap * 2 : 16;
+            VoiceClip **nc = (VoiceClip **)realloc(vcc->clips, (size_t)cap * sizeof(*nc));
+            if (nc) { vcc->clips = nc; vcc->cap = cap; }
+        }
+        if (vcc->count < vcc->cap && (c = (VoiceClip *)calloc(1, sizeof(*c))) != NULL) {
+            c->key = key;
+            c->bytes = bytes;
+            c->frames = frames;
+            c->on_disk = true;      /* 前回の起動で書かれたファイル */
+            vcc->disk_bytes += bytes;
+            c->refs = 1;
+            c->tick = ++vcc->tick;
+            vcc->clips[vcc->count++] = c;
+        }
+    }
+    if (c && !c->data && data && c->bytes == bytes) {
+        c->data = data;
+        c->frames = frames;
+        data = NULL;
+        vcc->mem_bytes += bytes;
+        voice_cache_enforce(vcc);
+    }
+    free(data);
+    if (c && !c->data) {
+        /* ファイルが消えていた */
+        if (--c->refs == 0) {
+            for (int i = 0; i < vcc->count; i++)
+                if (vcc->clips[i] == c) {
+                    if (c->on_disk) { c->on_disk = false; vcc->disk_bytes -= c->bytes; }
+                    voice_clip_remove_at(vcc, i);
+                    break;
+                }
+        }
+        c = NULL;
     }
+    if (c) vcc->hits++;
+    else vcc->misses++;
+    pthread_mutex_unlock(&vcc->mutex);
+    return c;
+}
 
-    pthread_mutex_destroy(&vc->voice_mutex);
-    vc->active = false;
+static void voice_clip_release(VoiceClip *c) {
+    VoiceClipCache *vcc = &g_bot.voice_cache;
+    pthread_mutex_lock(&vcc->mutex);
+    c->refs--;
+    voice_cache_enforce(vcc);
+    pthread_mutex_unlock(&vcc->mutex);
+}
 
-    /* Compact array */
-    int idx = (int)(vc - g_bot.voice_conns);
-    if (idx < g_bot.voice_conn_count - 1) {
-        memmove(&g_bot.voice_conns[idx], &g_bot.voice_conns[idx + 1],
-                (size_t)(g_bot.voice_conn_count - 1 - idx) * sizeof(VoiceConn));
+/* Frames of the track being produced, collected for the cache. */
+typedef struct {
+    uint8_t *data;
+    size_t   len, cap, limit;   /* limit = 0: 記録しない */
+    uint32_t frames;
+} VoiceClipRec;
+
+static void voice_clip_rec_begin(VoiceClipRec *rec) {
+    memset(rec, 0, sizeof(*rec));
+    voice_cache_init();
+    pthread_mutex_lock(&g_bot.voice_cache.mutex);
+    /* 1 曲で上限の 1/4 まで (ライブ配信などで際限なく伸びないように) */
+    rec->limit = g_bot.voice_cache.max_bytes / 4;
+    pthread_mutex_unlock(&g_bot.voice_cache.mutex);
+}
+
+static void voice_clip_rec_add(VoiceClipRec *rec, const VoiceFrame *f) {
+    if (!rec->limit) return;
+    size_t need = rec->len + 4 + f->len;
+    if (need > rec->limit) {
+        free(rec->data);
+        memset(rec, 0, sizeof(*rec));
+        return;
     }
-    g_bot.voice_conn_count--;
+    if (need > rec->cap) {
+        size_t cap = rec->cap ? rec->cap * 2 : 64 * 1024;
+        while (cap < need) cap *= 2;
+        uint8_t *nd = (uint8_t *)realloc(rec->data, cap);
+        if (!nd) {
+            free(rec->data);
+            memset(rec, 0, sizeof(*rec));
+            return;
+        }
+        rec->data = nd;
+        rec->cap = cap;
+    }
+    uint8_t *p = rec->data + rec->len;
+    memcpy(p, &f->len, 2);
+    memcpy(p + 2, &f->samples, 2);
+    memcpy(p + 4, f->data, f->len);
+    rec->len = need;
+    rec->frames++;
+}
+
+/* Hand a complete recording to the cache (takes ownership of rec->data). */
+static void voice_clip_store(uint64_t key, VoiceClipRec *rec) {
+    VoiceClipCache *vcc = &g_bot.voice_cache;
+    uint8_t *data = rec->data;
+    rec->data = NULL;
+    if (!data || rec->frames == 0) { free(data); return; }
+    uint8_t *shrunk = (uint8_t *)realloc(data, rec->len);
+    if (shrunk) data = shrunk;
+
+    pthread_mutex_lock(&vcc->mutex);
+    if (vcc->max_bytes == 0 || rec->len > vcc->max_bytes / 4 || voice_clip_find(vcc, key)) {
+        pthread_mutex_unlock(&vcc->mutex);
+        free(data);
+        return;
+    }
+    if (vcc->count >= vcc->cap) {
+        int cap = vcc->cap ? vcc->cap * 2 : 16;
+        VoiceClip **nc = (VoiceClip **)realloc(vcc->clips, (size_t)cap * sizeof(*nc));
+        if (!nc) { pthread_mutex_unlock(&vcc->mutex); free(data); return; }
+        vcc->clips = nc;
+        vcc->cap = cap;
+    }
+    VoiceClip *c = (VoiceClip *)calloc(1, sizeof(*c));
+    if (!c) { pthread_mutex_unlock(&vcc->mutex); free(data); return; }
+    c->key = key;
+    c->data = data;
+    c->bytes = rec->len;
+    c->frames = rec->frames;
+    c->tick = ++vcc->tick;
+    vcc->clips[vcc->count++] = c;
+    vcc->mem_bytes += c->bytes;
+    voice_cache_enforce(vcc);
+    pthread_mutex_unlock(&vcc->mutex);
 }
 
-/* --- Voice WebSocket (separate from main Gateway) --- */
+/* --- PCM gain (v2.6.0) ---
+ * 音声音量 は Opus に渡す前の int16 PCM に掛けるゲイン (Q12, 4096 = 100%)。
+ * 1 フレーム (20ms) かけて前の値から新しい値へ 16 サンプルごとに段階的に変え
+ * (ジッパーノイズ対策)、リミッター有効時は 0.75FS を超えた分を 32767 未満へ
+ * 滑らかに押し込む。無効時は飽和させる。SIMD 版とスカラー版は同じ結果を返す。 */
 
-/* Connect to voice WebSocket (no zlib decompression needed) */
-static int voice_ws_connect_raw(WsConn *ws, const char *host, int port, const char *path) {
-    struct addrinfo hints = {0}, *res = NULL;
-    hints.ai_family = AF_INET;
-    hints.ai_socktype = SOCK_STREAM;
-    char port_str[8];
-    snprintf(port_str, sizeof(port_str), "%d", port);
+#define VOICE_GAIN_ONE      4096
+#define VOICE_GAIN_MAX      (2 * VOICE_GAIN_ONE)   /* 200% (int16 に収まる) */
+#define VOICE_GAIN_BLOCK    16                     /* ゲインを更新する単位 (サンプル) */
+#define VOICE_LIMIT_KNEE    24576
+#define VOICE_LIMIT_RANGE   (32767 - VOICE_LIMIT_KNEE)
 
-    if (getaddrinfo(host, port_str, &hints, &res) != 0) {
-        LOG_E("Voice DNS解決失敗: %s", host);
-        return -1;
+static inline int16_t pcm_soft_limit(int32_t v) {
+    int32_t a = v < 0 ? -v : v;
+    if (a > VOICE_LIMIT_KNEE) {
+        int32_t d = a - VOICE_LIMIT_KNEE;
+        a = VOICE_LIMIT_KNEE + VOICE_LIMIT_RANGE * d / (d + VOICE_LIMIT_RANGE);
     }
+    return (int16_t)(v < 0 ? -a : a);
+}
 
-    ws->fd = socket(res->ai_family, res->ai_socktype, res->ai_protocol);
-    if (ws->fd < 0) {
-        freeaddrinfo(res);
-        return -1;
-    }
+static inline int16_t pcm_saturate(int32_t v) {
+    return (int16_t)(v > 32767 ? 32767 : v < -32768 ? -32768 : v);
+}
 
-    sock_set_timeout(ws->fd, 10);
+/* Gain for block b of `blocks`: reaches g1 on the last block. */
+static inline int32_t pcm_block_gain(int32_t g0, int32_t g1, int b, int blocks) {
+    return g0 + (g1 - g0) * (b + 1) / blocks;
+}
 
-    if (connect(ws->fd, res->ai_addr, res->ai_addrlen) < 0) {
-        freeaddrinfo(res);
-        close(ws->fd); ws->fd = -1;
-        return -1;
+static void pcm_gain_block_scalar(int16_t *p, int n, int32_t g, bool limit) {
+    for (int i = 0; i < n; i++) {
+        int32_t v = ((int32_t)p[i] * g) >> 12;
+        p[i] = limit ? pcm_soft_limit(v) : pcm_saturate(v);
     }
-    freeaddrinfo(res);
+}
 
-    ws->ssl_ctx = SSL_CTX_new(TLS_client_method());
-    if (!ws->ssl_ctx) { close(ws->fd); ws->fd = -1; return -1; }
-    SSL_CTX_set_verify(ws->ssl_ctx, SSL_VERIFY_PEER, NULL);
-    SSL_CTX_set_default_verify_paths(ws->ssl_ctx);
-#ifdef _WIN32
-    load_windows_ca_store(ws->ssl_ctx);
+#if !defined(__SSE2__) && !defined(__ARM_NEON) && !defined(__ARM_NEON__)
+static void pcm_gain_scalar(int16_t *pcm, int n, int32_t g0, int32_t g1, bool limit) {
+    int blocks = n / VOICE_GAIN_BLOCK;
+    for (int b = 0; b < blocks; b++)
+        pcm_gain_block_scalar(pcm + b * VOICE_GAIN_BLOCK, VOICE_GAIN_BLOCK,
+                              pcm_block_gain(g0, g1, b, blocks), limit);
+    pcm_gain_block_scalar(pcm + blocks * VOICE_GAIN_BLOCK, n - blocks * VOICE_GAIN_BLOCK, g1, limit);
+}
 #endif
 
-    ws->ssl = SSL_new(ws->ssl_ctx);
-    SSL_set_fd(ws->ssl, ws->fd);
-    SSL_set_tlsext_host_name(ws->ssl, host);
+#if defined(__SSE2__)
+/* 8 samples → 32-bit products (x * g) >> 12, packed back with saturation.
+ * リミッター有効でニーを超えるサンプルがあるブロックだけスカラーで処理する。 */
+static void pcm_gain_sse2(int16_t *pcm, int n, int32_t g0, int32_t g1, bool limit) {
+    int blocks = n / VOICE_GAIN_BLOCK;
+    const __m128i knee = _mm_set1_epi32(VOICE_LIMIT_KNEE);
+    const __m128i nknee = _mm_set1_epi32(-VOICE_LIMIT_KNEE);
+    for (int b = 0; b < blocks; b++) {
+        int16_t *p = pcm + b * VOICE_GAIN_BLOCK;
+        int32_t g = pcm_block_gain(g0, g1, b, blocks);
+        __m128i gv = _mm_set1_epi16((int16_t)g);
+        __m128i out[2];
+        int over = 0;
+        for (int h = 0; h < 2; h++) {
+            __m128i x = _mm_loadu_si128((const __m128i *)(p + h * 8));
+            __m128i lo = _mm_mullo_epi16(x, gv), hi = _mm_mulhi_epi16(x, gv);
+            __m128i a = _mm_srai_epi32(_mm_unpacklo_epi16(lo, hi), 12);
+            __m128i c = _mm_srai_epi32(_mm_unpackhi_epi16(lo, hi), 12);
+            if (limit) {
+                __m128i m = _mm_or_si128(_mm_or_si128(_mm_cmpgt_epi32(a, knee), _mm_cmplt_epi32(a, nknee)),
+                                         _mm_or_si128(_mm_cmpgt_epi32(c, knee), _mm_cmplt_epi32(c, nknee)));
+                over |= _mm_movemask_epi8(m);
+            }
+            out[h] = _mm_packs_epi32(a, c);
+        }
+        if (over) {
+            pcm_gain_block_scalar(p, VOICE_GAIN_BLOCK, g, true);
+        } else {
+            _mm_storeu_si128((__m128i *)p, out[0]);
+            _mm_storeu_si128((__m128i *)(p + 8), out[1]);
+        }
+    }
+    pcm_gain_block_scalar(pcm + blocks * VOICE_GAIN_BLOCK, n - blocks * VOICE_GAIN_BLOCK, g1, limit);
+}
+#endif
 
-    if (SSL_connect(ws->ssl) <= 0) {
-        SSL_free(ws->ssl); ws->ssl = NULL;
-        SSL_CTX_free(ws->ssl_ctx); ws->ssl_ctx = NULL;
-        close(ws->fd); ws->fd = -1;
-        return -1;
+#if defined(__x86_64__) && defined(__GNUC__)
+/* Same as the SSE2 kernel, one 16-sample block per iteration. 256-bit の
+ * unpack / packs はどちらも 128-bit レーン単位なので並びは元に戻る。 */
+__attribute__((target("avx2")))
+static void pcm_gain_avx2(int16_t *pcm, int n, int32_t g0, int32_t g1, bool limit) {
+    int blocks = n / VOICE_GAIN_BLOCK;
+    const __m256i knee = _mm256_set1_epi32(VOICE_LIMIT_KNEE);
+    const __m256i nknee = _mm256_set1_epi32(-VOICE_LIMIT_KNEE);
+    for (int b = 0; b < blocks; b++) {
+        int16_t *p = pcm + b * VOICE_GAIN_BLOCK;
+        int32_t g = pcm_block_gain(g0, g1, b, blocks);
+        __m256i gv = _mm256_set1_epi16((int16_t)g);
+        __m256i x = _mm256_loadu_si256((const __m256i *)p);
+        __m256i lo = _mm256_mullo_epi16(x, gv), hi = _mm256_mulhi_epi16(x, gv);
+        __m256i a = _mm256_srai_epi32(_mm256_unpacklo_epi16(lo, hi), 12);
+        __m256i c = _mm256_srai_epi32(_mm256_unpackhi_epi16(lo, hi), 12);
+        if (limit) {
+            __m256i m = _mm256_or_si256(
+                _mm256_or_si256(_mm256_cmpgt_epi32(a, knee), _mm256_cmpgt_epi32(nknee, a)),
+                _mm256_or_si256(_mm256_cmpgt_epi32(c, knee), _mm256_cmpgt_epi32(nknee, c)));
+            if (_mm256_movemask_epi8(m)) {
+                pcm_gain_block_scalar(p, VOICE_GAIN_BLOCK, g, true);
+                continue;
+            }
+        }
+        _mm256_storeu_si256((__m256i *)p, _mm256_packs_epi32(a, c));
     }
+    pcm_gain_block_scalar(pcm + blocks * VOICE_GAIN_BLOCK, n - blocks * VOICE_GAIN_BLOCK, g1, limit);
+}
+#endif
 
-    /* WebSocket upgrade handshake */
-    uint8_t nonce[16];
-    RAND_bytes(nonce, 16);
-    char *ws_key = base64_encode(nonce, 16);
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+static void pcm_gain_neon(int16_t *pcm, int n, int32_t g0, int32_t g1, bool limit) {
+    int blocks = n / VOICE_GAIN_BLOCK;
+    const int32x4_t knee = vdupq_n_s32(VOICE_LIMIT_KNEE);
+    const int32x4_t nknee = vdupq_n_s32(-VOICE_LIMIT_KNEE);
+    for (int b = 0; b < blocks; b++) {
+        int16_t *p = pcm + b * VOICE_GAIN_BLOCK;
+        int32_t g = pcm_block_gain(g0, g1, b, blocks);
+        int16x4_t gv = vdup_n_s16((int16_t)g);
+        int16x8_t out[2];
+        uint32x4_t over = vdupq_n_u32(0);
+        for (int h = 0; h < 2; h++) {
+            int16x8_t x = vld1q_s16(p + h * 8);
+            int32x4_t a = vshrq_n_s32(vmull_s16(vget_low_s16(x), gv), 12);
+            int32x4_t c = vshrq_n_s32(vmull_s16(vget_high_s16(x), gv), 12);
+            if (limit) {
+                over = vorrq_u32(over, vorrq_u32(vcgtq_s32(a, knee), vcltq_s32(a, nknee)));
+                over = vorrq_u32(over, vorrq_u32(vcgtq_s32(c, knee), vcltq_s32(c, nknee)));
+            }
+            out[h] = vcombine_s16(vqmovn_s32(a), vqmovn_s32(c));
+        }
+        uint32x2_t o2 = vorr_u32(vget_low_u32(over), vget_high_u32(over));
+        if (vget_lane_u32(o2, 0) | vget_lane_u32(o2, 1)) {
+            pcm_gain_block_scalar(p, VOICE_GAIN_BLOCK, g, true);
+        } else {
+            vst1q_s16(p, out[0]);
+            vst1q_s16(p + 8, out[1]);
+        }
+    }
+    pcm_gain_block_scalar(pcm + blocks * VOICE_GAIN_BLOCK, n - blocks * VOICE_GAIN_BLOCK, g1, limit);
+}
+#endif
 
-    char req[2048];
-    int req_len = snprintf(req, sizeof(req),
-        "GET %s HTTP/1.1\r\n"
-        "Host: %s\r\n"
-        "Upgrade: websocket\r\n"
-        "Connection: Upgrade\r\n"
-        "Sec-WebSocket-Key: %s\r\n"
-        "Sec-WebSocket-Version: 13\r\n"
-        "\r\n",
-        path, host, ws_key);
-    free(ws_key);
+/* Apply a gain ramp g0 → g1 (Q12) in place. */
+static void pcm_gain(int16_t *pcm, int n, int32_t g0, int32_t g1, bool limit) {
+    if (g0 == VOICE_GAIN_ONE && g1 == VOICE_GAIN_ONE) return;
+#if defined(__x86_64__) && defined(__GNUC__)
+    static int has_avx2 = -1;
+    if (has_avx2 < 0) has_avx2 = __builtin_cpu_supports("avx2") ? 1 : 0;
+    if (has_avx2) { pcm_gain_avx2(pcm, n, g0, g1, limit); return; }
+#endif
+#if defined(__SSE2__)
+    pcm_gain_sse2(pcm, n, g0, g1, limit);
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+    pcm_gain_neon(pcm, n, g0, g1, limit);
+#else
+    pcm_gain_scalar(pcm, n, g0, g1, limit);
+#endif
+}
 
-    if (SSL_write(ws->ssl, req, req_len) <= 0) goto vws_fail;
+/* dst += src with int16 saturation (mixer). */
+#if defined(__x86_64__) && defined(__GNUC__)
+__attribute__((target("avx2")))
+static void pcm_mix_add_avx2(int16_t *dst, const int16_t *src, int n) {
+    int i = 0;
+    for (; i + 16 <= n; i += 16) {
+        __m256i a = _mm256_loadu_si256((const __m256i *)(dst + i));
+        __m256i b = _mm256_loadu_si256((const __m256i *)(src + i));
+        _mm256_storeu_si256((__m256i *)(dst + i), _mm256_adds_epi16(a, b));
+    }
+    for (; i < n; i++) dst[i] = pcm_saturate((int32_t)dst[i] + src[i]);
+}
+#endif
 
-    char resp[4096];
-    int rlen = SSL_read(ws->ssl, resp, sizeof(resp) - 1);
-    if (rlen <= 0) goto vws_fail;
-    resp[rlen] = '\0';
-    if (!strstr(resp, "101")) goto vws_fail;
+static void pcm_mix_add(int16_t *dst, const int16_t *src, int n) {
+    int i = 0;
+#if defined(__x86_64__) && defined(__GNUC__)
+    static int has_avx2 = -1;
+    if (has_avx2 < 0) has_avx2 = __builtin_cpu_supports("avx2") ? 1 : 0;
+    if (has_avx2) { pcm_mix_add_avx2(dst, src, n); return; }
+#endif
+#if defined(__SSE2__)
+    for (; i + 8 <= n; i += 8) {
+        __m128i a = _mm_loadu_si128((const __m128i *)(dst + i));
+        __m128i b = _mm_loadu_si128((const __m128i *)(src + i));
+        _mm_storeu_si128((__m128i *)(dst + i), _mm_adds_epi16(a, b));
+    }
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+    for (; i + 8 <= n; i += 8)
+        vst1q_s16(dst + i, vqaddq_s16(vld1q_s16(dst + i), vld1q_s16(src + i)));
+#endif
+    for (; i < n; i++) dst[i] = pcm_saturate((int32_t)dst[i] + src[i]);
+}
 
-    /* Voice WS does NOT use zlib */
-    ws->zlib_init = false;
-    ws->connected = true;
-    LOG_I("Voice WebSocket接続成功: %s", host);
-    return 0;
+/* --- Send-ahead pipeline (v2.6.0) ---
+ * audio_thread (生成側) がソースを読み、Opus にエンコードして VoiceRing に積む。
+ * 送信側は送信プールのスレッドで、20ms ごとにリングから 1 フレーム取り出し、
+ * スロットの中で RTP ヘッダーを付けてそのまま暗号化・送信する。ffmpeg の遅れや
+ * エンコードの揺れはリングの深さ (音声バッファ設定) が吸収する。 */
 
-vws_fail:
-    if (ws->ssl) { SSL_free(ws->ssl); ws->ssl = NULL; }
-    if (ws->ssl_ctx) { SSL_CTX_free(ws->ssl_ctx); ws->ssl_ctx = NULL; }
-    close(ws->fd); ws->fd = -1;
-    return -1;
+static inline uint32_t voice_ring_count(VoiceRing *r) {
+    return __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE) -
+           __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
 }
 
-/* Read voice WS message (no zlib, plain text frames only) */
-static char *voice_ws_read(WsConn *ws) {
-    if (!ws->connected || !ws->ssl) return NULL;
-
-    StrBuf raw; sb_init(&raw);
-    bool final = false;
-    int msg_opcode = 0;
+static inline bool voice_track_dropped(VoiceConn *vc, uint32_t track) {
+    return track <= __atomic_load_n(&vc->drop_upto, __ATOMIC_ACQUIRE);
+}
 
-    while (!final) {
-        uint8_t hdr[2];
-        int r = SSL_read(ws->ssl, hdr, 2);
-        if (r <= 0) { sb_free(&raw); return NULL; }
+/* Drop every frame up to and including `track` (skip / stop). */
+static void voice_drop_tracks(VoiceConn *vc, uint32_t track) {
+    uint32_t cur = __atomic_load_n(&vc->drop_upto, __ATOMIC_RELAXED);
+    while (track > cur &&
+           !__atomic_compare_exchange_n(&vc->drop_upto, &cur, track, false,
+                                        __ATOMIC_RELEASE, __ATOMIC_RELAXED)) {
+    }
+}
 
-        final = (hdr[0] & 0x80) != 0;
-        int opcode = hdr[0] & 0x0F;
-        if (opcode != 0) msg_opcode = opcode;
-        bool masked = (hdr[1] & 0x80) != 0;
-        uint64_t payload_len = hdr[1] & 0x7F;
+static bool voice_is_playing(VoiceConn *vc) {
+    return __atomic_load_n(&vc->producing_track, __ATOMIC_ACQUIRE) != 0 ||
+           __atomic_load_n(&vc->sending_track, __ATOMIC_ACQUIRE) != 0 ||
+           voice_ring_count(&vc->ring) > 0;
+}
 
-        if (payload_len == 126) {
-            uint8_t ext[2];
-            if (SSL_read(ws->ssl, ext, 2) < 2) { sb_free(&raw); return NULL; }
-            payload_len = ((uint64_t)ext[0] << 8) | ext[1];
-        } else if (payload_len == 127) {
-            uint8_t ext[8];
-            if (SSL_read(ws->ssl, ext, 8) < 8) { sb_free(&raw); return NULL; }
-            payload_len = 0;
-            for (int i = 0; i < 8; i++) payload_len = (payload_len << 8) | ext[i];
+/* Producer: wait for a free slot. NULL when the track was dropped or the
+ * connection is going away. */
+static VoiceFrame *voice_ring_reserve(VoiceConn *vc, uint32_t track) {
+    VoiceRing *r = &vc->ring;
+    if (!r->slots) {
+        VoiceFrame *slots = (VoiceFrame *)calloc(VOICE_RING_SLOTS, sizeof(VoiceFrame));
+        if (!slots) return NULL;
+        __atomic_store_n(&r->slots, slots, __ATOMIC_RELEASE);
+    }
+    bool waited = false;
+    for (;;) {
+        if (!vc->active || vc->stop_requested || g_shutdown) return NULL;
+        if (track && voice_track_dropped(vc, track)) return NULL;
+        uint32_t limit = __atomic_load_n(&r->limit, __ATOMIC_RELAXED);
+        if (limit < 1) limit = 1;
+        if (limit > VOICE_RING_SLOTS) limit = VOICE_RING_SLOTS;
+        if (voice_ring_count(r) < limit) break;
+        if (!waited) {
+            __atomic_fetch_add(&r->overruns, 1, __ATOMIC_RELAXED);
+            waited = true;
         }
-
-        uint8_t mask_key[4] = {0};
-        if (masked) {
-            if (SSL_read(ws->ssl, mask_key, 4) < 4) { sb_free(&raw); return NULL; }
+        usleep(5000);
+    }
+    return &r->slots[r->tail & (VOICE_RING_SLOTS - 1)];
+}
+
+static void voice_ring_commit(VoiceRing *r) {
+    __atomic_store_n(&r->tail, r->tail + 1, __ATOMIC_RELEASE);
+}
+
+/* Consumer side of the ring: the i-th unconsumed frame, NULL past the end.
+ * 送信側はまとめて送り終えるまで pop しない (スロットを暗号化バッファに使うため)。 */
+static VoiceFrame *voice_ring_peek(VoiceRing *r, uint32_t i) {
+    uint32_t head = r->head;
+    if (__atomic_load_n(&r->tail, __ATOMIC_ACQUIRE) - head <= i) return NULL;
+    VoiceFrame *slots = __atomic_load_n(&r->slots, __ATOMIC_ACQUIRE);
+    return &slots[(head + i) & (VOICE_RING_SLOTS - 1)];
+}
+
+static void voice_ring_pop(VoiceRing *r, uint32_t n) {
+    __atomic_store_n(&r->head, r->head + n, __ATOMIC_RELEASE);
+}
+
+/* Stamp the RTP header into packet[0..11] and encrypt the Opus payload that
+ * already sits at packet + 12 in place; returns the packet length (0 = failed).
+ * packet には opus_len + VOICE_SEAL_OVERHEAD バイトの領域が要る。
+ * seq / timestamp / nonce は接続単位で連続させる (曲ごとに戻すと nonce が再利用される)。 */
+static size_t voice_seal_packet(VoiceConn *vc, uint8_t *packet, int opus_len, uint32_t samples) {
+    if (opus_len < 0 || opus_len > VOICE_OPUS_MAX) return 0;
+
+    /* Build RTP header (12 bytes) */
+    packet[0] = 0x80; /* Version 2 */
+    packet[1] = 0x78; /* Payload type 120 */
+    packet[2] = (vc->rtp_seq >> 8) & 0xFF;
+    packet[3] = vc->rtp_seq & 0xFF;
+    packet[4] = (vc->rtp_timestamp >> 24) & 0xFF;
+    packet[5] = (vc->rtp_timestamp >> 16) & 0xFF;
+    packet[6] = (vc->rtp_timestamp >> 8) & 0xFF;
+    packet[7] = vc->rtp_timestamp & 0xFF;
+    packet[8] = (vc->ssrc >> 24) & 0xFF;
+    packet[9] = (vc->ssrc >> 16) & 0xFF;
+    packet[10] = (vc->ssrc >> 8) & 0xFF;
+    packet[11] = vc->ssrc & 0xFF;
+
+    /* AEAD XChaCha20-Poly1305 (rtpsize) encryption:
+     * nonce = 24 bytes: 4-byte counter (big-endian) + 20 zero bytes
+     * AAD = RTP header (12 bytes)
+     * 4-byte nonce suffix appended to packet */
+    uint32_t nonce_val = vc->voice_nonce++;
+    uint8_t nonce[24];
+    memset(nonce, 0, sizeof(nonce));
+    nonce[0] = (nonce_val >> 24) & 0xFF;
+    nonce[1] = (nonce_val >> 16) & 0xFF;
+    nonce[2] = (nonce_val >> 8) & 0xFF;
+    nonce[3] = nonce_val & 0xFF;
+
+    unsigned long long clen = 0;
+    if (crypto_aead_xchacha20poly1305_ietf_encrypt(
+            packet + 12, &clen,
+            packet + 12, (unsigned long long)opus_len,  /* in place */
+            packet, 12,  /* AAD = RTP header */
+            NULL, nonce, vc->secret_key) != 0) {
+        LOG_E("音声暗号化失敗");
+        return 0;
+    }
+    memcpy(packet + 12 + clen, nonce, 4);
+
+    vc->rtp_seq++;
+    vc->rtp_timestamp += samples;
+    return 12 + (size_t)clen + 4;
+}
+
+/* Send sealed packets to the voice server — sendmmsg when catching up. */
+static void voice_udp_send(VoiceConn *vc, uint8_t **pkt, const size_t *len, int n) {
+    int done = 0;
+#ifdef __linux__
+    if (n > 1) {
+        struct mmsghdr msgs[VOICE_SEND_BATCH];
+        struct iovec iov[VOICE_SEND_BATCH];
+        memset(msgs, 0, sizeof(msgs));
+        for (int i = 0; i < n; i++) {
+            iov[i].iov_base = pkt[i];
+            iov[i].iov_len = len[i];
+            msgs[i].msg_hdr.msg_name = &vc->udp_addr;
+            msgs[i].msg_hdr.msg_namelen = sizeof(vc->udp_addr);
+            msgs[i].msg_hdr.msg_iov = &iov[i];
+            msgs[i].msg_hdr.msg_iovlen = 1;
         }
-
-        if (payload_len > 0) {
-            if (payload_len > 16 * 1024 * 1024) { sb_free(&raw); return NULL; }
-            uint8_t *buf = (uint8_t *)malloc((size_t)payload_len);
-            if (!buf) { sb_free(&raw); return NULL; }
-            uint64_t total = 0;
-            while (total < payload_len) {
-                int chunk = (int)(payload_len - total);
-                if (chunk > 4096) chunk = 4096;
-                r = SSL_read(ws->ssl, buf + total, chunk);
-                if (r <= 0) { free(buf); sb_free(&raw); return NULL; }
-                total += r;
-            }
-            if (masked) {
-                for (uint64_t i = 0; i < payload_len; i++)
-                    buf[i] ^= mask_key[i & 3];
-            }
-            sb_appendn(&raw, (char *)buf, (int)payload_len);
-            free(buf);
+        while (done < n) {
+            int r = sendmmsg(vc->udp_fd, msgs + done, (unsigned int)(n - done), 0);
+            if (r <= 0) break;
+            done += r;
         }
-
-        if (msg_opcode == WS_OP_PING) {
-            ws_send_pong(ws, (uint8_t *)raw.data, raw.len);
-            sb_free(&raw); sb_init(&raw);
-            final = false;
-            continue;
+    }
+#endif
+    for (; done < n; done++) {
+        ssize_t sent = sendto(vc->udp_fd, pkt[done], len[done], 0,
+                              (struct sockaddr *)&vc->udp_addr, sizeof(vc->udp_addr));
+        if (sent < 0) {
+            LOG_E("Voice UDP送信失敗: %s", strerror(errno));
+            return;
         }
-        if (msg_opcode == WS_OP_CLOSE) {
-            sb_free(&raw);
-            return NULL;
+    }
+}
+
+/* Sender → producer mailbox of finished tracks. The completion event is fired
+ * on the producer thread: event_fire holds callback_mutex and must never stall
+ * the pacing clock. */
+static void voice_post_done(VoiceConn *vc, const char *path) {
+    uint32_t tail = vc->done_tail;
+    if (tail - __atomic_load_n(&vc->done_head, __ATOMIC_ACQUIRE) >= VOICE_DONE_SLOTS) {
+        /* 生成側がイベントを出せずにいる (ハンドラが長く callback_mutex を持っている等) */
+        LOG_W("音声再生完了: 通知が溜まりすぎたため破棄しました: %s", path);
+        return;
+    }
+    AudioQueueItem *it = &vc->done[tail & (VOICE_DONE_SLOTS - 1)];
+    size_t n = strnlen(path, sizeof(it->path) - 1);
+    memcpy(it->path, path, n);
+    it->path[n] = '\0';
+    __atomic_store_n(&vc->done_tail, tail + 1, __ATOMIC_RELEASE);
+}
+
+static void voice_fire_done(VoiceConn *vc) {
+    for (;;) {
+        uint32_t head = vc->done_head;
+        if (__atomic_load_n(&vc->done_tail, __ATOMIC_ACQUIRE) == head) break;
+        char path[256];
+        snprintf(path, sizeof(path), "%s", vc->done[head & (VOICE_DONE_SLOTS - 1)].path);
+        __atomic_store_n(&vc->done_head, head + 1, __ATOMIC_RELEASE);
+
+        LOG_I("音声再生完了: %s", path);
+        /* Fire event — skip if disconnecting to avoid deadlock with callback_mutex */
+        if (!vc->stop_requested) {
+            Value done_val = hajimu_string(path);
+            event_fire("音声再生完了", 1, &done_val);
+            event_fire("VOICE_PLAY_END", 1, &done_val);
         }
     }
+}
 
-    sb_append_char(&raw, '\0');
-    return sb_detach(&raw);
+/* --- Native decoders (v2.6.0) ---
+ * WAV と FLAC (libmpg123 付きでビルドしたときは MP3 も) のローカルファイルは ffmpeg を
+ * 起動せず、このプロセスの中でデコードする。ファイルは mmap (Windows は一括読み込み)
+ * してその上から直接読む。48kHz 以外は Kaiser 窓付き sinc の多相フィルターで変換し、
+ * ステレオ以外は 2ch にダウンミックスする。Vorbis・URL・解釈できないファイルは
+ * 今までどおり ffmpeg に渡す。 */
+
+#define PCM_BLOCK_FRAMES   4096     /* 1 回に変換する入力フレーム数 */
+#define PCM_MIN_RATE       8000
+#define PCM_MAX_RATE       384000
+#define PCM_MAX_CHANNELS   8
+#define PCM_RS_ZEROS       32       /* sinc の片側の零交差数 */
+#define PCM_RS_MAX_TAPS    384
+#define PCM_RS_MAX_PHASES  1024
+#define PCM_RS_BETA        9.0      /* Kaiser 窓 (阻止域およそ -90dB) */
+#define PCM_MP3_FEED       16384    /* mpg123 に 1 回に渡す入力バイト数 */
+
+static inline uint16_t pcm_le16(const uint8_t *p) { return (uint16_t)(p[0] | (p[1] << 8)); }
+static inline uint32_t pcm_le32(const uint8_t *p) {
+    return (uint32_t)p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
 }
 
-/* Send voice identify (op 0) */
-static void voice_send_identify(VoiceConn *vc) {
-    StrBuf sb; sb_init(&sb);
-    jb_obj_start(&sb);
-    jb_int(&sb, "op", 0);
-    jb_key(&sb, "d"); jb_obj_start(&sb);
-    jb_str(&sb, "server_id", vc->guild_id);
-    jb_str(&sb, "user_id", g_bot.bot_id);
-    jb_str(&sb, "session_id", vc->session_id);
-    jb_str(&sb, "token", vc->voice_token);
-    jb_obj_end(&sb); sb_append_char(&sb, ',');
-    jb_obj_end(&sb);
-    ws_send_text(&vc->vws, sb.data, sb.len);
-    sb_free(&sb);
-    LOG_I("Voice IDENTIFY送信 (guild=%s)", vc->guild_id);
+/* Read-only view of a whole file. */
+typedef struct {
+    const uint8_t *base;
+    size_t   size;
+    uint8_t *buf;               /* mmap できなかったときの読み込み先 */
+} AudioMap;
+
+static bool audio_map_open(const char *path, AudioMap *m) {
+    memset(m, 0, sizeof(*m));
+    FILE *fp = fopen(path, "rb");
+    if (!fp) return false;
+    fseek(fp, 0, SEEK_END);
+    long flen = ftell(fp);
+    fseek(fp, 0, SEEK_SET);
+    if (flen <= 0) {
+        fclose(fp);
+        return false;
+    }
+    m->size = (size_t)flen;
+#ifndef _WIN32
+    void *map = mmap(NULL, m->size, PROT_READ, MAP_PRIVATE, fileno(fp), 0);
+    if (map != MAP_FAILED) {
+        madvise(map, m->size, MADV_SEQUENTIAL);
+        m->base = (const uint8_t *)map;
+    }
+#endif
+    if (!m->base) {
+        m->buf = (uint8_t *)malloc(m->size);
+        if (m->buf && fread(m->buf, 1, m->size, fp) == m->size) m->base = m->buf;
+        else {
+            free(m->buf);
+            m->buf = NULL;
+        }
+    }
+    fclose(fp);
+    return m->base != NULL;
 }
 
-/* Send voice select protocol (op 1) */
-static void voice_send_select_protocol(VoiceConn *vc) {
-    StrBuf sb; sb_init(&sb);
-    jb_obj_start(&sb);
-    jb_int(&sb, "op", 1);
-    jb_key(&sb, "d"); jb_obj_start(&sb);
-    jb_str(&sb, "protocol", "udp");
-    jb_key(&sb, "data"); jb_obj_start(&sb);
-    jb_str(&sb, "address", vc->external_ip);
-    jb_int(&sb, "port", vc->external_port);
-    jb_str(&sb, "mode", "aead_xchacha20_poly1305_rtpsize");
-    jb_obj_end(&sb); sb_append_char(&sb, ',');
-    jb_obj_end(&sb); sb_append_char(&sb, ',');
-    jb_obj_end(&sb);
-    ws_send_text(&vc->vws, sb.data, sb.len);
-    sb_free(&sb);
-    LOG_I("Voice SELECT_PROTOCOL送信 (ip=%s, port=%d)", vc->external_ip, vc->external_port);
+static void audio_map_close(AudioMap *m) {
+    if (m->buf) free(m->buf);
+#ifndef _WIN32
+    else if (m->base) munmap((void *)m->base, m->size);
+#endif
+    memset(m, 0, sizeof(*m));
 }
 
-/* Send voice heartbeat (op 3) */
-static void voice_send_heartbeat(VoiceConn *vc) {
-    /* Voice heartbeat uses a nonce (timestamp) */
-    struct timespec ts;
-    clock_gettime(CLOCK_MONOTONIC, &ts);
-    uint64_t nonce = (uint64_t)ts.tv_sec * 1000 + (uint64_t)ts.tv_nsec / 1000000;
+/* --- WAV --- */
 
-    char buf[64];
-    snprintf(buf, sizeof(buf), "{\"op\":3,\"d\":%llu}", (unsigned long long)nonce);
-    ws_send_text(&vc->vws, buf, (int)strlen(buf));
-    vc->voice_heartbeat_acked = false;
+enum { WAV_PCM = 1, WAV_FLOAT = 3, WAV_ALAW = 6, WAV_MULAW = 7, WAV_EXTENSIBLE = 0xFFFE };
+
+typedef struct {
+    int      format;            /* WAV_PCM / WAV_FLOAT / WAV_ALAW / WAV_MULAW */
+    int      channels, rate;
+    int      bytes;             /* 1 サンプルの格納バイト数 */
+    uint32_t mask;              /* WAVE_FORMAT_EXTENSIBLE のスピーカー配置 */
+    size_t   data;              /* data チャンク本体の位置 */
+    size_t   frames;
+} WavInfo;
+
+/* Walk the RIFF chunks for fmt and data. 書きかけのファイル (data のサイズが
+ * 0 や 0xFFFFFFFF) はファイルの末尾までをデータとみなす。 */
+static bool wav_parse(const uint8_t *p, size_t n, WavInfo *w) {
+    memset(w, 0, sizeof(*w));
+    if (n < 12 || memcmp(p, "RIFF", 4) != 0 || memcmp(p + 8, "WAVE", 4) != 0) return false;
+    int block = 0;
+    bool fmt = false;
+    size_t off = 12;
+    while (off + 8 <= n) {
+        uint32_t len = pcm_le32(p + off + 4);
+        const uint8_t *c = p + off + 8;
+        size_t avail = n - off - 8;
+        if (memcmp(p + off, "fmt ", 4) == 0 && len >= 16 && len <= avail) {
+            w->format = pcm_le16(c);
+            w->channels = pcm_le16(c + 2);
+            w->rate = (int)pcm_le32(c + 4);
+            block = pcm_le16(c + 12);
+            if (w->format == WAV_EXTENSIBLE && len >= 40) {
+                w->mask = pcm_le32(c + 20);
+                w->format = pcm_le16(c + 24);   /* サブフォーマット GUID の先頭 */
+            }
+            fmt = true;
+        } else if (memcmp(p + off, "data", 4) == 0) {
+            if (!fmt || w->channels < 1 || w->channels > PCM_MAX_CHANNELS ||
+                block <= 0 || block % w->channels) return false;
+            w->bytes = block / w->channels;
+            w->data = off + 8;
+            w->frames = (len == 0 || len > avail ? avail : len) / (size_t)block;
+            switch (w->format) {
+            case WAV_PCM:   return w->bytes >= 1 && w->bytes <= 4;
+            case WAV_FLOAT: return w->bytes == 4 || w->bytes == 8;
+            case WAV_ALAW:
+            case WAV_MULAW: return w->bytes == 1;
+            default:        return false;
+            }
+        }
+        if (len > avail) break;
+        off += 8 + (size_t)len + (len & 1);
+    }
+    return false;
 }
 
-/* Send voice speaking (op 5) */
-static void voice_send_speaking(VoiceConn *vc, bool speaking) {
-    StrBuf sb; sb_init(&sb);
-    jb_obj_start(&sb);
-    jb_int(&sb, "op", 5);
-    jb_key(&sb, "d"); jb_obj_start(&sb);
-    jb_int(&sb, "speaking", speaking ? 1 : 0);
-    jb_int(&sb, "delay", 0);
-    jb_int(&sb, "ssrc", (int64_t)vc->ssrc);
-    jb_obj_end(&sb); sb_append_char(&sb, ',');
-    jb_obj_end(&sb);
-    ws_send_text(&vc->vws, sb.data, sb.len);
-    sb_free(&sb);
+static int16_t g711_ulaw(uint8_t u) {
+    u = (uint8_t)~u;
+    int t = (((u & 0x0F) << 3) + 0x84) << ((u & 0x70) >> 4);
+    return (int16_t)((u & 0x80) ? 0x84 - t : t - 0x84);
 }
 
-/* --- UDP IP Discovery --- */
+static int16_t g711_alaw(uint8_t a) {
+    a ^= 0x55;
+    int t = (a & 0x0F) << 4;
+    int seg = (a & 0x70) >> 4;
+    if (seg == 0) t += 8;
+    else {
+        t += 0x108;
+        if (seg > 1) t <<= seg - 1;
+    }
+    return (int16_t)((a & 0x80) ? t : -t);
+}
 
-static int voice_ip_discovery(VoiceConn *vc) {
-    /* Create UDP socket */
-    vc->udp_fd = socket(AF_INET, SOCK_DGRAM, 0);
-    if (vc->udp_fd < 0) {
-        LOG_E("Voice UDPソケット作成失敗");
-        return -1;
+/* Convert frames of any supported WAV format to interleaved float. */
+static void wav_to_float(const WavInfo *w, const uint8_t *src, size_t frames, float *dst) {
+    size_t n = frames * (size_t)w->channels;
+    switch (w->format * 16 + w->bytes) {
+    case WAV_PCM * 16 + 1:
+        for (size_t i = 0; i < n; i++) dst[i] = (float)(src[i] - 128) * (1.0f / 128);
+        break;
+    case WAV_PCM * 16 + 2:
+        for (size_t i = 0; i < n; i++)
+            dst[i] = (float)(int16_t)pcm_le16(src + i * 2) * (1.0f / 32768);
+        break;
+    case WAV_PCM * 16 + 3:
+        for (size_t i = 0; i < n; i++) {
+            const uint8_t *s = src + i * 3;
+            int32_t v = (int32_t)(((uint32_t)s[0] << 8) | ((uint32_t)s[1] << 16) | ((uint32_t)s[2] << 24));
+            dst[i] = (float)v * (1.0f / 2147483648.0f);
+        }
+        break;
+    case WAV_PCM * 16 + 4:
+        for (size_t i = 0; i < n; i++)
+            dst[i] = (float)(int32_t)pcm_le32(src + i * 4) * (1.0f / 2147483648.0f);
+        break;
+    case WAV_FLOAT * 16 + 4:
+        for (size_t i = 0; i < n; i++) {
+            uint32_t u = pcm_le32(src + i * 4);
+            memcpy(&dst[i], &u, 4);
+        }
+        break;
+    case WAV_FLOAT * 16 + 8:
+        for (size_t i = 0; i < n; i++) {
+            uint64_t u = pcm_le32(src + i * 8) | ((uint64_t)pcm_le32(src + i * 8 + 4) << 32);
+            double d;
+            memcpy(&d, &u, 8);
+            dst[i] = (float)d;
+        }
+        break;
+    case WAV_ALAW * 16 + 1:
+        for (size_t i = 0; i < n; i++) dst[i] = (float)g711_alaw(src[i]) * (1.0f / 32768);
+        break;
+    case WAV_MULAW * 16 + 1:
+        for (size_t i = 0; i < n; i++) dst[i] = (float)g711_ulaw(src[i]) * (1.0f / 32768);
+        break;
     }
+}
 
-    memset(&vc->udp_addr, 0, sizeof(vc->udp_addr));
-    vc->udp_addr.sin_family = AF_INET;
-    vc->udp_addr.sin_port = htons((uint16_t)vc->voice_port);
-    inet_pton(AF_INET, vc->voice_ip, &vc->udp_addr.sin_addr);
+/* --- FLAC --- */
 
-    /* Set timeout */
-    sock_set_rcvtimeo(vc->udp_fd, 5);
+typedef struct {
+    const uint8_t *p;
+    size_t len;
+    size_t bit;
+    bool   err;                 /* 末尾を越えて読もうとした */
+} FlacBits;
+
+static uint32_t flac_bits(FlacBits *b, int n) {
+    uint32_t v = 0;
+    while (n > 0) {
+        size_t byte = b->bit >> 3;
+        if (byte >= b->len) {
+            b->err = true;
+            return 0;
+        }
+        int avail = 8 - (int)(b->bit & 7);
+        int take = n < avail ? n : avail;
+        v = (v << take) | ((uint32_t)(b->p[byte] >> (avail - take)) & ((1u << take) - 1));
+        n -= take;
+        b->bit += (size_t)take;
+    }
+    return v;
+}
+
+static int32_t flac_sbits(FlacBits *b, int n) {
+    if (n == 0) return 0;
+    uint32_t v = flac_bits(b, n);
+    if (n < 32 && (v & (1u << (n - 1)))) v |= ~0u << n;
+    return (int32_t)v;
+}
+
+/* Count zero bits up to the next one bit (and consume it). */
+static uint32_t flac_unary(FlacBits *b) {
+    uint32_t n = 0;
+    for (;;) {
+        size_t byte = b->bit >> 3;
+        if (byte >= b->len) {
+            b->err = true;
+            return n;
+        }
+        int off = (int)(b->bit & 7);
+        unsigned v = (uint8_t)(b->p[byte] << off);
+        if (v) {
+            int z = __builtin_clz(v) - 24;
+            b->bit += (size_t)z + 1;
+            return n + (uint32_t)z;
+        }
+        n += (uint32_t)(8 - off);
+        b->bit += (size_t)(8 - off);
+    }
+}
 
-    /* Send 74-byte IP Discovery packet:
-     * Type (2) = 0x0001, Length (2) = 70, SSRC (4), Address (64), Port (2) */
-    uint8_t disc_pkt[74];
-    memset(disc_pkt, 0, sizeof(disc_pkt));
-    disc_pkt[0] = 0x00; disc_pkt[1] = 0x01; /* Type: Request */
-    disc_pkt[2] = 0x00; disc_pkt[3] = 70;   /* Length: 70 */
-    disc_pkt[4] = (vc->ssrc >> 24) & 0xFF;
-    disc_pkt[5] = (vc->ssrc >> 16) & 0xFF;
-    disc_pkt[6] = (vc->ssrc >> 8) & 0xFF;
-    disc_pkt[7] = vc->ssrc & 0xFF;
+static uint8_t flac_crc8(const uint8_t *p, size_t n) {
+    uint8_t crc = 0;
+    for (size_t i = 0; i < n; i++) {
+        crc ^= p[i];
+        for (int k = 0; k < 8; k++) crc = (uint8_t)((crc & 0x80) ? (crc << 1) ^ 0x07 : crc << 1);
+    }
+    return crc;
+}
 
-    ssize_t sent = sendto(vc->udp_fd, disc_pkt, sizeof(disc_pkt), 0,
-                          (struct sockaddr *)&vc->udp_addr, sizeof(vc->udp_addr));
-    if (sent != sizeof(disc_pkt)) {
-        LOG_E("Voice IP Discovery送信失敗");
-        return -1;
+static uint16_t flac_crc16(const uint8_t *p, size_t n) {
+    uint16_t crc = 0;
+    for (size_t i = 0; i < n; i++) {
+        crc ^= (uint16_t)(p[i] << 8);
+        for (int k = 0; k < 8; k++) crc = (uint16_t)((crc & 0x8000) ? (crc << 1) ^ 0x8005 : crc << 1);
     }
+    return crc;
+}
 
-    /* Receive response: same 74-byte format with our external IP+port filled in */
-    uint8_t resp[256];
-    socklen_t addr_len = sizeof(vc->udp_addr);
-    ssize_t rcvd = -1;
-    /* Retry up to 3 times (Discord may drop first packet) */
-    for (int attempt = 0; attempt < 3 && rcvd < 8; attempt++) {
-        if (attempt > 0) {
-            LOG_I("Voice IP Discovery リトライ (%d/3)", attempt + 1);
-            /* Resend discovery packet */
-            sendto(vc->udp_fd, disc_pkt, sizeof(disc_pkt), 0,
-                   (struct sockaddr *)&vc->udp_addr, sizeof(vc->udp_addr));
+typedef struct {
+    const uint8_t *p;
+    size_t   len;
+    size_t   pos;               /* 次のフレームを探し始める位置 */
+    int      rate, channels, bits;
+    int      max_block;
+    int32_t *ch[PCM_MAX_CHANNELS];
+} FlacDec;
+
+/* Read the stream header. ID3v2 タグが前に付いていても読み飛ばす。 */
+static bool flac_open(FlacDec *f, const uint8_t *p, size_t len) {
+    memset(f, 0, sizeof(*f));
+    size_t off = 0;
+    if (len >= 10 && memcmp(p, "ID3", 3) == 0) {
+        off = 10 + (((size_t)(p[6] & 0x7F) << 21) | ((size_t)(p[7] & 0x7F) << 14) |
+                    ((size_t)(p[8] & 0x7F) << 7) | (size_t)(p[9] & 0x7F));
+        if (p[5] & 0x10) off += 10;
+    }
+    if (off + 4 > len || memcmp(p + off, "fLaC", 4) != 0) return false;
+    off += 4;
+    bool info = false, last = false;
+    while (!last && off + 4 <= len) {
+        last = (p[off] & 0x80) != 0;
+        int type = p[off] & 0x7F;
+        size_t blen = ((size_t)p[off + 1] << 16) | ((size_t)p[off + 2] << 8) | p[off + 3];
+        off += 4;
+        if (off + blen > len) return false;
+        if (type == 0 && blen >= 34) {
+            const uint8_t *s = p + off;
+            f->max_block = (s[2] << 8) | s[3];
+            f->rate = (s[10] << 12) | (s[11] << 4) | (s[12] >> 4);
+            f->channels = ((s[12] >> 1) & 7) + 1;
+            f->bits = (((s[12] & 1) << 4) | (s[13] >> 4)) + 1;
+            info = true;
         }
-        rcvd = recvfrom(vc->udp_fd, resp, sizeof(resp), 0,
-                        (struct sockaddr *)&vc->udp_addr, &addr_len);
-        if (rcvd >= 8) break;
-        LOG_I("Voice IP Discovery recvfrom: %zd (errno=%d: %s)", rcvd, errno, strerror(errno));
+        off += blen;
     }
-    if (rcvd < 8) {
-        LOG_E("Voice IP Discovery応答不正 (%zd bytes, errno=%d: %s)", rcvd, errno, strerror(errno));
-        return -1;
+    /* 32bit は side チャンネルが 33bit になるので ffmpeg に任せる */
+    if (!info || f->bits < 4 || f->bits > 24 || f->max_block < 16) return false;
+    f->p = p;
+    f->len = len;
+    f->pos = off;
+    for (int c = 0; c < f->channels; c++) {
+        f->ch[c] = (int32_t *)malloc(sizeof(int32_t) * (size_t)f->max_block);
+        if (!f->ch[c]) return false;
+    }
+    return true;
+}
+
+static void flac_close(FlacDec *f) {
+    for (int c = 0; c < PCM_MAX_CHANNELS; c++) free(f->ch[c]);
+    memset(f, 0, sizeof(*f));
+}
+
+/* Partitioned Rice residual into out[order..n). */
+static bool flac_residual(FlacBits *b, int32_t *out, int n, int order) {
+    int method = (int)flac_bits(b, 2);
+    if (method > 1) return false;
+    int pbits = method ? 5 : 4, escape = method ? 31 : 15;
+    int po = (int)flac_bits(b, 4);
+    int per = n >> po;
+    if ((per << po) != n || per < order) return false;
+    int i = order;
+    for (int part = 0; part < (1 << po); part++) {
+        int count = per - (part == 0 ? order : 0);
+        int k = (int)flac_bits(b, pbits);
+        if (k == escape) {
+            int raw = (int)flac_bits(b, 5);
+            for (int j = 0; j < count; j++) out[i++] = flac_sbits(b, raw);
+        } else {
+            for (int j = 0; j < count; j++) {
+                uint32_t u = (flac_unary(b) << k) | flac_bits(b, k);
+                out[i++] = (int32_t)(u >> 1) ^ -(int32_t)(u & 1);
+            }
+        }
+        if (b->err) return false;
     }
+    return true;
+}
 
-    /* Extract IP (bytes 8..71) and port (last 2 bytes, big-endian) */
-    snprintf(vc->external_ip, sizeof(vc->external_ip), "%s", (char *)&resp[8]);
-    vc->external_port = ((uint16_t)resp[rcvd - 2] << 8) | resp[rcvd - 1];
+static bool flac_subframe(FlacBits *b, int32_t *out, int n, int bps) {
+    if (flac_bits(b, 1) != 0) return false;
+    int type = (int)flac_bits(b, 6);
+    int wasted = 0;
+    if (flac_bits(b, 1)) {
+        wasted = (int)flac_unary(b) + 1;
+        bps -= wasted;
+        if (bps <= 0) return false;
+    }
+    if (type == 0) {                                    /* CONSTANT */
+        int32_t v = flac_sbits(b, bps);
+        for (int i = 0; i < n; i++) out[i] = v;
+    } else if (type == 1) {                             /* VERBATIM */
+        for (int i = 0; i < n; i++) out[i] = flac_sbits(b, bps);
+    } else if (type >= 8 && type <= 12) {               /* FIXED */
+        int order = type - 8;
+        if (order > n) return false;
+        for (int i = 0; i < order; i++) out[i] = flac_sbits(b, bps);
+        if (!flac_residual(b, out, n, order)) return false;
+        for (int i = order; i < n; i++) {
+            switch (order) {
+            case 1: out[i] += out[i - 1]; break;
+            case 2: out[i] += 2 * out[i - 1] - out[i - 2]; break;
+            case 3: out[i] += 3 * (out[i - 1] - out[i - 2]) + out[i - 3]; break;
+            case 4: out[i] += 4 * (out[i - 1] + out[i - 3]) - 6 * out[i - 2] - out[i - 4]; break;
+            }
+        }
+    } else if (type >= 32) {                            /* LPC */
+        int order = type - 31;
+        if (order > n) return false;
+        for (int i = 0; i < order; i++) out[i] = flac_sbits(b, bps);
+        int precision = (int)flac_bits(b, 4) + 1;
+        int shift = flac_sbits(b, 5);
+        if (precision == 16 || shift < 0) return false;
+        int32_t coef[32];
+        for (int j = 0; j < order; j++) coef[j] = flac_sbits(b, precision);
+        if (!flac_residual(b, out, n, order)) return false;
+        for (int i = order; i < n; i++) {
+            int64_t sum = 0;
+            for (int j = 0; j < order; j++) sum += (int64_t)coef[j] * out[i - 1 - j];
+            out[i] += (int32_t)(sum >> shift);
+        }
+    } else {
+        return false;
+    }
+    if (wasted)
+        for (int i = 0; i < n; i++) out[i] = (int32_t)((uint32_t)out[i] << wasted);
+    return !b->err;
+}
+
+/* Decode the frame starting at byte pos. Returns its sample count, or 0 when
+ * this is not a valid frame (偽の同期パターンや壊れたフレーム). */
+static int flac_decode_frame(FlacDec *f, size_t pos) {
+    static const int rates[12] = { 0, 88200, 176400, 192000, 8000, 16000,
+                                   22050, 24000, 32000, 44100, 48000, 96000 };
+    static const int sizes[8] = { 0, 8, 12, 0, 16, 20, 24, 32 };
+    FlacBits b = { f->p, f->len, pos * 8, false };
+    flac_bits(&b, 16);                                  /* sync + blocking strategy */
+    int bs_code = (int)flac_bits(&b, 4);
+    int sr_code = (int)flac_bits(&b, 4);
+    int ch_code = (int)flac_bits(&b, 4);
+    int sz_code = (int)flac_bits(&b, 3);
+    if (flac_bits(&b, 1) != 0 || bs_code == 0 || sr_code == 15 || ch_code > 10) return 0;
+    uint32_t c = flac_bits(&b, 8);                      /* UTF-8 風のフレーム番号 */
+    int extra = 0;
+    if (c & 0x80) {
+        while (extra < 7 && (c & (0x40u >> extra))) extra++;
+        if (extra == 0 || extra > 6) return 0;
+    }
+    for (int i = 0; i < extra; i++)
+        if ((flac_bits(&b, 8) & 0xC0) != 0x80) return 0;
+    int block;
+    if (bs_code == 1) block = 192;
+    else if (bs_code <= 5) block = 576 << (bs_code - 2);
+    else if (bs_code == 6) block = (int)flac_bits(&b, 8) + 1;
+    else if (bs_code == 7) block = (int)flac_bits(&b, 16) + 1;
+    else block = 256 << (bs_code - 8);
+    int rate = sr_code == 0 ? f->rate : sr_code < 12 ? rates[sr_code]
+             : sr_code == 12 ? (int)flac_bits(&b, 8) * 1000
+             : sr_code == 13 ? (int)flac_bits(&b, 16) : (int)flac_bits(&b, 16) * 10;
+    int bits = sz_code == 0 ? f->bits : sizes[sz_code];
+    size_t hdr_end = b.bit / 8;
+    if (b.err || hdr_end >= f->len || flac_crc8(f->p + pos, hdr_end - pos) != f->p[hdr_end]) return 0;
+    b.bit += 8;
+    int channels = ch_code < 8 ? ch_code + 1 : 2;
+    if (block > f->max_block || rate != f->rate || bits != f->bits || channels != f->channels)
+        return 0;
+
+    for (int ch = 0; ch < channels; ch++) {
+        bool side = (ch_code == 8 && ch == 1) || (ch_code == 9 && ch == 0) ||
+                    (ch_code == 10 && ch == 1);
+        if (!flac_subframe(&b, f->ch[ch], block, bits + (side ? 1 : 0))) return 0;
+    }
+    size_t end = (b.bit + 7) / 8;
+    if (end + 2 > f->len ||
+        flac_crc16(f->p + pos, end - pos) != (uint16_t)((f->p[end] << 8) | f->p[end + 1]))
+        return 0;
+    f->pos = end + 2;
+
+    int32_t *l = f->ch[0], *r = f->ch[1];
+    if (ch_code == 8) {
+        for (int i = 0; i < block; i++) r[i] = l[i] - r[i];
+    } else if (ch_code == 9) {
+        for (int i = 0; i < block; i++) l[i] += r[i];
+    } else if (ch_code == 10) {
+        for (int i = 0; i < block; i++) {
+            int32_t side = r[i];
+            int32_t mid = (int32_t)((uint32_t)l[i] << 1) | (side & 1);
+            l[i] = (mid + side) >> 1;
+            r[i] = (mid - side) >> 1;
+        }
+    }
+    return block;
+}
 
-    LOG_I("Voice IP Discovery完了: %s:%d", vc->external_ip, vc->external_port);
+/* Next decoded frame into f->ch, or 0 at the end of the stream. */
+static int flac_next(FlacDec *f) {
+    while (f->pos + 2 <= f->len) {
+        if (f->p[f->pos] == 0xFF && (f->p[f->pos + 1] & 0xFE) == 0xF8) {
+            int n = flac_decode_frame(f, f->pos);
+            if (n > 0) return n;
+        }
+        f->pos++;                   /* 次の同期パターンを探す */
+    }
     return 0;
 }
 
-/* --- Voice WebSocket Thread --- */
-
-static void *voice_ws_thread_func(void *arg) {
-    VoiceConn *vc = (VoiceConn *)arg;
-
-    /* Parse endpoint: remove port suffix, strip wss:// if present */
-    char host[256] = {0};
-    snprintf(host, sizeof(host), "%s", vc->endpoint);
+/* --- Resampler / channel mixer --- */
 
-    /* Extract port if present, otherwise default to 443 */
-    int ws_port = 443;
-    char *colon = strrchr(host, ':');
-    if (colon) {
-        ws_port = atoi(colon + 1);
-        if (ws_port <= 0 || ws_port > 65535) ws_port = 443;
-        *colon = '\0';
+typedef struct {
+    uint32_t L, M;              /* 出力:入力 = L:M (約分済み) */
+    uint32_t phases, taps;
+    float   *coef;              /* phases × taps */
+    float   *buf;               /* ステレオの入力履歴 */
+    size_t   cap, fill, pos;    /* フレーム単位。pos = 次の出力の直前の入力 */
+    uint32_t frac;              /* pos からの端数 (L 分の) */
+} PcmResampler;
+
+static double pcm_bessel_i0(double x) {
+    double sum = 1, term = 1;
+    for (int k = 1; k < 64; k++) {
+        term *= (x / (2 * k)) * (x / (2 * k));
+        sum += term;
+        if (term < sum * 1e-12) break;
+    }
+    return sum;
+}
+
+static void pcm_resampler_free(PcmResampler *rs) {
+    if (!rs) return;
+    free(rs->coef);
+    free(rs->buf);
+    free(rs);
+}
+
+/* Build the filter bank for in_rate → out_rate. 通過域は低い方のナイキスト
+ * 周波数の 90% まで。位相は L 個 (多すぎる比は 1024 に丸める)。 */
+static PcmResampler *pcm_resampler_new(uint32_t in_rate, uint32_t out_rate) {
+    uint32_t a = in_rate, b = out_rate;
+    while (b) { uint32_t t = a % b; a = b; b = t; }
+    PcmResampler *rs = (PcmResampler *)calloc(1, sizeof(*rs));
+    if (!rs) return NULL;
+    rs->L = out_rate / a;
+    rs->M = in_rate / a;
+    rs->phases = rs->L < PCM_RS_MAX_PHASES ? rs->L : PCM_RS_MAX_PHASES;
+    double cutoff = 0.90 * (rs->L < rs->M ? (double)rs->L / rs->M : 1.0);
+    uint32_t half = (uint32_t)ceil(PCM_RS_ZEROS / cutoff);
+    if (half > PCM_RS_MAX_TAPS / 2) half = PCM_RS_MAX_TAPS / 2;
+    rs->taps = half * 2;
+    rs->coef = (float *)malloc(sizeof(float) * rs->phases * rs->taps);
+    rs->cap = rs->taps + PCM_BLOCK_FRAMES;
+    rs->buf = (float *)calloc(rs->cap * 2, sizeof(float));
+    if (!rs->coef || !rs->buf) {
+        pcm_resampler_free(rs);
+        return NULL;
+    }
+    double i0b = pcm_bessel_i0(PCM_RS_BETA);
+    for (uint32_t ph = 0; ph < rs->phases; ph++) {
+        float *h = rs->coef + (size_t)ph * rs->taps;
+        double sum = 0;
+        for (uint32_t k = 0; k < rs->taps; k++) {
+            /* 出力位置から入力サンプル k までの距離 */
+            double x = (double)ph / rs->phases + (double)half - 1 - k;
+            double sx = M_PI * cutoff * x;
+            double sinc = fabs(sx) < 1e-9 ? 1.0 : sin(sx) / sx;
+            double r = x / half;
+            double win = r * r < 1 ? pcm_bessel_i0(PCM_RS_BETA * sqrt(1 - r * r)) / i0b : 0;
+            h[k] = (float)(cutoff * sinc * win);
+            sum += h[k];
+        }
+        for (uint32_t k = 0; k < rs->taps; k++) h[k] = (float)(h[k] / sum);   /* 直流利得 1 */
+    }
+    /* 先頭の出力が最初の入力サンプルに重なるよう、半分の窓をゼロで埋めておく */
+    rs->fill = rs->pos = half - 1;
+    return rs;
+}
+
+/* Feed n stereo frames, write the output frames to out and return how many.
+ * out には n * L / M + 2 フレーム分の空きが要る。 */
+static size_t pcm_resample(PcmResampler *rs, const float *in, size_t n, float *out) {
+    uint32_t half = rs->taps / 2;
+    size_t produced = 0;
+    while (n > 0) {
+        size_t k = rs->cap - rs->fill;
+        if (k > n) k = n;
+        memcpy(rs->buf + rs->fill * 2, in, k * 2 * sizeof(float));
+        rs->fill += k;
+        in += k * 2;
+        n -= k;
+        while (rs->pos + half < rs->fill) {
+            const float *h = rs->coef +
+                (size_t)((uint64_t)rs->frac * rs->phases / rs->L) * rs->taps;
+            const float *x = rs->buf + (rs->pos + 1 - half) * 2;
+            float l = 0, r = 0;
+            for (uint32_t t = 0; t < rs->taps; t++) {
+                l += x[t * 2] * h[t];
+                r += x[t * 2 + 1] * h[t];
+            }
+            out[produced * 2] = l;
+            out[produced * 2 + 1] = r;
+            produced++;
+            rs->frac += rs->M;
+            rs->pos += rs->frac / rs->L;
+            rs->frac %= rs->L;
+        }
+        /* もう使わない履歴を捨てる */
+        size_t drop = rs->pos + 1 - half;
+        if (drop > rs->fill) drop = rs->fill;
+        memmove(rs->buf, rs->buf + drop * 2, (rs->fill - drop) * 2 * sizeof(float));
+        rs->fill -= drop;
+        rs->pos -= drop;
     }
+    return produced;
+}
 
-    /* Build path */
-    char path[512];
-    snprintf(path, sizeof(path), "/?v=4");
+/* Stereo gains per input channel. mask が無い (または数が合わない) ときは
+ * WAV / FLAC 共通の既定の並びとみなす。LFE は捨て、合計で 1 を超えないよう正規化する。 */
+static void pcm_downmix_gains(int channels, uint32_t mask, float *gl, float *gr) {
+    static const uint32_t def_mask[PCM_MAX_CHANNELS + 1] = {
+        0, 0x4, 0x3, 0x7, 0x33, 0x37, 0x3F, 0x70F, 0x63F
+    };
+    if (channels == 1) {
+        gl[0] = gr[0] = 1;
+        return;
+    }
+    if (__builtin_popcount(mask) != channels) mask = def_mask[channels];
+    float suml = 0, sumr = 0;
+    int c = 0;
+    for (int bit = 0; bit < 32 && c < channels; bit++) {
+        if (!(mask & (1u << bit))) continue;
+        float l, r;
+        switch (bit) {
+        case 0:  l = 1;       r = 0;       break;   /* FL */
+        case 1:  l = 0;       r = 1;       break;   /* FR */
+        case 2:  l = 0.7071f; r = 0.7071f; break;   /* FC */
+        case 3:  l = 0;       r = 0;       break;   /* LFE */
+        case 4:
+        case 9:  l = 0.7071f; r = 0;       break;   /* BL / SL */
+        case 5:
+        case 10: l = 0;       r = 0.7071f; break;   /* BR / SR */
+        case 6:  l = 0.9239f; r = 0.3827f; break;   /* FLC */
+        case 7:  l = 0.3827f; r = 0.9239f; break;   /* FRC */
+        default: l = 0.5f;    r = 0.5f;    break;   /* BC・天井など */
+        }
+        gl[c] = l;
+        gr[c] = r;
+        suml += l;
+        sumr += r;
+        c++;
+    }
+    float norm = suml > sumr ? suml : sumr;
+    if (norm > 1)
+        for (int i = 0; i < channels; i++) {
+            gl[i] /= norm;
+            gr[i] /= norm;
+        }
+}
 
-    LOG_I("Voice WebSocketに接続中... (%s:%d)", host, ws_port);
-    if (voice_ws_connect_raw(&vc->vws, host, ws_port, path) < 0) {
-        LOG_E("Voice WebSocket接続失敗");
+/* --- PcmSource --- */
+
+enum { PCM_NATIVE_WAV, PCM_NATIVE_FLAC, PCM_NATIVE_MP3 };
+
+#ifdef HAVE_MPG123
+static pthread_once_t g_mpg123_once = PTHREAD_ONCE_INIT;
+static bool g_mpg123_ok;
+
+static void mpg123_init_once(void) {
+    g_mpg123_ok = mpg123_init() == MPG123_OK;   /* 1.27 以降は何もしない */
+    if (!g_mpg123_ok) LOG_W("libmpg123 を初期化できません — MP3 は ffmpeg で再生します");
+}
+
+/* Open an MP3 in feed mode over the mapped file and read its output format.
+ * 出力は 32bit 浮動小数 (mpg123 が対応しないビルドなら失敗して ffmpeg に回る)。 */
+static mpg123_handle *mp3_open(const AudioMap *map, size_t *fed, int *rate, int *channels) {
+    pthread_once(&g_mpg123_once, mpg123_init_once);
+    if (!g_mpg123_ok) return NULL;
+    int err = MPG123_OK;
+    mpg123_handle *mh = mpg123_new(NULL, &err);
+    if (!mh) return NULL;
+    mpg123_param(mh, MPG123_ADD_FLAGS, MPG123_QUIET, 0);
+    const long *rates;
+    size_t nrates;
+    mpg123_rates(&rates, &nrates);
+    bool fmt_ok = mpg123_format_none(mh) == MPG123_OK;
+    for (size_t i = 0; fmt_ok && i < nrates; i++)
+        fmt_ok = mpg123_format(mh, rates[i], MPG123_MONO | MPG123_STEREO,
+                               MPG123_ENC_FLOAT_32) == MPG123_OK;
+    if (!fmt_ok || mpg123_open_feed(mh) != MPG123_OK) {
+        mpg123_delete(mh);
+        return NULL;
+    }
+    /* 最初のフレームのヘッダまで読ませる (先頭の ID3 タグは mpg123 が飛ばす) */
+    size_t done;
+    int rc = MPG123_NEED_MORE;
+    *fed = 0;
+    while (rc == MPG123_NEED_MORE && *fed < map->size) {
+        size_t k = map->size - *fed;
+        if (k > PCM_MP3_FEED) k = PCM_MP3_FEED;
+        if (mpg123_feed(mh, map->base + *fed, k) != MPG123_OK) break;
+        *fed += k;
+        rc = mpg123_read(mh, NULL, 0, &done);
+    }
+    long r = 0;
+    int enc = 0;
+    if (rc != MPG123_NEW_FORMAT || mpg123_getformat(mh, &r, channels, &enc) != MPG123_OK ||
+        enc != MPG123_ENC_FLOAT_32) {
+        mpg123_delete(mh);
         return NULL;
     }
+    *rate = (int)r;
+    return mh;
+}
+#endif
 
-    /* Send IDENTIFY */
-    voice_send_identify(vc);
+struct PcmNative {
+    int      kind;
+    AudioMap map;
+    WavInfo  wav;
+    size_t   wav_pos;           /* 次に読むフレーム */
+    bool     direct;            /* 48kHz/16bit/ステレオ: マップからそのまま渡す */
+    FlacDec  flac;
+    int      flac_len, flac_off;
+#ifdef HAVE_MPG123
+    mpg123_handle *mp3;
+    size_t   mp3_fed;           /* mpg123 に渡し終えたバイト数 */
+    long     mp3_rate;
+#endif
+    int      channels;
+    float    gl[PCM_MAX_CHANNELS], gr[PCM_MAX_CHANNELS];
+    PcmResampler *rs;
+    bool     flushed;           /* 末尾でフィルターの遅れ分を押し出した */
+    float   *in, *st, *ro;      /* 元のチャンネル / ステレオ / 変換後 */
+    int16_t *out;
+    size_t   out_len, out_pos;
+    bool     eof;
+};
 
-    /* Read messages */
-    time_t last_heartbeat = time(NULL);
+static void pcm_native_free(PcmNative *nv) {
+    if (!nv) return;
+    flac_close(&nv->flac);      /* 判定で flac_open に失敗した分も */
+#ifdef HAVE_MPG123
+    if (nv->mp3) mpg123_delete(nv->mp3);
+#endif
+    audio_map_close(&nv->map);
+    pcm_resampler_free(nv->rs);
+    free(nv->in);
+    free(nv->st);
+    free(nv->ro);
+    free(nv->out);
+    free(nv);
+}
+
+/* Open a local WAV / FLAC / MP3 for in-process decoding. 対応しない中身なら NULL
+ * (呼び出し側は ffmpeg に回す)。 */
+static PcmNative *pcm_native_open(const char *filepath) {
+    if (strstr(filepath, "://")) return NULL;
+    FILE *fp = fopen(filepath, "rb");
+    if (!fp) return NULL;
+    uint8_t head[12];
+    size_t got = fread(head, 1, sizeof(head), fp);
+    fclose(fp);
+    bool wav = got >= 12 && memcmp(head, "RIFF", 4) == 0 && memcmp(head + 8, "WAVE", 4) == 0;
+    bool id3 = got >= 3 && memcmp(head, "ID3", 3) == 0;     /* FLAC にも MP3 にも付く */
+    bool flac = got >= 4 && (memcmp(head, "fLaC", 4) == 0 || id3);
+#ifdef HAVE_MPG123
+    bool mp3 = id3 || (got >= 2 && head[0] == 0xFF && (head[1] & 0xE0) == 0xE0);
+#else
+    bool mp3 = false;
+#endif
+    if (!wav && !flac && !mp3) return NULL;
 
-    while (vc->active && vc->vws.connected && !g_shutdown && !vc->stop_requested) {
-        /* Set short read timeout for heartbeating */
-        sock_set_rcvtimeo(vc->vws.fd, 1);
+    PcmNative *nv = (PcmNative *)calloc(1, sizeof(*nv));
+    if (!nv) return NULL;
+    if (!audio_map_open(filepath, &nv->map)) {
+        free(nv);
+        return NULL;
+    }
+    int rate;
+    uint32_t mask = 0;
+    if (wav) {
+        nv->kind = PCM_NATIVE_WAV;
+        if (!wav_parse(nv->map.base, nv->map.size, &nv->wav)) goto fail;
+        nv->channels = nv->wav.channels;
+        rate = nv->wav.rate;
+        mask = nv->wav.mask;
+        nv->direct = nv->wav.format == WAV_PCM && nv->wav.bytes == 2 && rate == VOICE_SAMPLE_RATE &&
+                     nv->channels == VOICE_CHANNELS && snap_host_little_endian();
+    } else if (flac && flac_open(&nv->flac, nv->map.base, nv->map.size)) {
+        nv->kind = PCM_NATIVE_FLAC;
+        nv->channels = nv->flac.channels;
+        rate = nv->flac.rate;
+    } else {
+#ifdef HAVE_MPG123
+        nv->kind = PCM_NATIVE_MP3;
+        if (!mp3 || !(nv->mp3 = mp3_open(&nv->map, &nv->mp3_fed, &rate, &nv->channels))) goto fail;
+        nv->mp3_rate = rate;
+#else
+        goto fail;
+#endif
+    }
+    if (rate < PCM_MIN_RATE || rate > PCM_MAX_RATE || nv->channels > PCM_MAX_CHANNELS) goto fail;
+    if (nv->direct) return nv;
+
+    pcm_downmix_gains(nv->channels, mask, nv->gl, nv->gr);
+    size_t out_frames = PCM_BLOCK_FRAMES;
+    if (rate != VOICE_SAMPLE_RATE) {
+        nv->rs = pcm_resampler_new((uint32_t)rate, VOICE_SAMPLE_RATE);
+        if (!nv->rs) goto fail;
+        out_frames = (size_t)PCM_BLOCK_FRAMES * nv->rs->L / nv->rs->M + 2;
+        nv->ro = (float *)malloc(sizeof(float) * 2 * out_frames);
+    }
+    nv->in = (float *)malloc(sizeof(float) * (size_t)nv->channels * PCM_BLOCK_FRAMES);
+    nv->st = (float *)malloc(sizeof(float) * 2 * PCM_BLOCK_FRAMES);
+    nv->out = (int16_t *)malloc(sizeof(int16_t) * 2 * out_frames);
+    if (!nv->in || !nv->st || !nv->out || (nv->rs && !nv->ro)) goto fail;
+    return nv;
+fail:
+    pcm_native_free(nv);
+    return NULL;
+}
 
-        char *msg = voice_ws_read(&vc->vws);
-        if (!msg) {
-            /* Check if it's just a timeout (not a disconnect request) */
-            if (vc->active && vc->vws.connected && !g_shutdown && !vc->stop_requested) {
-                /* Send heartbeat if interval elapsed */
-                if (vc->voice_heartbeat_interval > 0) {
-                    time_t now = time(NULL);
-                    if ((now - last_heartbeat) * 1000 >= vc->voice_heartbeat_interval) {
-                        voice_send_heartbeat(vc);
-                        last_heartbeat = now;
-                    }
+/* Decode up to PCM_BLOCK_FRAMES input frames into nv->in. */
+static size_t pcm_native_pull(PcmNative *nv) {
+    int ch = nv->channels;
+    if (nv->kind == PCM_NATIVE_WAV) {
+        size_t k = nv->wav.frames - nv->wav_pos;
+        if (k > PCM_BLOCK_FRAMES) k = PCM_BLOCK_FRAMES;
+        wav_to_float(&nv->wav, nv->map.base + nv->wav.data +
+                     nv->wav_pos * (size_t)(ch * nv->wav.bytes), k, nv->in);
+        nv->wav_pos += k;
+        return k;
+    }
+#ifdef HAVE_MPG123
+    if (nv->kind == PCM_NATIVE_MP3) {
+        size_t want = sizeof(float) * (size_t)ch * PCM_BLOCK_FRAMES, have = 0;
+        while (have < want) {
+            size_t done = 0;
+            int rc = mpg123_read(nv->mp3, (unsigned char *)nv->in + have, want - have, &done);
+            have += done;
+            if (rc == MPG123_NEED_MORE && nv->mp3_fed < nv->map.size) {
+                size_t k = nv->map.size - nv->mp3_fed;
+                if (k > PCM_MP3_FEED) k = PCM_MP3_FEED;
+                if (mpg123_feed(nv->mp3, nv->map.base + nv->mp3_fed, k) != MPG123_OK) break;
+                nv->mp3_fed += k;
+            } else if (rc == MPG123_NEW_FORMAT) {
+                long rate;
+                int c, enc;
+                mpg123_getformat(nv->mp3, &rate, &c, &enc);
+                if (c != ch || rate != nv->mp3_rate) {
+                    LOG_W("MP3: 途中で形式が変わったため打ち切ります");
+                    break;
                 }
-                continue;
-            }
-            break;
-        }
-
-        JsonNode *root = json_parse(msg);
-        if (!root) { free(msg); continue; }
-
-        int op = (int)json_get_num(root, "op");
-        JsonNode *d = json_get(root, "d");
-        LOG_I("Voice WS受信: op=%d, raw=%.200s", op, msg);
-
-        switch (op) {
-        case 8: { /* HELLO — get heartbeat_interval */
-            if (d) {
-                double hb = json_get_num(d, "heartbeat_interval");
-                vc->voice_heartbeat_interval = (int)hb;
-                LOG_I("Voice Heartbeat間隔: %dms", vc->voice_heartbeat_interval);
-                /* Send first heartbeat immediately */
-                voice_send_heartbeat(vc);
-                last_heartbeat = time(NULL);
+            } else if (rc != MPG123_OK) {
+                break;      /* MPG123_DONE, 入力の終わり, 壊れたデータ */
             }
-            break;
         }
-        case 2: { /* READY — get SSRC, IP, port */
-            if (d) {
-                vc->ssrc = (uint32_t)json_get_num(d, "ssrc");
-                const char *ip = json_get_str(d, "ip");
-                int port = (int)json_get_num(d, "port");
-                if (ip) snprintf(vc->voice_ip, sizeof(vc->voice_ip), "%s", ip);
-                vc->voice_port = port;
-                LOG_I("Voice READY: ssrc=%u, ip=%s, port=%d", vc->ssrc, vc->voice_ip, vc->voice_port);
-
-                /* Log available modes */
-                JsonNode *modes = json_get(d, "modes");
-                if (modes && modes->type == JSON_ARRAY) {
-                    for (int mi = 0; mi < modes->arr.count && mi < 10; mi++) {
-                        if (modes->arr.items[mi].type == JSON_STRING)
-                            LOG_I("Voice mode[%d]: %s", mi, modes->arr.items[mi].str);
-                    }
-                }
-
-                /* Perform IP Discovery */
-                if (voice_ip_discovery(vc) == 0) {
-                    /* Send SELECT_PROTOCOL */
-                    voice_send_select_protocol(vc);
-                } else {
-                    LOG_E("Voice IP Discovery失敗");
-                }
+        return have / (sizeof(float) * (size_t)ch);
+    }
+#endif
+    if (nv->flac_off == nv->flac_len) {
+        nv->flac_len = flac_next(&nv->flac);
+        nv->flac_off = 0;
+        if (nv->flac_len == 0) return 0;
+    }
+    size_t k = (size_t)(nv->flac_len - nv->flac_off);
+    if (k > PCM_BLOCK_FRAMES) k = PCM_BLOCK_FRAMES;
+    float scale = 1.0f / (float)(1u << (nv->flac.bits - 1));
+    for (int c = 0; c < ch; c++) {
+        const int32_t *src = nv->flac.ch[c] + nv->flac_off;
+        for (size_t i = 0; i < k; i++) nv->in[i * (size_t)ch + (size_t)c] = (float)src[i] * scale;
+    }
+    nv->flac_off += (int)k;
+    return k;
+}
+
+/* Refill nv->out with the next converted block. false at the end. */
+static bool pcm_native_fill(PcmNative *nv) {
+    size_t n = pcm_native_pull(nv);
+    int ch = nv->channels;
+    if (n == 0) {
+        if (!nv->rs || nv->flushed) return false;
+        n = nv->rs->taps / 2;           /* 最後の入力まで出し切るためのゼロ */
+        memset(nv->st, 0, sizeof(float) * 2 * n);
+        nv->flushed = true;
+    } else if (ch == 2) {
+        memcpy(nv->st, nv->in, sizeof(float) * 2 * n);
+    } else {
+        for (size_t i = 0; i < n; i++) {
+            const float *f = nv->in + i * (size_t)ch;
+            float l = 0, r = 0;
+            for (int c = 0; c < ch; c++) {
+                l += f[c] * nv->gl[c];
+                r += f[c] * nv->gr[c];
             }
-            break;
+            nv->st[i * 2] = l;
+            nv->st[i * 2 + 1] = r;
         }
-        case 4: { /* SESSION_DESCRIPTION — get secret_key */
-            if (d) {
-                JsonNode *key_arr = json_get(d, "secret_key");
-                if (key_arr && key_arr->type == JSON_ARRAY) {
-                    int ki = 0;
-                    int kcount = key_arr->arr.count;
-                    if (kcount > 32) kcount = 32;
-                    for (ki = 0; ki < kcount; ki++) {
-                        vc->secret_key[ki] = (unsigned char)(int)key_arr->arr.items[ki].number;
-                    }
-                    vc->ready = true;
-                    LOG_I("Voice準備完了! (guild=%s)", vc->guild_id);
-
-                    /* Initialize Opus encoder */
-                    int err;
-                    vc->opus_enc = opus_encoder_create(VOICE_SAMPLE_RATE, VOICE_CHANNELS,
-                                                       OPUS_APPLICATION_AUDIO, &err);
-                    if (err != OPUS_OK || !vc->opus_enc) {
-                        LOG_E("Opusエンコーダー作成失敗: %s", opus_strerror(err));
-                        vc->ready = false;
-                    } else {
-                        opus_encoder_ctl(vc->opus_enc, OPUS_SET_BITRATE(128000));
-                        LOG_I("Opusエンコーダー初期化完了");
-                    }
+    }
+    const float *src = nv->st;
+    if (nv->rs) {
+        n = pcm_resample(nv->rs, nv->st, n, nv->ro);
+        src = nv->ro;
+    }
+    for (size_t i = 0; i < n * 2; i++) {
+        float v = src[i] * 32768.0f;
+        if (v > 32767.0f) v = 32767.0f;
+        else if (v < -32768.0f) v = -32768.0f;
+        nv->out[i] = (int16_t)(v >= 0 ? v + 0.5f : v - 0.5f);
+    }
+    nv->out_len = n * 2;
+    nv->out_pos = 0;
+    return true;
+}
 
-                    /* Fire voice ready event */
-                    Value guild_val = hajimu_string(vc->guild_id);
-                    event_fire("ボイス接続完了", 1, &guild_val);
-                    event_fire("VOICE_CONNECTED", 1, &guild_val);
-                }
+/* Read up to n interleaved samples, like fread. */
+static size_t pcm_source_read(PcmSource *s, int16_t *dst, size_t n) {
+    size_t got = 0;
+    if (s->ahead_pos < s->ahead_len) {
+        got = s->ahead_len - s->ahead_pos;
+        if (got > n) got = n;
+        memcpy(dst, s->ahead + s->ahead_pos, got * sizeof(int16_t));
+        s->ahead_pos += got;
+    }
+    PcmNative *nv = s->native;
+    if (!nv) return got + (got < n ? fread(dst + got, sizeof(int16_t), n - got, s->fp) : 0);
+    while (got < n && !nv->eof) {
+        if (nv->direct) {
+            size_t frames = (n - got) / 2;
+            if (frames > nv->wav.frames - nv->wav_pos) frames = nv->wav.frames - nv->wav_pos;
+            if (frames == 0) {
+                nv->eof = true;
+                break;
             }
-            break;
-        }
-        case 6: { /* HEARTBEAT_ACK */
-            vc->voice_heartbeat_acked = true;
-            break;
+            memcpy(dst + got, nv->map.base + nv->wav.data + nv->wav_pos * 4, frames * 4);
+            nv->wav_pos += frames;
+            got += frames * 2;
+            continue;
         }
-        default:
-            LOG_D("Voice WS未処理op: %d", op);
+        if (nv->out_pos == nv->out_len && !pcm_native_fill(nv)) {
+            nv->eof = true;
             break;
         }
+        size_t k = nv->out_len - nv->out_pos;
+        if (k > n - got) k = n - got;
+        memcpy(dst + got, nv->out + nv->out_pos, k * sizeof(int16_t));
+        nv->out_pos += k;
+        got += k;
+    }
+    return got;
+}
 
-        json_free(root);
-        free(msg);
+static bool pcm_source_eof(PcmSource *s) {
+    return s->native ? s->native->eof : feof(s->fp) != 0;
+}
 
-        /* Send heartbeat if needed */
-        if (vc->voice_heartbeat_interval > 0) {
-            time_t now = time(NULL);
-            if ((now - last_heartbeat) * 1000 >= vc->voice_heartbeat_interval) {
-                voice_send_heartbeat(vc);
-                last_heartbeat = now;
-            }
-        }
-    }
+/* Decode up to n samples ahead of time; pcm_source_read returns them first.
+ * 次の曲の準備 (voice_prefetch) がパイプの立ち上がりをここで済ませる。 */
+static void pcm_source_prefill(PcmSource *s, size_t n) {
+    free(s->ahead);
+    s->ahead = (int16_t *)malloc(n * sizeof(int16_t));
+    s->ahead_len = s->ahead_pos = 0;
+    if (!s->ahead) return;
+    PcmSource raw = *s;
+    raw.ahead = NULL;
+    s->ahead_len = pcm_source_read(&raw, s->ahead, n);
+}
 
-    LOG_I("Voice WebSocketスレッド終了 (guild=%s)", vc->guild_id);
-    return NULL;
+/* Close the source. false if the ffmpeg / yt-dlp pipe exited with an error. */
+static bool pcm_source_close(PcmSource *s) {
+    bool ok = true;
+    free(s->ahead);
+    if (s->native) pcm_native_free(s->native);
+    else if (s->fp) {
+        if (s->is_pipe) ok = pclose(s->fp) == 0;
+        else fclose(s->fp);
+    }
+    memset(s, 0, sizeof(*s));
+    return ok;
 }
 
-/* --- Kick off voice WS after both gateway events received --- */
+/* Open a queued source as 48kHz/16bit/stereo PCM: local WAV / FLAC in-process,
+ * everything else through ffmpeg (YouTube は yt-dlp も). */
+static bool voice_open_source(const char *filepath, PcmSource *src) {
+    memset(src, 0, sizeof(*src));
+    src->native = pcm_native_open(filepath);
+    if (src->native) {
+        LOG_D("ネイティブデコード: %s", filepath);
+        return true;
+    }
 
-static void voice_check_ready(VoiceConn *vc) {
-    if (!vc->state_received || !vc->server_received) return;
+    /* Validate filepath to prevent shell injection via popen */
+    if (!voice_filepath_safe(filepath)) {
+        LOG_E("音声ファイルパスに不正な文字が含まれています: %s", filepath);
+        return false;
+    }
 
-    LOG_I("Voice両イベント受信完了。Voice WSに接続開始...");
-    /* Start voice WebSocket thread */
-    pthread_create(&vc->voice_ws_thread, NULL, voice_ws_thread_func, vc);
+    char cmd[2048];
+    if (is_youtube_url(filepath)) {
+        /* YouTube/streaming: yt-dlp → ffmpeg pipe */
+        LOG_I("yt-dlp経由で再生: %s", filepath);
+#ifdef _WIN32
+        /* Windows: /tmp/ は存在しないため stderr を NUL に捨てる */
+        snprintf(cmd, sizeof(cmd),
+            "yt-dlp -o - -f bestaudio --no-playlist --no-warnings %s \"%s\" 2>NUL | "
+            "ffmpeg -i pipe:0 -f s16le -ar %d -ac %d -loglevel quiet -",
+            g_bot.ytdlp_cookie_opt[0] ? g_bot.ytdlp_cookie_opt : "",
+            filepath, VOICE_SAMPLE_RATE, VOICE_CHANNELS);
+#else
+        snprintf(cmd, sizeof(cmd),
+            "yt-dlp -o - -f bestaudio --no-playlist --no-warnings %s \"%s\" 2>/tmp/hajimu_ytdlp_err.log | "
+            "ffmpeg -i pipe:0 -f s16le -ar %d -ac %d -loglevel quiet -",
+            g_bot.ytdlp_cookie_opt[0] ? g_bot.ytdlp_cookie_opt : "",
+            filepath, VOICE_SAMPLE_RATE, VOICE_CHANNELS);
+#endif
+    } else {
+        /* Local file or direct URL: ffmpeg only */
+        snprintf(cmd, sizeof(cmd),
+            "ffmpeg -i \"%s\" -f s16le -ar %d -ac %d -loglevel quiet -",
+            filepath, VOICE_SAMPLE_RATE, VOICE_CHANNELS);
+    }
+    FILE *fp = popen(cmd, "r");
+    if (!fp) {
+        LOG_E("ffmpeg起動失敗: %s", filepath);
+        return false;
+    }
+#ifdef _WIN32
+    /* Windows: popen はデフォルトでテキストモード。
+     * PCM も Opus もバイナリデータなので _setmode でバイナリモードに切り替える。
+     * これをしないと 0x1A (Ctrl+Z) のバイトが EOF と誤認されて途中で切断される。*/
+    _setmode(_fileno(fp), _O_BINARY);
+#endif
+    LOG_I("パイプ起動成功: %s", cmd);
+    src->fp = fp;
+    src->is_pipe = true;
+    return true;
 }
 
-/* --- Audio Playback Thread --- */
-
-/* Read WAV file header, return number of channels and sample rate */
-static bool wav_read_header(FILE *fp, int *channels, int *sample_rate, int *bits_per_sample) {
-    uint8_t hdr[44];
-    if (fread(hdr, 1, 44, fp) != 44) return false;
+/* --- Next-track prefetch (v2.6.0) ---
+ * 今の曲の残りが VOICE_PREFETCH_LEAD_MS を切ったら、キューの先頭 (次の曲) を
+ * 別スレッドで開いておく。yt-dlp の URL 解決・ffmpeg の起動・先頭のデコードが
+ * ここで済むので、今の曲の最後のフレームのすぐ後に次の曲のフレームが続き、
+ * 送信側から見て曲間が途切れない (RTP のタイムスタンプもそのまま続く)。
+ * 開いたパイプは先頭を読んだところで止まるので、早く開きすぎると配信元の接続が
+ * 切れたり URL の期限が切れたりする — 残りが分からない曲 (パイプ) の間は準備しない。
+ * 生成スレッドはキューから取り出した曲が準備済みならそのソースを引き取り、
+ * キューの先頭が変わったら準備を捨てる。 */
+
+#define VOICE_PREFETCH_MS      2000     /* PCM のソースを先にデコードしておく長さ */
+#define VOICE_PREFETCH_LEAD_MS 15000    /* 今の曲の残りがこれ以下になったら準備する */
+#define VOICE_PREFETCH_POLL    25       /* 何フレームごとに準備を見直すか (0.5 秒) */
+
+enum { PREFETCH_RUNNING, PREFETCH_FINISHED, PREFETCH_ABANDONED };
+
+struct VoicePrefetch {
+    char      path[256];
+    uint64_t  clip_key;
+    bool      try_passthrough;
+    int       state;            /* PREFETCH_* (__atomic) */
+    bool      cancel;           /* 持ち主が待っている — 先頭のデコードを省く (__atomic) */
+    pthread_t thread;
+    /* 以下はスレッドが書き、終わってから持ち主が読む */
+    FILE     *fp;               /* パススルー */
+    bool      is_pipe;
+    OpusDemux dm;
+    PcmSource src;
+    bool      decoding;
+};
 
-    /* Check RIFF header */
-    if (memcmp(hdr, "RIFF", 4) != 0 || memcmp(hdr + 8, "WAVE", 4) != 0) return false;
+static void voice_prefetch_close(VoicePrefetch *pf) {
+    if (pf->fp) {
+        opus_demux_free(&pf->dm);
+        if (pf->is_pipe) pclose(pf->fp);
+        else fclose(pf->fp);
+    }
+    if (pf->decoding) pcm_source_close(&pf->src);
+    free(pf);
+}
+
+/* 動いている準備スレッドの数 — 手放した (detach した) 分も含めて、
+ * ボット停止時に voice_prefetch_wait_all が終わるのを待つ */
+static pthread_mutex_t g_prefetch_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t  g_prefetch_cond = PTHREAD_COND_INITIALIZER;
+static int g_prefetch_live;
+
+static bool voice_prefetch_cancelled(VoicePrefetch *pf) {
+    return g_shutdown || __atomic_load_n(&pf->cancel, __ATOMIC_ACQUIRE) ||
+           __atomic_load_n(&pf->state, __ATOMIC_ACQUIRE) == PREFETCH_ABANDONED;
+}
+
+static void *voice_prefetch_thread_func(void *arg) {
+    VoicePrefetch *pf = (VoicePrefetch *)arg;
+    VoiceClip *clip = voice_clip_acquire(pf->clip_key);
+    if (clip) {
+        voice_clip_release(clip);   /* キャッシュから流せる — 開く必要はない */
+    } else if (!voice_prefetch_cancelled(pf)) {
+        if (pf->try_passthrough) pf->fp = voice_open_passthrough(pf->path, &pf->is_pipe, &pf->dm);
+        if (!pf->fp && voice_open_source(pf->path, &pf->src)) {
+            pf->decoding = true;
+            if (!voice_prefetch_cancelled(pf))
+                pcm_source_prefill(&pf->src, (size_t)(VOICE_PREFETCH_MS / VOICE_FRAME_MS) * VOICE_FRAME_SIZE);
+        }
+        LOG_D("次の曲を準備しました: %s", pf->path);
+    }
+    /* 持ち主が先に手放していたら自分で片付ける */
+    if (__atomic_exchange_n(&pf->state, PREFETCH_FINISHED, __ATOMIC_ACQ_REL) == PREFETCH_ABANDONED)
+        voice_prefetch_close(pf);
+    pthread_mutex_lock(&g_prefetch_mutex);
+    if (--g_prefetch_live == 0) pthread_cond_broadcast(&g_prefetch_cond);
+    pthread_mutex_unlock(&g_prefetch_mutex);
+    return NULL;
+}
 
-    /* fmt chunk */
-    *channels = hdr[22] | (hdr[23] << 8);
-    *sample_rate = hdr[24] | (hdr[25] << 8) | (hdr[26] << 16) | (hdr[27] << 24);
-    *bits_per_sample = hdr[34] | (hdr[35] << 8);
+static VoicePrefetch *voice_prefetch_start(const char *path, uint64_t clip_key, bool try_passthrough) {
+    VoicePrefetch *pf = (VoicePrefetch *)calloc(1, sizeof(*pf));
+    if (!pf) return NULL;
+    snprintf(pf->path, sizeof(pf->path), "%s", path);
+    pf->clip_key = clip_key;
+    pf->try_passthrough = try_passthrough;
+    pthread_mutex_lock(&g_prefetch_mutex);
+    g_prefetch_live++;
+    pthread_mutex_unlock(&g_prefetch_mutex);
+    if (pthread_create(&pf->thread, NULL, voice_prefetch_thread_func, pf) != 0) {
+        pthread_mutex_lock(&g_prefetch_mutex);
+        g_prefetch_live--;
+        pthread_mutex_unlock(&g_prefetch_mutex);
+        free(pf);
+        return NULL;
+    }
+    return pf;
+}
 
-    return true;
+/* Stop a prefetch and wait for its thread (接続・配信を破棄するとき)。
+ * 開き終わっていれば先頭のデコードは省かれる。 */
+static void voice_prefetch_cancel(VoicePrefetch *pf) {
+    if (!pf) return;
+    __atomic_store_n(&pf->cancel, true, __ATOMIC_RELEASE);
+    pthread_join(pf->thread, NULL);
+    voice_prefetch_close(pf);
 }
 
-/* Validate filepath for safe shell use (reject shell metacharacters) */
-static bool voice_filepath_safe(const char *path) {
-    /* Reject empty paths */
-    if (!path || !*path) return false;
+/* Wait for every prefetch thread, including abandoned ones (ボット停止時)。 */
+static void voice_prefetch_wait_all(int timeout_ms) {
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    ts.tv_sec += timeout_ms / 1000;
+    ts.tv_nsec += (long)(timeout_ms % 1000) * 1000000L;
+    if (ts.tv_nsec >= 1000000000L) { ts.tv_sec++; ts.tv_nsec -= 1000000000L; }
+    pthread_mutex_lock(&g_prefetch_mutex);
+    while (g_prefetch_live > 0)
+        if (pthread_cond_timedwait(&g_prefetch_cond, &g_prefetch_mutex, &ts) == ETIMEDOUT) break;
+    if (g_prefetch_live > 0) LOG_W("次の曲の準備が %d 件終わっていません", g_prefetch_live);
+    pthread_mutex_unlock(&g_prefetch_mutex);
+}
+
+/* Drop a prefetch without waiting for it: yt-dlp が URL を解決している最中でも
+ * 生成スレッドを止めないよう、まだ動いていればスレッド自身に片付けさせる。 */
+static void voice_prefetch_abandon(VoicePrefetch *pf) {
+    if (!pf) return;
+    pthread_detach(pf->thread);
+    if (__atomic_exchange_n(&pf->state, PREFETCH_ABANDONED, __ATOMIC_ACQ_REL) == PREFETCH_FINISHED)
+        voice_prefetch_close(pf);
+}
+
+/* Make *slot follow the queue head (next が空ならキューは空). */
+static void voice_prefetch_follow(VoicePrefetch **slot, const char *next) {
+    if (*slot && strcmp((*slot)->path, next) != 0) {
+        voice_prefetch_abandon(*slot);
+        *slot = NULL;
+    }
+}
+
+/* Claim the prepared source for path, waiting for it if it is still being
+ * opened. 引き取れたら true で、fp (パススルー) か src のどちらかが開いている。
+ * passthrough_ok が偽 (音量を変えている) ときはパススルーの準備は使わない。 */
+static bool voice_prefetch_take(VoicePrefetch **slot, const char *path, bool passthrough_ok,
+                                FILE **fp, bool *is_pipe, OpusDemux *dm, PcmSource *src,
+                                bool *decoding) {
+    VoicePrefetch *pf = *slot;
+    if (!pf) return false;
+    *slot = NULL;
+    if (strcmp(pf->path, path) != 0) {
+        voice_prefetch_abandon(pf);
+        return false;
+    }
+    pthread_join(pf->thread, NULL);
+    bool took = false;
+    if (pf->fp && passthrough_ok) {
+        *fp = pf->fp;
+        *is_pipe = pf->is_pipe;
+        *dm = pf->dm;
+        pf->fp = NULL;
+        took = true;
+    } else if (pf->decoding) {
+        *src = pf->src;
+        *decoding = true;
+        pf->decoding = false;
+        took = true;
+    }
+    voice_prefetch_close(pf);
+    return took;
+}
+
+/* Remaining play time estimated from how far into the file the decoder is:
+ * used / total バイトを読んで frames 分鳴らしたなら残りは比例すると見なす。
+ * 分からなければ -1。 */
+static int64_t voice_remaining_estimate(uint32_t frames, uint64_t used, uint64_t total) {
+    if (!used || !total) return -1;
+    if (used >= total) return 0;
+    return (int64_t)((uint64_t)frames * VOICE_FRAME_MS * (total - used) / used);
+}
+
+/* Remaining play time of a PCM source in ms, or -1 (ffmpeg のパイプ)。 */
+static int64_t pcm_source_remaining_ms(const PcmSource *s, uint32_t frames) {
+    const PcmNative *nv = s->native;
+    if (!nv) return -1;
+    if (nv->kind == PCM_NATIVE_WAV)
+        return nv->wav.rate > 0 ? (int64_t)(nv->wav.frames - nv->wav_pos) * 1000 / nv->wav.rate : -1;
+    if (nv->kind == PCM_NATIVE_FLAC) return voice_remaining_estimate(frames, nv->flac.pos, nv->flac.len);
+#ifdef HAVE_MPG123
+    if (nv->kind == PCM_NATIVE_MP3) return voice_remaining_estimate(frames, nv->mp3_fed, nv->map.size);
+#endif
+    return -1;
+}
 
-    /* For URLs, only reject the most dangerous shell metacharacters.
-     * URLs legitimately contain &, =, ?, etc. but since we use "%s"
-     * (double-quoted) in popen, only backtick, $, \, ", newline are dangerous. */
-    bool is_url = (strncmp(path, "http://", 7) == 0 || strncmp(path, "https://", 8) == 0);
+/* Remaining play time of a passthrough source, or -1 (yt-dlp のパイプ)。 */
+static int64_t voice_passthrough_remaining_ms(FILE *fp, bool is_pipe, uint64_t bytes,
+                                              uint32_t frames) {
+    if (is_pipe) return -1;
+    long pos = ftell(fp);
+    return pos > 0 ? voice_remaining_estimate(frames, (uint64_t)pos, bytes) : -1;
+}
 
-    for (const char *p = path; *p; p++) {
-        switch (*p) {
-            case '`': case '$': case '\\': case '"':
-            case '\n': case '\r':
-                return false;
-            case ';': case '|': case '<': case '>':
-            case '(': case ')': case '{': case '}': case '\'':
-                if (!is_url) return false;
-                break;
-            case '&':
-                if (!is_url) return false;
-                break;
+static uint64_t voice_file_bytes(const char *path) {
+    struct stat st;
+    return stat(path, &st) == 0 && st.st_size > 0 ? (uint64_t)st.st_size : 0;
+}
+
+/* Producer side, every VOICE_PREFETCH_POLL frames: keep the connection's
+ * prefetch on the current queue head, and open it once the current track has
+ * at most VOICE_PREFETCH_LEAD_MS left (remaining_ms = -1 なら開かない)。 */
+static void voice_prefetch_poll(VoiceConn *vc, int64_t remaining_ms) {
+    char next[256] = {0};
+    pthread_mutex_lock(&vc->voice_mutex);
+    if (vc->queue_count > 0) snprintf(next, sizeof(next), "%s", vc->queue[vc->queue_head].path);
+    pthread_mutex_unlock(&vc->voice_mutex);
+    voice_prefetch_follow(&vc->prefetch, next);
+    if (!vc->prefetch && next[0] && remaining_ms >= 0 && remaining_ms <= VOICE_PREFETCH_LEAD_MS) {
+        int32_t gain = __atomic_load_n(&vc->gain_target, __ATOMIC_RELAXED);
+        vc->prefetch = voice_prefetch_start(next, voice_clip_key(vc, next), gain == VOICE_GAIN_ONE);
+    }
+}
+
+/* --- Mixer (v2.6.0) ---
+ * 音声効果再生 のソース (効果音・読み上げなど) は曲のキューとは別に最大
+ * VOICE_MAX_MIX 個まで同時に鳴らせる。生成側が 20ms ごとに各ソースの PCM に
+ * ソースごとのゲインを掛け、曲の PCM に飽和加算してから 1 つのエンコーダーで
+ * エンコードする。パススルー・キャッシュ再生中の曲は、効果が鳴っている間だけ
+ * デコードして混ぜる。 */
+
+static void voice_clip_rec_cancel(VoiceClipRec *rec) {
+    if (!rec) return;
+    free(rec->data);
+    memset(rec, 0, sizeof(*rec));
+}
+
+/* Mix one 20ms frame of every active effect into pcm. Finished or stopped
+ * effects are closed here and reported with 音声効果完了. */
+static bool voice_mix_effects(VoiceConn *vc, int16_t *pcm) {
+    if (!__atomic_load_n(&vc->mix_active, __ATOMIC_ACQUIRE)) return false;
+    int16_t src[VOICE_FRAME_SIZE];
+    bool mixed = false;
+    for (int i = 0; i < VOICE_MAX_MIX; i++) {
+        VoiceMixSource *m = &vc->mix[i];
+        pthread_mutex_lock(&vc->voice_mutex);
+        uint32_t id = m->id;
+        bool stop = m->stop;
+        int32_t gain = m->gain;
+        pthread_mutex_unlock(&vc->voice_mutex);
+        if (!id) continue;
+
+        /* src は生成スレッドだけが触る */
+        if (!m->open && !stop) {
+            m->open = voice_open_source(m->path, &m->src);
+            if (!m->open) stop = true;
+        }
+        size_t got = stop ? 0 : pcm_source_read(&m->src, src, VOICE_FRAME_SIZE);
+        if (got > 0) {
+            if (got < VOICE_FRAME_SIZE)
+                memset(src + got, 0, (VOICE_FRAME_SIZE - got) * sizeof(int16_t));
+            pcm_gain(src, VOICE_FRAME_SIZE, gain, gain, false);
+            pcm_mix_add(pcm, src, VOICE_FRAME_SIZE);
+            mixed = true;
+        }
+        if (stop || got < VOICE_FRAME_SIZE) {
+            if (m->open) {
+                pcm_source_close(&m->src);
+                m->open = false;
+            }
+            char path[256];
+            snprintf(path, sizeof(path), "%s", m->path);
+            pthread_mutex_lock(&vc->voice_mutex);
+            m->id = 0;
+            __atomic_fetch_sub(&vc->mix_active, 1, __ATOMIC_RELEASE);
+            pthread_mutex_unlock(&vc->voice_mutex);
+            if (!vc->stop_requested) {
+                Value args[2] = { hajimu_string(path), hajimu_number(id) };
+                event_fire("音声効果完了", 2, args);
+                event_fire("VOICE_EFFECT_END", 2, args);
+            }
         }
     }
+    return mixed;
+}
+
+/* Gain, mix and encode one 20ms PCM frame into the ring. false when the
+ * track was dropped or encoding failed. rec may be NULL. apply_gain = false
+ * のときは音量を掛けない (キャッシュ・パススルーのパケットを復号した PCM は
+ * エンコード時の音量が既に入っているため)。 */
+static bool voice_emit_pcm(VoiceConn *vc, uint32_t track, int16_t *pcm, VoiceClipRec *rec,
+                           bool apply_gain) {
+    if (apply_gain) {
+        /* Volume: ramp from the last frame's gain to the current setting */
+        int32_t g1 = __atomic_load_n(&vc->gain_target, __ATOMIC_RELAXED);
+        pcm_gain(pcm, VOICE_FRAME_SIZE, vc->gain_cur, g1, vc->limiter);
+        vc->gain_cur = g1;
+    }
+    /* 効果を混ぜたフレームはキャッシュに残さない */
+    if (voice_mix_effects(vc, pcm)) voice_clip_rec_cancel(rec);
+
+    VoiceFrame *f = voice_ring_reserve(vc, track);
+    if (!f) return false;
+    /* Opus encode straight into the ring slot */
+    int opus_len = opus_encode(vc->opus_enc, pcm, VOICE_FRAME_SAMPLES,
+                               f->data, VOICE_OPUS_MAX);
+    if (opus_len < 0) {
+        LOG_E("Opusエンコードエラー: %s", opus_strerror(opus_len));
+        return false;
+    }
+    f->len = (uint16_t)opus_len;
+    f->samples = VOICE_FRAME_SAMPLES;
+    f->kind = VFRAME_AUDIO;
+    f->track = track;
+    if (rec) voice_clip_rec_add(rec, f);
+    voice_ring_commit(&vc->ring);
     return true;
 }
 
-/* Check if source is a YouTube/supported streaming URL */
-static bool is_youtube_url(const char *url) {
-    return (strstr(url, "youtube.com/watch") != NULL ||
-            strstr(url, "youtu.be/") != NULL ||
-            strstr(url, "youtube.com/shorts/") != NULL ||
-            strstr(url, "youtube.com/playlist") != NULL ||
-            strstr(url, "music.youtube.com/") != NULL ||
-            strstr(url, "soundcloud.com/") != NULL ||
-            strstr(url, "nicovideo.jp/") != NULL ||
-            strstr(url, "twitter.com/") != NULL ||
-            strstr(url, "x.com/") != NULL);
+/* Queue an already-encoded packet as-is, or decode it and go through
+ * voice_emit_pcm while effects are playing over it. 音量はエンコード時に
+ * 掛かっているので、復号した PCM には掛け直さない。 */
+static bool voice_emit_packet(VoiceConn *vc, uint32_t track, const uint8_t *pkt,
+                              int len, int samples, VoiceClipRec *rec) {
+    if (__atomic_load_n(&vc->mix_active, __ATOMIC_ACQUIRE) > 0) {
+        if (!vc->opus_dec) {
+            int err = 0;
+            vc->opus_dec = opus_decoder_create(VOICE_SAMPLE_RATE, VOICE_CHANNELS, &err);
+            if (err != OPUS_OK) vc->opus_dec = NULL;
+        }
+        if (vc->opus_dec) {
+            int16_t pcm[VOICE_FRAME_SIZE * 6];   /* 120ms まで */
+            int n = opus_decode(vc->opus_dec, pkt, len, pcm, VOICE_FRAME_SAMPLES * 6, 0);
+            for (int off = 0; off + VOICE_FRAME_SAMPLES <= n; off += VOICE_FRAME_SAMPLES)
+                if (!voice_emit_pcm(vc, track, pcm + off * VOICE_CHANNELS, rec, false)) return false;
+            return true;
+        }
+    }
+    VoiceFrame *f = voice_ring_reserve(vc, track);
+    if (!f) return false;
+    memcpy(f->data, pkt, (size_t)len);
+    f->len = (uint16_t)len;
+    f->samples = (uint16_t)samples;
+    f->kind = VFRAME_AUDIO;
+    f->track = track;
+    if (rec) voice_clip_rec_add(rec, f);
+    voice_ring_commit(&vc->ring);
+    return true;
 }
 
-/* Run yt-dlp and read output (helper) */
-static char *ytdlp_exec(const char *args, const char *url) {
-    if (!voice_filepath_safe(url)) return NULL;
-    char cmd[2048];
-    snprintf(cmd, sizeof(cmd), "yt-dlp %s %s \"%s\" 2>/dev/null",
-             g_bot.ytdlp_cookie_opt[0] ? g_bot.ytdlp_cookie_opt : "",
-             args, url);
-    FILE *pp = popen(cmd, "r");
-    if (!pp) return NULL;
+/* End-of-track marker: the sender reports completion once the last frame
+ * has actually gone out (path が空なら完了イベントは出さない) */
+static void voice_ring_end(VoiceConn *vc, uint32_t track, const char *path) {
+    VoiceFrame *end = voice_ring_reserve(vc, 0);
+    if (!end) return;
+    end->kind = VFRAME_END;
+    end->track = track;
+    end->len = 0;
+    snprintf((char *)end->data, sizeof(end->data), "%s", path);
+    voice_ring_commit(&vc->ring);
+}
 
-    char *buf = (char *)calloc(1, 4096);
-    if (!buf) { pclose(pp); return NULL; }
-    size_t total = 0;
-    char line[1024];
-    while (fgets(line, sizeof(line), pp)) {
-        size_t len = strlen(line);
-        if (total + len >= 4095) break;
-        memcpy(buf + total, line, len);
-        total += len;
+/* Nothing queued but effects are playing: mix them over silence until they
+ * finish or a track is queued. */
+static void voice_play_effects_only(VoiceConn *vc) {
+    pthread_mutex_lock(&vc->voice_mutex);
+    uint32_t track = ++vc->track_seq;
+    pthread_mutex_unlock(&vc->voice_mutex);
+    __atomic_store_n(&vc->producing_track, track, __ATOMIC_RELEASE);
+    int16_t pcm[VOICE_FRAME_SIZE];
+    while (__atomic_load_n(&vc->mix_active, __ATOMIC_ACQUIRE) > 0 &&
+           __atomic_load_n(&vc->queue_count, __ATOMIC_RELAXED) == 0) {
+        memset(pcm, 0, sizeof(pcm));
+        if (!voice_emit_pcm(vc, track, pcm, NULL, true)) break;
     }
-    buf[total] = '\0';
-    pclose(pp);
-    /* Trim trailing newlines */
-    while (total > 0 && (buf[total-1] == '\n' || buf[total-1] == '\r'))
-        buf[--total] = '\0';
-    return buf;
+    voice_ring_end(vc, track, "");
+    __atomic_store_n(&vc->producing_track, 0, __ATOMIC_RELEASE);
 }
 
+/* Producer: dequeue → decode → Opus encode into the ring. Never touches the
+ * socket; the sender thread owns RTP state. */
 static void *voice_audio_thread_func(void *arg) {
     VoiceConn *vc = (VoiceConn *)arg;
 
     while (vc->active && !vc->stop_requested && !g_shutdown) {
+        voice_fire_done(vc);
+
         /* Get next item from queue */
         char filepath[256] = {0};
 
         pthread_mutex_lock(&vc->voice_mutex);
-        if (vc->queue_count <= 0) {
+        if (vc->queue_count <= 0 || !vc->opus_enc) {
+            if (vc->opus_enc && __atomic_load_n(&vc->mix_active, __ATOMIC_ACQUIRE) > 0) {
+                pthread_mutex_unlock(&vc->voice_mutex);
+                voice_play_effects_only(vc);
+                continue;
+            }
+            /* Nothing to play: sleep until 音声再生 / 音声効果再生 / a finished
+             * track / disconnect signals voice_cond (timeout as a safety net) */
+            if (!vc->stop_requested &&
+                __atomic_load_n(&vc->done_tail, __ATOMIC_ACQUIRE) == vc->done_head) {
+                struct timespec ts;
+                clock_gettime(CLOCK_REALTIME, &ts);
+                ts.tv_nsec += 500000000L;
+                if (ts.tv_nsec >= 1000000000L) { ts.tv_sec++; ts.tv_nsec -= 1000000000L; }
+                pthread_cond_timedwait(&vc->voice_cond, &vc->voice_mutex, &ts);
+            }
             pthread_mutex_unlock(&vc->voice_mutex);
-            /* Nothing to play, sleep and check again */
-            usleep(100000); /* 100ms */
+            /* 音声停止 でキューが空になった — 準備していた次の曲も要らない */
+            voice_prefetch_abandon(vc->prefetch);
+            vc->prefetch = NULL;
             continue;
         }
         snprintf(filepath, sizeof(filepath), "%s", vc->queue[vc->queue_head].path);
         vc->queue_head = (vc->queue_head + 1) % MAX_AUDIO_QUEUE;
         vc->queue_count--;
+        /* 取り出しと同じロックで番号を付ける — 音声停止 が取り出し直後の曲を
+         * 見落とさないように */
+        uint32_t track = ++vc->track_seq;
         pthread_mutex_unlock(&vc->voice_mutex);
 
         if (!filepath[0]) continue;
 
+        __atomic_store_n(&vc->producing_track, track, __ATOMIC_RELEASE);
         LOG_I("音声再生開始: %s", filepath);
         vc->playing = true;
         vc->paused = false;
 
-        /* Determine source: WAV file or pipe from ffmpeg */
+        /* Replays stream from the frame cache. Otherwise pre-encoded Opus
+         * goes packet-for-packet and everything else is decoded to PCM and
+         * encoded here, recording the frames for the next replay. */
+        int32_t gain = __atomic_load_n(&vc->gain_target, __ATOMIC_RELAXED);
+        uint64_t clip_key = voice_clip_key(vc, filepath);
+        VoiceClip *clip = voice_clip_acquire(clip_key);
+        bool is_pipe = false;
+        OpusDemux dm;
         FILE *fp = NULL;
-        bool use_ffmpeg = false;
-        const char *ext = strrchr(filepath, '.');
-
-        if (ext && (strcasecmp(ext, ".wav") == 0 || strcasecmp(ext, ".wave") == 0)) {
-            fp = fopen(filepath, "rb");
-            if (!fp) {
-                LOG_E("音声ファイルを開けません: %s", filepath);
-                vc->playing = false;
-                continue;
-            }
-            int channels, sample_rate, bps;
-            if (!wav_read_header(fp, &channels, &sample_rate, &bps)) {
-                LOG_E("WAVヘッダーが不正です: %s", filepath);
-                fclose(fp);
-                vc->playing = false;
-                continue;
-            }
-            LOG_D("WAV: ch=%d, sr=%d, bps=%d", channels, sample_rate, bps);
-            /* We expect 48kHz, 16bit, stereo for direct Opus encoding.
-             * If different, fall through to ffmpeg */
-            if (sample_rate != VOICE_SAMPLE_RATE || channels != VOICE_CHANNELS || bps != 16) {
-                fclose(fp);
-                fp = NULL;
-                use_ffmpeg = true;
-            }
-        } else {
-            use_ffmpeg = true;
+        PcmSource src;
+        bool decoding = false;
+        /* 前の曲の間に準備したソースがあれば引き取る。音量を変えている間は
+         * パススルーしない (PCM でしかゲインを掛けられない) */
+        if (clip) {
+            voice_prefetch_abandon(vc->prefetch);
+            vc->prefetch = NULL;
+        } else if (!voice_prefetch_take(&vc->prefetch, filepath, gain == VOICE_GAIN_ONE,
+                                        &fp, &is_pipe, &dm, &src, &decoding)) {
+            if (gain == VOICE_GAIN_ONE) fp = voice_open_passthrough(filepath, &is_pipe, &dm);
+            if (!fp) decoding = voice_open_source(filepath, &src);
         }
+        bool passthrough = fp != NULL;
+        uint64_t src_bytes = passthrough && !is_pipe ? voice_file_bytes(filepath) : 0;
+        __atomic_store_n(&vc->passthrough, passthrough, __ATOMIC_RELAXED);
+        uint32_t frames = 0;
+        bool complete = false;
+        VoiceClipRec rec;
+        if (clip) memset(&rec, 0, sizeof(rec));
+        else voice_clip_rec_begin(&rec);
+        int16_t pcm_buf[VOICE_FRAME_SIZE]; /* 960 * 2 = 1920 samples */
 
-        if (use_ffmpeg) {
-            /* Validate filepath to prevent shell injection via popen */
-            if (!voice_filepath_safe(filepath)) {
-                LOG_E("音声ファイルパスに不正な文字が含まれています: %s", filepath);
-                vc->playing = false;
-                continue;
-            }
-
-            char cmd[2048];
-            if (is_youtube_url(filepath)) {
-                /* YouTube/streaming: yt-dlp → ffmpeg pipe */
-                LOG_I("yt-dlp経由で再生: %s", filepath);
-#ifdef _WIN32
-                /* Windows: /tmp/ は存在しないため stderr を NUL に捨てる */
-                snprintf(cmd, sizeof(cmd),
-                    "yt-dlp -o - -f bestaudio --no-playlist --no-warnings %s \"%s\" 2>NUL | "
-                    "ffmpeg -i pipe:0 -f s16le -ar %d -ac %d -loglevel quiet -",
-                    g_bot.ytdlp_cookie_opt[0] ? g_bot.ytdlp_cookie_opt : "",
-                    filepath, VOICE_SAMPLE_RATE, VOICE_CHANNELS);
-#else
-                snprintf(cmd, sizeof(cmd),
-                    "yt-dlp -o - -f bestaudio --no-playlist --no-warnings %s \"%s\" 2>/tmp/hajimu_ytdlp_err.log | "
-                    "ffmpeg -i pipe:0 -f s16le -ar %d -ac %d -loglevel quiet -",
-                    g_bot.ytdlp_cookie_opt[0] ? g_bot.ytdlp_cookie_opt : "",
-                    filepath, VOICE_SAMPLE_RATE, VOICE_CHANNELS);
-#endif
-            } else {
-                /* Local file or direct URL: ffmpeg only */
-                snprintf(cmd, sizeof(cmd),
-                    "ffmpeg -i \"%s\" -f s16le -ar %d -ac %d -loglevel quiet -",
-                    filepath, VOICE_SAMPLE_RATE, VOICE_CHANNELS);
-            }
-            fp = popen(cmd, "r");
-            if (!fp) {
-                LOG_E("ffmpeg起動失敗: %s", filepath);
-                vc->playing = false;
-                continue;
+        if (clip) {
+            LOG_I("キャッシュから再生 (%u frames): %s", clip->frames, filepath);
+            size_t off = 0;
+            while (off + 4 <= clip->bytes) {
+                uint16_t len, samples;
+                memcpy(&len, clip->data + off, 2);
+                memcpy(&samples, clip->data + off + 2, 2);
+                if (off + 4 + len > clip->bytes || len > VOICE_OPUS_MAX) break;
+                if (!voice_emit_packet(vc, track, clip->data + off + 4, len, samples, NULL))
+                    break;
+                off += 4 + (size_t)len;
+                if (++frames % 500 == 0) voice_fire_done(vc);
+                if (frames % VOICE_PREFETCH_POLL == 0)
+                    voice_prefetch_poll(vc, (int64_t)(clip->frames - frames) * VOICE_FRAME_MS);
             }
-#ifdef _WIN32
-            /* Windows: popen はデフォルトでテキストモード。
-             * PCM も Opus もバイナリデータなので _setmode でバイナリモードに切り替える。
-             * これをしないと 0x1A (Ctrl+Z) のバイトが EOF と誤認されて途中で切断される。*/
-            _setmode(_fileno(fp), _O_BINARY);
-#endif
-            LOG_I("パイプ起動成功: %s", cmd);
+            voice_clip_release(clip);
         }
 
-        /* Send SPEAKING */
-        voice_send_speaking(vc, true);
-
-        /* Initialize RTP counters */
-        vc->rtp_seq = 0;
-        vc->rtp_timestamp = 0;
-        vc->voice_nonce = 0;
-
-        /* Audio loop: read PCM, Opus encode, encrypt, send RTP */
-        int16_t pcm_buf[VOICE_FRAME_SIZE]; /* 960 * 2 = 1920 samples */
-        uint8_t opus_buf[VOICE_MAX_PACKET];
-        uint8_t packet[VOICE_MAX_PACKET + 12 + crypto_aead_xchacha20poly1305_ietf_ABYTES + 4];
-
-        /* Use absolute time-based scheduling to prevent timing drift */
-        struct timespec send_start;
-        clock_gettime(CLOCK_MONOTONIC, &send_start);
-        uint64_t frames_sent = 0;
-
-        while (vc->playing && !vc->stop_requested && !g_shutdown) {
-            /* Handle pause */
-            if (vc->paused) {
-                usleep(50000); /* 50ms */
-                /* Reset timing base after unpause */
-                clock_gettime(CLOCK_MONOTONIC, &send_start);
-                frames_sent = 0;
-                continue;
+        while (passthrough) {
+            size_t off, len;
+            if (!opus_demux_packet(&dm, &off, &len)) {
+                LOG_I("音声データ読み取り完了 (EOF, frames=%u)", frames);
+                complete = feof(fp) && frames > 0;
+                break;
             }
+            /* 送信側で刻めない長さ・大きすぎるパケットは捨てる */
+            int samples = opus_demux_samples(dm.buf + off, len);
+            if (samples < 0 || len > VOICE_OPUS_MAX) continue;
+
+            if (!voice_emit_packet(vc, track, dm.buf + off, (int)len, samples, &rec)) break;
+            if (++frames % 500 == 0) voice_fire_done(vc);
+            if (frames % VOICE_PREFETCH_POLL == 0)
+                voice_prefetch_poll(vc, voice_passthrough_remaining_ms(fp, is_pipe, src_bytes, frames));
+        }
 
+        while (decoding) {
             /* Read PCM data (VOICE_FRAME_SIZE samples * 2 bytes) */
-            size_t read_bytes = fread(pcm_buf, sizeof(int16_t), VOICE_FRAME_SIZE, fp);
+            size_t read_bytes = pcm_source_read(&src, pcm_buf, VOICE_FRAME_SIZE);
             if (read_bytes == 0) {
                 /* EOF — check if yt-dlp had errors */
-                if (vc->rtp_seq == 0) {
+                if (frames == 0) {
                     LOG_E("音声データが取得できませんでした (seq=0)");
                     /* Read yt-dlp error log */
 #ifndef _WIN32
@@ -3486,185 +10294,981 @@ static void *voice_audio_thread_func(void *arg) {
                     LOG_E("yt-dlp/ffmpegのステータスを確認: yt-dlp と ffmpeg が PATH に存在するか確認してください");
 #endif
                 } else {
-                    LOG_I("音声データ読み取り完了 (EOF, seq=%u)", vc->rtp_seq);
+                    LOG_I("音声データ読み取り完了 (EOF, frames=%u)", frames);
+                    complete = pcm_source_eof(&src);
                 }
                 break;
             }
-            if (vc->rtp_seq % 500 == 0) {
-                LOG_I("音声送信中... seq=%u, bytes=%zu", vc->rtp_seq, read_bytes);
-            }
             /* Pad with silence if partial frame */
             if ((int)read_bytes < VOICE_FRAME_SIZE) {
                 memset(pcm_buf + read_bytes, 0,
                        (size_t)(VOICE_FRAME_SIZE - (int)read_bytes) * sizeof(int16_t));
             }
 
-            /* Opus encode */
-            int opus_len = opus_encode(vc->opus_enc, pcm_buf, VOICE_FRAME_SAMPLES,
-                                       opus_buf, sizeof(opus_buf));
-            if (opus_len < 0) {
-                LOG_E("Opusエンコードエラー: %s", opus_strerror(opus_len));
-                break;
+            if (!voice_emit_pcm(vc, track, pcm_buf, &rec, true)) break;
+            if (++frames % 500 == 0) voice_fire_done(vc);
+            if (frames % VOICE_PREFETCH_POLL == 0)
+                voice_prefetch_poll(vc, pcm_source_remaining_ms(&src, frames));
+        }
+
+        /* Close file/pipe — ffmpeg / yt-dlp が途中で失敗した曲はキャッシュしない */
+        if (passthrough) opus_demux_free(&dm);
+        if (fp) {
+            if (is_pipe) { if (pclose(fp) != 0) complete = false; }
+            else fclose(fp);
+        }
+        if (decoding && !pcm_source_close(&src)) complete = false;
+        /* 途中で音量が変わった曲は、どの設定のキーにも当たらないので保存しない */
+        if (complete && !voice_track_dropped(vc, track) &&
+            (passthrough || vc->gain_cur == gain))
+            voice_clip_store(clip_key, &rec);
+        else free(rec.data);
+
+        voice_ring_end(vc, track, filepath);
+        __atomic_store_n(&vc->producing_track, 0, __ATOMIC_RELEASE);
+        __atomic_store_n(&vc->passthrough, false, __ATOMIC_RELAXED);
+        vc->playing = false;
+
+        /* Check loop mode (re-queue) */
+        if (vc->loop_mode && !vc->stop_requested) {
+            pthread_mutex_lock(&vc->voice_mutex);
+            if (vc->queue_count < MAX_AUDIO_QUEUE) {
+                int tail = vc->queue_tail;
+                snprintf(vc->queue[tail].path, sizeof(vc->queue[tail].path), "%s", filepath);
+                vc->queue_tail = (vc->queue_tail + 1) % MAX_AUDIO_QUEUE;
+                vc->queue_count++;
+            }
+            pthread_mutex_unlock(&vc->voice_mutex);
+        }
+    }
+
+    LOG_I("音声スレッド終了 (guild=%s)", vc->guild_id);
+    return NULL;
+}
+
+/* --- Broadcast (v2.6.0) ---
+ * 配信スレッドがソースを 1 回だけデコード・エンコードして共有リングに書き、
+ * 購読している接続の送信スレッドがそれぞれの位置から読んで、自分の RTP ヘッダー・
+ * nonce・鍵で暗号化して送る。配信側は実時間より lead フレームだけ先行し、
+ * 読み手がリング 1 周分遅れたら (一時停止など) 現在位置に合流し直す。 */
+
+#define VOICE_CAST_BITRATE 128000
+
+static long long voice_cast_now_units(VoiceCast *c) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    long long ns = (long long)(now.tv_sec - c->clock_start.tv_sec) * 1000000000LL +
+                   (long long)(now.tv_nsec - c->clock_start.tv_nsec);
+    return ns / (VOICE_FRAME_MS * 1000000LL);
+}
+
+/* Next slot to fill, holding the producer at most c->lead frames ahead of real
+ * time. NULL when the track is skipped or the broadcast is ending. */
+static VoiceFrame *voice_cast_reserve(VoiceCast *c) {
+    for (;;) {
+        if (c->stop || c->skip || g_shutdown) return NULL;
+        long long now = voice_cast_now_units(c);
+        /* アイドル明け・生成の遅れ: 今から数え直す */
+        if (c->clock_units < now) c->clock_units = now;
+        long long ahead = c->clock_units - now;
+        if (ahead < (long long)c->lead) break;
+        usleep((useconds_t)((ahead - c->lead + 1) * VOICE_FRAME_MS * 1000));
+    }
+    VoiceFrame *slots = c->slots;
+    return &slots[c->tail & (VOICE_RING_SLOTS - 1)];
+}
+
+static void voice_cast_commit(VoiceCast *c, VoiceFrame *f) {
+    f->kind = VFRAME_AUDIO;
+    f->track = 0;
+    c->clock_units += f->samples / VOICE_FRAME_SAMPLES;
+    c->frames++;
+    __atomic_store_n(&c->tail, c->tail + 1, __ATOMIC_RELEASE);
+}
+
+static bool voice_cast_emit_pcm(VoiceCast *c, const int16_t *pcm, VoiceClipRec *rec) {
+    VoiceFrame *f = voice_cast_reserve(c);
+    if (!f) return false;
+    int opus_len = opus_encode(c->enc, pcm, VOICE_FRAME_SAMPLES, f->data, VOICE_OPUS_MAX);
+    if (opus_len < 0) {
+        LOG_E("Opusエンコードエラー: %s", opus_strerror(opus_len));
+        return false;
+    }
+    f->len = (uint16_t)opus_len;
+    f->samples = VOICE_FRAME_SAMPLES;
+    if (rec) voice_clip_rec_add(rec, f);
+    c->encoded++;
+    voice_cast_commit(c, f);
+    return true;
+}
+
+static bool voice_cast_emit_packet(VoiceCast *c, const uint8_t *pkt, int len, int samples,
+                                   VoiceClipRec *rec) {
+    VoiceFrame *f = voice_cast_reserve(c);
+    if (!f) return false;
+    memcpy(f->data, pkt, (size_t)len);
+    f->len = (uint16_t)len;
+    f->samples = (uint16_t)samples;
+    if (rec) voice_clip_rec_add(rec, f);
+    voice_cast_commit(c, f);
+    return true;
+}
+
+/* voice_prefetch_poll for a broadcast queue. */
+static void voice_cast_prefetch_poll(VoiceCast *c, int64_t remaining_ms) {
+    char next[256] = {0};
+    pthread_mutex_lock(&c->mutex);
+    if (c->queue_count > 0) snprintf(next, sizeof(next), "%s", c->queue[c->queue_head].path);
+    pthread_mutex_unlock(&c->mutex);
+    voice_prefetch_follow(&c->prefetch, next);
+    if (!c->prefetch && next[0] && remaining_ms >= 0 && remaining_ms <= VOICE_PREFETCH_LEAD_MS)
+        c->prefetch = voice_prefetch_start(
+            next, voice_clip_key_for(next, VOICE_CAST_BITRATE, VOICE_GAIN_ONE, true), true);
+}
+
+/* Broadcast producer: same source handling as voice_audio_thread_func (cache →
+ * passthrough → ffmpeg), but into the shared ring. 音量・効果は接続ごとなので
+ * 掛けない。 */
+static void *voice_cast_thread_func(void *arg) {
+    VoiceCast *c = (VoiceCast *)arg;
+    clock_gettime(CLOCK_MONOTONIC, &c->clock_start);
+    c->clock_units = 0;
+
+    while (!c->stop && !g_shutdown) {
+        char filepath[256] = {0};
+        pthread_mutex_lock(&c->mutex);
+        if (c->queue_count <= 0) {
+            if (!c->stop) {
+                struct timespec ts;
+                clock_gettime(CLOCK_REALTIME, &ts);
+                ts.tv_nsec += 500000000L;
+                if (ts.tv_nsec >= 1000000000L) { ts.tv_sec++; ts.tv_nsec -= 1000000000L; }
+                pthread_cond_timedwait(&c->cond, &c->mutex, &ts);
+            }
+            pthread_mutex_unlock(&c->mutex);
+            voice_prefetch_abandon(c->prefetch);
+            c->prefetch = NULL;
+            continue;
+        }
+        snprintf(filepath, sizeof(filepath), "%s", c->queue[c->queue_head].path);
+        c->queue_head = (c->queue_head + 1) % MAX_AUDIO_QUEUE;
+        c->queue_count--;
+        c->skip = false;
+        pthread_mutex_unlock(&c->mutex);
+        if (!filepath[0]) continue;
+
+        __atomic_store_n(&c->producing, 1, __ATOMIC_RELEASE);
+        LOG_I("音声配信 #%u 再生開始: %s", c->id, filepath);
+
+        /* 既定設定の接続と同じキー — 接続で再生した曲のキャッシュも使える */
+        uint64_t clip_key = voice_clip_key_for(filepath, VOICE_CAST_BITRATE, VOICE_GAIN_ONE, true);
+        VoiceClip *clip = voice_clip_acquire(clip_key);
+        bool is_pipe = false;
+        OpusDemux dm;
+        FILE *fp = NULL;
+        PcmSource src;
+        bool decoding = false;
+        if (clip) {
+            voice_prefetch_abandon(c->prefetch);
+            c->prefetch = NULL;
+        } else if (!voice_prefetch_take(&c->prefetch, filepath, true,
+                                        &fp, &is_pipe, &dm, &src, &decoding)) {
+            fp = voice_open_passthrough(filepath, &is_pipe, &dm);
+            if (!fp) decoding = voice_open_source(filepath, &src);
+        }
+        bool passthrough = fp != NULL;
+        uint64_t src_bytes = passthrough && !is_pipe ? voice_file_bytes(filepath) : 0;
+        uint32_t frames = 0;
+        bool complete = false;
+        VoiceClipRec rec;
+        if (clip) memset(&rec, 0, sizeof(rec));
+        else voice_clip_rec_begin(&rec);
+
+        if (clip) {
+            size_t off = 0;
+            while (off + 4 <= clip->bytes) {
+                uint16_t len, samples;
+                memcpy(&len, clip->data + off, 2);
+                memcpy(&samples, clip->data + off + 2, 2);
+                if (off + 4 + len > clip->bytes || len > VOICE_OPUS_MAX) break;
+                if (!voice_cast_emit_packet(c, clip->data + off + 4, len, samples, NULL)) break;
+                off += 4 + (size_t)len;
+                if (++frames % VOICE_PREFETCH_POLL == 0)
+                    voice_cast_prefetch_poll(c, (int64_t)(clip->frames - frames) * VOICE_FRAME_MS);
             }
+            voice_clip_release(clip);
+        }
 
-            /* Build RTP header (12 bytes) */
-            uint8_t rtp_header[12];
-            rtp_header[0] = 0x80; /* Version 2 */
-            rtp_header[1] = 0x78; /* Payload type 120 */
-            rtp_header[2] = (vc->rtp_seq >> 8) & 0xFF;
-            rtp_header[3] = vc->rtp_seq & 0xFF;
-            rtp_header[4] = (vc->rtp_timestamp >> 24) & 0xFF;
-            rtp_header[5] = (vc->rtp_timestamp >> 16) & 0xFF;
-            rtp_header[6] = (vc->rtp_timestamp >> 8) & 0xFF;
-            rtp_header[7] = vc->rtp_timestamp & 0xFF;
-            rtp_header[8] = (vc->ssrc >> 24) & 0xFF;
-            rtp_header[9] = (vc->ssrc >> 16) & 0xFF;
-            rtp_header[10] = (vc->ssrc >> 8) & 0xFF;
-            rtp_header[11] = vc->ssrc & 0xFF;
-
-            /* AEAD XChaCha20-Poly1305 (rtpsize) encryption:
-             * nonce = 24 bytes: 4-byte counter (big-endian) + 20 zero bytes
-             * AAD = RTP header (12 bytes)
-             * 4-byte nonce suffix appended to packet */
-            uint32_t nonce_val = vc->voice_nonce++;
-            uint8_t nonce[24];
-            memset(nonce, 0, sizeof(nonce));
-            nonce[0] = (nonce_val >> 24) & 0xFF;
-            nonce[1] = (nonce_val >> 16) & 0xFF;
-            nonce[2] = (nonce_val >> 8) & 0xFF;
-            nonce[3] = nonce_val & 0xFF;
-
-            /* Encrypt opus data with AEAD (authenticated with RTP header as AAD) */
-            uint8_t encrypted[VOICE_MAX_PACKET + crypto_aead_xchacha20poly1305_ietf_ABYTES];
-            unsigned long long clen = 0;
-            if (crypto_aead_xchacha20poly1305_ietf_encrypt(
-                    encrypted, &clen,
-                    opus_buf, (unsigned long long)opus_len,
-                    rtp_header, 12,  /* AAD = RTP header */
-                    NULL, nonce, vc->secret_key) != 0) {
-                LOG_E("音声暗号化失敗");
+        while (passthrough) {
+            size_t off, len;
+            if (!opus_demux_packet(&dm, &off, &len)) {
+                complete = feof(fp) && frames > 0;
                 break;
             }
+            int samples = opus_demux_samples(dm.buf + off, len);
+            if (samples < 0 || len > VOICE_OPUS_MAX) continue;
+            if (!voice_cast_emit_packet(c, dm.buf + off, (int)len, samples, &rec)) break;
+            if (++frames % VOICE_PREFETCH_POLL == 0)
+                voice_cast_prefetch_poll(c, voice_passthrough_remaining_ms(fp, is_pipe, src_bytes, frames));
+        }
 
-            /* Assemble final packet: RTP header + encrypted audio + 4-byte nonce suffix */
-            memcpy(packet, rtp_header, 12);
-            memcpy(packet + 12, encrypted, (size_t)clen);
-            /* Append 4-byte nonce at end */
-            packet[12 + (int)clen]     = nonce[0];
-            packet[12 + (int)clen + 1] = nonce[1];
-            packet[12 + (int)clen + 2] = nonce[2];
-            packet[12 + (int)clen + 3] = nonce[3];
-            int total_len = 12 + (int)clen + 4;
-
-            /* Send via UDP */
-            ssize_t sent = sendto(vc->udp_fd, packet, (size_t)total_len, 0,
-                                  (struct sockaddr *)&vc->udp_addr, sizeof(vc->udp_addr));
-            if (sent < 0) {
-                LOG_E("Voice UDP送信失敗: %s", strerror(errno));
+        int16_t pcm_buf[VOICE_FRAME_SIZE];
+        while (decoding) {
+            size_t read_bytes = pcm_source_read(&src, pcm_buf, VOICE_FRAME_SIZE);
+            if (read_bytes == 0) {
+                if (frames == 0) LOG_E("音声配信 #%u: 音声データが取得できませんでした", c->id);
+                complete = pcm_source_eof(&src) && frames > 0;
                 break;
             }
+            if ((int)read_bytes < VOICE_FRAME_SIZE) {
+                memset(pcm_buf + read_bytes, 0,
+                       (size_t)(VOICE_FRAME_SIZE - (int)read_bytes) * sizeof(int16_t));
+            }
+            if (!voice_cast_emit_pcm(c, pcm_buf, &rec)) break;
+            if (++frames % VOICE_PREFETCH_POLL == 0)
+                voice_cast_prefetch_poll(c, pcm_source_remaining_ms(&src, frames));
+        }
+
+        if (passthrough) opus_demux_free(&dm);
+        if (fp) {
+            if (is_pipe) { if (pclose(fp) != 0) complete = false; }
+            else fclose(fp);
+        }
+        if (decoding && !pcm_source_close(&src)) complete = false;
+        if (complete && !c->skip) voice_clip_store(clip_key, &rec);
+        else free(rec.data);
+        __atomic_store_n(&c->producing, 0, __ATOMIC_RELEASE);
+
+        if (!c->stop) {
+            Value args[2] = { hajimu_number(c->id), hajimu_string(filepath) };
+            event_fire("音声配信完了", 2, args);
+            event_fire("VOICE_BROADCAST_END", 2, args);
+        }
+
+        pthread_mutex_lock(&c->mutex);
+        if (c->loop_mode && !c->stop && c->queue_count < MAX_AUDIO_QUEUE) {
+            int tail = c->queue_tail;
+            snprintf(c->queue[tail].path, sizeof(c->queue[tail].path), "%s", filepath);
+            c->queue_tail = (c->queue_tail + 1) % MAX_AUDIO_QUEUE;
+            c->queue_count++;
+        }
+        pthread_mutex_unlock(&c->mutex);
+    }
+
+    LOG_I("音声配信 #%u 終了", c->id);
+    return NULL;
+}
+
+/* Subscriber side: copy the next broadcast frame's payload to dst. The copy is
+ * checked against the producer afterwards — a slot it lapped is discarded and
+ * the reader rejoins at the live position. 送信スレッドの mutex を持って呼ぶ。 */
+static bool voice_cast_read(VoiceConn *vc, uint8_t *dst, int *len, uint32_t *samples) {
+    VoiceCast *c = vc->cast;
+    for (;;) {
+        uint32_t tail = __atomic_load_n(&c->tail, __ATOMIC_ACQUIRE);
+        if (tail - vc->cast_pos > VOICE_RING_SLOTS - 8) {
+            vc->cast_pos = tail > c->lead ? tail - c->lead : 0;
+            continue;
+        }
+        if (vc->cast_pos == tail) return false;
+        const VoiceFrame *f = &c->slots[vc->cast_pos & (VOICE_RING_SLOTS - 1)];
+        int n = f->len;
+        uint32_t s = f->samples;
+        if (n > VOICE_OPUS_MAX) n = 0;
+        memcpy(dst, f->data, (size_t)n);
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (__atomic_load_n(&c->tail, __ATOMIC_ACQUIRE) - vc->cast_pos >= VOICE_RING_SLOTS)
+            continue;           /* 読んでいる間に上書きされた */
+        vc->cast_pos++;
+        *len = n;
+        *samples = s;
+        return true;
+    }
+}
+
+/* Switch a connection to a broadcast (NULL = back to its own queue). The
+ * swap happens under the sender's mutex so a tick never sees a half state. */
+static bool voice_cast_subscribe(VoiceConn *vc, VoiceCast *c) {
+    if (vc->sender_id < 0) return false;
+    if (c && !vc->cast_pkt) {
+        vc->cast_pkt = malloc(sizeof(*vc->cast_pkt) * VOICE_SEND_BATCH);
+        if (!vc->cast_pkt) return false;
+    }
+    VoiceSender *s = &g_bot.voice_senders.threads[vc->sender_id];
+    pthread_mutex_lock(&s->mutex);
+    if (vc->cast) __atomic_fetch_sub(&vc->cast->subscribers, 1, __ATOMIC_RELAXED);
+    vc->cast = c;
+    if (c) {
+        uint32_t tail = __atomic_load_n(&c->tail, __ATOMIC_ACQUIRE);
+        vc->cast_pos = tail > c->lead ? tail - c->lead : 0;
+        __atomic_fetch_add(&c->subscribers, 1, __ATOMIC_RELAXED);
+    }
+    pthread_mutex_unlock(&s->mutex);
+    return true;
+}
+
+static pthread_once_t g_voice_cast_once = PTHREAD_ONCE_INIT;
+
+static void voice_cast_init_once(void) {
+    pthread_mutex_init(&g_bot.voice_cast_mutex, NULL);
+}
+
+static VoiceCast *voice_cast_find(uint32_t id) {
+    if (!id) return NULL;
+    for (int i = 0; i < MAX_VOICE_CASTS; i++)
+        if (g_bot.voice_casts[i].id == id) return &g_bot.voice_casts[i];
+    return NULL;
+}
+
+/* Unsubscribe everyone, stop the producer and release the slot. */
+static void voice_cast_free(VoiceCast *c) {
+    for (int i = 0; i < MAX_VOICE_CONNS; i++) {
+        VoiceConn *vc = &g_bot.voice_conns[i];
+        if (vc->active && vc->cast == c) voice_cast_subscribe(vc, NULL);
+    }
+    pthread_mutex_lock(&c->mutex);
+    c->stop = true;
+    pthread_cond_signal(&c->cond);
+    pthread_mutex_unlock(&c->mutex);
+    pthread_join(c->thread, NULL);
+    voice_prefetch_cancel(c->prefetch);
+    c->prefetch = NULL;
+    opus_encoder_destroy(c->enc);
+    free(c->slots);
+    pthread_cond_destroy(&c->cond);
+    pthread_mutex_destroy(&c->mutex);
+    c->slots = NULL;
+    c->enc = NULL;
+    c->id = 0;
+}
+
+/* One connection's share of a wheel tick. ticks > 1 only when the pool thread
+ * fell behind; the frames owed are then sealed back to back and go out in one
+ * sendmmsg. Called with the owning sender's mutex held, so SPEAKING changes are
+ * only flagged here — the pool thread sends op 5 after releasing the mutex. */
+static void voice_sender_service(VoiceConn *vc, int ticks) {
+    static const uint8_t silence[] = {0xF8, 0xFF, 0xFE}; /* Opus silence frame */
+    VoiceRing *r = &vc->ring;
+    if (!vc->ready || vc->paused || vc->stop_requested) return;
+
+    uint8_t *pkt[VOICE_SEND_BATCH];
+    size_t len[VOICE_SEND_BATCH];
+    int n = 0, quiet = 0;
+    uint32_t used = 0;          /* 消費したスロット — 送り終えてから pop する */
+    bool finished = false, mute = false;
+
+    if (ticks > VOICE_SEND_BATCH) ticks = VOICE_SEND_BATCH;
+    for (int t = 0; t < ticks; t++) {
+        if (vc->hold > 0) {
+            vc->hold--;
+            continue;
+        }
+
+        /* 購読中の配信があればそのフレームを、なければ自分のリングを送る */
+        uint8_t *b = NULL;
+        int flen = 0;
+        uint32_t fsamples = 0;
+        if (vc->cast) {
+            if (voice_cast_read(vc, vc->cast_pkt[n] + 12, &flen, &fsamples))
+                b = vc->cast_pkt[n];
+        } else {
+            /* Skip dropped frames and consume end-of-track markers */
+            VoiceFrame *f;
+            while ((f = voice_ring_peek(r, used)) &&
+                   (f->kind == VFRAME_END || voice_track_dropped(vc, f->track))) {
+                if (f->kind == VFRAME_END) {
+                    if (f->data[0]) {
+                        voice_post_done(vc, (const char *)f->data);
+                        finished = true;
+                    }
+                    __atomic_store_n(&vc->sending_track, 0, __ATOMIC_RELEASE);
+                }
+                used++;
+            }
+            if (f) {
+                uint32_t depth = voice_ring_count(r) - used;
+                if (depth < r->low_water) r->low_water = depth;
+                __atomic_store_n(&vc->sending_track, f->track, __ATOMIC_RELEASE);
+                b = f->rtp;
+                flen = f->len;
+                fsamples = f->samples;
+                used++;
+            }
+        }
 
-            vc->rtp_seq++;
-            vc->rtp_timestamp += VOICE_FRAME_SAMPLES;
-            frames_sent++;
-
-            /* Sleep until next frame's absolute deadline (prevents timing drift) */
-            long long target_ns = (long long)frames_sent * VOICE_FRAME_MS * 1000000LL;
-            struct timespec now;
-            clock_gettime(CLOCK_MONOTONIC, &now);
-            long long elapsed_ns = (long long)(now.tv_sec - send_start.tv_sec) * 1000000000LL +
-                                   (long long)(now.tv_nsec - send_start.tv_nsec);
-            if (elapsed_ns < target_ns) {
-                struct timespec sleep_ts;
-                long long sleep_ns = target_ns - elapsed_ns;
-                sleep_ts.tv_sec = (time_t)(sleep_ns / 1000000000LL);
-                sleep_ts.tv_nsec = (long)(sleep_ns % 1000000000LL);
-                nanosleep(&sleep_ts, NULL);
+        if (b) {
+            if (!vc->speaking) {
+                vc->speaking = true;
+                vc->speaking_changed = !vc->speaking_changed;
+            }
+            mute = false;
+            size_t l = voice_seal_packet(vc, b, flen, fsamples);
+            if (l) {
+                pkt[n] = b;
+                len[n++] = l;
+            }
+            vc->hold = fsamples / VOICE_FRAME_SAMPLES - 1;
+            __atomic_fetch_add(&r->sent, 1, __ATOMIC_RELAXED);
+            vc->silence_left = 5;
+        } else if (vc->speaking && !mute) {
+            uint32_t prod = vc->cast ? (uint32_t)__atomic_load_n(&vc->cast->producing, __ATOMIC_ACQUIRE)
+                          : __atomic_load_n(&vc->producing_track, __ATOMIC_ACQUIRE);
+            if (prod && (vc->cast || !voice_track_dropped(vc, prod))) {
+                /* Producer is mid-track but behind: leave a gap in the
+                 * timeline rather than stalling the clock */
+                __atomic_fetch_add(&r->underruns, 1, __ATOMIC_RELAXED);
+                vc->rtp_timestamp += VOICE_FRAME_SAMPLES;
+            } else if (vc->silence_left > 0) {
+                /* 5 frames of silence, then SPEAKING off */
+                uint8_t *b = vc->silence_pkt[quiet++];
+                memcpy(b + 12, silence, sizeof(silence));
+                size_t l = voice_seal_packet(vc, b, (int)sizeof(silence), VOICE_FRAME_SAMPLES);
+                if (l) {
+                    pkt[n] = b;
+                    len[n++] = l;
+                }
+                if (--vc->silence_left == 0) mute = true;
             }
         }
+    }
 
-        /* Send SPEAKING off + 5 frames of silence */
-        voice_send_speaking(vc, false);
-        for (int i = 0; i < 5 && vc->active; i++) {
-            /* Opus silence frame */
-            static const uint8_t silence[] = {0xF8, 0xFF, 0xFE};
-            uint8_t rtp_header[12];
-            rtp_header[0] = 0x80;
-            rtp_header[1] = 0x78;
-            rtp_header[2] = (vc->rtp_seq >> 8) & 0xFF;
-            rtp_header[3] = vc->rtp_seq & 0xFF;
-            rtp_header[4] = (vc->rtp_timestamp >> 24) & 0xFF;
-            rtp_header[5] = (vc->rtp_timestamp >> 16) & 0xFF;
-            rtp_header[6] = (vc->rtp_timestamp >> 8) & 0xFF;
-            rtp_header[7] = vc->rtp_timestamp & 0xFF;
-            rtp_header[8] = (vc->ssrc >> 24) & 0xFF;
-            rtp_header[9] = (vc->ssrc >> 16) & 0xFF;
-            rtp_header[10] = (vc->ssrc >> 8) & 0xFF;
-            rtp_header[11] = vc->ssrc & 0xFF;
-
-            uint8_t nonce[24];
-            memset(nonce, 0, sizeof(nonce));
-            uint32_t sil_nonce_val = vc->voice_nonce++;
-            nonce[0] = (sil_nonce_val >> 24) & 0xFF;
-            nonce[1] = (sil_nonce_val >> 16) & 0xFF;
-            nonce[2] = (sil_nonce_val >> 8) & 0xFF;
-            nonce[3] = sil_nonce_val & 0xFF;
-
-            uint8_t enc_silence[3 + crypto_aead_xchacha20poly1305_ietf_ABYTES];
-            unsigned long long sil_clen = 0;
-            crypto_aead_xchacha20poly1305_ietf_encrypt(
-                enc_silence, &sil_clen,
-                silence, 3,
-                rtp_header, 12,
-                NULL, nonce, vc->secret_key);
-
-            uint8_t pkt[12 + 3 + crypto_aead_xchacha20poly1305_ietf_ABYTES + 4];
-            memcpy(pkt, rtp_header, 12);
-            memcpy(pkt + 12, enc_silence, (size_t)sil_clen);
-            pkt[12 + (int)sil_clen]     = nonce[0];
-            pkt[12 + (int)sil_clen + 1] = nonce[1];
-            pkt[12 + (int)sil_clen + 2] = nonce[2];
-            pkt[12 + (int)sil_clen + 3] = nonce[3];
-            sendto(vc->udp_fd, pkt, (size_t)(12 + (int)sil_clen + 4), 0,
-                   (struct sockaddr *)&vc->udp_addr, sizeof(vc->udp_addr));
+    if (n > 0) voice_udp_send(vc, pkt, len, n);
+    if (used > 0) voice_ring_pop(r, used);
+    if (mute) {
+        vc->speaking = false;
+        vc->speaking_changed = !vc->speaking_changed;
+    }
+    if (finished) voice_wake(vc);
+}
+
+static int voice_cpu_count(void) {
+#ifdef _WIN32
+    SYSTEM_INFO si;
+    GetSystemInfo(&si);
+    return si.dwNumberOfProcessors > 0 ? (int)si.dwNumberOfProcessors : 1;
+#else
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+    return n > 0 ? (int)n : 1;
+#endif
+}
+
+/* 音声送信設定 の 高優先度 / CPU固定 — best effort; the OS may refuse. */
+static void voice_sender_tune(VoiceSender *s) {
+    VoiceSenderPool *p = &g_bot.voice_senders;
+    if (p->high_priority) {
+#ifdef _WIN32
+        if (!SetThreadPriority(GetCurrentThread(), THREAD_PRIORITY_TIME_CRITICAL))
+            LOG_W("音声送信スレッド%d: 優先度を上げられません", s->index);
+#else
+        struct sched_param sp;
+        memset(&sp, 0, sizeof(sp));
+        sp.sched_priority = sched_get_priority_min(SCHED_FIFO) + 1;
+        int rc = pthread_setschedparam(pthread_self(), SCHED_FIFO, &sp);
+        if (rc != 0)
+            LOG_W("音声送信スレッド%d: 優先度を上げられません (%s)", s->index, strerror(rc));
+#endif
+    }
+    if (p->pin_cpu) {
+        int cpu = s->index % voice_cpu_count();
+#if defined(_WIN32)
+        if (!SetThreadAffinityMask(GetCurrentThread(), (DWORD_PTR)1 << cpu))
+            LOG_W("音声送信スレッド%d: CPU%d に固定できません", s->index, cpu);
+#elif defined(__linux__)
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(cpu, &set);
+        int rc = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+        if (rc != 0)
+            LOG_W("音声送信スレッド%d: CPU%d に固定できません (%s)", s->index, cpu, strerror(rc));
+#else
+        LOG_W("音声送信スレッド%d: CPU固定はこの環境では使えません", s->index);
+#endif
+    }
+}
+
+/* Pool sender: walks its 20-slot wheel on an absolute 1ms clock. Each slot is
+ * visited once per 20ms, and every connection parked there gets one frame. */
+static void *voice_sender_thread_func(void *arg) {
+    VoiceSender *s = (VoiceSender *)arg;
+    voice_sender_tune(s);
+
+    /* Use absolute time-based scheduling to prevent timing drift */
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    long long cursor = 0;       /* 次に処理する ms */
+
+    while (!g_shutdown) {
+        struct timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        long long now_ms = ((long long)(now.tv_sec - start.tv_sec) * 1000000000LL +
+                            (long long)(now.tv_nsec - start.tv_nsec)) / 1000000LL;
+        int visits[VOICE_WHEEL_SLOTS] = {0};
+        bool late = now_ms - cursor > 200;
+        if (late) cursor = now_ms;  /* Stalled (suspend, debugger…): rebase instead of bursting */
+        for (; cursor <= now_ms; cursor++) visits[cursor % VOICE_WHEEL_SLOTS]++;
+
+        VoiceConn *speak[VOICE_SPEAK_BATCH];
+        bool speak_on[VOICE_SPEAK_BATCH];
+        int nspeak = 0;
+        pthread_mutex_lock(&s->mutex);
+        for (int w = 0; w < VOICE_WHEEL_SLOTS; w++) {
+            for (int i = 0; i < s->count[w]; i++) {
+                VoiceConn *vc = s->wheel[w][i];
+                if (late) __atomic_fetch_add(&vc->ring.late, 1, __ATOMIC_RELAXED);
+                if (visits[w]) voice_sender_service(vc, visits[w]);
+                if (vc->speaking_changed && nspeak < VOICE_SPEAK_BATCH) {
+                    vc->speaking_changed = false;
+                    speak_on[nspeak] = vc->speaking;
+                    speak[nspeak++] = vc;
+                }
+            }
+        }
+        /* Sleep until the next occupied slot */
+        int d = 0;
+        while (d < VOICE_WHEEL_SLOTS - 1 && s->count[(cursor + d) % VOICE_WHEEL_SLOTS] == 0) d++;
+        /* op 5 は WS への SSL_write (ws_write_mutex 待ちもある) なので wheel の
+         * mutex を離してから送る。speak_mutex を先に取り、その間に外された接続は
+         * detach がここを待つ */
+        if (nspeak) pthread_mutex_lock(&s->speak_mutex);
+        pthread_mutex_unlock(&s->mutex);
+        if (nspeak) {
+            for (int i = 0; i < nspeak; i++) voice_send_speaking(speak[i], speak_on[i]);
+            pthread_mutex_unlock(&s->speak_mutex);
+        }
+
+        long long target_ns = (cursor + d) * 1000000LL;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        long long elapsed_ns = (long long)(now.tv_sec - start.tv_sec) * 1000000000LL +
+                               (long long)(now.tv_nsec - start.tv_nsec);
+        if (elapsed_ns < target_ns) {
+            struct timespec sleep_ts;
+            long long sleep_ns = target_ns - elapsed_ns;
+            sleep_ts.tv_sec = (time_t)(sleep_ns / 1000000000LL);
+            sleep_ts.tv_nsec = (long)(sleep_ns % 1000000000LL);
+            nanosleep(&sleep_ts, NULL);
+        }
+    }
+
+    LOG_I("音声送信スレッド%d終了", s->index);
+    return NULL;
+}
+
+static pthread_once_t g_voice_sender_once = PTHREAD_ONCE_INIT;
+
+static void voice_sender_init_once(void) {
+    pthread_mutex_init(&g_bot.voice_senders.mutex, NULL);
+}
+
+/* Start the pool on the first VC接続: 音声送信設定 のスレッド数、
+ * 既定はコア数 (最大 8)。 p->mutex を持って呼ぶ。 */
+static bool voice_sender_start(VoiceSenderPool *p) {
+    int n = p->want;
+    if (n <= 0) {
+        n = voice_cpu_count();
+        if (n > 8) n = 8;
+    }
+    if (n > VOICE_SENDERS_MAX) n = VOICE_SENDERS_MAX;
+    for (int i = 0; i < n; i++) {
+        VoiceSender *s = &p->threads[i];
+        s->index = i;
+        pthread_mutex_init(&s->mutex, NULL);
+        pthread_mutex_init(&s->speak_mutex, NULL);
+        if (pthread_create(&s->thread, NULL, voice_sender_thread_func, s) != 0) {
+            pthread_mutex_destroy(&s->speak_mutex);
+            pthread_mutex_destroy(&s->mutex);
+            break;
+        }
+        p->count++;
+    }
+    if (p->count == 0) {
+        LOG_E("音声送信スレッドを起動できません");
+        return false;
+    }
+    LOG_I("音声送信スレッド起動: %d本", p->count);
+    return true;
+}
+
+/* Park a connection on the least-loaded sender, in its emptiest slot. */
+static bool voice_sender_attach(VoiceConn *vc) {
+    VoiceSenderPool *p = &g_bot.voice_senders;
+    pthread_once(&g_voice_sender_once, voice_sender_init_once);
+    pthread_mutex_lock(&p->mutex);
+    if (p->count == 0 && !voice_sender_start(p)) {
+        pthread_mutex_unlock(&p->mutex);
+        return false;
+    }
+    VoiceSender *s = &p->threads[0];
+    for (int i = 1; i < p->count; i++)
+        if (p->threads[i].load < s->load) s = &p->threads[i];
+
+    pthread_mutex_lock(&s->mutex);
+    int w = 0;
+    for (int i = 1; i < VOICE_WHEEL_SLOTS; i++)
+        if (s->count[i] < s->count[w]) w = i;
+    if (s->count[w] == s->cap[w]) {
+        int cap = s->cap[w] ? s->cap[w] * 2 : 4;
+        VoiceConn **grown = realloc(s->wheel[w], (size_t)cap * sizeof(*grown));
+        if (!grown) {
+            pthread_mutex_unlock(&s->mutex);
+            pthread_mutex_unlock(&p->mutex);
+            return false;
+        }
+        s->wheel[w] = grown;
+        s->cap[w] = cap;
+    }
+    s->wheel[w][s->count[w]++] = vc;
+    s->load++;
+    vc->sender_id = s->index;
+    vc->wheel_slot = w;
+    pthread_mutex_unlock(&s->mutex);
+    pthread_mutex_unlock(&p->mutex);
+    return true;
+}
+
+static void voice_sender_detach(VoiceConn *vc) {
+    if (vc->sender_id < 0) return;
+    VoiceSenderPool *p = &g_bot.voice_senders;
+    VoiceSender *s = &p->threads[vc->sender_id];
+    pthread_mutex_lock(&p->mutex);
+    pthread_mutex_lock(&s->mutex);
+    int w = vc->wheel_slot;
+    for (int i = 0; i < s->count[w]; i++) {
+        if (s->wheel[w][i] != vc) continue;
+        s->wheel[w][i] = s->wheel[w][--s->count[w]];
+        s->load--;
+        break;
+    }
+    pthread_mutex_unlock(&s->mutex);
+    /* 外す前に集めた SPEAKING を送り終えるのを待つ */
+    pthread_mutex_lock(&s->speak_mutex);
+    pthread_mutex_unlock(&s->speak_mutex);
+    pthread_mutex_unlock(&p->mutex);
+    vc->sender_id = -1;
+    vc->speaking_changed = false;
+}
+
+/* --- Voice receive (v2.6.0) ---
+ * recv_thread は UDP を recvmmsg でまとめて読み、AEAD XChaCha20-Poly1305
+ * (rtpsize) をその場で復号して SSRC ごとのジッタバッファに seq 順で入れるだけ。
+ * play_thread が 20ms ごとに各話者のバッファから 1 フレームずつ取り出し、
+ * 話者ごとの Opus デコーダーで PCM にして WAV・コールバックへ渡す。欠けた
+ * フレームは Opus の欠落補間 (PLC) で埋める。 */
+
+static VoiceRecvStream *voice_recv_stream(VoiceRecv *rv, uint32_t ssrc) {
+    for (int i = 0; i < rv->stream_count; i++)
+        if (rv->streams[i]->ssrc == ssrc) return rv->streams[i];
+    if (rv->stream_count >= VOICE_RECV_STREAMS) return NULL;
+    VoiceRecvStream *s = calloc(1, sizeof(*s));
+    if (!s) return NULL;
+    s->ssrc = ssrc;
+    rv->streams[rv->stream_count++] = s;
+    return s;
+}
+
+/* Decrypt one datagram in place and file its Opus payload by seq.
+ * rv->mutex を持って呼ぶ。 */
+static void voice_recv_packet(VoiceConn *vc, VoiceRecv *rv, uint8_t *buf, size_t len) {
+    /* RTP v2, payload type 120 only (RTCP など他は捨てる) */
+    if (len < 12 + crypto_aead_xchacha20poly1305_ietf_ABYTES + 4) return;
+    if ((buf[0] >> 6) != 2 || (buf[1] & 0x7F) != 0x78) return;
+    size_t hdr = 12 + (size_t)(buf[0] & 0x0F) * 4;
+    bool ext = (buf[0] & 0x10) != 0;
+    if (ext) hdr += 4;          /* rtpsize: 拡張ヘッダーの 4 バイトまでが AAD */
+    if (hdr + crypto_aead_xchacha20poly1305_ietf_ABYTES + 4 > len) return;
+
+    uint8_t nonce[24];
+    memset(nonce, 0, sizeof(nonce));
+    memcpy(nonce, buf + len - 4, 4);
+    unsigned long long plen = 0;
+    if (crypto_aead_xchacha20poly1305_ietf_decrypt(
+            buf + hdr, &plen, NULL,
+            buf + hdr, (unsigned long long)(len - 4 - hdr),
+            buf, hdr, nonce, vc->secret_key) != 0) {
+        rv->decrypt_errors++;
+        return;
+    }
+    const uint8_t *opus = buf + hdr;
+    if (ext) {
+        size_t ext_bytes = (size_t)((buf[hdr - 2] << 8) | buf[hdr - 1]) * 4;
+        if (ext_bytes > plen) return;
+        opus += ext_bytes;
+        plen -= ext_bytes;
+    }
+    if (plen == 0 || plen > VOICE_OPUS_MAX) return;
+
+    uint32_t ssrc = ((uint32_t)buf[8] << 24) | ((uint32_t)buf[9] << 16) |
+                    ((uint32_t)buf[10] << 8) | buf[11];
+    uint16_t seq = (uint16_t)((buf[2] << 8) | buf[3]);
+    VoiceRecvStream *s = voice_recv_stream(rv, ssrc);
+    if (!s) {
+        rv->no_slot++;
+        return;
+    }
+    rv->packets++;
+    s->packets++;
+
+    int16_t ahead = (int16_t)(seq - s->next_seq);
+    if (!s->playing && (s->count == 0 || (ahead < 0 && -ahead < VOICE_JB_SLOTS / 2))) {
+        /* 発話の始まり: 最初に届いた (または順序が入れ替わったより古い) seq から */
+        if (s->count == 0 || ahead < 0) s->next_seq = seq;
+        ahead = (int16_t)(seq - s->next_seq);
+    }
+    if (ahead < 0) {
+        s->late++;              /* もう取り出し済みの位置 */
+        return;
+    }
+    if (ahead >= VOICE_JB_SLOTS) {
+        /* 大きく飛んだ: 古い分を捨てて合わせ直す */
+        for (int i = 0; i < VOICE_JB_SLOTS; i++) s->jb[i].used = false;
+        s->count = 0;
+        s->next_seq = seq;
+        s->playing = false;
+    }
+    VoiceJitterSlot *slot = &s->jb[seq & (VOICE_JB_SLOTS - 1)];
+    if (slot->used && slot->seq == seq) return;     /* 重複 */
+    if (!slot->used) s->count++;
+    slot->used = true;
+    slot->seq = seq;
+    slot->len = (uint16_t)plen;
+    memcpy(slot->data, opus, plen);
+}
+
+static void *voice_recv_thread_func(void *arg) {
+    VoiceConn *vc = (VoiceConn *)arg;
+    VoiceRecv *rv = vc->recv;
+    uint8_t (*bufs)[2048] = malloc(sizeof(*bufs) * VOICE_RECV_BATCH);
+    if (!bufs) return NULL;
+
+    /* 話者が多いチャンネルでも取りこぼさないよう受信バッファを広げる */
+    int rcvbuf = 1 << 20;
+    setsockopt(vc->udp_fd, SOL_SOCKET, SO_RCVBUF, (const char *)&rcvbuf, sizeof(rcvbuf));
+    sock_set_rcvtimeo(vc->udp_fd, 1);
+
+#ifdef __linux__
+    struct mmsghdr msgs[VOICE_RECV_BATCH];
+    struct iovec iov[VOICE_RECV_BATCH];
+    struct sockaddr_in from[VOICE_RECV_BATCH];
+#endif
+    while (!rv->stop && vc->active && !vc->stop_requested && !g_shutdown) {
+        int n = 0;
+        size_t lens[VOICE_RECV_BATCH];
+        bool ok[VOICE_RECV_BATCH];
+#ifdef __linux__
+        memset(msgs, 0, sizeof(msgs));
+        for (int i = 0; i < VOICE_RECV_BATCH; i++) {
+            iov[i].iov_base = bufs[i];
+            iov[i].iov_len = sizeof(bufs[i]);
+            msgs[i].msg_hdr.msg_name = &from[i];
+            msgs[i].msg_hdr.msg_namelen = sizeof(from[i]);
+            msgs[i].msg_hdr.msg_iov = &iov[i];
+            msgs[i].msg_hdr.msg_iovlen = 1;
+        }
+        n = recvmmsg(vc->udp_fd, msgs, VOICE_RECV_BATCH, MSG_WAITFORONE, NULL);
+        for (int i = 0; i < n; i++) {
+            lens[i] = msgs[i].msg_len;
+            ok[i] = from[i].sin_addr.s_addr == vc->udp_addr.sin_addr.s_addr &&
+                    from[i].sin_port == vc->udp_addr.sin_port;
+        }
+#else
+        struct sockaddr_in from;
+        socklen_t fl = sizeof(from);
+        ssize_t r = recvfrom(vc->udp_fd, (char *)bufs[0], sizeof(bufs[0]), 0,
+                             (struct sockaddr *)&from, &fl);
+        if (r > 0) {
+            n = 1;
+            lens[0] = (size_t)r;
+            ok[0] = from.sin_addr.s_addr == vc->udp_addr.sin_addr.s_addr &&
+                    from.sin_port == vc->udp_addr.sin_port;
+        }
+#endif
+        if (n <= 0) continue;   /* timeout — stop フラグを見直す */
+        pthread_mutex_lock(&rv->mutex);
+        for (int i = 0; i < n; i++)
+            if (ok[i]) voice_recv_packet(vc, rv, bufs[i], lens[i]);
+        pthread_mutex_unlock(&rv->mutex);
+    }
+    free(bufs);
+    return NULL;
+}
+
+/* 44-byte PCM WAV header for 48kHz/16bit/stereo; rewritten with the real
+ * sizes when the file is closed. */
+static void wav_write_header(FILE *fp, uint32_t data_bytes) {
+    uint8_t h[44];
+    uint32_t rate = VOICE_SAMPLE_RATE, byte_rate = VOICE_SAMPLE_RATE * VOICE_CHANNELS * 2;
+    uint32_t riff = 36 + data_bytes;
+    memcpy(h, "RIFF", 4);
+    for (int i = 0; i < 4; i++) h[4 + i] = (uint8_t)(riff >> (8 * i));
+    memcpy(h + 8, "WAVEfmt ", 8);
+    h[16] = 16; h[17] = h[18] = h[19] = 0;
+    h[20] = 1; h[21] = 0;                       /* PCM */
+    h[22] = VOICE_CHANNELS; h[23] = 0;
+    for (int i = 0; i < 4; i++) h[24 + i] = (uint8_t)(rate >> (8 * i));
+    for (int i = 0; i < 4; i++) h[28 + i] = (uint8_t)(byte_rate >> (8 * i));
+    h[32] = VOICE_CHANNELS * 2; h[33] = 0;
+    h[34] = 16; h[35] = 0;
+    memcpy(h + 36, "data", 4);
+    for (int i = 0; i < 4; i++) h[40 + i] = (uint8_t)(data_bytes >> (8 * i));
+    fwrite(h, 1, sizeof(h), fp);
+}
+
+static void voice_recv_close_wav(VoiceRecvStream *s) {
+    if (!s->wav) return;
+    uint64_t bytes = s->wav_samples * VOICE_CHANNELS * 2;
+    if (bytes > 0xFFFFFFFFULL - 36) bytes = 0xFFFFFFFFULL - 36;
+    fseek(s->wav, 0, SEEK_SET);
+    wav_write_header(s->wav, (uint32_t)bytes);
+    fclose(s->wav);
+    s->wav = NULL;
+}
+
+/* Hand one decoded frame to the sinks. WAV は録音開始からの時間軸に揃え、
+ * 話していなかった間は無音で埋める (話者ごとのファイルを重ねればそのまま合う)。 */
+static void voice_recv_sink(VoiceConn *vc, VoiceRecv *rv, VoiceRecvStream *s,
+                            const int16_t *pcm, int samples) {
+    char user[MAX_SNOWFLAKE];
+    voice_speaker_user(vc, s->ssrc, user, sizeof(user));
+
+    if (rv->dir[0]) {
+        if (!s->wav) {
+            char path[512];
+            if (user[0]) snprintf(path, sizeof(path), "%s/%s.wav", rv->dir, user);
+            else snprintf(path, sizeof(path), "%s/ssrc_%u.wav", rv->dir, s->ssrc);
+            s->wav = fopen(path, "wb");
+            if (s->wav) wav_write_header(s->wav, 0);
+            else LOG_E("音声受信: %s を作成できません", path);
+        }
+        if (s->wav) {
+            static const int16_t zeros[VOICE_FRAME_SIZE];
+            uint64_t due = (rv->tick - 1) * VOICE_FRAME_SAMPLES;
+            while (s->wav_samples < due) {
+                uint64_t k = due - s->wav_samples;
+                if (k > VOICE_FRAME_SAMPLES) k = VOICE_FRAME_SAMPLES;
+                fwrite(zeros, sizeof(int16_t) * VOICE_CHANNELS, (size_t)k, s->wav);
+                s->wav_samples += k;
+            }
+            fwrite(pcm, sizeof(int16_t) * VOICE_CHANNELS, (size_t)samples, s->wav);
+            s->wav_samples += (uint64_t)samples;
+        }
+    }
 
-            vc->rtp_seq++;
-            vc->rtp_timestamp += VOICE_FRAME_SAMPLES;
-            usleep(VOICE_FRAME_MS * 1000);
+    if (rv->has_callback) {
+        Value arr = hajimu_array();
+        for (int i = 0; i < samples * VOICE_CHANNELS; i++)
+            hajimu_array_push(&arr, hajimu_number(pcm[i]));
+        Value args[3] = { hajimu_string(vc->guild_id), hajimu_string(user), arr };
+        /* イベントハンドラが callback_mutex を持ったまま 音声受信停止 / VC切断 すると
+         * このスレッドを join するので、待たずに停止を見てフレームを捨てる */
+        while (pthread_mutex_trylock(&g_bot.callback_mutex) != 0) {
+            if (rv->stop || g_shutdown) return;
+            usleep(1000);
         }
+        if (!rv->stop && hajimu_runtime_available()) hajimu_call(&rv->callback, 3, args);
+        pthread_mutex_unlock(&g_bot.callback_mutex);
+    }
+}
+
+/* Playout: every 20ms take one frame per speaker (two while a buffer runs
+ * deep, so latency cannot build up), decode outside the lock and sink it. */
+static void *voice_recv_play_thread_func(void *arg) {
+    VoiceConn *vc = (VoiceConn *)arg;
+    VoiceRecv *rv = vc->recv;
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    int16_t pcm[VOICE_FRAME_SIZE * 6];   /* 120ms まで */
+    uint8_t pkt[VOICE_OPUS_MAX];
+
+    while (!rv->stop && vc->active && !vc->stop_requested && !g_shutdown) {
+        rv->tick++;
+        pthread_mutex_lock(&rv->mutex);
+        int count = rv->stream_count;
+        pthread_mutex_unlock(&rv->mutex);
+
+        for (int i = 0; i < count; i++) {
+            VoiceRecvStream *s = rv->streams[i];   /* 追加のみ — i < count は有効 */
+            for (int take = 0; take < 2; take++) {
+                int len = -1;   /* -1 = 何もしない, 0 = 欠落 (PLC) */
+                pthread_mutex_lock(&rv->mutex);
+                if (!s->playing && s->count >= rv->depth) s->playing = true;
+                if (s->playing && (take == 0 || s->count > rv->depth * 2)) {
+                    VoiceJitterSlot *slot = &s->jb[s->next_seq & (VOICE_JB_SLOTS - 1)];
+                    if (slot->used && slot->seq == s->next_seq) {
+                        len = slot->len;
+                        memcpy(pkt, slot->data, (size_t)len);
+                        slot->used = false;
+                        s->count--;
+                        s->next_seq++;
+                    } else if (s->count == 0) {
+                        s->playing = false;     /* 発話の切れ目 */
+                    } else {
+                        len = 0;
+                        s->lost++;
+                        s->next_seq++;
+                    }
+                }
+                pthread_mutex_unlock(&rv->mutex);
+                if (len < 0) break;
 
-        /* Close file/pipe */
-        if (use_ffmpeg) {
-            pclose(fp);
-        } else {
-            fclose(fp);
+                if (!s->dec) {
+                    int err = 0;
+                    s->dec = opus_decoder_create(VOICE_SAMPLE_RATE, VOICE_CHANNELS, &err);
+                    if (err != OPUS_OK) s->dec = NULL;
+                }
+                if (!s->dec) break;
+                int n = len > 0 ? opus_decode(s->dec, pkt, len, pcm, VOICE_FRAME_SAMPLES * 6, 0)
+                                : opus_decode(s->dec, NULL, 0, pcm, VOICE_FRAME_SAMPLES, 0);
+                if (n > 0) voice_recv_sink(vc, rv, s, pcm, n);
+                if (rv->stop) break;    /* コールバックが停止したかもしれない */
+            }
+            if (rv->stop) break;
         }
 
-        vc->playing = false;
-        LOG_I("音声再生完了: %s", filepath);
-
-        /* Fire event — skip if disconnecting to avoid deadlock with callback_mutex */
-        if (!vc->stop_requested) {
-            Value done_val = hajimu_string(filepath);
-            event_fire("音声再生完了", 1, &done_val);
-            event_fire("VOICE_PLAY_END", 1, &done_val);
+        /* Sleep until next frame's absolute deadline */
+        long long target_ns = (long long)rv->tick * VOICE_FRAME_MS * 1000000LL;
+        struct timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        long long elapsed_ns = (long long)(now.tv_sec - start.tv_sec) * 1000000000LL +
+                               (long long)(now.tv_nsec - start.tv_nsec);
+        if (elapsed_ns < target_ns) {
+            struct timespec sleep_ts;
+            long long sleep_ns = target_ns - elapsed_ns;
+            sleep_ts.tv_sec = (time_t)(sleep_ns / 1000000000LL);
+            sleep_ts.tv_nsec = (long)(sleep_ns % 1000000000LL);
+            nanosleep(&sleep_ts, NULL);
         }
+    }
+    /* 自分のコールバックから停止された: vc はもう触らず、ここで片付ける */
+    if (rv->detached) voice_recv_free(rv);
+    return NULL;
+}
 
-        /* Check loop mode (re-queue) */
-        if (vc->loop_mode && !vc->stop_requested) {
-            pthread_mutex_lock(&vc->voice_mutex);
-            if (vc->queue_count < MAX_AUDIO_QUEUE) {
-                int tail = vc->queue_tail;
-                snprintf(vc->queue[tail].path, sizeof(vc->queue[tail].path), "%s", filepath);
-                vc->queue_tail = (vc->queue_tail + 1) % MAX_AUDIO_QUEUE;
-                vc->queue_count++;
-            }
-            pthread_mutex_unlock(&vc->voice_mutex);
-        }
+/* Stop both receive threads, finish the WAV files and free everything.
+ * 受信コールバックの中から呼ばれたら自分自身は join できないので、
+ * detach して後始末を取り出しスレッドの終わりに任せる。 */
+static void voice_recv_stop(VoiceConn *vc) {
+    VoiceRecv *rv = vc->recv;
+    if (!rv) return;
+    rv->stop = true;
+    vc->recv = NULL;
+    if (pthread_equal(pthread_self(), rv->play_thread)) {
+        rv->detached = true;
+        pthread_detach(rv->play_thread);
+        return;
     }
+    pthread_join(rv->play_thread, NULL);
+    voice_recv_free(rv);
+}
 
-    LOG_I("音声スレッド終了 (guild=%s)", vc->guild_id);
-    return NULL;
+static void voice_recv_free(VoiceRecv *rv) {
+    pthread_join(rv->recv_thread, NULL);
+    for (int i = 0; i < rv->stream_count; i++) {
+        VoiceRecvStream *s = rv->streams[i];
+        voice_recv_close_wav(s);
+        if (s->dec) opus_decoder_destroy(s->dec);
+        free(s);
+    }
+    pthread_mutex_destroy(&rv->mutex);
+    free(rv);
 }
 
 /* --- Send Gateway op 4 (Voice State Update) --- */
@@ -3705,14 +11309,11 @@ static Value fn_bot_create(int argc, Value *argv) {
     if (g_bot.intents == 0) g_bot.intents = INTENT_DEFAULT;
     g_bot.log_level = LOG_INFO;
 
-    /* Init mutexes */
-    pthread_mutexattr_t attr;
-    pthread_mutexattr_init(&attr);
-    pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
-    pthread_mutex_init(&g_bot.callback_mutex, &attr);
-    pthread_mutexattr_destroy(&attr);
+    /* Init mutexes (callback_mutex は rest_init が作る) */
     pthread_mutex_init(&g_bot.ws_write_mutex, NULL);
-    pthread_mutex_init(&g_bot.rest_mutex, NULL);
+    rest_init();
+    cache_init();
+    pthread_mutex_init(&g_bot.mod_job_mutex, NULL);
     pthread_mutex_init(&g_bot.collector_mutex, NULL);
 
     /* Init libcurl */
@@ -3726,6 +11327,13 @@ static Value fn_bot_create(int argc, Value *argv) {
         LOG_I("CLIENT_ID を環境変数から設定: %s", g_bot.application_id);
     }
 
+    /* DISCORD_COMMAND_GUILD_ID があればコマンドをそのサーバーに登録 (即時反映) */
+    const char *cmd_guild_env = getenv("DISCORD_COMMAND_GUILD_ID");
+    if (cmd_guild_env && cmd_guild_env[0]) {
+        snprintf(g_bot.command_guild_id, sizeof(g_bot.command_guild_id), "%s", cmd_guild_env);
+        LOG_I("コマンド登録先サーバーを環境変数から設定: %s", g_bot.command_guild_id);
+    }
+
     /* YOUTUBE_COOKIES_BROWSER 環境変数からyt-dlpのcookieオプションを自動設定 */
     const char *cookies_browser = getenv("YOUTUBE_COOKIES_BROWSER");
     if (cookies_browser && cookies_browser[0]) {
@@ -3743,6 +11351,11 @@ static Value fn_bot_create(int argc, Value *argv) {
         }
     }
 
+    /* DISCORD_CACHE_SNAPSHOT があれば起動時にキャッシュを復元し、停止時に保存 */
+    const char *snap_env = getenv("DISCORD_CACHE_SNAPSHOT");
+    if (snap_env && snap_env[0])
+        snprintf(g_bot.cache_snapshot_path, sizeof(g_bot.cache_snapshot_path), "%s", snap_env);
+
     LOG_I("ボット初期化完了");
     return hajimu_bool(true);
 }
@@ -3761,6 +11374,9 @@ static Value fn_bot_start(int argc, Value *argv) {
 
     g_bot.running = true;
 
+    /* v2.6.0: 前回のキャッシュとセッションを復元 (HELLO で RESUME を送る) */
+    if (g_bot.cache_snapshot_path[0]) cache_snapshot_load(g_bot.cache_snapshot_path);
+
     /* Start gateway thread */
     if (pthread_create(&g_bot.gateway_thread, NULL, gateway_thread_func, NULL) != 0) {
         LOG_E("Gatewayスレッドの作成に失敗しました");
@@ -3781,7 +11397,9 @@ static Value fn_bot_start(int argc, Value *argv) {
     signal(SIGINT, SIG_DFL);  /* Let default handler work */
     pthread_join(g_bot.gateway_thread, NULL);
     pthread_join(g_bot.heartbeat_thread, NULL);
+    voice_prefetch_wait_all(10000);     /* 手放した次の曲の準備 */
 
+    if (g_bot.cache_snapshot_path[0]) cache_snapshot_save(g_bot.cache_snapshot_path);
     LOG_I("ボットが停止しました");
     return hajimu_bool(true);
 }
@@ -3790,7 +11408,7 @@ static Value fn_bot_start(int argc, Value *argv) {
 static Value fn_bot_stop(int argc, Value *argv) {
     (void)argc; (void)argv;
     g_bot.running = false;
-    g_shutdown = 1;
+    __atomic_store_n(&g_shutdown, 1, __ATOMIC_RELEASE);
     ws_close(&g_bot.ws);
     LOG_I("ボットを停止します...");
     return hajimu_bool(true);
@@ -4675,24 +12293,95 @@ static Value fn_invite_info(int argc, Value *argv) {
  * v1.5.0: Webhook & ファイル添付
  * ========================================================================= */
 
-/* discord_rest_multipart: multipart/form-data で POST (ファイル添付用) */
-static JsonNode *discord_rest_multipart(const char *endpoint,
-                                        const char *json_payload,
-                                        const char *filepath,
-                                        long *http_code) {
+/* v2.6.0: Multipart attachment source.
+ * パス / メモリ上のバッファ / スクリプトの読み込み関数 のいずれかから
+ * 一時ファイルを介さずに files[n] パートを組み立てる。 */
+typedef struct {
+    char        filename[256];
+    const char *path;          /* ファイルパス (curl_mime_filedata) */
+    const char *data;          /* メモリ上のデータ (呼び出し中のみ有効) */
+    size_t      len;
+    size_t      off;
+    char       *owned;         /* Base64 デコード結果など、解放が必要なバッファ */
+    Value      *reader;        /* 読み込み関数 — 文字列を返し、空/null で終端 */
+    char       *chunk;         /* reader が返した現在のチャンク */
+    size_t      chunk_len, chunk_off;
+    bool        eof;
+    const char *mime_type;
+} MultipartFile;
+
+static size_t multipart_mem_read(char *buffer, size_t size, size_t nitems, void *arg) {
+    MultipartFile *f = (MultipartFile *)arg;
+    size_t n = size * nitems;
+    if (n > f->len - f->off) n = f->len - f->off;
+    memcpy(buffer, f->data + f->off, n);
+    f->off += n;
+    return n;
+}
+
+static int multipart_mem_seek(void *arg, curl_off_t offset, int origin) {
+    MultipartFile *f = (MultipartFile *)arg;
+    if (origin != SEEK_SET || offset < 0 || (size_t)offset > f->len)
+        return CURL_SEEKFUNC_CANTSEEK;
+    f->off = (size_t)offset;
+    return CURL_SEEKFUNC_OK;
+}
+
+/* 読み込み関数を呼び出してチャンクを順に流す (サイズ不明 → chunked 転送) */
+static size_t multipart_cb_read(char *buffer, size_t size, size_t nitems, void *arg) {
+    MultipartFile *f = (MultipartFile *)arg;
+    while (f->chunk_off >= f->chunk_len) {
+        if (f->eof) return 0;
+        free(f->chunk);
+        f->chunk = NULL;
+        f->chunk_len = f->chunk_off = 0;
+        Value r = hajimu_null();
+        pthread_mutex_lock(&g_bot.callback_mutex);
+        if (hajimu_runtime_available()) r = hajimu_call(f->reader, 0, NULL);
+        pthread_mutex_unlock(&g_bot.callback_mutex);
+        if (r.type != VALUE_STRING || !r.string.data || !r.string.data[0]) {
+            f->eof = true;
+            return 0;
+        }
+        f->chunk = strdup(r.string.data);
+        if (!f->chunk) return CURL_READFUNC_ABORT;
+        f->chunk_len = strlen(f->chunk);
+    }
+    size_t n = size * nitems;
+    if (n > f->chunk_len - f->chunk_off) n = f->chunk_len - f->chunk_off;
+    memcpy(buffer, f->chunk + f->chunk_off, n);
+    f->chunk_off += n;
+    return n;
+}
+
+static void multipart_file_release(MultipartFile *f) {
+    free(f->owned);
+    free(f->chunk);
+    f->owned = f->chunk = NULL;
+}
+
+/* multipart/form-data で送信 (payload_json + files[0..n-1])。
+ * REST プールのハンドルを使い、ルート別バケットに従う。 */
+static JsonNode *discord_rest_multipart_files(const char *method, const char *endpoint,
+                                              const char *json_payload,
+                                              MultipartFile *files, int file_count,
+                                              long *http_code) {
     if (!g_bot.token_set) { LOG_E("トークンが設定されていません"); return NULL; }
-    pthread_mutex_lock(&g_bot.rest_mutex);
-    if (!g_bot.curl) g_bot.curl = curl_easy_init();
-    CURL *curl = g_bot.curl;
-    if (!curl) { pthread_mutex_unlock(&g_bot.rest_mutex); return NULL; }
 
     char url[MAX_URL_LEN];
     snprintf(url, sizeof(url), "%s%s", DISCORD_API_BASE, endpoint);
+    char route[RL_ROUTE_LEN];
+    rl_route_key(method, endpoint, route, sizeof(route));
+    rl_wait(route);
+
+    int slot = rest_acquire();
+    if (slot < 0) return NULL;
+    CURL *curl = g_bot.rest_pool[slot].curl;
 
     CurlBuf resp = {NULL, 0};
     resp.data = (char *)calloc(1, REST_BUF_INIT);
     if (!resp.data) {
-        pthread_mutex_unlock(&g_bot.rest_mutex);
+        rest_release(slot);
         return NULL;
     }
 
@@ -4702,6 +12391,7 @@ static JsonNode *discord_rest_multipart(const char *endpoint,
     hdrs = curl_slist_append(hdrs, auth);
     hdrs = curl_slist_append(hdrs, DISCORD_USER_AGENT);
 
+    curl_easy_reset(curl);
     curl_mime *mime = curl_mime_init(curl);
 
     /* JSON payload part */
@@ -4712,74 +12402,386 @@ static JsonNode *discord_rest_multipart(const char *endpoint,
         curl_mime_type(part, "application/json");
     }
 
-    /* File part */
-    if (filepath) {
+    /* File parts */
+    for (int i = 0; i < file_count; i++) {
+        MultipartFile *f = &files[i];
         curl_mimepart *fpart = curl_mime_addpart(mime);
-        curl_mime_name(fpart, "files[0]");
-        curl_mime_filedata(fpart, filepath);
+        char name[32];
+        snprintf(name, sizeof(name), "files[%d]", i);
+        curl_mime_name(fpart, name);
+        if (f->path) {
+            curl_mime_filedata(fpart, f->path);
+        } else if (f->reader) {
+            curl_mime_data_cb(fpart, -1, multipart_cb_read, NULL, NULL, f);
+        } else {
+            f->off = 0;
+            curl_mime_data_cb(fpart, (curl_off_t)f->len, multipart_mem_read,
+                              multipart_mem_seek, NULL, f);
+        }
+        if (f->filename[0]) curl_mime_filename(fpart, f->filename);
+        if (f->mime_type) curl_mime_type(fpart, f->mime_type);
     }
 
-    curl_easy_reset(curl);
+    RlHeaders rlh = {0};
     curl_easy_setopt(curl, CURLOPT_URL, url);
     curl_easy_setopt(curl, CURLOPT_HTTPHEADER, hdrs);
     curl_easy_setopt(curl, CURLOPT_MIMEPOST, mime);
+    if (strcmp(method, "POST") != 0) curl_easy_setopt(curl, CURLOPT_CUSTOMREQUEST, method);
     curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, curl_write_cb);
     curl_easy_setopt(curl, CURLOPT_WRITEDATA, &resp);
-    curl_easy_setopt(curl, CURLOPT_TIMEOUT, 60L);
+    curl_easy_setopt(curl, CURLOPT_HEADERFUNCTION, rl_header_cb);
+    curl_easy_setopt(curl, CURLOPT_HEADERDATA, &rlh);
+    curl_easy_setopt(curl, CURLOPT_TIMEOUT, 120L);
     curl_easy_setopt(curl, CURLOPT_NOSIGNAL, 1L);
+#ifdef _WIN32
+    curl_easy_setopt(curl, CURLOPT_SSL_OPTIONS, (long)CURLSSLOPT_NATIVE_CA);
+#endif
 
     CURLcode res = curl_easy_perform(curl);
     long code = 0;
     curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &code);
     curl_slist_free_all(hdrs);
     curl_mime_free(mime);
+    rest_release(slot);
     if (http_code) *http_code = code;
+    if (res == CURLE_OK) rl_update(route, &rlh);
 
     JsonNode *result = NULL;
     if (res == CURLE_OK && resp.data && resp.len > 0) {
         result = json_parse(resp.data);
+        if (code == 429) {
+            /* 本文がストリームの場合は巻き戻せないためリトライせず、バケットだけ塞ぐ */
+            JsonNode *retry = json_get(result, "retry_after");
+            rl_block(route, retry ? retry->number : 1.0, rlh.global);
+            LOG_W("ファイル送信: レート制限 (%.1f秒)", retry ? retry->number : 1.0);
+        }
     } else if (res != CURLE_OK) {
         LOG_E("ファイル送信エラー: %s", curl_easy_strerror(res));
     }
     free(resp.data);
-    pthread_mutex_unlock(&g_bot.rest_mutex);
     return result;
 }
 
-/* Webhook送信用 REST (トークン不要、Webhook URL を直接使う) */
+/* discord_rest_multipart: multipart/form-data で POST (ファイル添付用) */
+static JsonNode *discord_rest_multipart(const char *endpoint,
+                                        const char *json_payload,
+                                        const char *filepath,
+                                        long *http_code) {
+    MultipartFile f;
+    memset(&f, 0, sizeof(f));
+    f.path = filepath;
+    return discord_rest_multipart_files("POST", endpoint, json_payload,
+                                        &f, filepath ? 1 : 0, http_code);
+}
+
+/* Webhook送信用 REST (トークン不要、Webhook URL を直接使う)
+ * v2.6.0: REST プールの keep-alive 接続を再利用し、
+ * "/webhooks/{id}/{token}" バケットのレート制限に従う。 */
+static JsonNode *webhook_rest_method(const char *method, const char *full_url,
+                                     const char *body, long *http_code, CURLcode *curl_res) {
+    const char *path = strstr(full_url, "/webhooks/");
+    char route[RL_ROUTE_LEN];
+    rl_route_key(method, path ? path : full_url, route, sizeof(route));
+    return rest_request(method, full_url, route, body, false, http_code, curl_res);
+}
+
 static JsonNode *webhook_rest(const char *full_url, const char *body, long *http_code) {
-    CURL *curl = curl_easy_init();
-    if (!curl) return NULL;
+    return webhook_rest_method("POST", full_url, body ? body : "{}", http_code, NULL);
+}
 
-    CurlBuf resp = {NULL, 0};
-    resp.data = (char *)calloc(1, REST_BUF_INIT);
+/* --- v2.6.0: Webhook 送信キュー ---
+ *
+ * Webhook URL (クエリ込み — ?thread_id= 別) ごとにキューと送信スレッドを持ち、
+ * wait=false を付けて順番に送る。"まとめる" を指定した連続項目は
+ * ユーザー名/アバターが同じなら本文 2000 文字・埋め込み 10 個まで
+ * 1回の実行にまとめる (別々のメッセージの本文が繋がるので既定では行わない)。
+ * 送信スレッドはキューがしばらく空なら終了する。 */
+
+static void webhook_item_free(WebhookItem *it) {
+    while (it) {
+        WebhookItem *next = it->next;
+        free(it->content);
+        free(it->username);
+        free(it->avatar_url);
+        for (int i = 0; i < it->embed_count; i++) free(it->embeds[i]);
+        free(it);
+        it = next;
+    }
+}
+
+static bool webhook_str_eq(const char *a, const char *b) {
+    if (!a || !b) return a == b;
+    return strcmp(a, b) == 0;
+}
+
+static bool webhook_can_merge(const WebhookItem *first, const WebhookItem *next,
+                              int content_len, int embed_count) {
+    if (!first->batchable || !next->batchable) return false;
+    if (!webhook_str_eq(first->username, next->username)) return false;
+    if (!webhook_str_eq(first->avatar_url, next->avatar_url)) return false;
+    if (embed_count + next->embed_count > WEBHOOK_MAX_EMBEDS) return false;
+    int add = next->content ? (int)strlen(next->content) + (content_len ? 1 : 0) : 0;
+    return content_len + add <= MAX_MSG_LEN;
+}
+
+/* Build one execute payload from a detached chain of items */
+static char *webhook_batch_json(WebhookItem *items) {
+    StrBuf content; sb_init(&content);
+    bool any_embed = false;
+    for (WebhookItem *it = items; it; it = it->next) {
+        if (it->content && it->content[0]) {
+            if (content.len) sb_append_char(&content, '\n');
+            sb_append(&content, it->content);
+        }
+        if (it->embed_count) any_embed = true;
+    }
 
-    struct curl_slist *hdrs = NULL;
-    hdrs = curl_slist_append(hdrs, "Content-Type: application/json");
-    hdrs = curl_slist_append(hdrs, DISCORD_USER_AGENT);
+    StrBuf sb; sb_init(&sb);
+    jb_obj_start(&sb);
+    if (content.len) jb_str(&sb, "content", content.data);
+    if (items->username)   jb_str(&sb, "username", items->username);
+    if (items->avatar_url) jb_str(&sb, "avatar_url", items->avatar_url);
+    if (any_embed) {
+        jb_key(&sb, "embeds"); jb_arr_start(&sb);
+        for (WebhookItem *it = items; it; it = it->next) {
+            for (int i = 0; i < it->embed_count; i++) {
+                sb_append(&sb, it->embeds[i]);
+                sb_append_char(&sb, ',');
+            }
+        }
+        jb_arr_end(&sb); sb_append_char(&sb, ',');
+    }
+    jb_obj_end(&sb);
+    sb_free(&content);
+    return sb_detach(&sb);
+}
 
-    curl_easy_setopt(curl, CURLOPT_URL, full_url);
-    curl_easy_setopt(curl, CURLOPT_HTTPHEADER, hdrs);
-    curl_easy_setopt(curl, CURLOPT_POST, 1L);
-    curl_easy_setopt(curl, CURLOPT_POSTFIELDS, body ? body : "{}");
-    curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, curl_write_cb);
-    curl_easy_setopt(curl, CURLOPT_WRITEDATA, &resp);
-    curl_easy_setopt(curl, CURLOPT_TIMEOUT, 30L);
-    curl_easy_setopt(curl, CURLOPT_NOSIGNAL, 1L);
+/* true if the request never reached the server (名前解決・接続・TLS の失敗) */
+static bool webhook_unsent(CURLcode res) {
+    return res == CURLE_COULDNT_RESOLVE_HOST || res == CURLE_COULDNT_RESOLVE_PROXY ||
+           res == CURLE_COULDNT_CONNECT || res == CURLE_SSL_CONNECT_ERROR;
+}
+
+static void *webhook_sender_thread(void *arg) {
+    WebhookQueue *q = (WebhookQueue *)arg;
+    pthread_mutex_lock(&g_bot.webhook_mutex);
+    for (;;) {
+        while (!q->head) {
+            struct timespec ts;
+            clock_gettime(CLOCK_REALTIME, &ts);
+            ts.tv_sec += WEBHOOK_IDLE_SEC;
+            int rc = pthread_cond_timedwait(&q->cond, &g_bot.webhook_mutex, &ts);
+            if (rc == ETIMEDOUT && !q->head) {
+                q->thread_running = false;
+                pthread_mutex_unlock(&g_bot.webhook_mutex);
+                return NULL;
+            }
+        }
 
-    CURLcode res = curl_easy_perform(curl);
-    long code = 0;
-    curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &code);
-    curl_slist_free_all(hdrs);
-    curl_easy_cleanup(curl);
-    if (http_code) *http_code = code;
+        /* 先頭から結合できる限り取り出す */
+        WebhookItem *first = q->head, *last = first;
+        int merged = 1;
+        int content_len = first->content ? (int)strlen(first->content) : 0;
+        int embeds = first->embed_count;
+        while (last->next && webhook_can_merge(first, last->next, content_len, embeds)) {
+            WebhookItem *nx = last->next;
+            if (nx->content) content_len += (int)strlen(nx->content) + (content_len ? 1 : 0);
+            embeds += nx->embed_count;
+            last = nx;
+            merged++;
+        }
+        q->head = last->next;
+        if (!q->head) q->tail = NULL;
+        last->next = NULL;
+        q->pending -= merged;
+        q->inflight += merged;
+        char url[MAX_URL_LEN + 16];
+        snprintf(url, sizeof(url), "%s%swait=false", q->url,
+                 strchr(q->url, '?') ? "&" : "?");
+        pthread_mutex_unlock(&g_bot.webhook_mutex);
+
+        char *body = webhook_batch_json(first);
+        long code = 0;
+        for (int attempt = 0; attempt < WEBHOOK_MAX_ATTEMPTS; attempt++) {
+            CURLcode res = CURLE_OK;
+            JsonNode *resp = webhook_rest_method("POST", url, body, &code, &res);
+            if (resp) { json_free(resp); free(resp); }
+            /* 要求が届いていないと分かる接続段階の失敗だけ再送する。5xx や
+             * 送信後の切断では Discord がメッセージを作り終えていることがあり、
+             * wait=false では確かめられないので、再送すると二重投稿になる
+             * (429 は rest_request 内でバケット待機して再送済み) */
+            if (!webhook_unsent(res)) break;
+            usleep((useconds_t)(250000 << attempt));
+        }
+        free(body);
+        bool ok = code == 200 || code == 204;
+        if (!ok) LOG_W("Webhookキュー: 送信失敗 (HTTP %ld, %d件)", code, merged);
+        webhook_item_free(first);
+
+        pthread_mutex_lock(&g_bot.webhook_mutex);
+        q->inflight -= merged;
+        q->requests++;
+        if (ok) q->sent += merged;
+        else    q->failed += merged;
+    }
+}
+
+/* Find/create the queue for a webhook URL. The query (thread_id など) is
+ * part of the key; any wait= parameter is dropped since the sender adds its own.
+ * Caller must hold webhook_mutex. */
+static WebhookQueue *webhook_queue_get(const char *full_url) {
+    char base[MAX_URL_LEN];
+    snprintf(base, sizeof(base), "%s", full_url);
+    char *q = strchr(base, '?');
+    if (q) {
+        char *out = q + 1, *p = q + 1;
+        while (*p) {
+            size_t n = strcspn(p, "&");
+            if (strncmp(p, "wait=", 5) != 0 && n > 0) {
+                if (out != q + 1) *out++ = '&';
+                memmove(out, p, n);
+                out += n;
+            }
+            p += n;
+            if (*p == '&') p++;
+        }
+        *out = '\0';
+        if (out == q + 1) *q = '\0';   /* クエリが wait= だけだった */
+    }
+
+    WebhookQueue *free_slot = NULL;
+    for (int i = 0; i < MAX_WEBHOOK_QUEUES; i++) {
+        WebhookQueue *wq = &g_bot.webhook_queues[i];
+        if (wq->active && strcmp(wq->url, base) == 0) return wq;
+        if (!free_slot && (!wq->active ||
+            (!wq->thread_running && !wq->head && wq->inflight == 0))) free_slot = wq;
+    }
+    if (!free_slot) return NULL;
+    if (!free_slot->cond_init) {
+        pthread_cond_init(&free_slot->cond, NULL);
+        free_slot->cond_init = true;
+    }
+    free_slot->active = true;
+    free_slot->head = free_slot->tail = NULL;
+    free_slot->pending = free_slot->inflight = 0;
+    free_slot->sent = free_slot->failed = free_slot->requests = free_slot->dropped = 0;
+    snprintf(free_slot->url, sizeof(free_slot->url), "%s", base);
+    return free_slot;
+}
+
+/* Webhook送信キュー(URL, 内容[, 設定])
+ * 設定: {"ユーザー名": 文字列, "アバターURL": 文字列,
+ *        "埋め込み": 埋め込みID or ID配列, "まとめる": 真/偽 (既定 偽)}
+ * 送信結果を待たずに即座に戻る (?wait=false)。 */
+static Value fn_webhook_queue_send(int argc, Value *argv) {
+    if (argc < 2 || argv[0].type != VALUE_STRING ||
+        (argv[1].type != VALUE_STRING && argv[1].type != VALUE_NULL)) {
+        LOG_E("Webhook送信キュー: (URL, 内容[, 設定]) が必要です");
+        return hajimu_bool(false);
+    }
+    WebhookItem *it = (WebhookItem *)calloc(1, sizeof(WebhookItem));
+    if (!it) return hajimu_bool(false);
+    if (argv[1].type == VALUE_STRING && argv[1].string.data[0])
+        it->content = strdup(argv[1].string.data);
+
+    if (argc >= 3 && argv[2].type == VALUE_DICT) {
+        for (int i = 0; i < argv[2].dict.length; i++) {
+            const char *key = argv[2].dict.keys[i];
+            Value *val = &argv[2].dict.values[i];
+            if (strcmp(key, "ユーザー名") == 0 && val->type == VALUE_STRING) {
+                it->username = strdup(val->string.data);
+            } else if (strcmp(key, "アバターURL") == 0 && val->type == VALUE_STRING) {
+                it->avatar_url = strdup(val->string.data);
+            } else if (strcmp(key, "まとめる") == 0 && val->type == VALUE_BOOL) {
+                it->batchable = val->boolean;
+            } else if (strcmp(key, "埋め込み") == 0) {
+                int n = val->type == VALUE_ARRAY ? val->array.length : 1;
+                for (int k = 0; k < n && it->embed_count < WEBHOOK_MAX_EMBEDS; k++) {
+                    Value *ev = val->type == VALUE_ARRAY ? &val->array.elements[k] : val;
+                    if (ev->type != VALUE_NUMBER) continue;
+                    Embed *e = embed_get((int)ev->number);
+                    if (!e) continue;
+                    it->embeds[it->embed_count++] = embed_to_json(e);
+                    e->active = false;  /* 送信済み扱いでスロット解放 */
+                }
+            }
+        }
+    }
+    if (!it->content && it->embed_count == 0) {
+        LOG_E("Webhook送信キュー: 内容か埋め込みが必要です");
+        webhook_item_free(it);
+        return hajimu_bool(false);
+    }
 
-    JsonNode *result = NULL;
-    if (res == CURLE_OK && resp.data && resp.len > 0) {
-        result = json_parse(resp.data);
+    rest_init();
+    pthread_mutex_lock(&g_bot.webhook_mutex);
+    WebhookQueue *q = webhook_queue_get(argv[0].string.data);
+    if (!q || q->pending >= WEBHOOK_MAX_PENDING) {
+        if (q) q->dropped++;
+        pthread_mutex_unlock(&g_bot.webhook_mutex);
+        LOG_W("Webhook送信キュー: キューが満杯のため破棄しました");
+        webhook_item_free(it);
+        return hajimu_bool(false);
+    }
+    if (q->tail) q->tail->next = it;
+    else         q->head = it;
+    q->tail = it;
+    q->pending++;
+    if (!q->thread_running) {
+        pthread_t t;
+        if (pthread_create(&t, NULL, webhook_sender_thread, q) == 0) {
+            pthread_detach(t);
+            q->thread_running = true;
+        } else {
+            LOG_E("Webhook送信キュー: スレッド作成失敗");
+        }
+    }
+    pthread_cond_signal(&q->cond);
+    pthread_mutex_unlock(&g_bot.webhook_mutex);
+    return hajimu_bool(true);
+}
+
+/* Webhookキュー状態() — 全キューの合計 {"送信待ち", "送信中", "送信済み", "失敗", "破棄", "リクエスト数"} */
+static Value fn_webhook_queue_status(int argc, Value *argv) {
+    (void)argc; (void)argv;
+    int pending = 0, inflight = 0, sent = 0, failed = 0, dropped = 0, requests = 0;
+    rest_init();
+    pthread_mutex_lock(&g_bot.webhook_mutex);
+    for (int i = 0; i < MAX_WEBHOOK_QUEUES; i++) {
+        WebhookQueue *q = &g_bot.webhook_queues[i];
+        if (!q->active) continue;
+        pending += q->pending; inflight += q->inflight;
+        sent += q->sent; failed += q->failed;
+        dropped += q->dropped; requests += q->requests;
+    }
+    pthread_mutex_unlock(&g_bot.webhook_mutex);
+    Value d = value_dict_new();
+    value_dict_add(&d, "送信待ち", hajimu_number(pending));
+    value_dict_add(&d, "送信中", hajimu_number(inflight));
+    value_dict_add(&d, "送信済み", hajimu_number(sent));
+    value_dict_add(&d, "失敗", hajimu_number(failed));
+    value_dict_add(&d, "破棄", hajimu_number(dropped));
+    value_dict_add(&d, "リクエスト数", hajimu_number(requests));
+    return d;
+}
+
+/* Webhookキュー待機([タイムアウト秒]) — すべてのキューが空になるまで待つ */
+static Value fn_webhook_queue_flush(int argc, Value *argv) {
+    double timeout = (argc >= 1 && argv[0].type == VALUE_NUMBER) ? argv[0].number : 30.0;
+    double deadline = mono_now() + timeout;
+    rest_init();
+    for (;;) {
+        int busy = 0;
+        pthread_mutex_lock(&g_bot.webhook_mutex);
+        for (int i = 0; i < MAX_WEBHOOK_QUEUES; i++) {
+            WebhookQueue *q = &g_bot.webhook_queues[i];
+            if (q->active) busy += q->pending + q->inflight;
+        }
+        pthread_mutex_unlock(&g_bot.webhook_mutex);
+        if (busy == 0) return hajimu_bool(true);
+        if (mono_now() >= deadline) return hajimu_bool(false);
+        usleep(20000);
     }
-    free(resp.data);
-    return result;
 }
 
 /* Webhook作成(チャンネルID, 名前) */
@@ -4878,6 +12880,130 @@ static Value fn_send_file(int argc, Value *argv) {
     return result;
 }
 
+/* ファイル複数送信(チャンネルID, ファイル配列[, 内容])
+ * ファイル: パス文字列、または辞書 {"名前": ファイル名,
+ *           "パス": パス | "データ": 文字列 | "Base64": 文字列 | "読み込み": 関数,
+ *           "説明": 代替テキスト, "種類": MIMEタイプ}
+ * 内容: 文字列、または辞書 {"内容": 文字列, "埋め込み": 埋め込みID}
+ * 最大10ファイル。データ/Base64/読み込み関数は一時ファイルを作らずに送る。 */
+static Value fn_send_files(int argc, Value *argv) {
+    if (argc < 2 || argv[0].type != VALUE_STRING || argv[1].type != VALUE_ARRAY) {
+        LOG_E("ファイル複数送信: (チャンネルID, ファイル配列[, 内容]) が必要です");
+        return hajimu_null();
+    }
+    int count = argv[1].array.length;
+    if (count < 1) return hajimu_null();
+    if (count > MAX_ATTACHMENTS) {
+        LOG_W("ファイル複数送信: 添付は最大%d件です (先頭%d件のみ送信)",
+              MAX_ATTACHMENTS, MAX_ATTACHMENTS);
+        count = MAX_ATTACHMENTS;
+    }
+
+    MultipartFile files[MAX_ATTACHMENTS];
+    memset(files, 0, sizeof(files));
+    const char *descs[MAX_ATTACHMENTS] = {0};
+    int n = 0;
+    for (int i = 0; i < count; i++) {
+        Value *v = &argv[1].array.elements[i];
+        MultipartFile *f = &files[n];
+        if (v->type == VALUE_STRING) {
+            f->path = v->string.data;
+        } else if (v->type == VALUE_DICT) {
+            for (int k = 0; k < v->dict.length; k++) {
+                const char *key = v->dict.keys[k];
+                Value *val = &v->dict.values[k];
+                if (strcmp(key, "名前") == 0 && val->type == VALUE_STRING) {
+                    snprintf(f->filename, sizeof(f->filename), "%s", val->string.data);
+                } else if (strcmp(key, "パス") == 0 && val->type == VALUE_STRING) {
+                    f->path = val->string.data;
+                } else if (strcmp(key, "データ") == 0 && val->type == VALUE_STRING) {
+                    f->data = val->string.data;
+                    f->len = strlen(val->string.data);
+                } else if (strcmp(key, "Base64") == 0 && val->type == VALUE_STRING) {
+                    size_t len = 0;
+                    f->owned = (char *)base64_decode(val->string.data, &len);
+                    f->data = f->owned;
+                    f->len = len;
+                } else if (strcmp(key, "読み込み") == 0 &&
+                           (val->type == VALUE_FUNCTION || val->type == VALUE_BUILTIN)) {
+                    f->reader = val;
+                } else if (strcmp(key, "説明") == 0 && val->type == VALUE_STRING) {
+                    descs[n] = val->string.data;
+                } else if (strcmp(key, "種類") == 0 && val->type == VALUE_STRING) {
+                    f->mime_type = val->string.data;
+                }
+            }
+        }
+        if (!f->path && !f->data && !f->reader) {
+            LOG_W("ファイル複数送信: %d番目のファイルにデータがありません", i + 1);
+            multipart_file_release(f);
+            memset(f, 0, sizeof(*f));
+            descs[n] = NULL;
+            continue;
+        }
+        if (!f->filename[0]) {
+            if (f->path) {
+                const char *base = strrchr(f->path, '/');
+#ifdef _WIN32
+                const char *bs = strrchr(f->path, '\\');
+                if (bs && (!base || bs > base)) base = bs;
+#endif
+                snprintf(f->filename, sizeof(f->filename), "%s", base ? base + 1 : f->path);
+            } else {
+                snprintf(f->filename, sizeof(f->filename), "file%d.txt", n);
+            }
+        }
+        n++;
+    }
+    if (n == 0) return hajimu_null();
+
+    /* Build payload_json — attachments[].id は files[n] の n に対応 */
+    StrBuf sb; sb_init(&sb);
+    jb_obj_start(&sb);
+    if (argc >= 3 && argv[2].type == VALUE_STRING) {
+        jb_str(&sb, "content", argv[2].string.data);
+    } else if (argc >= 3 && argv[2].type == VALUE_DICT) {
+        for (int k = 0; k < argv[2].dict.length; k++) {
+            const char *key = argv[2].dict.keys[k];
+            Value *val = &argv[2].dict.values[k];
+            if (strcmp(key, "内容") == 0 && val->type == VALUE_STRING) {
+                jb_str(&sb, "content", val->string.data);
+            } else if (strcmp(key, "埋め込み") == 0 && val->type == VALUE_NUMBER) {
+                Embed *e = embed_get((int)val->number);
+                if (e) {
+                    char *ej = embed_to_json(e);
+                    jb_key(&sb, "embeds"); jb_arr_start(&sb);
+                    sb_append(&sb, ej);
+                    jb_arr_end(&sb); sb_append_char(&sb, ',');
+                    free(ej);
+                    e->active = false;
+                }
+            }
+        }
+    }
+    jb_key(&sb, "attachments"); jb_arr_start(&sb);
+    for (int i = 0; i < n; i++) {
+        jb_obj_start(&sb);
+        jb_int(&sb, "id", i);
+        jb_str(&sb, "filename", files[i].filename);
+        if (descs[i]) jb_str(&sb, "description", descs[i]);
+        jb_obj_end(&sb); sb_append_char(&sb, ',');
+    }
+    jb_arr_end(&sb); sb_append_char(&sb, ',');
+    jb_obj_end(&sb);
+
+    char ep[128];
+    snprintf(ep, sizeof(ep), "/channels/%s/messages", argv[0].string.data);
+    long code = 0;
+    JsonNode *resp = discord_rest_multipart_files("POST", ep, sb.data, files, n, &code);
+    sb_free(&sb);
+    for (int i = 0; i < n; i++) multipart_file_release(&files[i]);
+    Value result = hajimu_null();
+    if (resp && code == 200) result = json_to_value(resp);
+    if (resp) { json_free(resp); free(resp); }
+    return result;
+}
+
 /* --- サーバー (Guild) 操作 --- */
 
 /* サーバー情報(ID) */
@@ -5258,6 +13384,293 @@ static Value fn_bulk_delete_count(int argc, Value *argv) {
     return hajimu_bool(code == 204);
 }
 
+/* --- v2.6.0: メッセージ一掃 (大規模パージ) ---
+ *
+ * 履歴取得 (GET ?before=) と削除を別スレッドでパイプライン化する。
+ * 14日未満のメッセージは 100件ずつ bulk-delete、それより古いもの
+ * (bulk-delete 不可) は個別 DELETE に回す。個別 DELETE は
+ * discord_rest のルート別バケットに従って自動的にペース配分される。 */
+
+typedef struct PurgeBatch {
+    int  count;
+    bool bulk;
+    char ids[PURGE_BULK_MAX][MAX_SNOWFLAKE];
+    struct PurgeBatch *next;
+} PurgeBatch;
+
+typedef struct {
+    char channel_id[MAX_SNOWFLAKE];
+    PurgeBatch *head, *tail;
+    bool done;
+    int  deleted_bulk;
+    int  deleted_single;
+    int  failed;
+    pthread_mutex_t mutex;
+    pthread_cond_t  cond;
+} PurgeJob;
+
+static bool purge_delete_one(const char *channel_id, const char *message_id) {
+    char ep[160];
+    snprintf(ep, sizeof(ep), "/channels/%s/messages/%s", channel_id, message_id);
+    long code = 0;
+    JsonNode *resp = discord_rest("DELETE", ep, NULL, &code);
+    if (resp) { json_free(resp); free(resp); }
+    return code == 204;
+}
+
+static void purge_run_batch(PurgeJob *job, PurgeBatch *b) {
+    if (b->bulk && b->count >= 2) {
+        StrBuf sb; sb_init(&sb);
+        jb_obj_start(&sb);
+        jb_key(&sb, "messages"); jb_arr_start(&sb);
+        for (int i = 0; i < b->count; i++) {
+            json_escape_str(&sb, b->ids[i]);
+            sb_append_char(&sb, ',');
+        }
+        jb_arr_end(&sb); sb_append_char(&sb, ',');
+        jb_obj_end(&sb);
+
+        char ep[128];
+        snprintf(ep, sizeof(ep), "/channels/%s/messages/bulk-delete", job->channel_id);
+        long code = 0;
+        JsonNode *resp = discord_rest("POST", ep, sb.data, &code);
+        sb_free(&sb);
+        if (resp) { json_free(resp); free(resp); }
+        if (code == 204) {
+            pthread_mutex_lock(&job->mutex);
+            job->deleted_bulk += b->count;
+            pthread_mutex_unlock(&job->mutex);
+            return;
+        }
+        /* 期限境界を跨いだ等で拒否された場合は個別削除にフォールバック */
+        LOG_W("メッセージ一掃: 一括削除失敗 (HTTP %ld)、個別削除に切り替えます", code);
+    }
+    for (int i = 0; i < b->count; i++) {
+        bool ok = purge_delete_one(job->channel_id, b->ids[i]);
+        pthread_mutex_lock(&job->mutex);
+        if (ok) job->deleted_single++;
+        else    job->failed++;
+        pthread_mutex_unlock(&job->mutex);
+    }
+}
+
+static void *purge_delete_thread(void *arg) {
+    PurgeJob *job = (PurgeJob *)arg;
+    for (;;) {
+        pthread_mutex_lock(&job->mutex);
+        while (!job->head && !job->done) pthread_cond_wait(&job->cond, &job->mutex);
+        PurgeBatch *b = job->head;
+        if (b) {
+            job->head = b->next;
+            if (!job->head) job->tail = NULL;
+        }
+        pthread_mutex_unlock(&job->mutex);
+        if (!b) break;
+        purge_run_batch(job, b);
+        free(b);
+    }
+    return NULL;
+}
+
+static void purge_enqueue(PurgeJob *job, PurgeBatch **slot) {
+    PurgeBatch *b = *slot;
+    *slot = NULL;
+    if (!b || b->count == 0) { free(b); return; }
+    if (b->count == 1) b->bulk = false;
+    pthread_mutex_lock(&job->mutex);
+    if (job->tail) job->tail->next = b;
+    else           job->head = b;
+    job->tail = b;
+    pthread_cond_signal(&job->cond);
+    pthread_mutex_unlock(&job->mutex);
+}
+
+static void purge_add(PurgeJob *job, PurgeBatch **slot, bool bulk, const char *id) {
+    if (!*slot) {
+        *slot = (PurgeBatch *)calloc(1, sizeof(PurgeBatch));
+        if (!*slot) return;
+        (*slot)->bulk = bulk;
+    }
+    snprintf((*slot)->ids[(*slot)->count++], MAX_SNOWFLAKE, "%s", id);
+    if ((*slot)->count >= PURGE_BULK_MAX) purge_enqueue(job, slot);
+}
+
+static Value purge_progress_value(PurgeJob *job, int scanned, int matched) {
+    pthread_mutex_lock(&job->mutex);
+    int deleted = job->deleted_bulk + job->deleted_single;
+    int bulk = job->deleted_bulk, single = job->deleted_single, failed = job->failed;
+    pthread_mutex_unlock(&job->mutex);
+    Value d = value_dict_new();
+    value_dict_add(&d, "チャンネルID", hajimu_string(job->channel_id));
+    value_dict_add(&d, "走査数", hajimu_number(scanned));
+    value_dict_add(&d, "対象数", hajimu_number(matched));
+    value_dict_add(&d, "削除数", hajimu_number(deleted));
+    value_dict_add(&d, "一括削除数", hajimu_number(bulk));
+    value_dict_add(&d, "個別削除数", hajimu_number(single));
+    value_dict_add(&d, "失敗数", hajimu_number(failed));
+    return d;
+}
+
+/* メッセージ一掃(チャンネルID, 上限[, 条件])
+ * 条件: {"著者ID": ID or ID配列, "内容": 部分一致文字列, "フィルタ": 関数(メッセージ),
+ *        "最大経過秒": 秒数, "ボットのみ": 真/偽, "ピン留めを含む": 真/偽,
+ *        "開始ID": メッセージID, "走査上限": 件数}
+ * 戻り値: {"削除数", "一括削除数", "個別削除数", "失敗数", "走査数", "対象数"} */
+static Value fn_purge(int argc, Value *argv) {
+    if (argc < 2 || argv[0].type != VALUE_STRING || argv[1].type != VALUE_NUMBER) {
+        LOG_E("メッセージ一掃: (チャンネルID, 上限[, 条件]) が必要です");
+        return hajimu_null();
+    }
+    int limit = (int)argv[1].number;
+    if (limit <= 0) return hajimu_null();
+
+    Value *authors = NULL, *filter = NULL;
+    const char *contains = NULL;
+    char before[MAX_SNOWFLAKE] = "";
+    double max_age_sec = 0;
+    bool bots_only = false, include_pinned = false;
+    int scan_limit = limit * 5 > 1000 ? limit * 5 : 1000;
+
+    if (argc >= 3 && argv[2].type == VALUE_DICT) {
+        for (int i = 0; i < argv[2].dict.length; i++) {
+            const char *key = argv[2].dict.keys[i];
+            Value *val = &argv[2].dict.values[i];
+            if (strcmp(key, "著者ID") == 0) {
+                if (val->type == VALUE_STRING || val->type == VALUE_ARRAY) authors = val;
+            } else if (strcmp(key, "内容") == 0) {
+                if (val->type == VALUE_STRING) contains = val->string.data;
+            } else if (strcmp(key, "フィルタ") == 0) {
+                if (val->type == VALUE_FUNCTION || val->type == VALUE_BUILTIN) filter = val;
+            } else if (strcmp(key, "最大経過秒") == 0) {
+                if (val->type == VALUE_NUMBER) max_age_sec = val->number;
+            } else if (strcmp(key, "ボットのみ") == 0) {
+                bots_only = val->type == VALUE_BOOL && val->boolean;
+            } else if (strcmp(key, "ピン留めを含む") == 0) {
+                include_pinned = val->type == VALUE_BOOL && val->boolean;
+            } else if (strcmp(key, "開始ID") == 0) {
+                if (val->type == VALUE_STRING)
+                    snprintf(before, sizeof(before), "%s", val->string.data);
+            } else if (strcmp(key, "走査上限") == 0) {
+                if (val->type == VALUE_NUMBER && val->number > 0) scan_limit = (int)val->number;
+            }
+        }
+    }
+
+    PurgeJob *job = (PurgeJob *)calloc(1, sizeof(PurgeJob));
+    if (!job) return hajimu_null();
+    snprintf(job->channel_id, sizeof(job->channel_id), "%s", argv[0].string.data);
+    pthread_mutex_init(&job->mutex, NULL);
+    pthread_cond_init(&job->cond, NULL);
+    pthread_t deleter;
+    if (pthread_create(&deleter, NULL, purge_delete_thread, job) != 0) {
+        LOG_E("メッセージ一掃: スレッド作成失敗");
+        pthread_mutex_destroy(&job->mutex);
+        pthread_cond_destroy(&job->cond);
+        free(job);
+        return hajimu_null();
+    }
+
+    struct timespec wall;
+    clock_gettime(CLOCK_REALTIME, &wall);
+    uint64_t now_ms = (uint64_t)wall.tv_sec * 1000ULL + (uint64_t)(wall.tv_nsec / 1000000);
+
+    PurgeBatch *young = NULL, *old = NULL;
+    int scanned = 0, matched = 0;
+    bool stop = false;
+
+    while (!stop && matched < limit && scanned < scan_limit) {
+        char ep[192];
+        if (before[0])
+            snprintf(ep, sizeof(ep), "/channels/%s/messages?limit=%d&before=%s",
+                     job->channel_id, PURGE_PAGE_SIZE, before);
+        else
+            snprintf(ep, sizeof(ep), "/channels/%s/messages?limit=%d",
+                     job->channel_id, PURGE_PAGE_SIZE);
+        long code = 0;
+        JsonNode *page = discord_rest("GET", ep, NULL, &code);
+        if (!page || code != 200 || page->type != JSON_ARRAY) {
+            LOG_E("メッセージ一掃: 履歴の取得に失敗しました (HTTP %ld)", code);
+            if (page) { json_free(page); free(page); }
+            break;
+        }
+        int count = page->arr.count;
+        for (int i = 0; i < count && matched < limit && scanned < scan_limit; i++) {
+            JsonNode *msg = &page->arr.items[i];
+            const char *id = json_get_str(msg, "id");
+            if (!id) continue;
+            scanned++;
+            snprintf(before, sizeof(before), "%s", id);
+
+            uint64_t ts_ms = ((uint64_t)strtoull(id, NULL, 10) >> 22) + DISCORD_EPOCH_MS;
+            uint64_t age_ms = now_ms > ts_ms ? now_ms - ts_ms : 0;
+            /* 履歴は新しい順 — 期限を超えたら以降はすべて対象外 */
+            if (max_age_sec > 0 && age_ms > (uint64_t)(max_age_sec * 1000)) { stop = true; break; }
+
+            if (!include_pinned) {
+                JsonNode *pinned = json_get(msg, "pinned");
+                if (pinned && pinned->type == JSON_BOOL && pinned->boolean) continue;
+            }
+            JsonNode *author = json_get(msg, "author");
+            if (bots_only) {
+                JsonNode *bot = json_get(author, "bot");
+                if (!bot || bot->type != JSON_BOOL || !bot->boolean) continue;
+            }
+            if (authors) {
+                const char *aid = json_get_str(author, "id");
+                bool hit = false;
+                if (aid && authors->type == VALUE_STRING) {
+                    hit = strcmp(aid, authors->string.data) == 0;
+                } else if (aid) {
+                    for (int k = 0; k < authors->array.length && !hit; k++) {
+                        Value *a = &authors->array.elements[k];
+                        hit = a->type == VALUE_STRING && strcmp(aid, a->string.data) == 0;
+                    }
+                }
+                if (!hit) continue;
+            }
+            if (contains) {
+                const char *content = json_get_str(msg, "content");
+                if (!content || !strstr(content, contains)) continue;
+            }
+            if (filter) {
+                Value mv = json_to_value(msg);
+                pthread_mutex_lock(&g_bot.callback_mutex);
+                Value r = hajimu_runtime_available() ? hajimu_call(filter, 1, &mv) : hajimu_bool(true);
+                pthread_mutex_unlock(&g_bot.callback_mutex);
+                if (r.type == VALUE_BOOL && !r.boolean) continue;
+            }
+
+            matched++;
+            if (age_ms < PURGE_BULK_MAX_AGE_MS) purge_add(job, &young, true, id);
+            else                                purge_add(job, &old, false, id);
+        }
+        json_free(page); free(page);
+
+        Value progress = purge_progress_value(job, scanned, matched);
+        event_fire("一掃進捗", 1, &progress);
+        event_fire("PURGE_PROGRESS", 1, &progress);
+
+        if (count < PURGE_PAGE_SIZE) break;  /* 履歴の末尾 */
+    }
+
+    purge_enqueue(job, &young);
+    purge_enqueue(job, &old);
+    pthread_mutex_lock(&job->mutex);
+    job->done = true;
+    pthread_cond_signal(&job->cond);
+    pthread_mutex_unlock(&job->mutex);
+    pthread_join(deleter, NULL);
+
+    Value result = purge_progress_value(job, scanned, matched);
+    LOG_I("メッセージ一掃: %d件走査 / %d件削除 (一括 %d, 個別 %d, 失敗 %d)",
+          scanned, job->deleted_bulk + job->deleted_single,
+          job->deleted_bulk, job->deleted_single, job->failed);
+    pthread_mutex_destroy(&job->mutex);
+    pthread_cond_destroy(&job->cond);
+    free(job);
+    return result;
+}
+
 /* リアクション全削除(チャンネルID, メッセージID) */
 static Value fn_remove_all_reactions(int argc, Value *argv) {
     if (argc < 2 || argv[0].type != VALUE_STRING || argv[1].type != VALUE_STRING) {
@@ -6865,11 +15278,79 @@ static Value fn_get_user_voice_channel(int argc, Value *argv) {
     if (argc < 2 || argv[0].type != VALUE_STRING || argv[1].type != VALUE_STRING) {
         return hajimu_null();
     }
-    const char *vc = voice_state_cache_get(argv[0].string.data, argv[1].string.data);
-    if (vc) return hajimu_string(vc);
+    char vc[MAX_SNOWFLAKE];
+    if (voice_state_cache_get(argv[0].string.data, argv[1].string.data, vc, sizeof(vc)))
+        return hajimu_string(vc);
     return hajimu_null();
 }
 
+/* VC人数(チャンネルID[, 人間のみ]) — ボイス状態キャッシュから人数を返す (v2.6.0) */
+static Value fn_vc_user_count(int argc, Value *argv) {
+    if (argc < 1 || argv[0].type != VALUE_STRING) {
+        LOG_E("VC人数: チャンネルID(文字列)が必要です");
+        return hajimu_number(0);
+    }
+    bool humans_only = argc >= 2 && argv[1].type == VALUE_BOOL && argv[1].boolean;
+    cache_init();
+    uint32_t n = 0;
+    pthread_mutex_lock(&g_bot.cache.mutex);
+    int64_t i = snowmap_find(&g_bot.cache.vchan_map, snow_parse(argv[0].string.data), 0);
+    if (i >= 0) n = humans_only ? g_bot.cache.vchan_humans[i] : g_bot.cache.vchan_users[i];
+    pthread_mutex_unlock(&g_bot.cache.mutex);
+    return hajimu_number(n);
+}
+
+/* VCメンバー一覧(チャンネルID) — 接続中ユーザーとミュート状態 (v2.6.0) */
+static Value fn_vc_members(int argc, Value *argv) {
+    if (argc < 1 || argv[0].type != VALUE_STRING) {
+        LOG_E("VCメンバー一覧: チャンネルID(文字列)が必要です");
+        return hajimu_null();
+    }
+    uint64_t cid = snow_parse(argv[0].string.data);
+    cache_init();
+    Value arr = hajimu_array();
+    pthread_mutex_lock(&g_bot.cache.mutex);
+    EntityCache *c = &g_bot.cache;
+    if (snowmap_find(&c->vchan_map, cid, 0) >= 0) {
+        for (uint32_t i = 0; i < c->voice_count; i++) {
+            if (c->voice_channel[i] != cid) continue;
+            uint8_t f = c->voice_flags[i];
+            Value d = value_dict_new();
+            value_dict_add(&d, "ユーザーID", snow_value(c->voice_user[i]));
+            value_dict_add(&d, "サーバーID", snow_value(c->voice_guild[i]));
+            value_dict_add(&d, "ミュート", hajimu_bool(f & (VS_FLAG_SELF_MUTE | VS_FLAG_MUTE)));
+            value_dict_add(&d, "スピーカーミュート", hajimu_bool(f & (VS_FLAG_SELF_DEAF | VS_FLAG_DEAF)));
+            value_dict_add(&d, "サーバーミュート", hajimu_bool(f & VS_FLAG_MUTE));
+            value_dict_add(&d, "配信中", hajimu_bool(f & VS_FLAG_STREAM));
+            value_dict_add(&d, "カメラ", hajimu_bool(f & VS_FLAG_VIDEO));
+            value_dict_add(&d, "ボット", hajimu_bool(f & VS_FLAG_BOT));
+            hajimu_array_push(&arr, d);
+        }
+    }
+    pthread_mutex_unlock(&g_bot.cache.mutex);
+    return arr;
+}
+
+/* ボット単独(サーバーID) — Bot の VC に人間が残っていなければ真 (v2.6.0) */
+static Value fn_vc_bot_alone(int argc, Value *argv) {
+    if (argc < 1 || argv[0].type != VALUE_STRING) {
+        LOG_E("ボット単独: サーバーID(文字列)が必要です");
+        return hajimu_bool(false);
+    }
+    cache_init();
+    bool alone = false;
+    pthread_mutex_lock(&g_bot.cache.mutex);
+    EntityCache *c = &g_bot.cache;
+    int64_t i = snowmap_find(&c->voice_map, snow_parse(argv[0].string.data),
+                             snow_parse(g_bot.bot_id));
+    if (i >= 0) {
+        int64_t ci = snowmap_find(&c->vchan_map, c->voice_channel[i], 0);
+        alone = ci < 0 || c->vchan_humans[ci] == 0;
+    }
+    pthread_mutex_unlock(&g_bot.cache.mutex);
+    return hajimu_bool(alone);
+}
+
 /* VC接続(サーバーID, チャンネルID) — Join a voice channel */
 static Value fn_vc_join(int argc, Value *argv) {
     if (argc < 2 || argv[0].type != VALUE_STRING || argv[1].type != VALUE_STRING) {
@@ -6896,7 +15377,11 @@ static Value fn_vc_join(int argc, Value *argv) {
     vc->state_received = false;
     vc->server_received = false;
 
-    /* Start audio thread */
+    /* Park on the sender pool, then start the audio (encode-ahead) thread */
+    if (!voice_sender_attach(vc)) {
+        voice_free(vc);
+        return hajimu_bool(false);
+    }
     pthread_create(&vc->audio_thread, NULL, voice_audio_thread_func, vc);
 
     /* Send Gateway op 4 to join voice channel */
@@ -6961,6 +15446,7 @@ static Value fn_voice_play(int argc, Value *argv) {
     snprintf(vc->queue[tail].path, sizeof(vc->queue[tail].path), "%s", source);
     vc->queue_tail = (vc->queue_tail + 1) % MAX_AUDIO_QUEUE;
     vc->queue_count++;
+    pthread_cond_signal(&vc->voice_cond);
     pthread_mutex_unlock(&vc->voice_mutex);
 
     LOG_I("音声キューに追加: %s", source);
@@ -6977,7 +15463,6 @@ static Value fn_voice_stop(int argc, Value *argv) {
     if (!vc) return hajimu_bool(false);
 
     pthread_mutex_lock(&vc->voice_mutex);
-    vc->playing = false;
     vc->paused = false;
     /* Don't set stop_requested=true: that kills the audio thread entirely.
        Just stop current playback and clear queue so nothing else plays. */
@@ -6985,7 +15470,13 @@ static Value fn_voice_stop(int argc, Value *argv) {
     vc->queue_head = 0;
     vc->queue_tail = 0;
     vc->queue_count = 0;
+    /* 重ねている効果音も止める */
+    for (int i = 0; i < VOICE_MAX_MIX; i++)
+        if (vc->mix[i].id) vc->mix[i].stop = true;
+    uint32_t last_track = vc->track_seq;    /* 取り出し済みの曲はすべてこれ以下 */
     pthread_mutex_unlock(&vc->voice_mutex);
+    /* Drop everything already encoded into the send-ahead ring */
+    voice_drop_tracks(vc, last_track);
 
     LOG_I("音声停止: guild=%s", vc->guild_id);
     return hajimu_bool(true);
@@ -6998,7 +15489,7 @@ static Value fn_voice_pause(int argc, Value *argv) {
         return hajimu_bool(false);
     }
     VoiceConn *vc = voice_find(argv[0].string.data);
-    if (!vc || !vc->playing) return hajimu_bool(false);
+    if (!vc || !voice_is_playing(vc)) return hajimu_bool(false);
 
     vc->paused = true;
     voice_send_speaking(vc, false);
@@ -7030,8 +15521,11 @@ static Value fn_voice_skip(int argc, Value *argv) {
     VoiceConn *vc = voice_find(argv[0].string.data);
     if (!vc) return hajimu_bool(false);
 
-    /* Stop current track (audio thread will pick next from queue) */
-    vc->playing = false;
+    /* Stop current track (audio thread will pick next from queue).
+     * 送信中の曲を捨てる。先読み済みの次の曲は残す。 */
+    uint32_t track = __atomic_load_n(&vc->sending_track, __ATOMIC_ACQUIRE);
+    if (!track) track = __atomic_load_n(&vc->producing_track, __ATOMIC_ACQUIRE);
+    voice_drop_tracks(vc, track);
     vc->paused = false;
     vc->stop_requested = false; /* Don't stop the thread, just skip */
     LOG_I("音声スキップ: guild=%s", vc->guild_id);
@@ -7088,7 +15582,7 @@ static Value fn_vc_status(int argc, Value *argv) {
         "\"一時停止\":%s,\"キュー数\":%d,\"ループ\":%s}",
         vc->ready ? "true" : "false",
         vc->channel_id,
-        vc->playing ? "true" : "false",
+        voice_is_playing(vc) ? "true" : "false",
         vc->paused ? "true" : "false",
         vc->queue_count,
         vc->loop_mode ? "true" : "false");
@@ -7103,26 +15597,527 @@ static Value fn_vc_status(int argc, Value *argv) {
     return hajimu_string(buf);
 }
 
-/* 音声音量(サーバーID, 音量) — Set Opus encoder bitrate (proxy for volume) */
+/* 音声音量(サーバーID, 音量[, リミッター]) — PCM gain 0-200% before encoding.
+ * 次のフレームから 20ms かけて新しい音量へ移る。リミッター (既定 真) は
+ * 100% を超えたときの音割れを抑える。パススルー中の曲には次の曲から効く。 */
 static Value fn_voice_volume(int argc, Value *argv) {
-    if (argc < 2 || argv[0].type != VALUE_STRING || argv[1].type != VALUE_NUMBER) {
-        LOG_E("音声音量: サーバーID(文字列), 音量(数値 1-200)が必要です");
+    if (argc < 2 || argv[0].type != VALUE_STRING || argv[1].type != VALUE_NUMBER ||
+        (argc >= 3 && argv[2].type != VALUE_BOOL)) {
+        LOG_E("音声音量: サーバーID(文字列), 音量(数値 0-200)[, リミッター(真偽)]が必要です");
         return hajimu_bool(false);
     }
     VoiceConn *vc = voice_find(argv[0].string.data);
-    if (!vc || !vc->opus_enc) return hajimu_bool(false);
+    if (!vc) return hajimu_bool(false);
+
+    double vol = argv[1].number;
+    if (vol < 0) vol = 0;
+    if (vol > 200) vol = 200;
+    if (argc >= 3) vc->limiter = argv[2].boolean;
+    int32_t gain = (int32_t)(vol * VOICE_GAIN_ONE / 100.0 + 0.5);
+    __atomic_store_n(&vc->gain_target, gain, __ATOMIC_RELAXED);
+    LOG_I("音声音量設定: %.0f%% (guild=%s)", vol, vc->guild_id);
+    return hajimu_bool(true);
+}
 
-    int vol = (int)argv[1].number;
-    if (vol < 1) vol = 1;
+/* 音声効果再生(サーバーID, ソース[, 音量]) — Mix a sound over the current track.
+ * 曲のキューとは独立に最大 8 個まで重ねられる。音量は 0-200 (既定 100)。
+ * 戻り値は効果ID (音声効果停止・音声効果完了 イベントで使う)、失敗時は null。
+ * 先読みバッファの分だけ遅れて聞こえるので、効果音が主な用途なら
+ * 音声バッファ設定 を小さめにする。 */
+static Value fn_voice_effect_play(int argc, Value *argv) {
+    if (argc < 2 || argv[0].type != VALUE_STRING || argv[1].type != VALUE_STRING ||
+        (argc >= 3 && argv[2].type != VALUE_NUMBER)) {
+        LOG_E("音声効果再生: サーバーID(文字列), ソース(文字列)[, 音量(数値 0-200)]が必要です");
+        return hajimu_null();
+    }
+    VoiceConn *vc = voice_find(argv[0].string.data);
+    if (!vc || !vc->ready) {
+        LOG_E("音声効果再生: ボイス接続が準備できていません (guild=%s)", argv[0].string.data);
+        return hajimu_null();
+    }
+    double vol = argc >= 3 ? argv[2].number : 100;
+    if (vol < 0) vol = 0;
     if (vol > 200) vol = 200;
 
-    /* Map volume percentage to bitrate: 100% = 64kbps, 200% = 128kbps */
-    int bitrate = 640 * vol;
-    opus_encoder_ctl(vc->opus_enc, OPUS_SET_BITRATE(bitrate));
-    LOG_I("音声ビットレート設定: %d bps (volume=%d%%)", bitrate, vol);
+    pthread_mutex_lock(&vc->voice_mutex);
+    VoiceMixSource *m = NULL;
+    for (int i = 0; i < VOICE_MAX_MIX; i++)
+        if (!vc->mix[i].id) { m = &vc->mix[i]; break; }
+    if (!m) {
+        pthread_mutex_unlock(&vc->voice_mutex);
+        LOG_E("音声効果再生: 同時に鳴らせる効果は%d個までです", VOICE_MAX_MIX);
+        return hajimu_null();
+    }
+    snprintf(m->path, sizeof(m->path), "%s", argv[1].string.data);
+    m->gain = (int32_t)(vol * VOICE_GAIN_ONE / 100.0 + 0.5);
+    m->stop = false;
+    m->id = ++vc->mix_seq;
+    if (!m->id) m->id = ++vc->mix_seq;
+    uint32_t id = m->id;
+    __atomic_fetch_add(&vc->mix_active, 1, __ATOMIC_RELEASE);
+    pthread_cond_signal(&vc->voice_cond);
+    pthread_mutex_unlock(&vc->voice_mutex);
+
+    LOG_I("音声効果再生 #%u: %s", id, argv[1].string.data);
+    return hajimu_number(id);
+}
+
+/* 音声効果停止(サーバーID[, 効果ID]) — Stop one effect, or all of them */
+static Value fn_voice_effect_stop(int argc, Value *argv) {
+    if (argc < 1 || argv[0].type != VALUE_STRING ||
+        (argc >= 2 && argv[1].type != VALUE_NUMBER)) {
+        LOG_E("音声効果停止: サーバーID(文字列)[, 効果ID(数値)]が必要です");
+        return hajimu_bool(false);
+    }
+    VoiceConn *vc = voice_find(argv[0].string.data);
+    if (!vc) return hajimu_bool(false);
+    uint32_t id = argc >= 2 ? (uint32_t)argv[1].number : 0;
+    bool found = false;
+    pthread_mutex_lock(&vc->voice_mutex);
+    for (int i = 0; i < VOICE_MAX_MIX; i++) {
+        if (!vc->mix[i].id || (id && vc->mix[i].id != id)) continue;
+        vc->mix[i].stop = true;
+        found = true;
+    }
+    pthread_mutex_unlock(&vc->voice_mutex);
+    return hajimu_bool(found);
+}
+
+/* 音声バッファ設定(サーバーID, ミリ秒) — Depth of the encode-ahead ring (100-3000ms) */
+static Value fn_voice_buffer(int argc, Value *argv) {
+    if (argc < 2 || argv[0].type != VALUE_STRING || argv[1].type != VALUE_NUMBER) {
+        LOG_E("音声バッファ設定: サーバーID(文字列), ミリ秒(数値 100-3000)が必要です");
+        return hajimu_bool(false);
+    }
+    VoiceConn *vc = voice_find(argv[0].string.data);
+    if (!vc) return hajimu_bool(false);
+
+    int ms = (int)argv[1].number;
+    if (ms < 100) ms = 100;
+    if (ms > VOICE_RING_MAX_MS) ms = VOICE_RING_MAX_MS;
+    __atomic_store_n(&vc->ring.limit, (uint32_t)(ms / VOICE_FRAME_MS), __ATOMIC_RELAXED);
+    LOG_I("音声バッファ設定: %dms (guild=%s)", ms, vc->guild_id);
+    return hajimu_bool(true);
+}
+
+/* 音声統計(サーバーID) — Send-ahead ring counters for tuning the buffer depth.
+ * 最小バッファms は前回の取得以降の最小値で、取得するとリセットされる。 */
+static Value fn_voice_stats(int argc, Value *argv) {
+    if (argc < 1 || argv[0].type != VALUE_STRING) {
+        LOG_E("音声統計: サーバーID(文字列)が必要です");
+        return hajimu_null();
+    }
+    VoiceConn *vc = voice_find(argv[0].string.data);
+    if (!vc) return hajimu_null();
+
+    VoiceRing *r = &vc->ring;
+    uint32_t depth = voice_ring_count(r);
+    uint32_t low = __atomic_exchange_n(&r->low_water, UINT32_MAX, __ATOMIC_RELAXED);
+    if (low == UINT32_MAX) low = depth;
+
+    Value d = value_dict_new();
+    value_dict_add(&d, "送信フレーム", hajimu_number((double)__atomic_load_n(&r->sent, __ATOMIC_RELAXED)));
+    value_dict_add(&d, "アンダーラン", hajimu_number((double)__atomic_load_n(&r->underruns, __ATOMIC_RELAXED)));
+    value_dict_add(&d, "オーバーラン", hajimu_number((double)__atomic_load_n(&r->overruns, __ATOMIC_RELAXED)));
+    value_dict_add(&d, "送信遅延", hajimu_number((double)__atomic_load_n(&r->late, __ATOMIC_RELAXED)));
+    value_dict_add(&d, "バッファms", hajimu_number((double)(__atomic_load_n(&r->limit, __ATOMIC_RELAXED) * VOICE_FRAME_MS)));
+    value_dict_add(&d, "深さms", hajimu_number((double)(depth * VOICE_FRAME_MS)));
+    value_dict_add(&d, "最小バッファms", hajimu_number((double)(low * VOICE_FRAME_MS)));
+    value_dict_add(&d, "パススルー", hajimu_bool(__atomic_load_n(&vc->passthrough, __ATOMIC_RELAXED)));
+    value_dict_add(&d, "送信スレッド", hajimu_number(vc->sender_id));
+    return d;
+}
+
+/* 音声送信設定(設定) — 設定: {"スレッド数": 数値, "高優先度": 真偽, "CPU固定": 真偽}
+ * 全接続の RTP 送信を受け持つスレッドプール。最初の VC接続 で起動するので
+ * それより前に呼ぶ。スレッド数の既定はコア数 (最大 8)、高優先度は SCHED_FIFO
+ * (Linux は権限が必要)、CPU固定 はスレッド i を CPU i に固定する。 */
+static Value fn_voice_sender_config(int argc, Value *argv) {
+    if (argc < 1 || argv[0].type != VALUE_DICT) {
+        LOG_E("音声送信設定: 設定(辞書)が必要です");
+        return hajimu_bool(false);
+    }
+    VoiceSenderPool *p = &g_bot.voice_senders;
+    pthread_once(&g_voice_sender_once, voice_sender_init_once);
+    pthread_mutex_lock(&p->mutex);
+    if (p->count > 0) {
+        pthread_mutex_unlock(&p->mutex);
+        LOG_W("音声送信設定: 送信スレッドは起動済みです (VC接続 の前に呼んでください)");
+        return hajimu_bool(false);
+    }
+    for (int k = 0; k < argv[0].dict.length; k++) {
+        const char *key = argv[0].dict.keys[k];
+        Value *val = &argv[0].dict.values[k];
+        if (strcmp(key, "スレッド数") == 0 && val->type == VALUE_NUMBER) {
+            int n = (int)val->number;
+            if (n < 0) n = 0;
+            if (n > VOICE_SENDERS_MAX) n = VOICE_SENDERS_MAX;
+            p->want = n;
+        } else if (strcmp(key, "高優先度") == 0 && val->type == VALUE_BOOL) {
+            p->high_priority = val->boolean;
+        } else if (strcmp(key, "CPU固定") == 0 && val->type == VALUE_BOOL) {
+            p->pin_cpu = val->boolean;
+        }
+    }
+    pthread_mutex_unlock(&p->mutex);
+    return hajimu_bool(true);
+}
+
+/* 音声受信開始(サーバーID[, 設定]) — 設定: {"保存先": ディレクトリ,
+ * "コールバック": 関数(サーバーID, ユーザーID, PCM配列), "遅延ms": 数値}
+ * 話者ごとに <保存先>/<ユーザーID>.wav (48kHz/16bit/ステレオ) を書き、
+ * コールバックには 20ms ごとのインターリーブ PCM を渡す。遅延ms (20-500,
+ * 既定 60) はジッタバッファに溜めてから取り出し始める量。 */
+static Value fn_voice_recv_start(int argc, Value *argv) {
+    if (argc < 1 || argv[0].type != VALUE_STRING ||
+        (argc >= 2 && argv[1].type != VALUE_DICT)) {
+        LOG_E("音声受信開始: サーバーID(文字列)[, 設定(辞書)]が必要です");
+        return hajimu_bool(false);
+    }
+    VoiceConn *vc = voice_find(argv[0].string.data);
+    if (!vc || !vc->ready || vc->udp_fd < 0) {
+        LOG_E("音声受信開始: ボイス接続が準備できていません (guild=%s)", argv[0].string.data);
+        return hajimu_bool(false);
+    }
+    if (vc->recv) {
+        LOG_W("音声受信開始: 既に受信中です (guild=%s)", vc->guild_id);
+        return hajimu_bool(false);
+    }
+
+    VoiceRecv *rv = calloc(1, sizeof(*rv));
+    if (!rv) return hajimu_bool(false);
+    int ms = VOICE_JB_DEFAULT_MS;
+    rv->callback = hajimu_null();
+    for (int k = 0; argc >= 2 && k < argv[1].dict.length; k++) {
+        const char *key = argv[1].dict.keys[k];
+        Value *val = &argv[1].dict.values[k];
+        if (strcmp(key, "保存先") == 0 && val->type == VALUE_STRING) {
+            snprintf(rv->dir, sizeof(rv->dir), "%s", val->string.data);
+        } else if (strcmp(key, "コールバック") == 0 &&
+                   (val->type == VALUE_FUNCTION || val->type == VALUE_BUILTIN)) {
+            rv->callback = *val;
+            rv->has_callback = true;
+        } else if (strcmp(key, "遅延ms") == 0 && val->type == VALUE_NUMBER) {
+            ms = (int)val->number;
+        }
+    }
+    if (ms < VOICE_FRAME_MS) ms = VOICE_FRAME_MS;
+    if (ms > 500) ms = 500;
+    rv->depth = ms / VOICE_FRAME_MS;
+    if (!rv->dir[0] && !rv->has_callback)
+        LOG_W("音声受信開始: 保存先もコールバックもありません (統計のみ)");
+
+    pthread_mutex_init(&rv->mutex, NULL);
+    vc->recv = rv;
+    if (pthread_create(&rv->recv_thread, NULL, voice_recv_thread_func, vc) != 0) {
+        vc->recv = NULL;
+        pthread_mutex_destroy(&rv->mutex);
+        free(rv);
+        return hajimu_bool(false);
+    }
+    if (pthread_create(&rv->play_thread, NULL, voice_recv_play_thread_func, vc) != 0) {
+        rv->stop = true;
+        pthread_join(rv->recv_thread, NULL);
+        vc->recv = NULL;
+        pthread_mutex_destroy(&rv->mutex);
+        free(rv);
+        return hajimu_bool(false);
+    }
+    LOG_I("音声受信開始: guild=%s", vc->guild_id);
+    return hajimu_bool(true);
+}
+
+/* 音声受信停止(サーバーID) — WAV はここで閉じてヘッダーのサイズを確定する */
+static Value fn_voice_recv_stop(int argc, Value *argv) {
+    if (argc < 1 || argv[0].type != VALUE_STRING) {
+        LOG_E("音声受信停止: サーバーID(文字列)が必要です");
+        return hajimu_bool(false);
+    }
+    VoiceConn *vc = voice_find(argv[0].string.data);
+    if (!vc || !vc->recv) return hajimu_bool(false);
+    voice_recv_stop(vc);
+    LOG_I("音声受信停止: guild=%s", vc->guild_id);
+    return hajimu_bool(true);
+}
+
+/* 音声受信統計(サーバーID) — {パケット, 復号失敗, 話者上限超過, 話者: [{ユーザーID,
+ * SSRC, パケット, 欠落, 遅着, バッファ}]} */
+static Value fn_voice_recv_stats(int argc, Value *argv) {
+    if (argc < 1 || argv[0].type != VALUE_STRING) {
+        LOG_E("音声受信統計: サーバーID(文字列)が必要です");
+        return hajimu_null();
+    }
+    VoiceConn *vc = voice_find(argv[0].string.data);
+    if (!vc || !vc->recv) return hajimu_null();
+    VoiceRecv *rv = vc->recv;
+
+    Value d = value_dict_new();
+    Value list = hajimu_array();
+    pthread_mutex_lock(&rv->mutex);
+    value_dict_add(&d, "パケット", hajimu_number((double)rv->packets));
+    value_dict_add(&d, "復号失敗", hajimu_number((double)rv->decrypt_errors));
+    value_dict_add(&d, "話者上限超過", hajimu_number((double)rv->no_slot));
+    for (int i = 0; i < rv->stream_count; i++) {
+        VoiceRecvStream *s = rv->streams[i];
+        char user[MAX_SNOWFLAKE];
+        voice_speaker_user(vc, s->ssrc, user, sizeof(user));
+        Value e = value_dict_new();
+        value_dict_add(&e, "ユーザーID", user[0] ? hajimu_string(user) : hajimu_null());
+        value_dict_add(&e, "SSRC", hajimu_number(s->ssrc));
+        value_dict_add(&e, "パケット", hajimu_number((double)s->packets));
+        value_dict_add(&e, "欠落", hajimu_number((double)s->lost));
+        value_dict_add(&e, "遅着", hajimu_number((double)s->late));
+        value_dict_add(&e, "バッファ", hajimu_number(s->count));
+        hajimu_array_push(&list, e);
+    }
+    pthread_mutex_unlock(&rv->mutex);
+    value_dict_add(&d, "話者", list);
+    return d;
+}
+
+/* --- 音声配信 (v2.6.0) --- */
+
+/* 音声配信作成([先読みms]) — Broadcast source decoded and encoded once for every
+ * subscribed connection. 先読みms (100-3000, 既定 1000) は実時間より先に
+ * 作る量で、参加した接続はその分遅れて聞こえる。配信IDを返す。 */
+static Value fn_voice_cast_create(int argc, Value *argv) {
+    int ms = VOICE_RING_DEFAULT_MS;
+    if (argc >= 1 && argv[0].type == VALUE_NUMBER) ms = (int)argv[0].number;
+    if (ms < 100) ms = 100;
+    if (ms > VOICE_RING_MAX_MS) ms = VOICE_RING_MAX_MS;
+
+    pthread_once(&g_voice_cast_once, voice_cast_init_once);
+    pthread_mutex_lock(&g_bot.voice_cast_mutex);
+    VoiceCast *c = NULL;
+    for (int i = 0; i < MAX_VOICE_CASTS && !c; i++)
+        if (!g_bot.voice_casts[i].id) c = &g_bot.voice_casts[i];
+    if (!c) {
+        pthread_mutex_unlock(&g_bot.voice_cast_mutex);
+        LOG_E("音声配信作成: 配信は最大%d個です", MAX_VOICE_CASTS);
+        return hajimu_null();
+    }
+    memset(c, 0, sizeof(*c));
+    c->lead = (uint32_t)(ms / VOICE_FRAME_MS);
+    c->slots = calloc(VOICE_RING_SLOTS, sizeof(VoiceFrame));
+    int err = 0;
+    c->enc = opus_encoder_create(VOICE_SAMPLE_RATE, VOICE_CHANNELS, OPUS_APPLICATION_AUDIO, &err);
+    if (!c->slots || err != OPUS_OK || !c->enc) {
+        LOG_E("音声配信作成: 初期化に失敗しました");
+        free(c->slots);
+        if (c->enc) opus_encoder_destroy(c->enc);
+        memset(c, 0, sizeof(*c));
+        pthread_mutex_unlock(&g_bot.voice_cast_mutex);
+        return hajimu_null();
+    }
+    opus_encoder_ctl(c->enc, OPUS_SET_BITRATE(VOICE_CAST_BITRATE));
+    pthread_mutex_init(&c->mutex, NULL);
+    pthread_cond_init(&c->cond, NULL);
+    c->id = ++g_bot.voice_cast_seq;
+    if (!c->id) c->id = ++g_bot.voice_cast_seq;
+    if (pthread_create(&c->thread, NULL, voice_cast_thread_func, c) != 0) {
+        LOG_E("音声配信作成: スレッドを起動できません");
+        opus_encoder_destroy(c->enc);
+        free(c->slots);
+        pthread_cond_destroy(&c->cond);
+        pthread_mutex_destroy(&c->mutex);
+        memset(c, 0, sizeof(*c));
+        pthread_mutex_unlock(&g_bot.voice_cast_mutex);
+        return hajimu_null();
+    }
+    uint32_t id = c->id;
+    pthread_mutex_unlock(&g_bot.voice_cast_mutex);
+    LOG_I("音声配信 #%u 作成 (先読み %dms)", id, ms);
+    return hajimu_number(id);
+}
+
+static VoiceCast *voice_cast_arg(Value *v) {
+    if (v->type != VALUE_NUMBER) return NULL;
+    return voice_cast_find((uint32_t)v->number);
+}
+
+/* 音声配信再生(配信ID, ソース) — Queue a file / URL on the broadcast */
+static Value fn_voice_cast_play(int argc, Value *argv) {
+    if (argc < 2 || argv[0].type != VALUE_NUMBER || argv[1].type != VALUE_STRING) {
+        LOG_E("音声配信再生: 配信ID(数値), ソース(文字列)が必要です");
+        return hajimu_bool(false);
+    }
+    VoiceCast *c = voice_cast_arg(&argv[0]);
+    if (!c) return hajimu_bool(false);
+
+    pthread_mutex_lock(&c->mutex);
+    if (c->queue_count >= MAX_AUDIO_QUEUE) {
+        pthread_mutex_unlock(&c->mutex);
+        LOG_E("音声配信再生: キューが満杯です");
+        return hajimu_bool(false);
+    }
+    int tail = c->queue_tail;
+    snprintf(c->queue[tail].path, sizeof(c->queue[tail].path), "%s", argv[1].string.data);
+    c->queue_tail = (c->queue_tail + 1) % MAX_AUDIO_QUEUE;
+    c->queue_count++;
+    pthread_cond_signal(&c->cond);
+    pthread_mutex_unlock(&c->mutex);
+    return hajimu_bool(true);
+}
+
+/* 音声配信スキップ(配信ID) — 先読み済みの分は購読者に届いてから次の曲になる */
+static Value fn_voice_cast_skip(int argc, Value *argv) {
+    if (argc < 1 || argv[0].type != VALUE_NUMBER) {
+        LOG_E("音声配信スキップ: 配信ID(数値)が必要です");
+        return hajimu_bool(false);
+    }
+    VoiceCast *c = voice_cast_arg(&argv[0]);
+    if (!c) return hajimu_bool(false);
+    c->skip = true;
+    return hajimu_bool(true);
+}
+
+/* 音声配信ループ(配信ID, 有効) */
+static Value fn_voice_cast_loop(int argc, Value *argv) {
+    if (argc < 2 || argv[0].type != VALUE_NUMBER || argv[1].type != VALUE_BOOL) {
+        LOG_E("音声配信ループ: 配信ID(数値), 有効(真偽)が必要です");
+        return hajimu_bool(false);
+    }
+    VoiceCast *c = voice_cast_arg(&argv[0]);
+    if (!c) return hajimu_bool(false);
+    pthread_mutex_lock(&c->mutex);
+    c->loop_mode = argv[1].boolean;
+    pthread_mutex_unlock(&c->mutex);
+    return hajimu_bool(true);
+}
+
+/* 音声配信参加(サーバーID, 配信ID) — The connection sends the broadcast instead
+ * of its own queue (自分のキューは離脱まで止まる)。 */
+static Value fn_voice_cast_join(int argc, Value *argv) {
+    if (argc < 2 || argv[0].type != VALUE_STRING || argv[1].type != VALUE_NUMBER) {
+        LOG_E("音声配信参加: サーバーID(文字列), 配信ID(数値)が必要です");
+        return hajimu_bool(false);
+    }
+    VoiceConn *vc = voice_find(argv[0].string.data);
+    VoiceCast *c = voice_cast_arg(&argv[1]);
+    if (!vc || !c) return hajimu_bool(false);
+    if (!voice_cast_subscribe(vc, c)) return hajimu_bool(false);
+    LOG_I("音声配信 #%u に参加: guild=%s", c->id, vc->guild_id);
+    return hajimu_bool(true);
+}
+
+/* 音声配信離脱(サーバーID) — Back to the connection's own queue */
+static Value fn_voice_cast_leave(int argc, Value *argv) {
+    if (argc < 1 || argv[0].type != VALUE_STRING) {
+        LOG_E("音声配信離脱: サーバーID(文字列)が必要です");
+        return hajimu_bool(false);
+    }
+    VoiceConn *vc = voice_find(argv[0].string.data);
+    if (!vc || !vc->cast) return hajimu_bool(false);
+    return hajimu_bool(voice_cast_subscribe(vc, NULL));
+}
+
+/* 音声配信終了(配信ID) — 購読している接続は自分のキューに戻る */
+static Value fn_voice_cast_end(int argc, Value *argv) {
+    if (argc < 1 || argv[0].type != VALUE_NUMBER) {
+        LOG_E("音声配信終了: 配信ID(数値)が必要です");
+        return hajimu_bool(false);
+    }
+    pthread_once(&g_voice_cast_once, voice_cast_init_once);
+    pthread_mutex_lock(&g_bot.voice_cast_mutex);
+    VoiceCast *c = voice_cast_arg(&argv[0]);
+    if (c) voice_cast_free(c);
+    pthread_mutex_unlock(&g_bot.voice_cast_mutex);
+    return hajimu_bool(c != NULL);
+}
+
+/* 音声配信情報(配信ID) — {購読数, キュー, 再生中, フレーム, エンコード} */
+static Value fn_voice_cast_info(int argc, Value *argv) {
+    if (argc < 1 || argv[0].type != VALUE_NUMBER) {
+        LOG_E("音声配信情報: 配信ID(数値)が必要です");
+        return hajimu_null();
+    }
+    VoiceCast *c = voice_cast_arg(&argv[0]);
+    if (!c) return hajimu_null();
+    pthread_mutex_lock(&c->mutex);
+    int queued = c->queue_count;
+    pthread_mutex_unlock(&c->mutex);
+
+    Value d = value_dict_new();
+    value_dict_add(&d, "購読数", hajimu_number(__atomic_load_n(&c->subscribers, __ATOMIC_RELAXED)));
+    value_dict_add(&d, "キュー", hajimu_number(queued));
+    value_dict_add(&d, "再生中", hajimu_bool(__atomic_load_n(&c->producing, __ATOMIC_RELAXED) != 0));
+    value_dict_add(&d, "フレーム", hajimu_number((double)c->frames));
+    value_dict_add(&d, "エンコード", hajimu_number((double)c->encoded));
+    return d;
+}
+
+/* 音声キャッシュ設定(メモリMB[, ディスク退避先[, ディスクMB]])
+ * エンコード済みフレームのキャッシュ (全接続で共有, 既定 32MB)。0 で無効。
+ * 退避先ディレクトリを指定すると、メモリから追い出した曲をファイルに書き、
+ * 再起動後も同じソースの再生に使う (既定 256MB)。空文字で退避をやめる。 */
+static Value fn_voice_cache_config(int argc, Value *argv) {
+    if (argc < 1 || argv[0].type != VALUE_NUMBER ||
+        (argc >= 2 && argv[1].type != VALUE_STRING && argv[1].type != VALUE_NULL) ||
+        (argc >= 3 && argv[2].type != VALUE_NUMBER)) {
+        LOG_E("音声キャッシュ設定: (メモリMB[, ディスク退避先[, ディスクMB]]) が必要です");
+        return hajimu_bool(false);
+    }
+    voice_cache_init();
+    VoiceClipCache *vcc = &g_bot.voice_cache;
+    double mb = argv[0].number;
+    if (mb < 0) mb = 0;
+    pthread_mutex_lock(&vcc->mutex);
+    vcc->max_bytes = (size_t)(mb * 1024.0 * 1024.0);
+    char scan[256] = "";
+    if (argc >= 2) {
+        const char *dir = argv[1].type == VALUE_STRING ? argv[1].string.data : "";
+        char old[256];
+        snprintf(old, sizeof(old), "%s", vcc->dir);
+        snprintf(vcc->dir, sizeof(vcc->dir), "%s", dir);
+        size_t n = strlen(vcc->dir);
+        while (n > 1 && (vcc->dir[n - 1] == '/' || vcc->dir[n - 1] == '\\')) vcc->dir[--n] = '\0';
+        if (!vcc->dir[0]) {
+            /* 退避をやめる: ディスクにしかない曲は忘れる (ファイルは残す) */
+            for (int i = vcc->count - 1; i >= 0; i--) {
+                VoiceClip *c = vcc->clips[i];
+                if (c->on_disk) { vcc->disk_bytes -= c->bytes; c->on_disk = false; }
+                if (!c->data && c->refs == 0) voice_clip_remove_at(vcc, i);
+            }
+        } else if (strcmp(old, vcc->dir) != 0) {
+            snprintf(scan, sizeof(scan), "%s", vcc->dir);
+        }
+    }
+    if (argc >= 3) {
+        double dmb = argv[2].number < 0 ? 0 : argv[2].number;
+        vcc->disk_max = (size_t)(dmb * 1024.0 * 1024.0);
+    }
+    voice_cache_enforce(vcc);
+    LOG_I("音声キャッシュ設定: メモリ%.0fMB%s%s", mb,
+          vcc->dir[0] ? ", 退避先 " : "", vcc->dir);
+    pthread_mutex_unlock(&vcc->mutex);
+    if (scan[0]) voice_cache_scan(vcc, scan);
     return hajimu_bool(true);
 }
 
+/* 音声キャッシュ統計() — {件数, メモリ使用量, ディスク件数, ディスク使用量, ヒット, ミス, 追い出し} */
+static Value fn_voice_cache_stats(int argc, Value *argv) {
+    (void)argc; (void)argv;
+    voice_cache_init();
+    VoiceClipCache *vcc = &g_bot.voice_cache;
+    pthread_mutex_lock(&vcc->mutex);
+    int mem = 0, disk = 0;
+    for (int i = 0; i < vcc->count; i++) {
+        if (vcc->clips[i]->data) mem++;
+        if (vcc->clips[i]->on_disk) disk++;
+    }
+    Value d = value_dict_new();
+    value_dict_add(&d, "件数", hajimu_number(mem));
+    value_dict_add(&d, "メモリ使用量", hajimu_number((double)vcc->mem_bytes));
+    value_dict_add(&d, "メモリ上限", hajimu_number((double)vcc->max_bytes));
+    value_dict_add(&d, "ディスク件数", hajimu_number(disk));
+    value_dict_add(&d, "ディスク使用量", hajimu_number((double)vcc->disk_bytes));
+    value_dict_add(&d, "ヒット", hajimu_number((double)vcc->hits));
+    value_dict_add(&d, "ミス", hajimu_number((double)vcc->misses));
+    value_dict_add(&d, "追い出し", hajimu_number((double)vcc->evictions));
+    pthread_mutex_unlock(&vcc->mutex);
+    return d;
+}
+
 /* =========================================================================
  * YouTube / yt-dlp 連携
  * ========================================================================= */
@@ -8828,6 +17823,462 @@ static Value fn_bulk_ban(int argc, Value *argv) {
     return result;
 }
 
+/* --- v2.6.0: 一括モデレーションジョブ ---
+ *
+ * 数千件規模のロール付与/剥奪・キック・タイムアウト・BAN を
+ * バックグラウンドのワーカースレッドで処理する。各リクエストは
+ * discord_rest 経由なのでルート別バケット内で並列化される。
+ * BAN は bulk-ban (200件/回) にまとめる。
+ *
+ * チェックポイントファイル (任意):
+ *   HJMODJOB1 <種類> <サーバーID> <ロールID|-> <数値> <総数>\n
+ *   W0000000000\n     ← 完了済み先頭件数 (固定幅、その場で書き換え)
+ *   <印><対象ID>\n ... ← 印は ' '、失敗したら '!' に書き換える
+ * 再開時はウォーターマーク以降と、それより前で失敗したものを再実行する
+ * (各操作は冪等)。 */
+
+static const char *modjob_type_names[MODJOB_TYPE_COUNT] = {
+    "ロール付与", "ロール剥奪", "キック", "タイムアウト", "BAN"
+};
+
+static int modjob_type_from_name(const char *s) {
+    for (int i = 0; i < MODJOB_TYPE_COUNT; i++)
+        if (strcmp(s, modjob_type_names[i]) == 0) return i;
+    if (strcmp(s, "role_add") == 0) return MODJOB_ROLE_ADD;
+    if (strcmp(s, "role_remove") == 0) return MODJOB_ROLE_REMOVE;
+    if (strcmp(s, "kick") == 0) return MODJOB_KICK;
+    if (strcmp(s, "timeout") == 0) return MODJOB_TIMEOUT;
+    if (strcmp(s, "ban") == 0) return MODJOB_BAN;
+    return -1;
+}
+
+/* Caller must hold job->mutex */
+static Value modjob_status_value(ModJob *job) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    double elapsed = (now.tv_sec - job->start_time.tv_sec) +
+                     (now.tv_nsec - job->start_time.tv_nsec) / 1e9;
+    Value d = value_dict_new();
+    value_dict_add(&d, "ジョブID", hajimu_number(job->id));
+    value_dict_add(&d, "種類", hajimu_string(modjob_type_names[job->type]));
+    value_dict_add(&d, "サーバーID", hajimu_string(job->guild_id));
+    value_dict_add(&d, "総数", hajimu_number(job->total));
+    value_dict_add(&d, "完了数", hajimu_number(job->done_count));
+    value_dict_add(&d, "成功数", hajimu_number(job->ok_count));
+    value_dict_add(&d, "失敗数", hajimu_number(job->fail_count));
+    value_dict_add(&d, "経過秒", hajimu_number(elapsed));
+    value_dict_add(&d, "完了", hajimu_bool(job->finished));
+    value_dict_add(&d, "停止", hajimu_bool(job->stop));
+    if (job->checkpoint_path[0])
+        value_dict_add(&d, "チェックポイント", hajimu_string(job->checkpoint_path));
+    return d;
+}
+
+/* Write target list + header once at job start */
+static bool modjob_checkpoint_open(ModJob *job) {
+    job->checkpoint = fopen(job->checkpoint_path, "w+");
+    if (!job->checkpoint) {
+        LOG_E("モデレーションジョブ: チェックポイントを開けません: %s", job->checkpoint_path);
+        return false;
+    }
+    fprintf(job->checkpoint, "HJMODJOB1 %d %s %s %d %d\n", (int)job->type, job->guild_id,
+            job->role_id[0] ? job->role_id : "-", job->param, job->total);
+    job->checkpoint_wm_offset = ftell(job->checkpoint);
+    fprintf(job->checkpoint, "W%010d\n", job->watermark);
+    job->checkpoint_offsets = (long *)malloc((size_t)(job->total > 0 ? job->total : 1) * sizeof(long));
+    for (int i = 0; i < job->total; i++) {
+        if (job->checkpoint_offsets) job->checkpoint_offsets[i] = ftell(job->checkpoint);
+        fprintf(job->checkpoint, " %s\n", job->targets[i]);
+    }
+    fflush(job->checkpoint);
+    return true;
+}
+
+/* Caller must hold job->mutex — ウォーターマークだけを書き換える */
+static void modjob_checkpoint_update(ModJob *job) {
+    if (!job->checkpoint) return;
+    fseek(job->checkpoint, job->checkpoint_wm_offset, SEEK_SET);
+    fprintf(job->checkpoint, "W%010d", job->watermark);
+    fflush(job->checkpoint);
+}
+
+/* Caller must hold job->mutex — 失敗した対象の行に印を付ける
+ * (次の modjob_checkpoint_update でまとめて書き出される) */
+static void modjob_checkpoint_mark_failed(ModJob *job, int i) {
+    if (!job->checkpoint || !job->checkpoint_offsets) return;
+    fseek(job->checkpoint, job->checkpoint_offsets[i], SEEK_SET);
+    fputc('!', job->checkpoint);
+}
+
+/* Execute one non-BAN target; returns true on success */
+static bool modjob_exec_one(ModJob *job, const char *user_id) {
+    char ep[192];
+    long code = 0;
+    JsonNode *resp = NULL;
+    switch (job->type) {
+        case MODJOB_ROLE_ADD:
+            snprintf(ep, sizeof(ep), "/guilds/%s/members/%s/roles/%s",
+                     job->guild_id, user_id, job->role_id);
+            resp = discord_rest("PUT", ep, "{}", &code);
+            break;
+        case MODJOB_ROLE_REMOVE:
+            snprintf(ep, sizeof(ep), "/guilds/%s/members/%s/roles/%s",
+                     job->guild_id, user_id, job->role_id);
+            resp = discord_rest("DELETE", ep, NULL, &code);
+            break;
+        case MODJOB_KICK:
+            snprintf(ep, sizeof(ep), "/guilds/%s/members/%s", job->guild_id, user_id);
+            resp = discord_rest("DELETE", ep, NULL, &code);
+            break;
+        case MODJOB_TIMEOUT: {
+            StrBuf sb; sb_init(&sb);
+            jb_obj_start(&sb);
+            if (job->param <= 0) {
+                jb_null(&sb, "communication_disabled_until");
+            } else {
+                time_t target = time(NULL) + job->param;
+                struct tm tm;
+#ifdef _WIN32
+                gmtime_s(&tm, &target);
+#else
+                gmtime_r(&target, &tm);
+#endif
+                char ts[64];
+                strftime(ts, sizeof(ts), "%Y-%m-%dT%H:%M:%SZ", &tm);
+                jb_str(&sb, "communication_disabled_until", ts);
+            }
+            jb_obj_end(&sb);
+            snprintf(ep, sizeof(ep), "/guilds/%s/members/%s", job->guild_id, user_id);
+            resp = discord_rest("PATCH", ep, sb.data, &code);
+            sb_free(&sb);
+            break;
+        }
+        default:
+            break;
+    }
+    if (resp) { json_free(resp); free(resp); }
+    return code == 200 || code == 204;
+}
+
+/* Execute one bulk-ban chunk; returns number of banned users.
+ * banned[k] に targets[from + k] が BAN されたかを入れる。 */
+static int modjob_exec_ban(ModJob *job, int from, int count, uint8_t *banned_flags) {
+    StrBuf sb; sb_init(&sb);
+    jb_obj_start(&sb);
+    jb_key(&sb, "user_ids"); jb_arr_start(&sb);
+    for (int i = from; i < from + count; i++) {
+        json_escape_str(&sb, job->targets[i]);
+        sb_append_char(&sb, ',');
+    }
+    jb_arr_end(&sb); sb_append_char(&sb, ',');
+    jb_int(&sb, "delete_message_seconds", job->param > 0 ? job->param : 0);
+    jb_obj_end(&sb);
+
+    char ep[128];
+    snprintf(ep, sizeof(ep), "/guilds/%s/bulk-ban", job->guild_id);
+    long code = 0;
+    JsonNode *resp = discord_rest("POST", ep, sb.data, &code);
+    sb_free(&sb);
+    int banned = 0;
+    memset(banned_flags, 0, (size_t)count);
+    if (resp && code == 200) {
+        JsonNode *ok = json_get(resp, "banned_users");
+        if (ok && ok->type == JSON_ARRAY) {
+            for (int k = 0; k < ok->arr.count; k++) {
+                const char *uid = ok->arr.items[k].type == JSON_STRING ? ok->arr.items[k].str.data : NULL;
+                for (int i = 0; uid && i < count; i++) {
+                    if (!banned_flags[i] && strcmp(job->targets[from + i], uid) == 0) {
+                        banned_flags[i] = 1;
+                        banned++;
+                        break;
+                    }
+                }
+            }
+        }
+    }
+    if (resp) { json_free(resp); free(resp); }
+    return banned;
+}
+
+static void *modjob_worker(void *arg) {
+    ModJob *job = (ModJob *)arg;
+    int chunk = job->type == MODJOB_BAN ? MODJOB_BAN_CHUNK : 1;
+    for (;;) {
+        pthread_mutex_lock(&job->mutex);
+        if (job->stop || job->next >= job->total) {
+            bool last = --job->running_workers == 0;
+            if (last) {
+                job->finished = true;
+                modjob_checkpoint_update(job);
+                if (job->checkpoint) { fclose(job->checkpoint); job->checkpoint = NULL; }
+                /* 全件成功で完走したらチェックポイントは不要 (失敗が残れば再開で再実行できる) */
+                if (!job->stop && job->fail_count == 0 && job->checkpoint_path[0])
+                    remove(job->checkpoint_path);
+            }
+            Value status = last ? modjob_status_value(job) : hajimu_null();
+            /* finished を立てて unlock した後はスロットが再利用され得るので、
+             * ログに使う値はロック中に控えておく */
+            int id = job->id, ok_count = job->ok_count, total = job->total;
+            pthread_mutex_unlock(&job->mutex);
+            if (last) {
+                LOG_I("モデレーションジョブ #%d 終了 (%d/%d 成功)", id, ok_count, total);
+                event_fire("ジョブ完了", 1, &status);
+                event_fire("JOB_COMPLETE", 1, &status);
+            }
+            return NULL;
+        }
+        int from = job->next;
+        int count = job->total - from < chunk ? job->total - from : chunk;
+        job->next += count;
+        pthread_mutex_unlock(&job->mutex);
+
+        uint8_t res[MODJOB_BAN_CHUNK];
+        int ok = 0;
+        if (job->type == MODJOB_BAN) {
+            ok = modjob_exec_ban(job, from, count, res);
+        } else {
+            ok = res[0] = modjob_exec_one(job, job->targets[from]) ? 1 : 0;
+        }
+
+        pthread_mutex_lock(&job->mutex);
+        for (int i = from; i < from + count; i++) {
+            job->done_flags[i] = res[i - from] ? 1 : 2;
+            if (!res[i - from]) modjob_checkpoint_mark_failed(job, i);
+        }
+        job->done_count += count;
+        job->ok_count += ok;
+        job->fail_count += count - ok;
+        int old_wm = job->watermark;
+        while (job->watermark < job->total && job->done_flags[job->watermark]) job->watermark++;
+        bool report = (job->done_count / job->progress_step) !=
+                      ((job->done_count - count) / job->progress_step);
+        if (report || job->watermark - old_wm >= MODJOB_CHECKPOINT_EVERY)
+            modjob_checkpoint_update(job);
+        Value status = report ? modjob_status_value(job) : hajimu_null();
+        pthread_mutex_unlock(&job->mutex);
+        if (report) {
+            event_fire("ジョブ進捗", 1, &status);
+            event_fire("JOB_PROGRESS", 1, &status);
+        }
+    }
+}
+
+/* Start a job over targets[start..total). Takes ownership of targets.
+ * スロットは mod_job_mutex を持ったまま組み立て、最後に active を立てる
+ * (ジョブ状態・ジョブ停止が作りかけのジョブを見ないように)。 */
+static int modjob_launch(ModJobType type, const char *guild_id, const char *role_id,
+                         int param, char (*targets)[MAX_SNOWFLAKE], int total,
+                         int start, int workers, const char *checkpoint_path) {
+    pthread_mutex_lock(&g_bot.mod_job_mutex);
+    ModJob *job = NULL;
+    for (int i = 0; i < MAX_MOD_JOBS; i++) {
+        ModJob *j = &g_bot.mod_jobs[i];
+        if (!j->active) { job = j; break; }
+        /* 終了済みジョブのスロットを回収 */
+        pthread_mutex_lock(&j->mutex);
+        bool reusable = j->finished && j->running_workers == 0;
+        pthread_mutex_unlock(&j->mutex);
+        if (reusable) {
+            pthread_mutex_destroy(&j->mutex);
+            free(j->targets);
+            free(j->done_flags);
+            free(j->checkpoint_offsets);
+            job = j;
+            break;
+        }
+    }
+    if (!job) {
+        pthread_mutex_unlock(&g_bot.mod_job_mutex);
+        LOG_E("モデレーションジョブ: 同時実行数の上限 (%d) に達しています", MAX_MOD_JOBS);
+        free(targets);
+        return -1;
+    }
+    memset(job, 0, sizeof(*job));
+    job->type = type;
+    snprintf(job->guild_id, sizeof(job->guild_id), "%s", guild_id);
+    if (role_id) snprintf(job->role_id, sizeof(job->role_id), "%s", role_id);
+    job->param = param;
+    job->targets = targets;
+    job->total = total;
+    job->done_flags = (uint8_t *)calloc(total > 0 ? total : 1, 1);
+    if (start > total) start = total;
+    memset(job->done_flags, 1, (size_t)start);
+    job->next = job->watermark = job->done_count = job->ok_count = start;
+    job->progress_step = total / 100 > 0 ? total / 100 : 1;
+    if (type == MODJOB_BAN && job->progress_step < MODJOB_BAN_CHUNK)
+        job->progress_step = MODJOB_BAN_CHUNK;
+    pthread_mutex_init(&job->mutex, NULL);
+    clock_gettime(CLOCK_MONOTONIC, &job->start_time);
+    if (checkpoint_path && checkpoint_path[0]) {
+        snprintf(job->checkpoint_path, sizeof(job->checkpoint_path), "%s", checkpoint_path);
+        modjob_checkpoint_open(job);
+    }
+    job->id = ++g_bot.mod_job_seq;
+
+    if (workers < 1) workers = 1;
+    if (workers > MODJOB_MAX_WORKERS) workers = MODJOB_MAX_WORKERS;
+    pthread_mutex_lock(&job->mutex);
+    for (int i = 0; i < workers; i++) {
+        pthread_t t;
+        if (pthread_create(&t, NULL, modjob_worker, job) == 0) {
+            pthread_detach(t);
+            job->running_workers++;
+        }
+    }
+    bool started = job->running_workers > 0;
+    if (!started) {
+        job->finished = true;
+        if (job->checkpoint) { fclose(job->checkpoint); job->checkpoint = NULL; }
+    }
+    int id = job->id;
+    pthread_mutex_unlock(&job->mutex);
+    job->active = true;
+    pthread_mutex_unlock(&g_bot.mod_job_mutex);
+    if (!started) {
+        LOG_E("モデレーションジョブ: スレッド作成失敗");
+        return -1;
+    }
+    LOG_I("モデレーションジョブ #%d 開始: %s ×%d (並列 %d)",
+          id, modjob_type_names[type], total - start, workers);
+    return id;
+}
+
+static ModJob *modjob_find(int id) {
+    for (int i = 0; i < MAX_MOD_JOBS; i++) {
+        if (g_bot.mod_jobs[i].active && g_bot.mod_jobs[i].id == id) return &g_bot.mod_jobs[i];
+    }
+    return NULL;
+}
+
+/* モデレーションジョブ開始(種類, サーバーID, 対象ID配列[, 設定])
+ * 種類: "ロール付与" / "ロール剥奪" / "キック" / "タイムアウト" / "BAN"
+ * 設定: {"ロールID": ID, "秒数": タイムアウト秒数, "削除秒数": BAN時のメッセージ削除秒数,
+ *        "並列数": ワーカー数, "チェックポイント": ファイルパス}
+ * 戻り値: ジョブID (失敗時 null) */
+static Value fn_modjob_start(int argc, Value *argv) {
+    if (argc < 3 || argv[0].type != VALUE_STRING || argv[1].type != VALUE_STRING ||
+        argv[2].type != VALUE_ARRAY) {
+        LOG_E("モデレーションジョブ開始: (種類, サーバーID, 対象ID配列[, 設定]) が必要です");
+        return hajimu_null();
+    }
+    int type = modjob_type_from_name(argv[0].string.data);
+    if (type < 0) {
+        LOG_E("モデレーションジョブ開始: 不明な種類: %s", argv[0].string.data);
+        return hajimu_null();
+    }
+    const char *role_id = NULL, *checkpoint = NULL;
+    int param = 0, workers = MODJOB_DEFAULT_WORKERS;
+    if (argc >= 4 && argv[3].type == VALUE_DICT) {
+        for (int i = 0; i < argv[3].dict.length; i++) {
+            const char *key = argv[3].dict.keys[i];
+            Value val = argv[3].dict.values[i];
+            if (strcmp(key, "ロールID") == 0 && val.type == VALUE_STRING) role_id = val.string.data;
+            else if ((strcmp(key, "秒数") == 0 || strcmp(key, "削除秒数") == 0) &&
+                     val.type == VALUE_NUMBER) param = (int)val.number;
+            else if (strcmp(key, "並列数") == 0 && val.type == VALUE_NUMBER) workers = (int)val.number;
+            else if (strcmp(key, "チェックポイント") == 0 && val.type == VALUE_STRING)
+                checkpoint = val.string.data;
+        }
+    }
+    if ((type == MODJOB_ROLE_ADD || type == MODJOB_ROLE_REMOVE) && !role_id) {
+        LOG_E("モデレーションジョブ開始: %s には \"ロールID\" が必要です", argv[0].string.data);
+        return hajimu_null();
+    }
+    if (type == MODJOB_TIMEOUT && param > 2419200) param = 2419200; /* Max 28 days */
+
+    int n = argv[2].array.length;
+    char (*targets)[MAX_SNOWFLAKE] = calloc(n > 0 ? n : 1, MAX_SNOWFLAKE);
+    if (!targets) return hajimu_null();
+    int total = 0;
+    for (int i = 0; i < n; i++) {
+        if (argv[2].array.elements[i].type == VALUE_STRING)
+            snprintf(targets[total++], MAX_SNOWFLAKE, "%s", argv[2].array.elements[i].string.data);
+    }
+    int id = modjob_launch((ModJobType)type, argv[1].string.data, role_id, param,
+                           targets, total, 0, workers, checkpoint);
+    return id < 0 ? hajimu_null() : hajimu_number(id);
+}
+
+/* モデレーションジョブ再開(チェックポイントパス[, 並列数]) — 中断位置から再開 */
+static Value fn_modjob_resume(int argc, Value *argv) {
+    if (argc < 1 || argv[0].type != VALUE_STRING) {
+        LOG_E("モデレーションジョブ再開: チェックポイントパスが必要です");
+        return hajimu_null();
+    }
+    const char *path = argv[0].string.data;
+    FILE *fp = fopen(path, "r");
+    if (!fp) {
+        LOG_E("モデレーションジョブ再開: ファイルを開けません: %s", path);
+        return hajimu_null();
+    }
+    int type = -1, param = 0, total = 0, wm = 0;
+    char guild_id[MAX_SNOWFLAKE] = "", role_id[MAX_SNOWFLAKE] = "";
+    char line[MAX_SNOWFLAKE + 4];
+    if (fscanf(fp, "HJMODJOB1 %d %23s %23s %d %d W%d", &type, guild_id, role_id,
+               &param, &total, &wm) != 6 || !fgets(line, sizeof(line), fp) ||
+        type < 0 || type >= MODJOB_TYPE_COUNT || total < 0) {
+        LOG_E("モデレーションジョブ再開: チェックポイント形式が不正です: %s", path);
+        fclose(fp);
+        return hajimu_null();
+    }
+    /* 並べ替えて [0, ok) = 成功済み、その後ろに失敗済み・未処理を置く
+     * (失敗したものも再実行する) */
+    char (*targets)[MAX_SNOWFLAKE] = calloc(total > 0 ? total : 1, MAX_SNOWFLAKE);
+    char (*retry)[MAX_SNOWFLAKE] = calloc(total > 0 ? total : 1, MAX_SNOWFLAKE);
+    if (!targets || !retry) { free(targets); free(retry); fclose(fp); return hajimu_null(); }
+    int loaded = 0, ok = 0, nretry = 0;
+    while (loaded < total && fgets(line, sizeof(line), fp)) {
+        line[strcspn(line, "\r\n")] = '\0';
+        if (!line[0] || !line[1]) continue;
+        char *dst = loaded < wm && line[0] != '!' ? targets[ok++] : retry[nretry++];
+        snprintf(dst, MAX_SNOWFLAKE, "%.*s", MAX_SNOWFLAKE - 1, line + 1);
+        loaded++;
+    }
+    fclose(fp);
+    memcpy(targets + ok, retry, (size_t)nretry * MAX_SNOWFLAKE);
+    free(retry);
+
+    int workers = MODJOB_DEFAULT_WORKERS;
+    if (argc >= 2 && argv[1].type == VALUE_NUMBER) workers = (int)argv[1].number;
+    LOG_I("モデレーションジョブ再開: %s (%d/%d 成功済み, 失敗 %d 件を再実行)",
+          path, ok, loaded, (wm < loaded ? wm : loaded) - ok);
+    int id = modjob_launch((ModJobType)type, guild_id,
+                           strcmp(role_id, "-") == 0 ? NULL : role_id,
+                           param, targets, loaded, ok, workers, path);
+    return id < 0 ? hajimu_null() : hajimu_number(id);
+}
+
+/* モデレーションジョブ状態(ジョブID) */
+static Value fn_modjob_status(int argc, Value *argv) {
+    if (argc < 1 || argv[0].type != VALUE_NUMBER) return hajimu_null();
+    pthread_mutex_lock(&g_bot.mod_job_mutex);
+    ModJob *job = modjob_find((int)argv[0].number);
+    Value result = hajimu_null();
+    if (job) {
+        pthread_mutex_lock(&job->mutex);
+        result = modjob_status_value(job);
+        pthread_mutex_unlock(&job->mutex);
+    }
+    pthread_mutex_unlock(&g_bot.mod_job_mutex);
+    return result;
+}
+
+/* モデレーションジョブ停止(ジョブID) — 処理中の要求が終わり次第停止 (チェックポイントは残る) */
+static Value fn_modjob_stop(int argc, Value *argv) {
+    if (argc < 1 || argv[0].type != VALUE_NUMBER) return hajimu_bool(false);
+    pthread_mutex_lock(&g_bot.mod_job_mutex);
+    ModJob *job = modjob_find((int)argv[0].number);
+    bool ok = false;
+    if (job) {
+        pthread_mutex_lock(&job->mutex);
+        ok = !job->finished;
+        job->stop = true;
+        pthread_mutex_unlock(&job->mutex);
+    }
+    pthread_mutex_unlock(&g_bot.mod_job_mutex);
+    return hajimu_bool(ok);
+}
+
 /* --- メンバー管理拡張 --- */
 
 /* メンバー編集(サーバーID, ユーザーID, 変更内容) */
@@ -9174,6 +18625,75 @@ static Value fn_permission_check(int argc, Value *argv) {
     return hajimu_bool((perms & check) == check);
 }
 
+/* perm_compute for the script functions. メンバーが未キャッシュ (予算で追い出された・
+ * まだ届いていない) ならサーバーがキャッシュにある場合に限り REST で取り寄せて
+ * キャッシュに入れ、計算し直す。計算に使ったメンバーは最終観測時刻を更新するので、
+ * 権限を照会し続けているメンバーは予算による追い出しの対象になりにくい。 */
+static bool perm_compute_fetch(const char *guild_id, uint64_t channel_id, const char *user_id,
+                               uint64_t *out) {
+    EntityCache *c = &g_bot.cache;
+    uint64_t gid = snow_parse(guild_id), uid = snow_parse(user_id);
+    cache_init();
+    pthread_mutex_lock(&c->mutex);
+    bool ok = perm_compute(gid, channel_id, uid, out);
+    bool missing = !ok && snowmap_find(&c->guild_map, gid, 0) >= 0 &&
+                   snowmap_find(&c->member_map, gid, uid) < 0;
+    int64_t mi = ok ? snowmap_find(&c->member_map, gid, uid) : -1;
+    if (mi >= 0) c->member_seen[mi] = (uint32_t)mono_now();
+    pthread_mutex_unlock(&c->mutex);
+    if (!missing || !g_bot.token_set) return ok;
+
+    char ep[128];
+    snprintf(ep, sizeof(ep), "/guilds/%s/members/%s", guild_id, user_id);
+    long code = 0;
+    JsonNode *resp = discord_rest("GET", ep, NULL, &code);
+    if (resp && code == 200) {
+        pthread_mutex_lock(&c->mutex);
+        cache_member_upsert(gid, resp, NULL);
+        ok = perm_compute(gid, channel_id, uid, out);
+        pthread_mutex_unlock(&c->mutex);
+    }
+    if (resp) { json_free(resp); free(resp); }
+    return ok;
+}
+
+/* 権限計算(サーバーID, チャンネルID, ユーザーID) — エンティティキャッシュから
+ * 実効権限を計算。チャンネルIDが空ならサーバー全体。メンバーだけが未キャッシュなら
+ * REST で取り寄せる。それでも計算できなければ null */
+static Value fn_permission_compute(int argc, Value *argv) {
+    if (argc < 3 || argv[0].type != VALUE_STRING || argv[2].type != VALUE_STRING) {
+        LOG_E("権限計算: (サーバーID, チャンネルID, ユーザーID) が必要です");
+        return hajimu_null();
+    }
+    uint64_t cid = argv[1].type == VALUE_STRING ? snow_parse(argv[1].string.data) : 0;
+    uint64_t perms = 0;
+    bool ok = perm_compute_fetch(argv[0].string.data, cid, argv[2].string.data, &perms);
+    return ok ? hajimu_number((double)perms) : hajimu_null();
+}
+
+/* 権限所持(サーバーID, チャンネルID, ユーザーID, 権限) — 権限は値または名前 */
+static Value fn_permission_has(int argc, Value *argv) {
+    if (argc < 4 || argv[0].type != VALUE_STRING || argv[2].type != VALUE_STRING) {
+        LOG_E("権限所持: (サーバーID, チャンネルID, ユーザーID, 権限) が必要です");
+        return hajimu_bool(false);
+    }
+    uint64_t need = 0;
+    if (argv[3].type == VALUE_NUMBER) {
+        need = (uint64_t)argv[3].number;
+    } else if (argv[3].type == VALUE_STRING) {
+        Value v = fn_permission_value(1, &argv[3]);
+        need = (uint64_t)v.number;
+        if (!need) {
+            LOG_W("権限所持: 不明な権限名 \"%s\"", argv[3].string.data);
+            return hajimu_bool(false);
+        }
+    }
+    uint64_t cid = argv[1].type == VALUE_STRING ? snow_parse(argv[1].string.data) : 0;
+    uint64_t perms = 0;
+    bool ok = perm_compute_fetch(argv[0].string.data, cid, argv[2].string.data, &perms);
+    return hajimu_bool(ok && (perms & need) == need);
+}
+
 /* アプリ情報() — Current application info */
 static Value fn_app_info(int argc, Value *argv) {
     (void)argc; (void)argv;
@@ -9444,6 +18964,18 @@ static Value fn_command_list(int argc, Value *argv) {
     return result;
 }
 
+/* コマンド登録先([サーバーID]) — 起動時の一括登録先。省略/空文字でグローバル */
+static Value fn_command_scope(int argc, Value *argv) {
+    if (argc >= 1 && argv[0].type == VALUE_STRING) {
+        snprintf(g_bot.command_guild_id, sizeof(g_bot.command_guild_id), "%s",
+                 argv[0].string.data);
+    } else {
+        g_bot.command_guild_id[0] = '\0';
+    }
+    LOG_D("コマンド登録先: %s", g_bot.command_guild_id[0] ? g_bot.command_guild_id : "グローバル");
+    return hajimu_bool(true);
+}
+
 /* コマンド権限設定(サーバーID, コマンドID, 権限配列JSON) */
 static Value fn_command_permissions(int argc, Value *argv) {
     if (argc < 3 || argv[0].type != VALUE_STRING || argv[1].type != VALUE_STRING ||
@@ -9466,32 +18998,12 @@ static Value fn_webhook_edit_message(int argc, Value *argv) {
     char url[512];
     snprintf(url, sizeof(url), "%s/webhooks/%s/%s/messages/%s",
              DISCORD_API_BASE, argv[0].string.data, argv[1].string.data, argv[2].string.data);
-    /* Use direct curl since this doesn't use bot auth */
-    CURL *curl = curl_easy_init();
-    if (!curl) return hajimu_null();
-    CurlBuf resp = {(char *)calloc(1, REST_BUF_INIT), 0};
-    if (!resp.data) { curl_easy_cleanup(curl); return hajimu_null(); }
-    struct curl_slist *hdrs = NULL;
-    hdrs = curl_slist_append(hdrs, "Content-Type: application/json");
-    curl_easy_setopt(curl, CURLOPT_URL, url);
-    curl_easy_setopt(curl, CURLOPT_CUSTOMREQUEST, "PATCH");
-    curl_easy_setopt(curl, CURLOPT_POSTFIELDS, argv[3].string.data);
-    curl_easy_setopt(curl, CURLOPT_HTTPHEADER, hdrs);
-    curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, curl_write_cb);
-    curl_easy_setopt(curl, CURLOPT_WRITEDATA, &resp);
-    curl_easy_setopt(curl, CURLOPT_TIMEOUT, 30L);
-    curl_easy_setopt(curl, CURLOPT_NOSIGNAL, 1L);
-    curl_easy_perform(curl);
+    /* Bot 認証なし — Webhook トークンで送る */
     long code = 0;
-    curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &code);
-    curl_slist_free_all(hdrs);
-    curl_easy_cleanup(curl);
+    JsonNode *resp = webhook_rest_method("PATCH", url, argv[3].string.data, &code, NULL);
     Value result = hajimu_null();
-    if (code == 200 && resp.data) {
-        JsonNode *j = json_parse(resp.data);
-        if (j) { result = json_to_value(j); json_free(j); free(j); }
-    }
-    free(resp.data);
+    if (resp && code == 200) result = json_to_value(resp);
+    if (resp) { json_free(resp); free(resp); }
     return result;
 }
 
@@ -9502,19 +19014,739 @@ static Value fn_webhook_delete_message(int argc, Value *argv) {
     char url[512];
     snprintf(url, sizeof(url), "%s/webhooks/%s/%s/messages/%s",
              DISCORD_API_BASE, argv[0].string.data, argv[1].string.data, argv[2].string.data);
-    CURL *curl = curl_easy_init();
-    if (!curl) return hajimu_bool(false);
-    curl_easy_setopt(curl, CURLOPT_URL, url);
-    curl_easy_setopt(curl, CURLOPT_CUSTOMREQUEST, "DELETE");
-    curl_easy_setopt(curl, CURLOPT_TIMEOUT, 30L);
-    curl_easy_setopt(curl, CURLOPT_NOSIGNAL, 1L);
-    curl_easy_perform(curl);
     long code = 0;
-    curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &code);
-    curl_easy_cleanup(curl);
+    JsonNode *resp = webhook_rest_method("DELETE", url, NULL, &code, NULL);
+    if (resp) { json_free(resp); free(resp); }
     return hajimu_bool(code == 204);
 }
 
+/* --- v2.6.0: エンティティキャッシュ (REST なし) --- */
+
+/* キャッシュサーバー(サーバーID) */
+static Value fn_cache_guild(int argc, Value *argv) {
+    if (argc < 1 || argv[0].type != VALUE_STRING) {
+        LOG_E("キャッシュサーバー: (サーバーID) が必要です");
+        return hajimu_null();
+    }
+    cache_init();
+    Value result = hajimu_null();
+    pthread_mutex_lock(&g_bot.cache.mutex);
+    int64_t i = snowmap_find(&g_bot.cache.guild_map, snow_parse(argv[0].string.data), 0);
+    if (i >= 0) result = cache_guild_value((uint32_t)i);
+    pthread_mutex_unlock(&g_bot.cache.mutex);
+    return result;
+}
+
+/* キャッシュサーバー一覧() */
+static Value fn_cache_guild_list(int argc, Value *argv) {
+    (void)argc; (void)argv;
+    cache_init();
+    Value arr = hajimu_array();
+    pthread_mutex_lock(&g_bot.cache.mutex);
+    for (uint32_t i = 0; i < g_bot.cache.guild_count; i++)
+        hajimu_array_push(&arr, cache_guild_value(i));
+    pthread_mutex_unlock(&g_bot.cache.mutex);
+    return arr;
+}
+
+/* キャッシュチャンネル(チャンネルID) */
+static Value fn_cache_channel(int argc, Value *argv) {
+    if (argc < 1 || argv[0].type != VALUE_STRING) {
+        LOG_E("キャッシュチャンネル: (チャンネルID) が必要です");
+        return hajimu_null();
+    }
+    cache_init();
+    Value result = hajimu_null();
+    pthread_mutex_lock(&g_bot.cache.mutex);
+    int64_t i = snowmap_find(&g_bot.cache.channel_map, snow_parse(argv[0].string.data), 0);
+    if (i >= 0) result = cache_channel_value((uint32_t)i);
+    pthread_mutex_unlock(&g_bot.cache.mutex);
+    return result;
+}
+
+/* キャッシュチャンネル一覧(サーバーID) */
+static Value fn_cache_channel_list(int argc, Value *argv) {
+    if (argc < 1 || argv[0].type != VALUE_STRING) {
+        LOG_E("キャッシュチャンネル一覧: (サーバーID) が必要です");
+        return hajimu_null();
+    }
+    cache_init();
+    uint64_t gid = snow_parse(argv[0].string.data);
+    Value arr = hajimu_array();
+    pthread_mutex_lock(&g_bot.cache.mutex);
+    for (uint32_t i = 0; i < g_bot.cache.channel_count; i++)
+        if (g_bot.cache.channel_guild[i] == gid)
+            hajimu_array_push(&arr, cache_channel_value(i));
+    pthread_mutex_unlock(&g_bot.cache.mutex);
+    return arr;
+}
+
+/* キャッシュロール(ロールID) */
+static Value fn_cache_role(int argc, Value *argv) {
+    if (argc < 1 || argv[0].type != VALUE_STRING) {
+        LOG_E("キャッシュロール: (ロールID) が必要です");
+        return hajimu_null();
+    }
+    cache_init();
+    Value result = hajimu_null();
+    pthread_mutex_lock(&g_bot.cache.mutex);
+    int64_t i = snowmap_find(&g_bot.cache.role_map, snow_parse(argv[0].string.data), 0);
+    if (i >= 0) result = cache_role_value((uint32_t)i);
+    pthread_mutex_unlock(&g_bot.cache.mutex);
+    return result;
+}
+
+/* キャッシュロール一覧(サーバーID) */
+static Value fn_cache_role_list(int argc, Value *argv) {
+    if (argc < 1 || argv[0].type != VALUE_STRING) {
+        LOG_E("キャッシュロール一覧: (サーバーID) が必要です");
+        return hajimu_null();
+    }
+    cache_init();
+    uint64_t gid = snow_parse(argv[0].string.data);
+    Value arr = hajimu_array();
+    pthread_mutex_lock(&g_bot.cache.mutex);
+    for (uint32_t i = 0; i < g_bot.cache.role_count; i++)
+        if (g_bot.cache.role_guild[i] == gid)
+            hajimu_array_push(&arr, cache_role_value(i));
+    pthread_mutex_unlock(&g_bot.cache.mutex);
+    return arr;
+}
+
+/* キャッシュメンバー(サーバーID, ユーザーID) */
+static Value fn_cache_member(int argc, Value *argv) {
+    if (argc < 2 || argv[0].type != VALUE_STRING || argv[1].type != VALUE_STRING) {
+        LOG_E("キャッシュメンバー: (サーバーID, ユーザーID) が必要です");
+        return hajimu_null();
+    }
+    cache_init();
+    Value result = hajimu_null();
+    pthread_mutex_lock(&g_bot.cache.mutex);
+    int64_t i = snowmap_find(&g_bot.cache.member_map, snow_parse(argv[0].string.data),
+                             snow_parse(argv[1].string.data));
+    if (i >= 0) result = cache_member_value((uint32_t)i);
+    pthread_mutex_unlock(&g_bot.cache.mutex);
+    return result;
+}
+
+/* キャッシュメンバー検索(サーバーID, クエリ[, 件数]) — 名前の前方一致 (REST なし)
+ * 大文字小文字・全角半角・カタカナひらがなを区別しない。既定 25 件 */
+static Value fn_cache_member_search(int argc, Value *argv) {
+    if (argc < 2 || argv[0].type != VALUE_STRING || argv[1].type != VALUE_STRING) {
+        LOG_E("キャッシュメンバー検索: (サーバーID, クエリ[, 件数]) が必要です");
+        return hajimu_null();
+    }
+    int limit = 25;
+    if (argc >= 3 && argv[2].type == VALUE_NUMBER) limit = (int)argv[2].number;
+    if (limit < 1) limit = 1;
+    if (limit > 100) limit = 100;
+    static const char *const field_names[NAME_FIELD_COUNT] = {
+        "ニックネーム", "表示名", "ユーザー名"
+    };
+    cache_init();
+    uint32_t rows[100];
+    uint8_t fields[100];
+    Value arr = hajimu_array();
+    pthread_mutex_lock(&g_bot.cache.mutex);
+    int n = name_index_search(snow_parse(argv[0].string.data), argv[1].string.data,
+                              limit, rows, fields);
+    for (int k = 0; k < n; k++) {
+        Value v = cache_member_value(rows[k]);
+        value_dict_add(&v, "一致項目", hajimu_string(field_names[fields[k]]));
+        hajimu_array_push(&arr, v);
+    }
+    pthread_mutex_unlock(&g_bot.cache.mutex);
+    return arr;
+}
+
+/* キャッシュクリア() */
+static Value fn_cache_clear(int argc, Value *argv) {
+    (void)argc; (void)argv;
+    cache_init();
+    pthread_mutex_lock(&g_bot.cache.mutex);
+    entity_cache_clear();
+    pthread_mutex_unlock(&g_bot.cache.mutex);
+    pthread_mutex_lock(&g_bot.msg_cache.mutex);
+    msg_cache_clear();
+    pthread_mutex_unlock(&g_bot.msg_cache.mutex);
+    pthread_mutex_lock(&g_bot.msg_index.mutex);
+    msg_index_clear();
+    pthread_mutex_unlock(&g_bot.msg_index.mutex);
+    pthread_mutex_lock(&g_bot.presence.mutex);
+    presence_clear();
+    pthread_mutex_unlock(&g_bot.presence.mutex);
+    return hajimu_bool(true);
+}
+
+/* メッセージキャッシュ設定(チャンネルあたり件数[, 上限MB]) — 0 で無効化 */
+static Value fn_message_cache_config(int argc, Value *argv) {
+    if (argc < 1 || argv[0].type != VALUE_NUMBER) {
+        LOG_E("メッセージキャッシュ設定: (件数[, 上限MB]) が必要です");
+        return hajimu_bool(false);
+    }
+    int per_channel = (int)argv[0].number;
+    if (per_channel < 0) per_channel = 0;
+    if (per_channel > MSG_CACHE_MAX_PER_CHANNEL) per_channel = MSG_CACHE_MAX_PER_CHANNEL;
+    double mb = (argc >= 2 && argv[1].type == VALUE_NUMBER) ? argv[1].number : MSG_CACHE_DEFAULT_MB;
+    if (mb < 1) mb = 1;
+    cache_init();
+    MessageCache *mc = &g_bot.msg_cache;
+    pthread_mutex_lock(&mc->mutex);
+    /* リング長が変わるため既存の内容は破棄する */
+    if ((uint32_t)per_channel != mc->per_channel) msg_cache_clear();
+    mc->per_channel = (uint32_t)per_channel;
+    mc->max_bytes = (size_t)(mb * 1024 * 1024);
+    msg_cache_enforce();
+    pthread_mutex_unlock(&mc->mutex);
+    LOG_I("メッセージキャッシュ: %d件/チャンネル, 上限 %.0fMB", per_channel, mb);
+    return hajimu_bool(true);
+}
+
+/* キャッシュメッセージ(チャンネルID, メッセージID) */
+static Value fn_cache_message(int argc, Value *argv) {
+    if (argc < 2 || argv[0].type != VALUE_STRING || argv[1].type != VALUE_STRING) {
+        LOG_E("キャッシュメッセージ: (チャンネルID, メッセージID) が必要です");
+        return hajimu_null();
+    }
+    cache_init();
+    Value result = hajimu_null();
+    pthread_mutex_lock(&g_bot.msg_cache.mutex);
+    MsgRing *r = msg_ring_find(snow_parse(argv[0].string.data));
+    int k = r ? msg_ring_index_of(r, snow_parse(argv[1].string.data)) : -1;
+    if (k >= 0) result = msg_record_value(r, &r->slots[(r->head + k) % r->cap]);
+    pthread_mutex_unlock(&g_bot.msg_cache.mutex);
+    return result;
+}
+
+/* キャッシュメッセージ一覧(チャンネルID[, 件数]) — 新しい順 */
+static Value fn_cache_message_list(int argc, Value *argv) {
+    if (argc < 1 || argv[0].type != VALUE_STRING) {
+        LOG_E("キャッシュメッセージ一覧: (チャンネルID[, 件数]) が必要です");
+        return hajimu_null();
+    }
+    int limit = (argc >= 2 && argv[1].type == VALUE_NUMBER) ? (int)argv[1].number : -1;
+    cache_init();
+    Value arr = hajimu_array();
+    pthread_mutex_lock(&g_bot.msg_cache.mutex);
+    MsgRing *r = msg_ring_find(snow_parse(argv[0].string.data));
+    for (uint32_t k = r ? r->count : 0; k-- > 0 && limit != 0; limit--)
+        hajimu_array_push(&arr, msg_record_value(r, &r->slots[(r->head + k) % r->cap]));
+    pthread_mutex_unlock(&g_bot.msg_cache.mutex);
+    return arr;
+}
+
+/* メッセージ索引設定(上限MB) — サーバーあたりの上限。真 で既定値、0 または 偽 で無効化 */
+static Value fn_msg_index_config(int argc, Value *argv) {
+    if (argc < 1 || (argv[0].type != VALUE_NUMBER && argv[0].type != VALUE_BOOL)) {
+        LOG_E("メッセージ索引設定: (上限MB) が必要です");
+        return hajimu_bool(false);
+    }
+    double mb = argv[0].type == VALUE_BOOL ? (argv[0].boolean ? MSG_INDEX_DEFAULT_MB : 0)
+                                           : argv[0].number;
+    if (mb < 0) mb = 0;
+    cache_init();
+    MsgIndex *mi = &g_bot.msg_index;
+    pthread_mutex_lock(&mi->mutex);
+    mi->max_bytes = (size_t)(mb * 1024 * 1024);
+    if (!mi->max_bytes) msg_index_clear();
+    for (uint32_t i = 0; i < mi->guild_count; i++) msg_index_enforce(mi->guilds[i]);
+    pthread_mutex_unlock(&mi->mutex);
+    if (mb > 0) LOG_I("メッセージ索引: 上限 %.0fMB/サーバー", mb);
+    else LOG_I("メッセージ索引: 無効");
+    return hajimu_bool(true);
+}
+
+/* メッセージ索引検索(サーバーID, クエリ[, 条件])
+ * 条件: 件数 または {"件数", "チャンネルID", "著者ID", "開始", "終了" (UNIX ms)}
+ * 新しい順。メッセージキャッシュにあれば本文で照合し、その内容を返す。 */
+static Value fn_msg_index_search(int argc, Value *argv) {
+    if (argc < 2 || argv[0].type != VALUE_STRING || argv[1].type != VALUE_STRING) {
+        LOG_E("メッセージ索引検索: (サーバーID, クエリ[, 条件]) が必要です");
+        return hajimu_null();
+    }
+    int limit = 25;
+    uint64_t channel_id = 0, author_id = 0, min_id = 0, max_id = UINT64_MAX;
+    if (argc >= 3 && argv[2].type == VALUE_NUMBER) {
+        limit = (int)argv[2].number;
+    } else if (argc >= 3 && argv[2].type == VALUE_DICT) {
+        for (int k = 0; k < argv[2].dict.length; k++) {
+            const char *key = argv[2].dict.keys[k];
+            Value *val = &argv[2].dict.values[k];
+            if (strcmp(key, "件数") == 0 && val->type == VALUE_NUMBER) {
+                limit = (int)val->number;
+            } else if (strcmp(key, "チャンネルID") == 0 && val->type == VALUE_STRING) {
+                channel_id = snow_parse(val->string.data);
+            } else if (strcmp(key, "著者ID") == 0 && val->type == VALUE_STRING) {
+                author_id = snow_parse(val->string.data);
+            } else if (strcmp(key, "開始") == 0 && val->type == VALUE_NUMBER) {
+                if (val->number > (double)DISCORD_EPOCH_MS)
+                    min_id = ((uint64_t)val->number - DISCORD_EPOCH_MS) << 22;
+            } else if (strcmp(key, "終了") == 0 && val->type == VALUE_NUMBER) {
+                max_id = val->number > (double)DISCORD_EPOCH_MS
+                       ? (((uint64_t)val->number - DISCORD_EPOCH_MS) << 22) | 0x3FFFFF : 0;
+            }
+        }
+    }
+    if (limit < 1) limit = 1;
+    if (limit > 100) limit = 100;
+
+    Value arr = hajimu_array();
+    char *words = msg_index_words(argv[1].string.data);
+    if (!words) return arr;
+    cache_init();
+    MsgIndex *mi = &g_bot.msg_index;
+    pthread_mutex_lock(&mi->mutex);
+    MsgIndexGuild *g = msg_index_guild(snow_parse(argv[0].string.data), false);
+    uint32_t count = 0;
+    uint32_t *cand = g ? msg_index_match(g, words, &count) : NULL;
+    /* 索引 → メッセージキャッシュの順にロックする */
+    pthread_mutex_lock(&g_bot.msg_cache.mutex);
+    for (uint32_t c = count; c-- > 0 && limit > 0;) {
+        uint32_t d = cand[c];
+        uint64_t mid = g->doc_msg[d];
+        if (!mid || mid < min_id || mid > max_id) continue;
+        if (channel_id && g->doc_channel[d] != channel_id) continue;
+        if (author_id && g->doc_author[d] != author_id) continue;
+        MsgRing *r = msg_ring_find(g->doc_channel[d]);
+        int k = r ? msg_ring_index_of(r, mid) : -1;
+        if (k >= 0) {
+            const CachedMessage *m = &r->slots[(r->head + k) % r->cap];
+            const char *content = m->blob + strlen(m->blob) + 1;
+            if (!msg_index_verify(content, words)) continue;
+            hajimu_array_push(&arr, msg_record_value(r, m));
+        } else {
+            Value v = value_dict_new();
+            value_dict_add(&v, "ID", snow_value(mid));
+            value_dict_add(&v, "チャンネルID", snow_value(g->doc_channel[d]));
+            value_dict_add(&v, "サーバーID", snow_value(g->guild_id));
+            value_dict_add(&v, "著者ID", snow_value(g->doc_author[d]));
+            value_dict_add(&v, "タイムスタンプ", hajimu_number((double)((mid >> 22) + DISCORD_EPOCH_MS)));
+            hajimu_array_push(&arr, v);
+        }
+        limit--;
+    }
+    pthread_mutex_unlock(&g_bot.msg_cache.mutex);
+    pthread_mutex_unlock(&mi->mutex);
+    free(cand);
+    free(words);
+    return arr;
+}
+
+/* 集計設定(上限件数[, 投票者を記録]) — 有効化以降に作られたメッセージを自動で集計する。
+ * 上限を超えると最も長く更新のないものから外す (外したものは 集計追跡 で取り直す)。
+ * 0 で自動集計を止め、自動で集計していた分も破棄する (集計追跡分は残る)。 */
+static Value fn_tally_config(int argc, Value *argv) {
+    if (argc < 1 || argv[0].type != VALUE_NUMBER) {
+        LOG_E("集計設定: (上限件数[, 投票者を記録]) が必要です");
+        return hajimu_bool(false);
+    }
+    int max = argv[0].number > 0 ? (int)argv[0].number : 0;
+    cache_init();
+    TallyStore *ts = &g_bot.tally;
+    pthread_mutex_lock(&ts->mutex);
+    if (max && !ts->max_auto) ts->since_id = tally_since_now();
+    if (!max) {
+        /* 止めた後は数え続けても正しさを保てないので、自動集計分は捨てる */
+        if (ts->auto_count)
+            LOG_I("集計設定: 自動集計していた %u 件を破棄しました", ts->auto_count);
+        for (uint32_t i = ts->msg_count; i-- > 0;)
+            if (!ts->msgs[i].pinned) tally_remove_at(i);
+        snowmap_free(&ts->gone_map);
+    }
+    ts->max_auto = (uint32_t)max;
+    ts->auto_voters = argc >= 2 && argv[1].type == VALUE_BOOL && argv[1].boolean;
+    tally_enforce();
+    pthread_mutex_unlock(&ts->mutex);
+    return hajimu_bool(true);
+}
+
+/* 集計追跡(チャンネルID, メッセージID[, 投票者を記録])
+ * 既存のメッセージは一度だけ取得して現在の件数から数え始める。
+ * 投票者は追跡を始めてからの分のみ記録される。 */
+static Value fn_tally_track(int argc, Value *argv) {
+    if (argc < 2 || argv[0].type != VALUE_STRING || argv[1].type != VALUE_STRING) {
+        LOG_E("集計追跡: (チャンネルID, メッセージID[, 投票者を記録]) が必要です");
+        return hajimu_bool(false);
+    }
+    bool voters = argc >= 3 && argv[2].type == VALUE_BOOL && argv[2].boolean;
+    uint64_t cid = snow_parse(argv[0].string.data), mid = snow_parse(argv[1].string.data);
+    if (!cid || !mid) return hajimu_bool(false);
+    cache_init();
+    TallyStore *ts = &g_bot.tally;
+    pthread_mutex_lock(&ts->mutex);
+    TallyMessage *m = tally_find(mid);
+    if (m) {
+        /* 自動集計中ならそのまま固定する */
+        if (!m->pinned) ts->auto_count--;
+        m->pinned = true;
+        m->voters = m->voters || voters;
+        pthread_mutex_unlock(&ts->mutex);
+        return hajimu_bool(true);
+    }
+    bool fresh = tally_auto_eligible(mid);
+    pthread_mutex_unlock(&ts->mutex);
+
+    /* 自動集計の対象なのに行が無い = まだリアクションが無い。それ以外 (追い出したものを
+     * 含む) は取得して初期値にする
+     * (取得中に届いたイベントは二重に数えないよう捨てる) */
+    JsonNode *resp = NULL;
+    if (!fresh) {
+        char ep[128];
+        snprintf(ep, sizeof(ep), "/channels/%s/messages/%s", argv[0].string.data, argv[1].string.data);
+        long code = 0;
+        resp = discord_rest("GET", ep, NULL, &code);
+        if (!resp || code != 200) {
+            if (resp) { json_free(resp); free(resp); }
+            LOG_E("集計追跡: メッセージを取得できません (HTTP %ld)", code);
+            return hajimu_bool(false);
+        }
+    }
+    pthread_mutex_lock(&ts->mutex);
+    m = tally_find(mid);
+    if (m) {
+        if (!m->pinned) ts->auto_count--;
+        m->pinned = true;
+        m->voters = m->voters || voters;
+    } else {
+        m = tally_add(mid, cid, 0, true, voters);
+        if (m && resp) tally_seed(m, resp);
+    }
+    pthread_mutex_unlock(&ts->mutex);
+    if (resp) { json_free(resp); free(resp); }
+    return hajimu_bool(m != NULL);
+}
+
+/* 集計解除(メッセージID) */
+static Value fn_tally_untrack(int argc, Value *argv) {
+    if (argc < 1 || argv[0].type != VALUE_STRING) {
+        LOG_E("集計解除: (メッセージID) が必要です");
+        return hajimu_bool(false);
+    }
+    cache_init();
+    pthread_mutex_lock(&g_bot.tally.mutex);
+    uint64_t mid = snow_parse(argv[0].string.data);
+    int64_t i = snowmap_find(&g_bot.tally.msg_map, mid, 0);
+    if (i >= 0) {
+        tally_forget(mid);
+        tally_remove_at((uint32_t)i);
+    }
+    pthread_mutex_unlock(&g_bot.tally.mutex);
+    return hajimu_bool(i >= 0);
+}
+
+/* Build {絵文字: 件数} or {回答ID: 票数} for a tracked message (null = 未追跡) */
+static Value tally_counts_value(const char *message_id, bool poll) {
+    cache_init();
+    Value d = hajimu_null();
+    pthread_mutex_lock(&g_bot.tally.mutex);
+    TallyMessage *m = tally_find(snow_parse(message_id));
+    if (m) {
+        d = value_dict_new();
+        for (uint16_t k = 0; k < m->entry_count; k++) {
+            const TallyEntry *e = &m->entries[k];
+            if (poll != (e->answer_id != 0)) continue;
+            char key[128];
+            if (poll) snprintf(key, sizeof(key), "%u", e->answer_id);
+            else if (e->emoji_id) snprintf(key, sizeof(key), "%s:%llu", e->name ? e->name : "",
+                                           (unsigned long long)e->emoji_id);
+            else snprintf(key, sizeof(key), "%s", e->name);
+            value_dict_add(&d, key, hajimu_number(e->count));
+        }
+    }
+    pthread_mutex_unlock(&g_bot.tally.mutex);
+    return d;
+}
+
+/* リアクション集計(メッセージID) — {絵文字: 件数}。カスタム絵文字は "名前:ID" */
+static Value fn_reaction_tally(int argc, Value *argv) {
+    if (argc < 1 || argv[0].type != VALUE_STRING) {
+        LOG_E("リアクション集計: (メッセージID) が必要です");
+        return hajimu_null();
+    }
+    return tally_counts_value(argv[0].string.data, false);
+}
+
+/* 投票集計(メッセージID) — {回答ID: 票数} */
+static Value fn_poll_tally(int argc, Value *argv) {
+    if (argc < 1 || argv[0].type != VALUE_STRING) {
+        LOG_E("投票集計: (メッセージID) が必要です");
+        return hajimu_null();
+    }
+    return tally_counts_value(argv[0].string.data, true);
+}
+
+/* Entry for a script key: 数値 = 回答ID、文字列 = 絵文字 ("👍" / "名前:ID" / "<:名前:ID>") */
+static TallyEntry *tally_entry_for(TallyMessage *m, const Value *key) {
+    if (key->type == VALUE_NUMBER) return tally_entry(m, 0, NULL, (uint32_t)key->number, false);
+    if (key->type != VALUE_STRING) return NULL;
+    const char *colon = strrchr(key->string.data, ':');
+    uint64_t id = colon ? snow_parse(colon + 1) : 0;
+    return tally_entry(m, id, id ? NULL : key->string.data, 0, false);
+}
+
+/* 集計ユーザー一覧(メッセージID, 絵文字|回答ID) — 投票者を記録していなければ null */
+static Value fn_tally_users(int argc, Value *argv) {
+    if (argc < 2 || argv[0].type != VALUE_STRING) {
+        LOG_E("集計ユーザー一覧: (メッセージID, 絵文字|回答ID) が必要です");
+        return hajimu_null();
+    }
+    cache_init();
+    Value arr = hajimu_null();
+    pthread_mutex_lock(&g_bot.tally.mutex);
+    TallyMessage *m = tally_find(snow_parse(argv[0].string.data));
+    if (m && m->voters) {
+        arr = hajimu_array();
+        TallyEntry *e = tally_entry_for(m, &argv[1]);
+        for (uint32_t k = 0; e && k < e->voter_count; k++) hajimu_array_push(&arr, snow_value(e->voters[k]));
+    }
+    pthread_mutex_unlock(&g_bot.tally.mutex);
+    return arr;
+}
+
+/* 集計ユーザー確認(メッセージID, 絵文字|回答ID, ユーザーID) — 投票者を記録していなければ null */
+static Value fn_tally_has_user(int argc, Value *argv) {
+    if (argc < 3 || argv[0].type != VALUE_STRING || argv[2].type != VALUE_STRING) {
+        LOG_E("集計ユーザー確認: (メッセージID, 絵文字|回答ID, ユーザーID) が必要です");
+        return hajimu_null();
+    }
+    cache_init();
+    Value result = hajimu_null();
+    pthread_mutex_lock(&g_bot.tally.mutex);
+    TallyMessage *m = tally_find(snow_parse(argv[0].string.data));
+    if (m && m->voters) {
+        TallyEntry *e = tally_entry_for(m, &argv[1]);
+        bool found = false;
+        if (e) tally_voter_pos(e, snow_parse(argv[2].string.data), &found);
+        result = hajimu_bool(found);
+    }
+    pthread_mutex_unlock(&g_bot.tally.mutex);
+    return result;
+}
+
+/* キャッシュ予算設定(設定) — 設定: {"全体MB", "メンバーMB", "メッセージMB",
+ *   "メンバー保持": "全て"|"ボイス"|"なし",
+ *   "プレゼンス保持": "全て"|"ステータスのみ"|"なし", "掃除間隔秒"} */
+static Value fn_cache_budget(int argc, Value *argv) {
+    if (argc < 1 || argv[0].type != VALUE_DICT) {
+        LOG_E("キャッシュ予算設定: (設定辞書) が必要です");
+        return hajimu_bool(false);
+    }
+    cache_init();
+    CacheBudget *cb = &g_bot.cache_budget;
+    pthread_mutex_lock(&g_bot.cache.mutex);
+    for (int k = 0; k < argv[0].dict.length; k++) {
+        const char *key = argv[0].dict.keys[k];
+        Value *val = &argv[0].dict.values[k];
+        if (val->type == VALUE_NUMBER) {
+            size_t bytes = val->number > 0 ? (size_t)(val->number * 1024 * 1024) : 0;
+            if (strcmp(key, "全体MB") == 0) {
+                cb->global_budget = bytes;
+            } else if (strcmp(key, "メンバーMB") == 0) {
+                cb->member_budget = bytes;
+            } else if (strcmp(key, "メッセージMB") == 0) {
+                pthread_mutex_lock(&g_bot.msg_cache.mutex);
+                g_bot.msg_cache.max_bytes = bytes ? bytes : (size_t)MSG_CACHE_DEFAULT_MB * 1024 * 1024;
+                msg_cache_enforce();
+                pthread_mutex_unlock(&g_bot.msg_cache.mutex);
+            } else if (strcmp(key, "掃除間隔秒") == 0) {
+                __atomic_store_n(&cb->sweep_interval, val->number >= 1 ? (int)val->number : 1,
+                                 __ATOMIC_RELAXED);
+            }
+        } else if (strcmp(key, "メンバー保持") == 0 && val->type == VALUE_STRING) {
+            const char *v = val->string.data;
+            if (strcmp(v, "全て") == 0) cb->member_retention = MEMBER_KEEP_ALL;
+            else if (strcmp(v, "ボイス") == 0) cb->member_retention = MEMBER_KEEP_VOICE;
+            else if (strcmp(v, "なし") == 0) cb->member_retention = MEMBER_KEEP_NONE;
+            else LOG_W("キャッシュ予算設定: 不明なメンバー保持 \"%s\"", v);
+        } else if (strcmp(key, "プレゼンス保持") == 0 && val->type == VALUE_STRING) {
+            const char *v = val->string.data;
+            PresenceStore *ps = &g_bot.presence;
+            pthread_mutex_lock(&ps->mutex);
+            if (strcmp(v, "全て") == 0) {
+                ps->retention = PRES_KEEP_ALL;
+            } else if (strcmp(v, "ステータスのみ") == 0) {
+                ps->retention = PRES_KEEP_STATUS;
+                presence_drop_activities();
+            } else if (strcmp(v, "なし") == 0) {
+                ps->retention = PRES_KEEP_NONE;
+                presence_clear();
+            } else {
+                LOG_W("キャッシュ予算設定: 不明なプレゼンス保持 \"%s\"", v);
+            }
+            pthread_mutex_unlock(&ps->mutex);
+        }
+    }
+    if (cb->sweep_interval <= 0)
+        __atomic_store_n(&cb->sweep_interval, CACHE_SWEEP_DEFAULT_SEC, __ATOMIC_RELAXED);
+    /* 掃除スレッドは 1 本だけ — 同時に呼ばれても立ち上げるのは交換に勝った側 */
+    bool start = !__atomic_exchange_n(&cb->sweeper_running, true, __ATOMIC_ACQ_REL);
+    pthread_mutex_unlock(&g_bot.cache.mutex);
+
+    if (start) {
+        pthread_t t;
+        if (pthread_create(&t, NULL, cache_sweeper_thread, NULL) != 0) {
+            LOG_E("キャッシュ掃除スレッドの作成に失敗しました");
+            __atomic_store_n(&cb->sweeper_running, false, __ATOMIC_RELEASE);
+            return hajimu_bool(false);
+        }
+        pthread_detach(t);
+    }
+    cache_sweep();
+    return hajimu_bool(true);
+}
+
+/* キャッシュ統計() — カテゴリごとのバイト数・件数・追い出し数・予算 */
+static Value fn_cache_stats(int argc, Value *argv) {
+    (void)argc; (void)argv;
+    cache_init();
+    CacheBudget *cb = &g_bot.cache_budget;
+    Value result = value_dict_new();
+    size_t total = 0;
+    pthread_mutex_lock(&g_bot.cache.mutex);
+    for (int cat = 0; cat < CACHE_CAT_COUNT; cat++) {
+        uint32_t entries = 0;
+        size_t bytes = cache_cat_bytes((CacheCategory)cat, &entries);
+        uint64_t evictions = cb->evictions[cat];
+        size_t budget = cat == CACHE_CAT_MEMBER ? cb->member_budget : 0;
+        if (cat == CACHE_CAT_MESSAGE) {
+            evictions = g_bot.msg_cache.evictions;
+            budget = g_bot.msg_cache.per_channel ? g_bot.msg_cache.max_bytes : 0;
+        } else if (cat == CACHE_CAT_MSG_INDEX) {
+            evictions = g_bot.msg_index.evictions;
+            budget = g_bot.msg_index.max_bytes;     /* サーバーあたり */
+        } else if (cat == CACHE_CAT_TALLY) {
+            evictions = g_bot.tally.evictions;
+        }
+        total += bytes;
+        Value d = value_dict_new();
+        value_dict_add(&d, "バイト", hajimu_number((double)bytes));
+        value_dict_add(&d, "件数", hajimu_number(entries));
+        value_dict_add(&d, "追い出し", hajimu_number((double)evictions));
+        value_dict_add(&d, "予算", hajimu_number((double)budget));
+        value_dict_add(&result, cache_cat_names[cat], d);
+    }
+    pthread_mutex_unlock(&g_bot.cache.mutex);
+    Value sum = value_dict_new();
+    value_dict_add(&sum, "バイト", hajimu_number((double)total));
+    value_dict_add(&sum, "予算", hajimu_number((double)cb->global_budget));
+    value_dict_add(&result, "合計", sum);
+    return result;
+}
+
+/* スナップショット設定(パス) — ボット起動時に読込、停止時に保存する。"" で無効 */
+static Value fn_snapshot_config(int argc, Value *argv) {
+    if (argc < 1 || argv[0].type != VALUE_STRING) {
+        LOG_E("スナップショット設定: (パス) が必要です");
+        return hajimu_bool(false);
+    }
+    snprintf(g_bot.cache_snapshot_path, sizeof(g_bot.cache_snapshot_path), "%s",
+             argv[0].string.data);
+    return hajimu_bool(true);
+}
+
+/* キャッシュ保存([パス]) — 省略時はスナップショット設定のパス */
+static Value fn_cache_save(int argc, Value *argv) {
+    const char *path = (argc >= 1 && argv[0].type == VALUE_STRING)
+                       ? argv[0].string.data : g_bot.cache_snapshot_path;
+    if (!path[0]) {
+        LOG_E("キャッシュ保存: (パス) が必要です");
+        return hajimu_bool(false);
+    }
+    return hajimu_bool(cache_snapshot_save(path));
+}
+
+/* キャッシュ読込([パス]) — 現在のキャッシュを置き換える */
+static Value fn_cache_load(int argc, Value *argv) {
+    const char *path = (argc >= 1 && argv[0].type == VALUE_STRING)
+                       ? argv[0].string.data : g_bot.cache_snapshot_path;
+    if (!path[0]) {
+        LOG_E("キャッシュ読込: (パス) が必要です");
+        return hajimu_bool(false);
+    }
+    return hajimu_bool(cache_snapshot_load(path));
+}
+
+/* プレゼンス取得(サーバーID, ユーザーID) — 未記録ならオフライン */
+static Value fn_presence_get(int argc, Value *argv) {
+    if (argc < 2 || argv[0].type != VALUE_STRING || argv[1].type != VALUE_STRING) {
+        LOG_E("プレゼンス取得: (サーバーID, ユーザーID) が必要です");
+        return hajimu_null();
+    }
+    cache_init();
+    PresenceStore *ps = &g_bot.presence;
+    uint64_t gid = snow_parse(argv[0].string.data);
+    unsigned st[PRES_PLANES] = {0};
+    Value activity = hajimu_null();
+    pthread_mutex_lock(&ps->mutex);
+    int64_t slot = snowmap_find(&ps->slot_map, gid, snow_parse(argv[1].string.data));
+    PresenceGuild *g = pres_guild(gid, false);
+    if (slot >= 0 && g) {
+        for (int p = 0; p < PRES_PLANES; p++) st[p] = pres_get(g->planes[p], (uint32_t)slot);
+        uint32_t id = g->activity[slot];
+        if (id) activity = hajimu_string(ps->strs[id]);
+    }
+    pthread_mutex_unlock(&ps->mutex);
+    Value d = value_dict_new();
+    value_dict_add(&d, "ステータス", hajimu_string(pres_status_names[st[PRES_PLANE_STATUS]]));
+    value_dict_add(&d, "デスクトップ", hajimu_string(pres_status_names[st[PRES_PLANE_DESKTOP]]));
+    value_dict_add(&d, "モバイル", hajimu_string(pres_status_names[st[PRES_PLANE_MOBILE]]));
+    value_dict_add(&d, "ウェブ", hajimu_string(pres_status_names[st[PRES_PLANE_WEB]]));
+    value_dict_add(&d, "アクティビティ", activity);
+    return d;
+}
+
+/* プレゼンス集計(サーバーID) — ステータス別・端末別の人数 */
+static Value fn_presence_counts(int argc, Value *argv) {
+    if (argc < 1 || argv[0].type != VALUE_STRING) {
+        LOG_E("プレゼンス集計: (サーバーID) が必要です");
+        return hajimu_null();
+    }
+    cache_init();
+    PresenceStore *ps = &g_bot.presence;
+    uint32_t n[4] = {0}, desktop = 0, mobile = 0, web = 0;
+    pthread_mutex_lock(&ps->mutex);
+    PresenceGuild *g = pres_guild(snow_parse(argv[0].string.data), false);
+    if (g) {
+        memcpy(n, g->status_count, sizeof(n));
+        desktop = pres_plane_active(g->planes[PRES_PLANE_DESKTOP], g->slot_count);
+        mobile = pres_plane_active(g->planes[PRES_PLANE_MOBILE], g->slot_count);
+        web = pres_plane_active(g->planes[PRES_PLANE_WEB], g->slot_count);
+    }
+    pthread_mutex_unlock(&ps->mutex);
+    Value d = value_dict_new();
+    value_dict_add(&d, "オンライン", hajimu_number(n[PRES_ONLINE]));
+    value_dict_add(&d, "退席中", hajimu_number(n[PRES_IDLE]));
+    value_dict_add(&d, "取り込み中", hajimu_number(n[PRES_DND]));
+    value_dict_add(&d, "合計", hajimu_number(n[PRES_ONLINE] + n[PRES_IDLE] + n[PRES_DND]));
+    value_dict_add(&d, "デスクトップ", hajimu_number(desktop));
+    value_dict_add(&d, "モバイル", hajimu_number(mobile));
+    value_dict_add(&d, "ウェブ", hajimu_number(web));
+    return d;
+}
+
+/* プレゼンス一覧(サーバーID[, ステータス]) — オフライン以外のユーザーID */
+static Value fn_presence_list(int argc, Value *argv) {
+    if (argc < 1 || argv[0].type != VALUE_STRING) {
+        LOG_E("プレゼンス一覧: (サーバーID[, ステータス]) が必要です");
+        return hajimu_null();
+    }
+    int want = (argc >= 2 && argv[1].type == VALUE_STRING)
+               ? pres_status_parse(argv[1].string.data) : -1;
+    cache_init();
+    PresenceStore *ps = &g_bot.presence;
+    Value arr = hajimu_array();
+    if (want == PRES_OFFLINE) return arr;   /* オフラインは保持しない */
+    pthread_mutex_lock(&ps->mutex);
+    PresenceGuild *g = pres_guild(snow_parse(argv[0].string.data), false);
+    for (uint32_t s = 0; g && s < g->slot_count; s++) {
+        unsigned st = pres_get(g->planes[PRES_PLANE_STATUS], s);
+        if (st == PRES_OFFLINE || (want >= 0 && st != (unsigned)want)) continue;
+        hajimu_array_push(&arr, snow_value(g->user[s]));
+    }
+    pthread_mutex_unlock(&ps->mutex);
+    return arr;
+}
+
 /* =========================================================================
  * Section 15: Plugin Registration
  * ========================================================================= */
@@ -9551,6 +19783,7 @@ static HajimuPluginFunc functions[] = {
     {"メッセージ取得",       fn_get_message,       2,  2},
     {"メッセージ履歴",       fn_message_history,   2,  2},
     {"メッセージ一括削除",   fn_bulk_delete_count, 2,  2},
+    {"メッセージ一掃",       fn_purge,             2,  3},
 
     /* 埋め込み */
     {"埋め込み作成",         fn_embed_create,      0,  0},
@@ -9635,9 +19868,13 @@ static HajimuPluginFunc functions[] = {
     {"Webhook一覧",         fn_webhook_list,      1,  1},
     {"Webhook削除",         fn_webhook_delete,    1,  1},
     {"Webhook送信",         fn_webhook_send,      2,  4},
+    {"Webhook送信キュー",   fn_webhook_queue_send, 2, 3},
+    {"Webhookキュー状態",   fn_webhook_queue_status, 0, 0},
+    {"Webhookキュー待機",   fn_webhook_queue_flush, 0, 1},
 
     /* ファイル (v1.5.0) */
     {"ファイル送信",           fn_send_file,         2,  3},
+    {"ファイル複数送信",       fn_send_files,        2,  3},
 
     /* コレクター (v1.6.0) */
     {"メッセージ収集",       fn_message_collector,  3,  4},
@@ -9671,6 +19908,9 @@ static HajimuPluginFunc functions[] = {
 
     /* ボイスチャンネル (v2.0.0) */
     {"ユーザーボイスチャンネル", fn_get_user_voice_channel, 2, 2},
+    {"VC人数",               fn_vc_user_count,     1,  2},
+    {"VCメンバー一覧",       fn_vc_members,        1,  1},
+    {"ボット単独",           fn_vc_bot_alone,      1,  1},
     {"VC接続",               fn_vc_join,           2,  2},
     {"VC切断",               fn_vc_leave,          1,  1},
     {"音声再生",             fn_voice_play,        2,  2},
@@ -9681,7 +19921,25 @@ static HajimuPluginFunc functions[] = {
     {"音声キュー",           fn_voice_queue,       1,  1},
     {"音声ループ",           fn_voice_loop,        2,  2},
     {"VC状態",               fn_vc_status,         1,  1},
-    {"音声音量",             fn_voice_volume,      2,  2},
+    {"音声音量",             fn_voice_volume,      2,  3},
+    {"音声効果再生",         fn_voice_effect_play, 2,  3},
+    {"音声効果停止",         fn_voice_effect_stop, 1,  2},
+    {"音声バッファ設定",     fn_voice_buffer,      2,  2},
+    {"音声統計",             fn_voice_stats,       1,  1},
+    {"音声送信設定",         fn_voice_sender_config, 1, 1},
+    {"音声受信開始",         fn_voice_recv_start,  1,  2},
+    {"音声受信停止",         fn_voice_recv_stop,   1,  1},
+    {"音声受信統計",         fn_voice_recv_stats,  1,  1},
+    {"音声配信作成",         fn_voice_cast_create, 0,  1},
+    {"音声配信再生",         fn_voice_cast_play,   2,  2},
+    {"音声配信スキップ",     fn_voice_cast_skip,   1,  1},
+    {"音声配信ループ",       fn_voice_cast_loop,   2,  2},
+    {"音声配信参加",         fn_voice_cast_join,   2,  2},
+    {"音声配信離脱",         fn_voice_cast_leave,  1,  1},
+    {"音声配信終了",         fn_voice_cast_end,    1,  1},
+    {"音声配信情報",         fn_voice_cast_info,   1,  1},
+    {"音声キャッシュ設定",   fn_voice_cache_config, 1, 3},
+    {"音声キャッシュ統計",   fn_voice_cache_stats, 0,  0},
 
     /* YouTube / yt-dlp (v2.4.0+) */
     {"YouTube情報",          fn_ytdlp_info,        1,  1},
@@ -9839,6 +20097,10 @@ static HajimuPluginFunc functions[] = {
     /* BAN管理拡張 */
     {"BAN一覧",                 fn_ban_list,                  1,  2},
     {"BAN一括",                 fn_bulk_ban,                  2,  3},
+    {"モデレーションジョブ開始",     fn_modjob_start,              3,  4},
+    {"モデレーションジョブ再開",     fn_modjob_resume,             1,  2},
+    {"モデレーションジョブ状態",     fn_modjob_status,             1,  1},
+    {"モデレーションジョブ停止",     fn_modjob_stop,               1,  1},
 
     /* メンバー管理拡張 */
     {"メンバー編集",             fn_member_edit,               3,  3},
@@ -9881,12 +20143,15 @@ static HajimuPluginFunc functions[] = {
     /* コマンド管理 */
     {"コマンド削除",             fn_command_delete,            1,  2},
     {"コマンド一覧",             fn_command_list,              0,  1},
+    {"コマンド登録先",           fn_command_scope,             0,  1},
     {"コマンド権限設定",         fn_command_permissions,       3,  3},
 
     /* ユーティリティ */
     {"Snowflakeタイムスタンプ",  fn_snowflake_timestamp,       1,  1},
     {"権限値",                   fn_permission_value,          1,  1},
     {"権限チェック",             fn_permission_check,          2,  2},
+    {"権限計算",                 fn_permission_compute,        3,  3},
+    {"権限所持",                 fn_permission_has,            4,  4},
     {"アプリ情報",               fn_app_info,                  0,  0},
     {"Voice地域一覧",            fn_voice_regions,             0,  0},
     {"ステッカーパック一覧",     fn_sticker_packs,             0,  0},
@@ -9894,6 +20159,37 @@ static HajimuPluginFunc functions[] = {
     /* .env */
     {"env読み込み",               fn_env_load,                  0,  1},
     {"env取得",                   fn_env_get,                   1,  2},
+
+    /* エンティティキャッシュ (v2.6.0) */
+    {"キャッシュサーバー",         fn_cache_guild,               1,  1},
+    {"キャッシュサーバー一覧",     fn_cache_guild_list,          0,  0},
+    {"キャッシュチャンネル",       fn_cache_channel,             1,  1},
+    {"キャッシュチャンネル一覧",   fn_cache_channel_list,        1,  1},
+    {"キャッシュロール",           fn_cache_role,                1,  1},
+    {"キャッシュロール一覧",       fn_cache_role_list,           1,  1},
+    {"キャッシュメンバー",         fn_cache_member,              2,  2},
+    {"キャッシュメンバー検索",     fn_cache_member_search,       2,  3},
+    {"キャッシュクリア",           fn_cache_clear,               0,  0},
+    {"メッセージキャッシュ設定",   fn_message_cache_config,      1,  2},
+    {"キャッシュメッセージ",       fn_cache_message,             2,  2},
+    {"キャッシュメッセージ一覧",   fn_cache_message_list,        1,  2},
+    {"メッセージ索引設定",         fn_msg_index_config,          1,  1},
+    {"メッセージ索引検索",         fn_msg_index_search,          2,  3},
+    {"集計設定",                   fn_tally_config,              1,  2},
+    {"集計追跡",                   fn_tally_track,               2,  3},
+    {"集計解除",                   fn_tally_untrack,             1,  1},
+    {"リアクション集計",           fn_reaction_tally,            1,  1},
+    {"投票集計",                   fn_poll_tally,                1,  1},
+    {"集計ユーザー一覧",           fn_tally_users,               2,  2},
+    {"集計ユーザー確認",           fn_tally_has_user,            3,  3},
+    {"キャッシュ予算設定",         fn_cache_budget,              1,  1},
+    {"キャッシュ統計",             fn_cache_stats,               0,  0},
+    {"スナップショット設定",       fn_snapshot_config,           1,  1},
+    {"キャッシュ保存",             fn_cache_save,                0,  1},
+    {"キャッシュ読込",             fn_cache_load,                0,  1},
+    {"プレゼンス取得",             fn_presence_get,              2,  2},
+    {"プレゼンス集計",             fn_presence_counts,           1,  1},
+    {"プレゼンス一覧",             fn_presence_list,             1,  2},
 };
 
 HAJIMU_PLUGIN_EXPORT HajimuPluginInfo *hajimu_plugin_init(void) {